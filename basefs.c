@@ -0,0 +1,56 @@
+#include <linux/init.h>
+#include <linux/proc_fs.h>
+#include "basefs.h"
+
+/* /proc/fs/basefs: one directory of statistics per mounted image. */
+struct proc_dir_entry *basefs_proc_root;
+
+/*
+ * basefs_mount - Mount a BaseFS image from a block device.
+ */
+static struct dentry *basefs_mount(struct file_system_type *fs_type,
+				   int flags, const char *dev_name, void *data)
+{
+	return mount_bdev(fs_type, flags, dev_name, data, basefs_fill_super);
+}
+
+struct file_system_type basefs_fs_type = {
+	.owner    = THIS_MODULE,
+	.name     = "basefs",
+	.mount    = basefs_mount,
+	.kill_sb  = kill_block_super,
+	.fs_flags = FS_REQUIRES_DEV,
+};
+MODULE_ALIAS_FS("basefs");
+
+static int __init basefs_init(void)
+{
+	int ret;
+
+	ret = basefs_init_inodecache();
+	if (ret)
+		return ret;
+	/* Statistics are optional: mounts work without the directory. */
+	basefs_proc_root = proc_mkdir("fs/basefs", NULL);
+	ret = register_filesystem(&basefs_fs_type);
+	if (ret) {
+		pr_err("basefs: cannot register file system (%d)\n", ret);
+		remove_proc_entry("fs/basefs", NULL);
+		basefs_destroy_inodecache();
+	}
+	return ret;
+}
+
+static void __exit basefs_exit(void)
+{
+	unregister_filesystem(&basefs_fs_type);
+	remove_proc_entry("fs/basefs", NULL);
+	basefs_destroy_inodecache();
+}
+
+module_init(basefs_init);
+module_exit(basefs_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("BaseFS: a basic file system for ML workloads");
+MODULE_SOFTDEP("pre: crc32c");
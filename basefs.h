@@ -10,12 +10,17 @@
 #include <linux/vmalloc.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/rwsem.h>
+#include <linux/percpu_counter.h>
+#include <linux/crc32c.h>
 
-/*
- * A unique "magic number" for BaseFS.
- * You can choose any 32-bit value that doesn't collide with known filesystems.
- */
-#define BASEFS_MAGIC 0x62617365  /* 'b','a','s','e' in hex */
+/* On-disk structures (superblock, group descriptors, inodes). */
+#include "basefs_disk.h"
+#include "basefs_ioctl.h"
 
 /*
  * Theoretical maximum file size: 1 PB = 2^50 bytes.
@@ -27,59 +32,417 @@
  * You may change this as needed.
  */
 #define BASEFS_DEFAULT_BLOCK_SIZE 1024 * 128
+
+/* links_count is 16 bits on disk. */
+#define BASEFS_LINK_MAX 65000
+
+#ifndef EFSCORRUPTED
+#define EFSCORRUPTED EUCLEAN  /* Filesystem is corrupted */
+#endif
+
 /*
- * On-disk superblock structure.
- * For simplicity, we store minimal metadata here.
- * Real filesystems often include versioning, block bitmaps, etc.
+ * In-memory B+ tree (btree.c), u64 keys with a u64 value each.
  */
-struct basefs_super_block {
-	__le32 magic;
-	__le64 blocks_count;
-	__le64 inodes_count;
-	/*
-	 * Add more fields if needed:
-	 *   - version
-	 *   - block bitmap location
-	 *   - inode bitmap location
-	 *   - etc.
-	 */
+struct btree_node;
+
+struct btree_root {
+	struct btree_node *root;
+	unsigned long nr_entries;
+};
+
+struct btree_root *btree_init(void);
+void btree_destroy(struct btree_root *tree);
+bool btree_search(struct btree_root *tree, u64 key, u64 *value);
+bool btree_lookup_ge(struct btree_root *tree, u64 key, u64 *found, u64 *value);
+bool btree_lookup_le(struct btree_root *tree, u64 key, u64 *found, u64 *value);
+int btree_insert(struct btree_root *tree, u64 key, u64 value);
+int btree_delete(struct btree_root *tree, u64 key);
+void btree_print(struct btree_root *tree);
+
+/*
+ * Free space is indexed twice (super.c):
+ *   free_by_start: key = first block,          value = length
+ *   free_by_len:   key = length:start packed,  value = first block
+ * Free extents never cross a group (each group starts with its bitmaps),
+ * so a length fits in BASEFS_LEN_BITS and the start in the bits below.
+ */
+#define BASEFS_START_BITS       44
+#define BASEFS_LEN_BITS         (64 - BASEFS_START_BITS)
+#define BASEFS_LEN_KEY(len, start) \
+	(((u64)(len) << BASEFS_START_BITS) | (u64)(start))
+
+/*
+ * Reservation window of a file being written, in blocks: enough for the
+ * run being allocated or as much again as the file already holds,
+ * rounded up to a power of two and kept within these bounds.
+ */
+#define BASEFS_MIN_PREALLOC     16
+#define BASEFS_MAX_PREALLOC     4096
+/* A file whose first window is this large is placed as a stream. */
+#define BASEFS_STREAM_WINDOW    256
+
+/*
+ * Per-CPU reservation pool: a chunk of free space taken out of the trees
+ * that windows are cut from without alloc_lock (super.c).  Chunks are up
+ * to BASEFS_POOL_CHUNK blocks.
+ */
+#define BASEFS_POOL_CHUNK       16384
+
+/* Groups whose bitmaps the prefetch work reads ahead at a time. */
+#define BASEFS_PREFETCH_BATCH   32
+
+/*
+ * Extents a truncate frees per transaction.  Freeing a fragmented file
+ * touches a bitmap and a descriptor block per extent, more than one
+ * transaction may hold for a large one.
+ */
+#define BASEFS_TRUNCATE_EXTENTS 16
+
+/*
+ * Directories of at least this many blocks get an in-memory name-hash
+ * index the first time a name is looked up in them (dir.c).
+ */
+#define BASEFS_DIR_INDEX_BLOCKS 4
+
+/*
+ * Bits of an indexed directory's bloom filter per name it has room for
+ * (dir.c).  Rebuilt twice as large when more names have been added.
+ */
+#define BASEFS_DIR_BLOOM_BITS   8
+
+/* Directory blocks readdir keeps reading ahead of the one it is in. */
+#define BASEFS_DIR_READAHEAD    16
+
+/*
+ * Lazy inode tables (itable.c): bytes zeroed at once, and the default
+ * rate of the background zeroing in MB/s (init_itable= mount option).
+ */
+#define BASEFS_ITABLE_CHUNK     (1024 * 1024)
+#define BASEFS_ITABLE_RATE      16
+
+/* Seconds between a change of the free counts and its superblock save. */
+#define BASEFS_SB_WRITEBACK_SECS 5
+
+/*
+ * Metadata journal (journal.c).  Metadata buffers are only changed
+ * inside a handle and handed to basefs_journal_dirty() instead of being
+ * marked dirty; they reach their home location once the transaction
+ * holding them has been committed to the log.  Defaults of the commit=
+ * and max_batch_time= mount options: seconds between commits, and how
+ * long a sync request may wait for others to join its commit.
+ */
+#define BASEFS_COMMIT_INTERVAL_SECS 5
+#define BASEFS_MAX_BATCH_USECS  15000
+
+/* Lookup counters, per CPU, in /proc/fs/basefs/<dev>/dir (dir.c). */
+struct basefs_dir_stats {
+	u64 lookups;
+	u64 misses;            /* each left a negative dentry */
+	u64 bloom_checks;      /* index searches the filter was asked about */
+	u64 bloom_rejects;     /* ... that it answered without the index */
+	u64 bloom_false;       /* ... that it let through for a missing name */
+};
+
+struct basefs_journal;
+struct basefs_dir_bloom;
+struct proc_dir_entry;
+struct seq_file;
+
+struct basefs_handle {
+	struct basefs_handle *h_outer;  /* handle this one is nested in */
+	unsigned int h_nofs;            /* memalloc_nofs_save() cookie */
+	bool h_sync;                    /* commit when the outermost one stops */
 };
 
+struct basefs_pool {
+	spinlock_t lock;
+	u64 start;
+	u32 len;
+};
+
+/*
+ * Where a delayed-allocation buffer points until writeback gives it a
+ * block (file.c).  Never a valid block.
+ */
+#define BASEFS_DELAY_BLOCK      (~(sector_t)0)
+
 /*
  * In-memory superblock info.
  * Holds a pointer to the on-disk copy and possibly other runtime data.
  */
 struct basefs_sb_info {
-	struct basefs_super_block *raw_sb;
+	struct super_block *sb;
+	struct basefs_super_block *raw_sb;  /* points into sbh */
 	unsigned long block_size;
-	/*
-	 * Additional runtime data (e.g., bitmaps, indexes) could go here.
-	 */
+
+	struct buffer_head *sbh;
+	struct buffer_head **gdt_bh;        /* group descriptor table */
+	u32 gdt_blocks;
+	u32 desc_per_block;
+
+	/* Geometry, host order. */
+	u32 groups_count;
+	u32 blocks_per_group;
+	u32 inodes_per_group;
+	u32 inode_size;
+	u32 itable_blocks;
+	u64 blocks_count;
+	u64 inodes_count;
+	u64 first_group_block;
+
+	/* Block allocator: free extents, see above. */
+	struct mutex alloc_lock;
+	struct btree_root *free_by_start;
+	struct btree_root *free_by_len;
+	struct percpu_counter free_blocks;  /* in the trees and unloaded groups */
+	unsigned long *group_loaded;        /* groups whose bitmap is in the trees */
+	u32 groups_loaded;
+	struct work_struct prefetch_work;   /* loads the other groups after mount */
+	bool prefetch_stop;
+	struct percpu_counter reserved_blocks;  /* in pools and file windows */
+	struct percpu_counter delalloc_blocks;  /* promised to delayed buffers */
+	struct basefs_pool __percpu *pools;
+	u32 pool_chunk;
+	spinlock_t *group_locks;            /* bitmap and free count, per group */
+
+	/* Inode allocator. */
+	struct mutex ialloc_lock;
+	struct percpu_counter free_inodes;
+	/* Zeroing of the inode tables makefs left unwritten (itable.c). */
+	struct delayed_work itable_work;
+	u32 itable_group;                   /* first group that may need it */
+	u32 itable_rate;                    /* MB/s, 0: only on allocation */
+
+	/* The totals above reach the superblock buffer from sb_work. */
+	unsigned long sb_state;
+	struct delayed_work sb_work;
+
+	struct basefs_journal *journal;     /* NULL without one */
+
+	struct basefs_dir_stats __percpu *dir_stats;
+
+	/* xattr blocks that can be shared, by hash (xattr.c) */
+	struct mutex xattr_lock;
+	struct btree_root *xattr_index;
+
+	/* Mount options. */
+	unsigned long commit_interval;      /* jiffies */
+	u32 max_batch_us;
+	bool immutable;                     /* read-only dataset, see super.c */
+	bool orlov;                         /* inode placement, see inode.c */
+
+	struct proc_dir_entry *proc;        /* /proc/fs/basefs/<dev> */
 };
 
+/* sb_state bits */
+#define BASEFS_SB_DIRTY         0   /* totals changed since the last save */
+
 /*
  * Inode private data for BaseFS.
  * We embed an actual struct inode and can store extra info if needed.
+ *
+ * Objects come from basefs_inode_cachep (super.c), cache line aligned.
+ * What every block lookup and allocation touches comes first, so that
+ * it shares the first cache lines with the lock that guards it instead
+ * of sitting behind struct inode; the rest is only read now and then.
+ * The locks and vfs_inode are set up once per object by the slab
+ * constructor, everything else by basefs_alloc_inode() on each use.
  */
 struct basefs_inode_info {
+	struct mutex i_map_lock;  /* protects the block mapping */
+	u32 i_flags;
+	u16 i_nr_extents;
+	/* Reserved window ahead of the last allocation, under i_map_lock. */
+	u32 i_prealloc_len;
+	u64 i_prealloc_start;
 	/*
-	 * Add any custom data for BaseFS inodes:
-	 *   - block offsets
-	 *   - times
-	 *   - etc.
+	 * Block mapping, kept in its on-disk form: nr_extents extents
+	 * sorted by lblk, or with BASEFS_INODE_EXTENT_TREE in i_flags the
+	 * root of the file's extent tree (extents.c).  Inline symlinks keep
+	 * their target here instead, and inline files the start of their
+	 * data (inline.c).
 	 */
+	union {
+		struct basefs_extent i_extents[BASEFS_INLINE_EXTENTS];
+		__u8                 i_data[BASEFS_INODE_DATA_SIZE];
+	};
+
+	u32 i_block_group;        /* group holding the inode, allocation goal */
+	u64 i_sync_tid;           /* last transaction that logged the inode */
+	/*
+	 * Large directories: name index, bloom filter of the names in it,
+	 * first block with room (dir.c).
+	 */
+	struct btree_root *i_dir_index;
+	struct basefs_dir_bloom *i_dir_bloom;
+	u64 i_dir_hint;
+	/* Extended attributes (xattr.c). */
+	struct rw_semaphore i_xattr_sem;
+	u64 i_xattr_block;
 	struct inode vfs_inode;  /* Must be last for container_of() usage */
 };
 
+static inline struct basefs_sb_info *BASEFS_SB(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
+
+static inline struct basefs_inode_info *BASEFS_I(struct inode *inode)
+{
+	return container_of(inode, struct basefs_inode_info, vfs_inode);
+}
+
+static inline u32 basefs_group_of_block(struct basefs_sb_info *sbi, u64 blk)
+{
+	return (u32)div64_u64(blk - sbi->first_group_block,
+			      sbi->blocks_per_group);
+}
+
 /* Forward declarations for objects defined in other .c files. */
 extern struct file_system_type basefs_fs_type;
+extern struct proc_dir_entry *basefs_proc_root;
 extern const struct super_operations  basefs_super_ops;
 extern const struct inode_operations  basefs_inode_ops;
+extern const struct inode_operations  basefs_dir_inode_ops;
+extern const struct inode_operations  basefs_fast_symlink_inode_ops;
+extern const struct inode_operations  basefs_symlink_inode_ops;
 extern const struct file_operations   basefs_file_ops;
+extern const struct file_operations   basefs_dir_ops;
 extern const struct address_space_operations basefs_aops;
 
 /* Function prototypes */
+int basefs_init_inodecache(void);
+void basefs_destroy_inodecache(void);
 int basefs_fill_super(struct super_block *sb, void *data, int silent);
 int basefs_save_sb(struct super_block *sb);  /* Optional for superblock writes */
+void basefs_mark_sb_dirty(struct super_block *sb);
+void basefs_set_incompat(struct super_block *sb, u32 feature);
+void basefs_set_compat(struct super_block *sb, u32 feature);
+void basefs_clear_ro_compat(struct super_block *sb, u32 feature);
+
+/* super.c: block allocator and group descriptors */
+__printf(3, 4)
+void basefs_msg(struct super_block *sb, const char *level, const char *fmt, ...);
+struct basefs_group_desc *basefs_get_group_desc(struct super_block *sb,
+						u32 group,
+						struct buffer_head **bhp);
+int basefs_new_blocks(struct super_block *sb, u64 goal, u32 hint,
+		      u32 *count, u64 *start);
+void basefs_free_blocks(struct super_block *sb, u64 start, u32 count);
+void basefs_free_meta_blocks(struct super_block *sb, u64 start, u32 count);
+void basefs_reuse_blocks(struct super_block *sb, u64 start, u32 count);
+int basefs_reserve_window(struct super_block *sb, u64 goal, u32 *count,
+			  u64 *start);
+void basefs_release_window(struct super_block *sb, u64 start, u32 count);
+int basefs_claim_blocks(struct super_block *sb, u64 start, u32 count);
+int basefs_reserve_delalloc(struct super_block *sb, u32 count);
+void basefs_release_delalloc(struct super_block *sb, u32 count);
+
+/* itable.c */
+int basefs_itable_init_upto(struct super_block *sb, u32 group, u32 blocks);
+bool basefs_itable_ready(struct super_block *sb, unsigned long ino);
+void basefs_itable_work(struct work_struct *work);
+void basefs_itable_start(struct super_block *sb);
+void basefs_itable_stop(struct super_block *sb);
+
+/* inode.c */
+u64 basefs_inode_block(struct super_block *sb, unsigned long ino,
+		       unsigned int *offset);
+struct basefs_inode *basefs_get_raw_inode(struct super_block *sb,
+					  unsigned long ino,
+					  struct buffer_head **bhp);
+struct inode *basefs_iget(struct super_block *sb, unsigned long ino);
+struct inode *basefs_new_inode(struct inode *dir, umode_t mode);
+int basefs_write_inode(struct inode *inode, struct writeback_control *wbc);
+void basefs_dirty_inode(struct inode *inode, int flags);
+void basefs_evict_inode(struct inode *inode);
+int basefs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+		   struct iattr *attr);
+long basefs_create_batch(struct file *file, void __user *argp);
+
+/* dir.c */
+int basefs_inode_by_name(struct inode *dir, const struct qstr *name,
+			 ino_t *ino);
+int basefs_add_link(struct dentry *dentry, struct inode *inode);
+int basefs_delete_entry(struct inode *dir, const struct qstr *name);
+int basefs_set_link(struct inode *dir, const struct qstr *name,
+		    struct inode *inode);
+bool basefs_empty_dir(struct inode *dir);
+void basefs_dir_drop_index(struct inode *dir);
+int basefs_dir_stats_show(struct seq_file *m, void *v);
+
+/* file.c */
+int basefs_get_block(struct inode *inode, sector_t iblock,
+		     struct buffer_head *bh_result, int create);
+int basefs_map_blocks(struct inode *inode, sector_t iblock, u32 max_blocks,
+		      bool create, u64 *pblk, bool *new);
+void basefs_truncate_blocks(struct inode *inode, loff_t size);
+int basefs_da_get_block_prep(struct inode *inode, sector_t iblock,
+			     struct buffer_head *bh, int create);
+void basefs_discard_prealloc(struct inode *inode);
+int basefs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+/* extents.c */
+struct basefs_ext_pos {
+	u64 lblk, pblk;    /* extent holding the block or the one before it */
+	u32 len;           /* 0: no such extent */
+	u64 next;          /* nothing is mapped from the block up to here */
+};
+
+int basefs_ext_check(struct inode *inode);
+int basefs_ext_lookup(struct inode *inode, u64 iblock,
+		      struct basefs_ext_pos *pos);
+int basefs_ext_insert(struct inode *inode, u64 lblk, u64 pblk, u32 len);
+int basefs_ext_truncate(struct inode *inode, u64 first, int budget);
+
+/* inline.c */
+static inline bool basefs_has_inline_data(struct inode *inode)
+{
+	return READ_ONCE(BASEFS_I(inode)->i_flags) & BASEFS_INODE_INLINE_DATA;
+}
+
+/* Inline data only has i_data while the tail holds xattrs. */
+static inline u32 basefs_inline_max(struct inode *inode)
+{
+	if (READ_ONCE(BASEFS_I(inode)->i_flags) & BASEFS_INODE_INLINE_XATTR)
+		return BASEFS_INODE_DATA_SIZE;
+	return basefs_inline_data_max(BASEFS_SB(inode->i_sb)->inode_size);
+}
+
+int basefs_inline_check(struct inode *inode);
+int basefs_read_inline(struct inode *inode, struct folio *folio);
+int basefs_write_inline_begin(struct inode *inode, struct page **pagep);
+int basefs_write_inline_end(struct inode *inode, loff_t pos,
+			    unsigned int copied, struct folio *folio);
+int basefs_write_inline_folio(struct folio *folio);
+int basefs_convert_inline(struct inode *inode);
+void basefs_truncate_inline(struct inode *inode, loff_t size);
+int basefs_inline_fill(struct inode *inode, const char *buf, size_t len,
+		       loff_t size);
+
+/* xattr.c */
+extern const struct xattr_handler *basefs_xattr_handlers[];
+int basefs_xattr_init(struct super_block *sb);
+void basefs_xattr_destroy(struct super_block *sb);
+ssize_t basefs_listxattr(struct dentry *dentry, char *buffer, size_t size);
+int basefs_xattr_get(struct inode *inode, int index, const char *name,
+		     void *buffer, size_t size);
+void basefs_xattr_delete_inode(struct inode *inode);
+
+/* journal.c */
+int basefs_journal_load(struct super_block *sb);
+void basefs_journal_destroy(struct super_block *sb);
+int basefs_journal_remount(struct super_block *sb, bool rdonly);
+void basefs_journal_set_options(struct super_block *sb);
+void basefs_journal_start(struct super_block *sb, struct basefs_handle *h);
+int basefs_journal_stop(struct super_block *sb, struct basefs_handle *h);
+bool basefs_journal_full(struct super_block *sb);
+void basefs_journal_dirty(struct super_block *sb, struct buffer_head *bh,
+			  struct inode *inode);
+void basefs_journal_sync(struct super_block *sb, struct buffer_head *bh);
+void basefs_journal_revoke(struct super_block *sb, u64 start, u32 count);
+int basefs_journal_force(struct super_block *sb, u64 tid);
+int basefs_journal_commit(struct super_block *sb);
+int basefs_journal_stats_show(struct seq_file *m, void *v);
 
 #endif /* _BASEFS_H */
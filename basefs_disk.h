@@ -0,0 +1,563 @@
+#ifndef _BASEFS_DISK_H
+#define _BASEFS_DISK_H
+
+/*
+ * On-disk format of BaseFS.
+ *
+ * This header is shared by the kernel module (through basefs.h) and the
+ * user-space tools (makefs, ...), so it must only use the fixed-size
+ * __le/__u types from <linux/types.h>.  All multi-byte fields are little
+ * endian on disk.
+ *
+ * Image layout (every region starts on a block boundary):
+ *
+ *   block 0              superblock (first BASEFS_SUPER_SIZE bytes)
+ *   gdt_start            group descriptor table, gdt_blocks blocks
+ *                        followed by reserved_gdt_blocks spare blocks
+ *                        the table can grow into when the image is resized
+ *   index_start          reserved area for the root B+ tree, index_blocks
+ *   journal_start        metadata journal, journal_blocks (may be empty)
+ *   first_group_block    group 0, group 1, ...
+ *
+ * Each group of blocks_per_group blocks starts with its own metadata:
+ *
+ *   +0                   block bitmap (one block, covers this group)
+ *   +1                   inode bitmap (one block)
+ *   +2                   inode table, itable_blocks blocks
+ *   +2+itable_blocks     data blocks
+ *
+ * The last group may be shorter than blocks_per_group.  Blocks before
+ * first_group_block are not covered by any bitmap and are never
+ * allocated.  Because every group is described by a fixed-size
+ * descriptor, the kernel only has to read the superblock and the
+ * descriptor table at mount and can fetch bitmaps and inode table blocks
+ * of a group when it first needs them.
+ */
+
+#include <linux/types.h>
+
+#ifdef __KERNEL__
+#define basefs_le16_to_cpu(x)  le16_to_cpu(x)
+#define basefs_le32_to_cpu(x)  le32_to_cpu(x)
+#else
+#include <endian.h>
+#define basefs_le16_to_cpu(x)  le16toh(x)
+#define basefs_le32_to_cpu(x)  le32toh(x)
+#endif
+
+/*
+ * A unique "magic number" for BaseFS.
+ * You can choose any 32-bit value that doesn't collide with known filesystems.
+ */
+#define BASEFS_MAGIC 0x62617365  /* 'b','a','s','e' in hex */
+
+/*
+ * Format version.  Images written before the layout above existed only
+ * had magic/blocks_count/inodes_count and read back as version 0.  The
+ * version only changes when the fixed layout does; everything added on
+ * top of it is announced by a feature flag below.
+ */
+#define BASEFS_FORMAT_VERSION   1
+
+#define BASEFS_SUPER_SIZE       1024      /* bytes used at the start of block 0 */
+#define BASEFS_MIN_BLOCK_SIZE   4096
+#define BASEFS_MAX_BLOCK_SIZE   (1024 * 128)
+#define BASEFS_MIN_INODE_SIZE   256
+#define BASEFS_GROUP_META_BLOCKS 2        /* block bitmap + inode bitmap */
+
+#define BASEFS_ROOT_INO         1         /* inode numbers start at 1 */
+
+/*
+ * Feature flags.
+ *   compat:    old code may mount read-write and ignore the feature.
+ *   ro_compat: old code may only mount read-only.
+ *   incompat:  old code must refuse the image.
+ */
+#define BASEFS_FEATURE_COMPAT_INDEX_AREA    0x0001  /* root B+ tree area reserved */
+#define BASEFS_FEATURE_COMPAT_RESIZE_GDT    0x0002  /* spare descriptor blocks */
+#define BASEFS_FEATURE_COMPAT_JOURNAL       0x0004  /* metadata journal */
+#define BASEFS_FEATURE_COMPAT_XATTR         0x0008  /* extended attributes */
+
+#define BASEFS_FEATURE_RO_COMPAT_SB_CSUM    0x0001  /* superblock checksum */
+#define BASEFS_FEATURE_RO_COMPAT_LAZY_ITABLE 0x0002 /* inode tables not all written */
+
+#define BASEFS_FEATURE_INCOMPAT_RECOVER     0x0001  /* journal needs replay */
+#define BASEFS_FEATURE_INCOMPAT_EXTENT_TREE 0x0002  /* some inode has an extent tree */
+#define BASEFS_FEATURE_INCOMPAT_INLINE_DATA 0x0004  /* file data in inodes */
+
+#define BASEFS_FEATURE_COMPAT_SUPP     (BASEFS_FEATURE_COMPAT_INDEX_AREA | \
+					BASEFS_FEATURE_COMPAT_RESIZE_GDT | \
+					BASEFS_FEATURE_COMPAT_JOURNAL | \
+					BASEFS_FEATURE_COMPAT_XATTR)
+#define BASEFS_FEATURE_RO_COMPAT_SUPP  (BASEFS_FEATURE_RO_COMPAT_SB_CSUM | \
+					BASEFS_FEATURE_RO_COMPAT_LAZY_ITABLE)
+#define BASEFS_FEATURE_INCOMPAT_SUPP   (BASEFS_FEATURE_INCOMPAT_RECOVER | \
+					BASEFS_FEATURE_INCOMPAT_EXTENT_TREE | \
+					BASEFS_FEATURE_INCOMPAT_INLINE_DATA)
+
+/*
+ * On-disk superblock structure.  Lives in the first BASEFS_SUPER_SIZE
+ * bytes of block 0.  Unused space is kept as 'reserved' so new fields can
+ * be added without moving existing ones.
+ */
+struct basefs_super_block {
+	__le32 magic;
+	__le32 version;            /* BASEFS_FORMAT_VERSION */
+	__le64 blocks_count;
+	__le64 inodes_count;
+	__le64 free_blocks_count;
+	__le64 free_inodes_count;
+	__le32 block_size;         /* bytes, power of two */
+	__le32 inode_size;         /* bytes, power of two */
+	__le32 blocks_per_group;
+	__le32 inodes_per_group;
+	__le32 groups_count;
+	__le32 itable_blocks;      /* inode table blocks per group */
+	__le64 gdt_start;          /* first block of the group descriptors */
+	__le32 gdt_blocks;
+	__le32 index_blocks;       /* size of the reserved root index area */
+	__le64 index_start;
+	__le64 first_group_block;  /* block where group 0 starts */
+	__le32 feature_compat;
+	__le32 feature_incompat;
+	__le32 feature_ro_compat;
+	__le32 root_ino;
+	__le64 mkfs_time;          /* seconds since the epoch */
+	__le64 wtime;              /* last superblock write */
+	__u8   uuid[16];
+	__le32 reserved_gdt_blocks; /* spare blocks after the descriptor table */
+	__le32 journal_blocks;     /* 0 without COMPAT_JOURNAL */
+	__le64 journal_start;      /* first block of the journal */
+	__le32 reserved[215];
+	__le32 checksum;           /* see basefs_super_csum() */
+};
+
+/*
+ * With BASEFS_FEATURE_RO_COMPAT_SB_CSUM, 'checksum' is the CRC32C
+ * (Castagnoli) of the superblock up to the checksum field, seeded with
+ * ~0 and not inverted at the end, as the kernel's crc32c() computes it.
+ * It is refreshed by every superblock write.
+ */
+#define BASEFS_SB_CSUM_OFFSET \
+	__builtin_offsetof(struct basefs_super_block, checksum)
+
+#ifdef __KERNEL__
+#define basefs_crc32c(crc, buf, len)   crc32c(crc, buf, len)
+#else
+static inline __u32 basefs_crc32c(__u32 crc, const void *buf,
+				  unsigned long len)
+{
+	const __u8 *p = buf;
+	int k;
+
+	while (len--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
+	return crc;
+}
+#endif
+
+static inline __u32 basefs_super_csum(const struct basefs_super_block *sb)
+{
+	return basefs_crc32c(~0U, sb, BASEFS_SB_CSUM_OFFSET);
+}
+
+/*
+ * Metadata journal (BASEFS_FEATURE_COMPAT_JOURNAL): journal_blocks
+ * blocks at journal_start.  Block 0 of the journal is its superblock,
+ * the others a circular log (block nr_blocks - 1 is followed by block 1)
+ * of transactions.  A transaction is written as
+ *
+ *   descriptor   home block numbers of the copies that follow it
+ *   copies       full images of those metadata blocks
+ *   ...          more descriptors and copies, then revoke blocks
+ *   commit       number of blocks above and their CRC32C
+ *
+ * every block of it starting with a header that carries the
+ * transaction's sequence number.  The next transaction starts right
+ * after the commit block, with the next sequence number.
+ *
+ * 'start' in the journal superblock is the log block to replay from (0
+ * if nothing needs replay) and the header's sequence the number of the
+ * transaction expected there.  Replay copies the blocks of every
+ * complete transaction from there on to their home locations, in order,
+ * and stops at the first block that does not carry the expected
+ * sequence number or at a commit whose checksum does not match.  A copy
+ * is skipped if a revoke record of its own or a later transaction
+ * covers it: the block was freed after it was logged and may hold file
+ * data by now.
+ *
+ * BASEFS_FEATURE_INCOMPAT_RECOVER is set in the superblock while the
+ * image is mounted read-write, so other tools know the journal may hold
+ * changes the rest of the image does not have yet.
+ */
+#define BASEFS_JOURNAL_MAGIC    0x626a6e6c  /* 'b','j','n','l' */
+#define BASEFS_JOURNAL_MIN_BLOCKS 256
+
+/* Block types */
+#define BASEFS_JT_SUPER         1
+#define BASEFS_JT_DESC          2
+#define BASEFS_JT_REVOKE        3
+#define BASEFS_JT_COMMIT        4
+
+struct basefs_journal_header {
+	__le32 magic;
+	__le32 type;
+	__le64 sequence;
+};
+
+struct basefs_journal_super {
+	struct basefs_journal_header header;
+	__le32 block_size;
+	__le32 nr_blocks;          /* the superblock's journal_blocks */
+	__le32 start;              /* log block to replay from, 0: none */
+	__le32 checksum;           /* CRC32C of the fields above, as the sb's */
+};
+
+struct basefs_journal_desc {
+	struct basefs_journal_header header;
+	__le32 nr;
+	__le32 reserved;
+	__le64 blocks[];
+};
+
+struct basefs_journal_range {
+	__le64 start;
+	__le32 count;
+	__le32 reserved;
+};
+
+struct basefs_journal_revoke {
+	struct basefs_journal_header header;
+	__le32 nr;
+	__le32 reserved;
+	struct basefs_journal_range ranges[];
+};
+
+struct basefs_journal_commit {
+	struct basefs_journal_header header;
+	__le32 nr_blocks;          /* blocks of the transaction before this one */
+	__le32 checksum;           /* CRC32C of those blocks, in log order */
+	__le64 commit_time;        /* seconds since the epoch */
+};
+
+#define BASEFS_JSB_CSUM_OFFSET \
+	__builtin_offsetof(struct basefs_journal_super, checksum)
+
+static inline __u32 basefs_journal_super_csum(const struct basefs_journal_super *jsb)
+{
+	return basefs_crc32c(~0U, jsb, BASEFS_JSB_CSUM_OFFSET);
+}
+
+/*
+ * Group descriptor, one per group, packed in the descriptor table.
+ *
+ * With BASEFS_BG_ITABLE_UNINIT in 'flags' only the first 'itable_init'
+ * blocks of the group's inode table have been written; the rest may
+ * hold anything and no inode in them is in use.  makefs leaves the
+ * tables of large images like that (RO_COMPAT_LAZY_ITABLE), and the
+ * kernel zeroes them when it first allocates there or in the
+ * background.
+ */
+struct basefs_group_desc {
+	__le64 block_bitmap;       /* absolute block numbers */
+	__le64 inode_bitmap;
+	__le64 inode_table;
+	__le32 free_blocks_count;
+	__le32 free_inodes_count;
+	__le32 used_dirs_count;
+	__le16 flags;              /* BASEFS_BG_* */
+	__le16 pad;
+	__le32 itable_init;        /* inode table blocks written, see above */
+	__le32 reserved[5];
+};
+
+#define BASEFS_BG_ITABLE_UNINIT 0x0001
+
+/* Inode table blocks of a group holding initialized inodes. */
+static inline __u32 basefs_itable_init(const struct basefs_group_desc *gd,
+				       __u32 itable_blocks)
+{
+	if (!(basefs_le16_to_cpu(gd->flags) & BASEFS_BG_ITABLE_UNINIT))
+		return itable_blocks;
+	return basefs_le32_to_cpu(gd->itable_init);
+}
+
+/*
+ * An extent maps 'len' contiguous file blocks starting at logical block
+ * 'lblk' to physical blocks starting at 'pblk'.
+ */
+struct basefs_extent {
+	__le64 lblk;
+	__le64 pblk;
+	__le32 len;
+	__le32 reserved;
+};
+
+/*
+ * On-disk inode, inode_size bytes in the inode table (the structure
+ * below is the minimum; larger inode sizes leave the tail reserved).
+ * Inode N lives in group (N - 1) / inodes_per_group at index
+ * (N - 1) % inodes_per_group.
+ *
+ * 'data' holds the block mapping: nr_extents extents sorted by lblk.
+ * A file with more extents than fit there has BASEFS_INODE_EXTENT_TREE
+ * set, no inline extents, and the root of an extent tree in 'data'
+ * instead (see below).  Symlinks whose target fits in 'data' keep it
+ * there instead and have no extents.
+ *
+ * A regular file with BASEFS_INODE_INLINE_DATA keeps its data in the
+ * inode too (BASEFS_FEATURE_INCOMPAT_INLINE_DATA): the first
+ * BASEFS_INODE_DATA_SIZE bytes in 'data', the rest in the space after
+ * this structure when inode_size leaves some, so it has no extents and
+ * no blocks, and is read along with its inode.  It can hold up to
+ * basefs_inline_data_max() bytes; a file that grows past that moves its
+ * data to a block.
+ *
+ * Extended attributes (see below) live in the same space after the
+ * structure when the inode has BASEFS_INODE_INLINE_XATTR, and in the
+ * block 'xattr_block' points at.  Inline data then only has 'data', at
+ * most BASEFS_INODE_DATA_SIZE bytes.
+ */
+#define BASEFS_INODE_DATA_SIZE  128
+#define BASEFS_INLINE_EXTENTS   (BASEFS_INODE_DATA_SIZE / sizeof(struct basefs_extent))
+
+/* Inode flags */
+#define BASEFS_INODE_EXTENT_TREE 0x00000001  /* 'data' is an extent tree root */
+#define BASEFS_INODE_INLINE_DATA 0x00000002  /* 'data' and the tail hold the file */
+#define BASEFS_INODE_INLINE_XATTR 0x00000004 /* the tail holds xattrs */
+
+/* Inline data never takes more than a (smallest) page. */
+#define BASEFS_INLINE_DATA_LIMIT 4096
+
+/*
+ * Extent tree (BASEFS_FEATURE_INCOMPAT_EXTENT_TREE, set the first time
+ * an inode gets one).  A B+ tree over the file's extents: the root is
+ * the header and up to BASEFS_EXTENT_ROOT_MAX index entries in the
+ * inode's 'data', every other node one block holding a header and as
+ * many index entries (depth > 0) or extents (depth 0, a leaf) as fit.
+ * 'depth' counts the levels below a node, so every leaf is at depth 0
+ * and the root is at depth 1 or more.
+ *
+ * Index entry i of a node points at the subtree mapping the file blocks
+ * from its lblk up to the lblk of entry i + 1 (up to where the node's
+ * own range ends for the last entry).  The first entry of a node has
+ * the lblk the node's range starts at, 0 for the root.  Leaves hold
+ * extents sorted by lblk.  No node is left empty.
+ */
+#define BASEFS_EXTENT_MAGIC     0x62657874  /* 'b','e','x','t' */
+#define BASEFS_EXTENT_MAX_DEPTH 5
+
+struct basefs_extent_header {
+	__le32 magic;
+	__le16 nr;                 /* entries in use */
+	__le16 max;                /* entries that fit */
+	__le16 depth;
+	__le16 reserved0;
+	__le32 reserved;
+};
+
+struct basefs_extent_idx {
+	__le64 lblk;               /* first file block of the subtree */
+	__le64 block;              /* block of the child node */
+};
+
+#define BASEFS_EXTENT_ROOT_MAX \
+	((BASEFS_INODE_DATA_SIZE - sizeof(struct basefs_extent_header)) / \
+	 sizeof(struct basefs_extent_idx))
+
+/* Entries of a tree block at 'depth'. */
+static inline __u16 basefs_extent_node_max(__u32 block_size, __u16 depth)
+{
+	block_size -= sizeof(struct basefs_extent_header);
+	if (depth)
+		return (__u16)(block_size / sizeof(struct basefs_extent_idx));
+	return (__u16)(block_size / sizeof(struct basefs_extent));
+}
+
+struct basefs_inode {
+	__le16 mode;
+	__le16 links_count;
+	__le32 flags;
+	__le32 uid;
+	__le32 gid;
+	__le64 size;
+	__le64 blocks;             /* blocks allocated to this inode */
+	__le64 atime;              /* seconds since the epoch */
+	__le64 mtime;
+	__le64 ctime;
+	__le32 generation;
+	__le16 nr_extents;
+	__le16 reserved0;
+	union {
+		struct basefs_extent extents[BASEFS_INLINE_EXTENTS];
+		char                 symlink[BASEFS_INODE_DATA_SIZE];
+		__u8                 data[BASEFS_INODE_DATA_SIZE];
+	};
+	__le64 xattr_block;        /* 0: none; not counted in 'blocks' */
+	__le32 reserved[14];
+};
+
+/* Bytes of file data an inode of 'inode_size' bytes holds inline. */
+static inline __u32 basefs_inline_data_max(__u32 inode_size)
+{
+	__u32 max = BASEFS_INODE_DATA_SIZE + inode_size -
+		    (__u32)sizeof(struct basefs_inode);
+
+	return max < BASEFS_INLINE_DATA_LIMIT ? max : BASEFS_INLINE_DATA_LIMIT;
+}
+
+/*
+ * Extended attributes (BASEFS_FEATURE_COMPAT_XATTR).  An inode's
+ * attributes are kept as a list of entries in up to two areas: the tail
+ * of the on-disk inode (inode_size - sizeof(struct basefs_inode) bytes,
+ * with BASEFS_INODE_INLINE_XATTR) and an xattr block.  An area holds
+ * entries back to back, each padded to BASEFS_XATTR_PAD bytes, sorted by
+ * name_index, name_len and name, and ends at an entry with name_len 0 or
+ * where the area does.  The unused rest of an area is zero.
+ *
+ * An xattr block starts with struct basefs_xattr_header, its entries
+ * follow.  Since the entries are sorted, inodes with the same attributes
+ * have byte-identical blocks, and they share one: 'refcount' counts the
+ * inodes pointing at the block, 'hash' is the CRC32C of the entries
+ * (seeded with ~0, as the superblock checksum) so that a block with the
+ * same ones can be found.  The block is freed when its last reference
+ * goes.  A block is never shared by more than BASEFS_XATTR_REFCOUNT_MAX
+ * inodes.
+ */
+#define BASEFS_XATTR_MAGIC      0x62786174  /* 'b','x','a','t' */
+#define BASEFS_XATTR_REFCOUNT_MAX 1024
+#define BASEFS_XATTR_PAD        4
+
+/* name_index values: the prefix the name is stored without. */
+#define BASEFS_XATTR_INDEX_USER     1       /* "user." */
+#define BASEFS_XATTR_INDEX_TRUSTED  2       /* "trusted." */
+#define BASEFS_XATTR_INDEX_SECURITY 3       /* "security." */
+
+struct basefs_xattr_header {
+	__le32 magic;
+	__le32 refcount;
+	__le32 hash;
+	__le32 reserved[5];
+};
+
+struct basefs_xattr_entry {
+	__u8   name_len;
+	__u8   name_index;
+	__le16 reserved;
+	__le32 value_len;
+	char   name[];             /* name_len bytes, then the value */
+};
+
+#define BASEFS_XATTR_ENTRY_LEN(name_len, value_len) \
+	(((__u64)sizeof(struct basefs_xattr_entry) + (name_len) + (value_len) + \
+	  BASEFS_XATTR_PAD - 1) & ~(__u64)(BASEFS_XATTR_PAD - 1))
+
+/*
+ * Bytes of entries an area of 'len' bytes at 'area' holds, or -1 if an
+ * entry runs past its end.
+ */
+static inline long basefs_xattr_area_used(const void *area, __u32 len)
+{
+	const struct basefs_xattr_entry *e;
+	__u32 off = 0;
+	__u64 elen;
+
+	while (off + sizeof(*e) <= len) {
+		e = (const struct basefs_xattr_entry *)((const __u8 *)area + off);
+		if (!e->name_len)
+			break;
+		elen = BASEFS_XATTR_ENTRY_LEN(e->name_len,
+					      basefs_le32_to_cpu(e->value_len));
+		if (elen > len - off)
+			return -1;
+		off += (__u32)elen;
+	}
+	return off;
+}
+
+/*
+ * Directory entry.  Directory data blocks are packed with entries that
+ * never cross a block boundary; the last entry of a block stretches to
+ * the end of it through rec_len.  inode == 0 marks an unused entry.
+ * "." and ".." are not stored.
+ */
+#define BASEFS_NAME_LEN         255
+#define BASEFS_DIR_PAD          8
+#define BASEFS_DIR_REC_LEN(name_len) \
+	(((name_len) + sizeof(struct basefs_dir_entry) + BASEFS_DIR_PAD - 1) & \
+	 ~(BASEFS_DIR_PAD - 1))
+
+/* file_type values, the same numbering as the VFS FT_* constants. */
+#define BASEFS_FT_UNKNOWN       0
+#define BASEFS_FT_REG_FILE      1
+#define BASEFS_FT_DIR           2
+#define BASEFS_FT_CHRDEV        3
+#define BASEFS_FT_BLKDEV        4
+#define BASEFS_FT_FIFO          5
+#define BASEFS_FT_SOCK          6
+#define BASEFS_FT_SYMLINK       7
+
+struct basefs_dir_entry {
+	__le64 inode;
+	__le32 rec_len;
+	__u8   name_len;
+	__u8   file_type;
+	__le16 reserved;
+	char   name[];
+};
+
+_Static_assert(sizeof(struct basefs_super_block) == BASEFS_SUPER_SIZE,
+	       "basefs_super_block must stay BASEFS_SUPER_SIZE bytes");
+_Static_assert(sizeof(struct basefs_group_desc) == 64,
+	       "basefs_group_desc must stay 64 bytes");
+_Static_assert(sizeof(struct basefs_inode) == BASEFS_MIN_INODE_SIZE,
+	       "basefs_inode must stay BASEFS_MIN_INODE_SIZE bytes");
+_Static_assert(sizeof(struct basefs_journal_super) == 32,
+	       "basefs_journal_super must stay 32 bytes");
+_Static_assert(sizeof(struct basefs_journal_desc) == 24,
+	       "basefs_journal_desc header must stay 24 bytes");
+_Static_assert(sizeof(struct basefs_journal_revoke) == 24,
+	       "basefs_journal_revoke header must stay 24 bytes");
+_Static_assert(sizeof(struct basefs_extent) == 24,
+	       "basefs_extent must stay 24 bytes");
+_Static_assert(sizeof(struct basefs_extent_header) == 16 &&
+	       sizeof(struct basefs_extent_idx) == 16,
+	       "extent tree header and index entries must stay 16 bytes");
+_Static_assert(sizeof(struct basefs_dir_entry) == 16,
+	       "basefs_dir_entry header must stay 16 bytes");
+
+/*
+ * Geometry helpers.  They take host-order values so that both the kernel
+ * and the tools can use them after converting the superblock fields.
+ */
+static inline __u64 basefs_group_first_block(__u64 first_group_block,
+					     __u32 blocks_per_group,
+					     __u32 group)
+{
+	return first_group_block + (__u64)group * blocks_per_group;
+}
+
+/* Number of blocks in 'group'; only the last group can be short. */
+static inline __u32 basefs_group_nr_blocks(__u64 blocks_count,
+					   __u64 first_group_block,
+					   __u32 blocks_per_group,
+					   __u32 group)
+{
+	__u64 start = basefs_group_first_block(first_group_block,
+					       blocks_per_group, group);
+
+	if (blocks_count - start < blocks_per_group)
+		return (__u32)(blocks_count - start);
+	return blocks_per_group;
+}
+
+/* Metadata blocks at the head of every group. */
+static inline __u32 basefs_group_overhead(__u32 itable_blocks)
+{
+	return BASEFS_GROUP_META_BLOCKS + itable_blocks;
+}
+
+#endif /* _BASEFS_DISK_H */
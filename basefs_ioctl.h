@@ -0,0 +1,103 @@
+#ifndef _BASEFS_IOCTL_H
+#define _BASEFS_IOCTL_H
+
+/*
+ * ioctls of BaseFS, shared by the kernel module (through basefs.h) and
+ * user-space programs.  Like basefs_disk.h it only uses fixed-size
+ * types, so the structures are the same for 32 and 64 bit callers.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define BASEFS_IOC_MAGIC        'B'
+
+/*
+ * BASEFS_IOC_DIR_XATTR, on a directory: fetch one extended attribute of
+ * many entries at once, e.g. the labels of the samples of a dataset.
+ * 'name' is the full attribute name and must be in the "user."
+ * namespace.  Starting at directory position 'pos' (0 the first time),
+ * one struct basefs_dir_xattr_rec per entry is written to the 'buf_len'
+ * bytes at 'buf', for as many entries as fit.  On return 'nr' is the
+ * number of records, 'pos' where the next call continues, and 'flags'
+ * has BASEFS_DIR_XATTR_EOF once the whole directory has been returned.
+ * Fails with ERANGE if not even one record fits.
+ */
+struct basefs_dir_xattr {
+	__u64 pos;
+	__u64 buf;                 /* user pointer */
+	__u32 buf_len;
+	__u32 nr;
+	__u32 flags;
+	__u32 reserved;
+	char  name[256];           /* NUL terminated */
+};
+
+#define BASEFS_DIR_XATTR_EOF    0x0001
+
+/*
+ * A record: the entry's name (name_len bytes, not terminated) follows
+ * the structure, then the value.  value_len is -ENODATA if the entry has
+ * no such attribute and another negative errno if it could not be read.
+ * The next record starts rec_len bytes on, a multiple of 8.
+ */
+struct basefs_dir_xattr_rec {
+	__u64 ino;
+	__u32 rec_len;
+	__s32 value_len;
+	__u8  name_len;
+	__u8  file_type;           /* BASEFS_FT_* */
+	__u16 reserved0;
+	__u32 reserved;
+	char  name[];
+};
+
+#define BASEFS_IOC_DIR_XATTR    _IOWR(BASEFS_IOC_MAGIC, 1, struct basefs_dir_xattr)
+
+/*
+ * BASEFS_IOC_CREATE_BATCH, on a directory: create many regular files in
+ * it at once, e.g. the samples of a preprocessed dataset.  'buf' holds
+ * 'nr' struct basefs_create_rec, 'buf_len' bytes in all (at most
+ * BASEFS_CREATE_BATCH_MAX).  Each file gets permission bits 'mode'
+ * (less the umask), the record's name and size and, if data_len is not
+ * 0, its first data_len bytes.  Data can only be given for a file small
+ * enough to be kept in its inode; a larger one is created as a hole.
+ *
+ * The files of one call are created in one journal transaction.  Once
+ * it has grown large enough to be committed the call stops early: on
+ * return 'nr' is the number of records done, the first of the others
+ * is where the next call should start, and 'created' is the number of
+ * files created.  Each record done has its 'result' set, 0 or a
+ * negative errno (-EEXIST if the name is taken), and 'ino' the new
+ * file's inode number.
+ */
+struct basefs_create_batch {
+	__u64 buf;                 /* user pointer */
+	__u32 buf_len;
+	__u32 nr;
+	__u32 mode;
+	__u32 created;
+	__u64 reserved;
+};
+
+#define BASEFS_CREATE_BATCH_MAX (16U << 20)
+
+/*
+ * A record: the name (name_len bytes, not terminated) follows the
+ * structure, then the data.  The next record starts rec_len bytes on, a
+ * multiple of 8.
+ */
+struct basefs_create_rec {
+	__u64 ino;                 /* out */
+	__u64 size;
+	__u32 rec_len;
+	__u32 data_len;
+	__s32 result;              /* out */
+	__u8  name_len;
+	__u8  reserved0[3];
+	char  name[];
+};
+
+#define BASEFS_IOC_CREATE_BATCH _IOWR(BASEFS_IOC_MAGIC, 2, struct basefs_create_batch)
+
+#endif /* _BASEFS_IOCTL_H */
@@ -8,10 +8,14 @@
  * All data (keys, pointers) are stored in allocated kernel memory.
  * For a production filesystem, you would store nodes on disk blocks
  * and implement buffering, caching, journaling, etc.
+ *
+ * Every key carries a u64 value.  Keys are unique; callers that need
+ * several records with the same natural key (e.g. free extents of the
+ * same length) fold a tie-breaker into the low bits of the key.
  */
 
 /* You may tune the order as needed. */
-#define BTREE_ORDER        4  /* Maximum number of children per node */
+#define BTREE_ORDER        32 /* Maximum number of children per node */
 #define BTREE_MAX_KEYS    (BTREE_ORDER - 1)  /* Max keys in a node */
 #define BTREE_MIN_KEYS    (BTREE_MAX_KEYS / 2) /* Min keys after split */
 
@@ -21,37 +25,54 @@
  *
  * For simplicity, we define a single struct btree_node
  * that can act as either internal or leaf by checking "is_leaf".
+ *
+ * Internal keys are separators: every key in children[i] is >= keys[i - 1]
+ * and < keys[i].  A separator may outlive the record it was copied from
+ * after a delete; it still splits the key space correctly.
  */
 struct btree_node {
 	bool           is_leaf;
 	int            num_keys;           /* how many keys are used */
 	u64            keys[BTREE_MAX_KEYS];   /* array of keys */
-	struct btree_node *children[BTREE_ORDER]; 
-	/*
-	 * For a typical B+ tree, leaves might store an array of data pointers.
-	 * We will store them in 'children' array for demonstration,
-	 * or in a separate array if you want clarity.
-	 */
-
-	/*
-	 * Optional: for B+ tree, leaf nodes are often linked in a chain.
-	 * If you want leaf chaining:
-	 * struct btree_node *next_leaf;
-	 */
+	union {
+		struct btree_node *children[BTREE_ORDER];  /* internal */
+		u64                values[BTREE_MAX_KEYS]; /* leaf */
+	};
 };
 
+/* Forward declarations */
+static int btree_split_child(struct btree_node *parent, int index);
+static int btree_insert_nonfull(struct btree_node *node, u64 key, u64 value);
+static void btree_print_recursive(struct btree_node *node, int level);
+
 /*
- * The btree_root structure contains a pointer to the actual root node.
- * In a real filesystem context, you'd also have references to disk blocks,
- * buffer heads, etc.
+ * Nodes are allocated on the write path of the filesystem (block
+ * allocation during writeback), so they must not recurse into it.
  */
-struct btree_root {
-	struct btree_node *root;
-};
+static struct btree_node *btree_alloc_node(bool is_leaf)
+{
+	struct btree_node *node;
 
-/* Forward declarations */
-static void btree_split_child(struct btree_node *parent, int index);
-static void btree_insert_nonfull(struct btree_node *node, u64 key);
+	node = kzalloc(sizeof(*node), GFP_NOFS);
+	if (node)
+		node->is_leaf = is_leaf;
+	return node;
+}
+
+/* Index of the first key in 'node' greater than 'key'. */
+static int btree_upper_bound(const struct btree_node *node, u64 key)
+{
+	int lo = 0, hi = node->num_keys, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (node->keys[mid] <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
 /* ------------------------------------------------------------------------- */
 
@@ -61,7 +82,6 @@ static void btree_insert_nonfull(struct btree_node *node, u64 key);
 struct btree_root *btree_init(void)
 {
 	struct btree_root *tree;
-	struct btree_node *root_node;
 
 	tree = kzalloc(sizeof(*tree), GFP_KERNEL);
 	if (!tree)
@@ -70,15 +90,11 @@ struct btree_root *btree_init(void)
 	/*
 	 * Allocate a root node (initially a leaf).
 	 */
-	root_node = kzalloc(sizeof(*root_node), GFP_KERNEL);
-	if (!root_node) {
+	tree->root = btree_alloc_node(true);
+	if (!tree->root) {
 		kfree(tree);
 		return NULL;
 	}
-	root_node->is_leaf = true;
-	root_node->num_keys = 0;
-
-	tree->root = root_node;
 	return tree;
 }
 
@@ -113,10 +129,10 @@ void btree_destroy(struct btree_root *tree)
 
 /*
  * btree_search - Search for 'key' in the B+ tree.
- * Returns true if found, false otherwise.
- * In a more complete design, you'd return a pointer to the record data.
+ * Returns true and stores the record's value in *value (if not NULL)
+ * when found, false otherwise.
  */
-bool btree_search(struct btree_root *tree, u64 key)
+bool btree_search(struct btree_root *tree, u64 key, u64 *value)
 {
 	struct btree_node *node;
 	int i;
@@ -125,164 +141,370 @@ bool btree_search(struct btree_root *tree, u64 key)
 		return false;
 
 	node = tree->root;
+	while (!node->is_leaf)
+		node = node->children[btree_upper_bound(node, key)];
 
-	while (1) {
-		/* Find the position of key in this node. */
+	i = btree_upper_bound(node, key);
+	if (i == 0 || node->keys[i - 1] != key)
+		return false;
+	if (value)
+		*value = node->values[i - 1];
+	return true;
+}
+
+/*
+ * Ceiling and floor searches.  The subtree a key descends into may hold
+ * nothing on the wanted side of it (its records can all have been
+ * deleted since the separator was copied), so each level falls back to
+ * the neighbouring child; that child answers from its first or last
+ * leaf, which keeps the walk O(log n).
+ */
+static bool btree_ge_recursive(struct btree_node *node, u64 key,
+			       u64 *found, u64 *value)
+{
+	int i = node->is_leaf ? 0 : btree_upper_bound(node, key);
+
+	if (node->is_leaf) {
 		for (i = 0; i < node->num_keys; i++) {
-			if (key < node->keys[i]) {
-				break;
-			} else if (key == node->keys[i]) {
-				return true; /* Found key */
+			if (node->keys[i] >= key) {
+				*found = node->keys[i];
+				*value = node->values[i];
+				return true;
 			}
 		}
-		if (node->is_leaf) {
-			/* Key is not found in leaf. */
+		return false;
+	}
+	for (; i <= node->num_keys; i++) {
+		if (btree_ge_recursive(node->children[i], key, found, value))
+			return true;
+	}
+	return false;
+}
+
+static bool btree_le_recursive(struct btree_node *node, u64 key,
+			       u64 *found, u64 *value)
+{
+	int i = btree_upper_bound(node, key);
+
+	if (node->is_leaf) {
+		if (i == 0)
 			return false;
-		} else {
-			/* Descend to child. */
-			node = node->children[i];
-		}
+		*found = node->keys[i - 1];
+		*value = node->values[i - 1];
+		return true;
+	}
+	for (; i >= 0; i--) {
+		if (btree_le_recursive(node->children[i], key, found, value))
+			return true;
 	}
+	return false;
+}
+
+/*
+ * btree_lookup_ge - Find the smallest key >= 'key'.
+ * btree_lookup_le - Find the largest key <= 'key'.
+ * Both return false when there is no such record.
+ */
+bool btree_lookup_ge(struct btree_root *tree, u64 key, u64 *found, u64 *value)
+{
+	if (!tree || !tree->root)
+		return false;
+	return btree_ge_recursive(tree->root, key, found, value);
+}
+
+bool btree_lookup_le(struct btree_root *tree, u64 key, u64 *found, u64 *value)
+{
+	if (!tree || !tree->root)
+		return false;
+	return btree_le_recursive(tree->root, key, found, value);
 }
 
 /*
- * btree_insert - Insert a key into the B+ tree.
- * In a real scenario, you'd also store associated data (value, block index, etc.).
+ * btree_insert - Insert 'key' with its 'value' into the B+ tree.
+ * Returns 0, -EEXIST if the key is already present, or -ENOMEM.  On
+ * failure the tree is unchanged apart from node splits, which keep it
+ * valid.
  */
-void btree_insert(struct btree_root *tree, u64 key)
+int btree_insert(struct btree_root *tree, u64 key, u64 value)
 {
 	struct btree_node *root;
 	struct btree_node *new_root;
+	int ret;
 
 	if (!tree)
-		return;
+		return -EINVAL;
 	root = tree->root;
 	if (!root)
-		return;
+		return -EINVAL;
 
 	/*
 	 * If the root is full, we must grow the tree in height.
 	 */
 	if (root->num_keys == BTREE_MAX_KEYS) {
 		/* Allocate a new root and make the old root a child. */
-		new_root = kzalloc(sizeof(*new_root), GFP_KERNEL);
+		new_root = btree_alloc_node(false);
 		if (!new_root)
-			return;
-
-		new_root->is_leaf = false;
-		new_root->num_keys = 0;
+			return -ENOMEM;
 		new_root->children[0] = root;
 
 		/*
 		 * Split the old root node if it is full.
 		 */
-		btree_split_child(new_root, 0);
-
-		/*
-		 * Now insert the key into the appropriate child.
-		 */
-		btree_insert_nonfull(new_root, key);
+		ret = btree_split_child(new_root, 0);
+		if (ret) {
+			kfree(new_root);
+			return ret;
+		}
 
 		/* Update tree->root pointer */
 		tree->root = new_root;
-	} else {
-		/* Root is not full, so insert directly. */
-		btree_insert_nonfull(root, key);
+		root = new_root;
 	}
+
+	ret = btree_insert_nonfull(root, key, value);
+	if (!ret)
+		tree->nr_entries++;
+	return ret;
 }
 
 /*
  * btree_insert_nonfull - Insert 'key' into a node that is known not to be full.
  */
-static void btree_insert_nonfull(struct btree_node *node, u64 key)
+static int btree_insert_nonfull(struct btree_node *node, u64 key, u64 value)
 {
-	int i = node->num_keys;
+	int i = btree_upper_bound(node, key);
+	int ret;
 
 	if (node->is_leaf) {
+		if (i > 0 && node->keys[i - 1] == key)
+			return -EEXIST;
 		/*
 		 * Insert the key into this leaf in sorted order.
 		 */
-		while (i >= 1 && key < node->keys[i - 1]) {
-			node->keys[i] = node->keys[i - 1];
-			i--;
-		}
+		memmove(&node->keys[i + 1], &node->keys[i],
+			(node->num_keys - i) * sizeof(node->keys[0]));
+		memmove(&node->values[i + 1], &node->values[i],
+			(node->num_keys - i) * sizeof(node->values[0]));
 		node->keys[i] = key;
+		node->values[i] = value;
 		node->num_keys++;
-	} else {
-		/*
-		 * Find the child that should receive the key.
-		 */
-		while (i >= 1 && key < node->keys[i - 1]) {
-			i--;
-		}
-		/*
-		 * If the child is full, split it first.
-		 */
-		if (node->children[i]->num_keys == BTREE_MAX_KEYS) {
-			btree_split_child(node, i);
-			if (key > node->keys[i])
-				i++;
-		}
-		btree_insert_nonfull(node->children[i], key);
+		return 0;
+	}
+
+	/*
+	 * If the child is full, split it first.
+	 */
+	if (node->children[i]->num_keys == BTREE_MAX_KEYS) {
+		ret = btree_split_child(node, i);
+		if (ret)
+			return ret;
+		if (key >= node->keys[i])
+			i++;
 	}
+	return btree_insert_nonfull(node->children[i], key, value);
 }
 
 /*
  * btree_split_child - Split child node of 'parent' at 'index'.
- * We assume child is full (has BTREE_MAX_KEYS).
+ * We assume child is full (has BTREE_MAX_KEYS) and parent is not.
+ *
+ * A leaf keeps its records on both sides and copies the first key of
+ * the right half up as the separator; an internal node moves its median
+ * key up.
  */
-static void btree_split_child(struct btree_node *parent, int index)
+static int btree_split_child(struct btree_node *parent, int index)
 {
 	struct btree_node *full_child = parent->children[index];
 	struct btree_node *new_node;
 	int mid = BTREE_MAX_KEYS / 2;
+	u64 separator;
 	int i;
 
+	new_node = btree_alloc_node(full_child->is_leaf);
+	if (!new_node)
+		return -ENOMEM;
+
+	if (full_child->is_leaf) {
+		new_node->num_keys = BTREE_MAX_KEYS - mid;
+		memcpy(new_node->keys, &full_child->keys[mid],
+		       new_node->num_keys * sizeof(new_node->keys[0]));
+		memcpy(new_node->values, &full_child->values[mid],
+		       new_node->num_keys * sizeof(new_node->values[0]));
+		separator = new_node->keys[0];
+	} else {
+		new_node->num_keys = BTREE_MAX_KEYS - mid - 1;
+		memcpy(new_node->keys, &full_child->keys[mid + 1],
+		       new_node->num_keys * sizeof(new_node->keys[0]));
+		memcpy(new_node->children, &full_child->children[mid + 1],
+		       (new_node->num_keys + 1) * sizeof(new_node->children[0]));
+		separator = full_child->keys[mid];
+	}
+	full_child->num_keys = mid; /* left side keeps 'mid' keys */
+
 	/*
-	 * Allocate new node which will hold the right half of full_child's keys.
-	 * For a B+ tree, you might want to replicate the mid key or manage pointers differently.
+	 * Shift parent's children and keys to make room for the new child.
 	 */
-	new_node = kzalloc(sizeof(*new_node), GFP_KERNEL);
-	if (!new_node)
-		return;
+	for (i = parent->num_keys; i >= index + 1; i--)
+		parent->children[i + 1] = parent->children[i];
+	parent->children[index + 1] = new_node;
 
-	new_node->is_leaf = full_child->is_leaf;
-	new_node->num_keys = BTREE_MAX_KEYS - mid - 1;
+	for (i = parent->num_keys - 1; i >= index; i--)
+		parent->keys[i + 1] = parent->keys[i];
+	parent->keys[index] = separator;
 
-	/* Copy the right half of keys from full_child to new_node. */
-	for (i = 0; i < new_node->num_keys; i++) {
-		new_node->keys[i] = full_child->keys[i + mid + 1];
+	parent->num_keys++;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Deletion                                                                    */
+
+/* Drop key 'index' and the child to its right from an internal node. */
+static void btree_remove_from_parent(struct btree_node *parent, int index)
+{
+	memmove(&parent->keys[index], &parent->keys[index + 1],
+		(parent->num_keys - index - 1) * sizeof(parent->keys[0]));
+	memmove(&parent->children[index + 1], &parent->children[index + 2],
+		(parent->num_keys - index - 1) * sizeof(parent->children[0]));
+	parent->num_keys--;
+}
+
+/*
+ * btree_merge - Fold children[index + 1] of 'parent' into children[index].
+ * Only called when both are at or below the minimum, so the result fits.
+ */
+static void btree_merge(struct btree_node *parent, int index)
+{
+	struct btree_node *left = parent->children[index];
+	struct btree_node *right = parent->children[index + 1];
+	int n = left->num_keys;
+
+	if (left->is_leaf) {
+		memcpy(&left->keys[n], right->keys,
+		       right->num_keys * sizeof(right->keys[0]));
+		memcpy(&left->values[n], right->values,
+		       right->num_keys * sizeof(right->values[0]));
+		left->num_keys += right->num_keys;
+	} else {
+		left->keys[n] = parent->keys[index];
+		memcpy(&left->keys[n + 1], right->keys,
+		       right->num_keys * sizeof(right->keys[0]));
+		memcpy(&left->children[n + 1], right->children,
+		       (right->num_keys + 1) * sizeof(right->children[0]));
+		left->num_keys += right->num_keys + 1;
 	}
-	/*
-	 * For a B+ tree, if it's not a leaf, copy child pointers as well.
-	 */
-	if (!full_child->is_leaf) {
-		for (i = 0; i <= new_node->num_keys; i++) {
-			new_node->children[i] = full_child->children[i + mid + 1];
+	btree_remove_from_parent(parent, index);
+	kfree(right);
+}
+
+/*
+ * btree_rebalance - children[index] of 'parent' dropped below the minimum.
+ * Borrow a key from a sibling that can spare one, otherwise merge.
+ */
+static void btree_rebalance(struct btree_node *parent, int index)
+{
+	struct btree_node *child = parent->children[index];
+	struct btree_node *left = index > 0 ? parent->children[index - 1] : NULL;
+	struct btree_node *right = index < parent->num_keys ?
+				   parent->children[index + 1] : NULL;
+	int n = child->num_keys;
+
+	if (left && left->num_keys > BTREE_MIN_KEYS) {
+		memmove(&child->keys[1], &child->keys[0],
+			n * sizeof(child->keys[0]));
+		if (child->is_leaf) {
+			memmove(&child->values[1], &child->values[0],
+				n * sizeof(child->values[0]));
+			child->keys[0] = left->keys[left->num_keys - 1];
+			child->values[0] = left->values[left->num_keys - 1];
+			parent->keys[index - 1] = child->keys[0];
+		} else {
+			memmove(&child->children[1], &child->children[0],
+				(n + 1) * sizeof(child->children[0]));
+			child->keys[0] = parent->keys[index - 1];
+			child->children[0] = left->children[left->num_keys];
+			parent->keys[index - 1] = left->keys[left->num_keys - 1];
 		}
+		child->num_keys++;
+		left->num_keys--;
+		return;
 	}
 
-	full_child->num_keys = mid; /* left side keeps 'mid' keys */
-
-	/*
-	 * Shift parent's children to make room for the new child pointer.
-	 */
-	for (i = parent->num_keys; i >= index + 1; i--) {
-		parent->children[i + 1] = parent->children[i];
+	if (right && right->num_keys > BTREE_MIN_KEYS) {
+		if (child->is_leaf) {
+			child->keys[n] = right->keys[0];
+			child->values[n] = right->values[0];
+			memmove(&right->values[0], &right->values[1],
+				(right->num_keys - 1) * sizeof(right->values[0]));
+		} else {
+			child->keys[n] = parent->keys[index];
+			child->children[n + 1] = right->children[0];
+			parent->keys[index] = right->keys[0];
+			memmove(&right->children[0], &right->children[1],
+				right->num_keys * sizeof(right->children[0]));
+		}
+		memmove(&right->keys[0], &right->keys[1],
+			(right->num_keys - 1) * sizeof(right->keys[0]));
+		child->num_keys++;
+		right->num_keys--;
+		if (child->is_leaf)
+			parent->keys[index] = right->keys[0];
+		return;
 	}
 
-	parent->children[index + 1] = new_node;
+	if (left)
+		btree_merge(parent, index - 1);
+	else if (right)
+		btree_merge(parent, index);
+}
 
-	/*
-	 * Shift parent's keys to insert the median key from full_child.
-	 * For a B+ tree, you might handle the median differently (e.g., keep it in child).
-	 */
-	for (i = parent->num_keys - 1; i >= index; i--) {
-		parent->keys[i + 1] = parent->keys[i];
+static int btree_delete_recursive(struct btree_node *node, u64 key)
+{
+	int i = btree_upper_bound(node, key);
+	int ret;
+
+	if (node->is_leaf) {
+		if (i == 0 || node->keys[i - 1] != key)
+			return -ENOENT;
+		i--;
+		memmove(&node->keys[i], &node->keys[i + 1],
+			(node->num_keys - i - 1) * sizeof(node->keys[0]));
+		memmove(&node->values[i], &node->values[i + 1],
+			(node->num_keys - i - 1) * sizeof(node->values[0]));
+		node->num_keys--;
+		return 0;
 	}
-	parent->keys[index] = full_child->keys[mid];
 
-	parent->num_keys++;
+	ret = btree_delete_recursive(node->children[i], key);
+	if (!ret && node->children[i]->num_keys < BTREE_MIN_KEYS)
+		btree_rebalance(node, i);
+	return ret;
+}
+
+/*
+ * btree_delete - Remove 'key' from the B+ tree.
+ * Returns 0 or -ENOENT.  Never allocates, so it cannot fail otherwise.
+ */
+int btree_delete(struct btree_root *tree, u64 key)
+{
+	struct btree_node *old_root;
+	int ret;
+
+	if (!tree || !tree->root)
+		return -EINVAL;
+
+	ret = btree_delete_recursive(tree->root, key);
+	if (ret)
+		return ret;
+	tree->nr_entries--;
+
+	/* An internal root left with a single child hands over to it. */
+	old_root = tree->root;
+	if (!old_root->is_leaf && old_root->num_keys == 0) {
+		tree->root = old_root->children[0];
+		kfree(old_root);
+	}
+	return 0;
 }
 
 /*
@@ -316,7 +538,8 @@ static void btree_print_recursive(struct btree_node *node, int level)
 	if (node->is_leaf) {
 		printk(KERN_INFO "%*sLeaf Node: ", level * 4, "");
 		for (i = 0; i < node->num_keys; i++) {
-			printk(KERN_CONT "%llu ", node->keys[i]);
+			printk(KERN_CONT "%llu=%llu ", node->keys[i],
+			       node->values[i]);
 		}
 		printk(KERN_CONT "\n");
 	} else {
@@ -333,18 +556,6 @@ static void btree_print_recursive(struct btree_node *node, int level)
 	}
 }
 
-/*
- * For convenience, you could export these symbols to allow usage in other .c files.
- * E.g., if building as part of a kernel module:
- */
-/*
-EXPORT_SYMBOL_GPL(btree_init);
-EXPORT_SYMBOL_GPL(btree_destroy);
-EXPORT_SYMBOL_GPL(btree_search);
-EXPORT_SYMBOL_GPL(btree_insert);
-EXPORT_SYMBOL_GPL(btree_print);
-*/
-
 /*
  * End of file
  */
@@ -0,0 +1,947 @@
+#include <linux/blkdev.h>
+#include <linux/jhash.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/xattr.h>
+#include "basefs.h"
+
+/*
+ * Directories are arrays of blocks packed with struct basefs_dir_entry
+ * records (see basefs_disk.h).  An entry never crosses a block and the
+ * last one of a block reaches its end, so each block can be walked on its
+ * own.  Directory blocks are read through the block device's buffer
+ * cache at their mapped physical address; directories have no page
+ * cache of their own.
+ *
+ * The VFS serialises changes to a directory with its i_rwsem, so the
+ * functions here do no locking of their own.
+ *
+ * A flat dataset directory can hold millions of entries, too many to
+ * search block by block.  A directory of BASEFS_DIR_INDEX_BLOCKS blocks
+ * or more gets an index the first time a name is looked up in it: a
+ * B+ tree (btree.c) from the hash of each name to the byte offset of its
+ * entry, kept in memory for as long as the inode is.  Names whose
+ * hashes collide get consecutive keys (the hash in the high 32 bits, a
+ * sequence number in the low ones), and every candidate is checked
+ * against the entry itself, so lookup, create and unlink read one
+ * directory block after an O(log n) search.  Creates look for room from
+ * i_dir_hint, the first block that had some the last time, instead of
+ * from block 0.  Nothing about the index is on disk: it is built by
+ * lookup, which holds i_rwsem shared, and published with cmpxchg(); it
+ * is only changed with i_rwsem held exclusive, and dropped (to be built
+ * again later) if a change to it fails.
+ *
+ * Datasets are probed for names that are not there (other extensions,
+ * cache files), and each miss would still search the index.  Next to
+ * the index sits a bloom filter of the hashes in it, BASEFS_DIR_BLOOM_BITS
+ * bits per name, which answers most misses from a few bits instead;
+ * creates, which look their name up first, skip the search the same
+ * way.  Unlinked names stay in the filter, which only makes it answer
+ * less often, and it is rebuilt from the index, twice as large, once
+ * more names have been added than it has room for.  The lookup that
+ * misses leaves a negative dentry, so a name probed again is answered
+ * by the dcache.  /proc/fs/basefs/<dev>/dir counts lookups, misses and
+ * how often the filter answered.
+ */
+
+/* Hashes per name of the bloom filter. */
+#define BASEFS_BLOOM_HASHES     4
+
+struct basefs_dir_bloom {
+	u32 shift;                  /* the filter has 1 << shift bits */
+	u32 nr;                     /* names added */
+	unsigned long map[];
+};
+
+static inline struct basefs_dir_entry *basefs_entry_at(struct buffer_head *bh,
+							unsigned int offset)
+{
+	return (struct basefs_dir_entry *)(bh->b_data + offset);
+}
+
+/* Space an entry actually needs; unused entries need none. */
+static inline unsigned int basefs_entry_used(const struct basefs_dir_entry *de)
+{
+	return de->inode ? BASEFS_DIR_REC_LEN(de->name_len) : 0;
+}
+
+static bool basefs_check_entry(struct inode *dir, struct basefs_dir_entry *de,
+			       unsigned int offset)
+{
+	u32 rec_len = le32_to_cpu(de->rec_len);
+
+	if (rec_len >= sizeof(*de) && !(rec_len % BASEFS_DIR_PAD) &&
+	    rec_len <= dir->i_sb->s_blocksize - offset &&
+	    BASEFS_DIR_REC_LEN(de->name_len) <= rec_len)
+		return true;
+
+	basefs_msg(dir->i_sb, KERN_ERR,
+		   "directory %lu: bad entry at offset %u (rec_len %u, name_len %u)",
+		   dir->i_ino, offset, rec_len, de->name_len);
+	return false;
+}
+
+static inline bool basefs_match(const struct qstr *name,
+				const struct basefs_dir_entry *de)
+{
+	return de->inode && de->name_len == name->len &&
+	       !memcmp(de->name, name->name, name->len);
+}
+
+/* Read directory block 'n'. */
+static struct buffer_head *basefs_dir_bread(struct inode *dir, u64 n)
+{
+	struct buffer_head *bh;
+	u64 pblk;
+	int ret;
+
+	ret = basefs_map_blocks(dir, n, 1, false, &pblk, NULL);
+	if (ret <= 0) {
+		if (!ret)
+			basefs_msg(dir->i_sb, KERN_ERR,
+				   "directory %lu has a hole at block %llu",
+				   dir->i_ino, n);
+		return ERR_PTR(ret ? ret : -EFSCORRUPTED);
+	}
+	bh = sb_bread(dir->i_sb, pblk);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	return bh;
+}
+
+static inline u64 basefs_dir_blocks(struct inode *dir)
+{
+	return dir->i_size >> dir->i_sb->s_blocksize_bits;
+}
+
+/* Index key of the first name with this hash, see above. */
+static inline u64 basefs_dir_hash(struct inode *dir, const char *name,
+				  unsigned int len)
+{
+	return (u64)full_name_hash(dir, name, len) << 32;
+}
+
+/* Add the entry 'de' at byte 'pos' of 'dir' to 'index'. */
+static int basefs_index_add(struct btree_root *index, struct inode *dir,
+			    const struct basefs_dir_entry *de, u64 pos)
+{
+	u64 key = basefs_dir_hash(dir, de->name, de->name_len);
+	u64 found, value;
+
+	if (btree_lookup_le(index, key | U32_MAX, &found, &value) &&
+	    (found >> 32) == (key >> 32)) {
+		if ((u32)found == U32_MAX)
+			return -ENOSPC;
+		key = found + 1;
+	}
+	return btree_insert(index, key, pos);
+}
+
+/* Remove the entry for 'name' at byte 'pos' from 'index'. */
+static void basefs_index_del(struct btree_root *index, struct inode *dir,
+			     const struct qstr *name, u64 pos)
+{
+	u64 key = basefs_dir_hash(dir, name->name, name->len);
+	u64 found, value;
+
+	while (btree_lookup_ge(index, key, &found, &value) &&
+	       (found >> 32) == (key >> 32)) {
+		if (value == pos) {
+			btree_delete(index, found);
+			return;
+		}
+		if ((u32)found == U32_MAX)
+			break;
+		key = found + 1;
+	}
+}
+
+static inline u32 basefs_bloom_bit(const struct basefs_dir_bloom *bloom,
+				   u32 hash, int i)
+{
+	return jhash_1word(hash, i) >> (32 - bloom->shift);
+}
+
+/* False if no name with this hash is in the index. */
+static bool basefs_bloom_test(const struct basefs_dir_bloom *bloom, u32 hash)
+{
+	int i;
+
+	for (i = 0; i < BASEFS_BLOOM_HASHES; i++)
+		if (!test_bit(basefs_bloom_bit(bloom, hash, i), bloom->map))
+			return false;
+	return true;
+}
+
+static void basefs_bloom_set(struct basefs_dir_bloom *bloom, u32 hash)
+{
+	int i;
+
+	for (i = 0; i < BASEFS_BLOOM_HASHES; i++)
+		__set_bit(basefs_bloom_bit(bloom, hash, i), bloom->map);
+	bloom->nr++;
+}
+
+/*
+ * basefs_bloom_build - A filter of the hashes in 'index', with room for
+ * twice 'names' of them.  NULL if there is no memory for it; lookups
+ * then search the index.
+ */
+static struct basefs_dir_bloom *basefs_bloom_build(struct btree_root *index,
+						   u32 names)
+{
+	u64 bits = (u64)max(names, 32U) * 2 * BASEFS_DIR_BLOOM_BITS;
+	struct basefs_dir_bloom *bloom;
+	u64 key = 0, found, value;
+	u32 shift = min(order_base_2(bits), 31);
+
+	bloom = kvzalloc(sizeof(*bloom) + BITS_TO_LONGS(1UL << shift) *
+			 sizeof(long), GFP_KERNEL);
+	if (!bloom)
+		return NULL;
+	bloom->shift = shift;
+	/* Names with the same hash share their bits: one visit per hash. */
+	while (btree_lookup_ge(index, key, &found, &value)) {
+		basefs_bloom_set(bloom, found >> 32);
+		if ((found | U32_MAX) == U64_MAX)
+			break;
+		key = (found | U32_MAX) + 1;
+	}
+	return bloom;
+}
+
+/* Record a name just added to the index, growing the filter if full. */
+static void basefs_bloom_add(struct inode *dir, u32 hash)
+{
+	struct basefs_inode_info *bi = BASEFS_I(dir);
+	struct basefs_dir_bloom *bloom = bi->i_dir_bloom, *new;
+
+	if (!bloom)
+		return;
+	basefs_bloom_set(bloom, hash);
+	if (bloom->nr <= (1UL << bloom->shift) / BASEFS_DIR_BLOOM_BITS ||
+	    bloom->shift == 31)
+		return;
+	new = basefs_bloom_build(bi->i_dir_index, bloom->nr);
+	if (new) {
+		WRITE_ONCE(bi->i_dir_bloom, new);
+		kvfree(bloom);
+	}
+}
+
+void basefs_dir_drop_index(struct inode *dir)
+{
+	struct basefs_inode_info *bi = BASEFS_I(dir);
+
+	btree_destroy(bi->i_dir_index);
+	bi->i_dir_index = NULL;
+	kvfree(bi->i_dir_bloom);
+	bi->i_dir_bloom = NULL;
+	bi->i_dir_hint = 0;
+}
+
+/*
+ * basefs_dir_index - The index of 'dir', built now if the directory is
+ * large enough to need one and has none yet.  NULL if it has none.
+ */
+static struct btree_root *basefs_dir_index(struct inode *dir)
+{
+	struct basefs_inode_info *bi = BASEFS_I(dir);
+	unsigned int bits = dir->i_sb->s_blocksize_bits;
+	unsigned int bs = dir->i_sb->s_blocksize;
+	struct btree_root *index = READ_ONCE(bi->i_dir_index);
+	struct basefs_dir_bloom *bloom;
+	struct basefs_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned int offset;
+	u32 names = 0;
+	u64 n;
+
+	if (index || basefs_dir_blocks(dir) < BASEFS_DIR_INDEX_BLOCKS)
+		return index;
+
+	index = btree_init();
+	if (!index)
+		return NULL;
+	for (n = 0; n < basefs_dir_blocks(dir); n++) {
+		bh = basefs_dir_bread(dir, n);
+		if (IS_ERR(bh))
+			goto fail;
+		for (offset = 0; offset < bs;
+		     offset += le32_to_cpu(de->rec_len)) {
+			de = basefs_entry_at(bh, offset);
+			if (!basefs_check_entry(dir, de, offset) ||
+			    (de->inode &&
+			     basefs_index_add(index, dir, de,
+					      (n << bits) + offset))) {
+				brelse(bh);
+				goto fail;
+			}
+			names += !!de->inode;
+		}
+		brelse(bh);
+		cond_resched();
+	}
+	bloom = basefs_bloom_build(index, names);
+
+	/* Another lookup may have built one meanwhile. */
+	if (cmpxchg(&bi->i_dir_index, NULL, index)) {
+		btree_destroy(index);
+		kvfree(bloom);
+		return READ_ONCE(bi->i_dir_index);
+	}
+	/* Until then lookups search the index alone. */
+	smp_store_release(&bi->i_dir_bloom, bloom);
+	return index;
+
+fail:
+	btree_destroy(index);
+	return NULL;
+}
+
+/*
+ * Find the entry at byte 'pos' of 'dir', and the one before it in its
+ * block, by walking the block from its start.  Returns NULL, with
+ * nothing held, if no entry starts there.
+ */
+static struct basefs_dir_entry *basefs_entry_at_pos(struct inode *dir, u64 pos,
+						    struct buffer_head **bhp,
+						    struct basefs_dir_entry **prevp)
+{
+	unsigned int bits = dir->i_sb->s_blocksize_bits;
+	unsigned int bs = dir->i_sb->s_blocksize;
+	unsigned int want = pos & (bs - 1);
+	struct basefs_dir_entry *de, *prev = NULL;
+	struct buffer_head *bh;
+	unsigned int offset;
+
+	bh = basefs_dir_bread(dir, pos >> bits);
+	if (IS_ERR(bh))
+		return ERR_CAST(bh);
+	for (offset = 0; offset <= want && offset < bs;
+	     offset += le32_to_cpu(de->rec_len)) {
+		de = basefs_entry_at(bh, offset);
+		if (!basefs_check_entry(dir, de, offset))
+			break;
+		if (offset == want) {
+			*bhp = bh;
+			*prevp = prev;
+			return de;
+		}
+		prev = de;
+	}
+	brelse(bh);
+	return NULL;
+}
+
+/* basefs_find_entry() for an indexed directory. */
+static struct basefs_dir_entry *basefs_index_find(struct inode *dir,
+						  struct btree_root *index,
+						  const struct qstr *name,
+						  struct buffer_head **bhp,
+						  struct basefs_dir_entry **prevp,
+						  u64 *posp)
+{
+	u64 key = basefs_dir_hash(dir, name->name, name->len);
+	struct basefs_dir_bloom *bloom = smp_load_acquire(&BASEFS_I(dir)->i_dir_bloom);
+	struct basefs_dir_stats __percpu *stats = BASEFS_SB(dir->i_sb)->dir_stats;
+	struct basefs_dir_entry *de, *prev;
+	struct buffer_head *bh;
+	u64 found, pos;
+
+	if (bloom) {
+		this_cpu_inc(stats->bloom_checks);
+		if (!basefs_bloom_test(bloom, key >> 32)) {
+			this_cpu_inc(stats->bloom_rejects);
+			return ERR_PTR(-ENOENT);
+		}
+	}
+	while (btree_lookup_ge(index, key, &found, &pos) &&
+	       (found >> 32) == (key >> 32)) {
+		de = basefs_entry_at_pos(dir, pos, &bh, &prev);
+		if (IS_ERR(de))
+			return de;
+		if (!de) {
+			basefs_msg(dir->i_sb, KERN_ERR,
+				   "directory %lu: index points at offset %llu, not an entry",
+				   dir->i_ino, pos);
+			return ERR_PTR(-EFSCORRUPTED);
+		}
+		if (basefs_match(name, de)) {
+			*bhp = bh;
+			if (prevp)
+				*prevp = prev;
+			if (posp)
+				*posp = pos;
+			return de;
+		}
+		brelse(bh);
+		if ((u32)found == U32_MAX)
+			break;
+		key = found + 1;
+	}
+	if (bloom)
+		this_cpu_inc(stats->bloom_false);
+	return ERR_PTR(-ENOENT);
+}
+
+/*
+ * basefs_find_entry - Find 'name' in 'dir'.  On success returns the entry,
+ * with its buffer in *bhp, the entry before it in the same block (or
+ * NULL) in *prevp and its byte offset in the directory in *posp (each if
+ * not NULL).  Returns ERR_PTR(-ENOENT) if there is no such name.
+ */
+static struct basefs_dir_entry *basefs_find_entry(struct inode *dir,
+						  const struct qstr *name,
+						  struct buffer_head **bhp,
+						  struct basefs_dir_entry **prevp,
+						  u64 *posp)
+{
+	struct btree_root *index = READ_ONCE(BASEFS_I(dir)->i_dir_index);
+	unsigned int bs = dir->i_sb->s_blocksize;
+	struct basefs_dir_entry *de, *prev;
+	struct buffer_head *bh;
+	unsigned int offset;
+	u64 n;
+
+	if (index)
+		return basefs_index_find(dir, index, name, bhp, prevp, posp);
+
+	for (n = 0; n < basefs_dir_blocks(dir); n++) {
+		bh = basefs_dir_bread(dir, n);
+		if (IS_ERR(bh))
+			return ERR_CAST(bh);
+		prev = NULL;
+		for (offset = 0; offset < bs;
+		     offset += le32_to_cpu(de->rec_len)) {
+			de = basefs_entry_at(bh, offset);
+			if (!basefs_check_entry(dir, de, offset)) {
+				brelse(bh);
+				return ERR_PTR(-EFSCORRUPTED);
+			}
+			if (basefs_match(name, de)) {
+				*bhp = bh;
+				if (prevp)
+					*prevp = prev;
+				if (posp)
+					*posp = (n << dir->i_sb->s_blocksize_bits) +
+						offset;
+				return de;
+			}
+			prev = de;
+		}
+		brelse(bh);
+	}
+	return ERR_PTR(-ENOENT);
+}
+
+int basefs_inode_by_name(struct inode *dir, const struct qstr *name,
+			 ino_t *ino)
+{
+	struct basefs_dir_stats __percpu *stats = BASEFS_SB(dir->i_sb)->dir_stats;
+	struct basefs_dir_entry *de;
+	struct buffer_head *bh;
+
+	this_cpu_inc(stats->lookups);
+	basefs_dir_index(dir);
+	de = basefs_find_entry(dir, name, &bh, NULL, NULL);
+	if (IS_ERR(de)) {
+		if (PTR_ERR(de) == -ENOENT)
+			this_cpu_inc(stats->misses);
+		return PTR_ERR(de);
+	}
+	*ino = le64_to_cpu(de->inode);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * basefs_dir_stats_show - /proc/fs/basefs/<dev>/dir: lookups, misses
+ * and how often the bloom filters answered a search of an index.
+ */
+int basefs_dir_stats_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct basefs_dir_stats st = {}, *c;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(BASEFS_SB(sb)->dir_stats, cpu);
+		st.lookups += c->lookups;
+		st.misses += c->misses;
+		st.bloom_checks += c->bloom_checks;
+		st.bloom_rejects += c->bloom_rejects;
+		st.bloom_false += c->bloom_false;
+	}
+	seq_printf(m, "%llu lookups, %llu of missing names (negative dentries)\n",
+		   st.lookups, st.misses);
+	seq_printf(m, "%llu index searches checked against a bloom filter\n",
+		   st.bloom_checks);
+	seq_printf(m, "%llu answered by the filter (%llu%%), %llu false positives (%llu%%)\n",
+		   st.bloom_rejects,
+		   st.bloom_checks ? div64_u64(st.bloom_rejects * 100, st.bloom_checks) : 0,
+		   st.bloom_false,
+		   st.bloom_checks ? div64_u64(st.bloom_false * 100, st.bloom_checks) : 0);
+	return 0;
+}
+
+static void basefs_dir_changed(struct inode *dir, struct buffer_head *bh)
+{
+	basefs_journal_dirty(dir->i_sb, bh, dir);
+	if (IS_DIRSYNC(dir))
+		basefs_journal_sync(dir->i_sb, bh);
+	brelse(bh);
+	dir->i_mtime = inode_set_ctime_current(dir);
+	mark_inode_dirty(dir);
+}
+
+/*
+ * basefs_add_link - Add an entry for 'inode' under the name of 'dentry'.
+ * Uses the first gap large enough, either an unused entry or the slack
+ * at the end of a used one, and appends a block if there is none.  An
+ * indexed directory is searched for the name through its index and for
+ * a gap from i_dir_hint on.
+ */
+int basefs_add_link(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = d_inode(dentry->d_parent);
+	struct basefs_inode_info *bi = BASEFS_I(dir);
+	struct btree_root *index = bi->i_dir_index;
+	const struct qstr *name = &dentry->d_name;
+	unsigned int bits = dir->i_sb->s_blocksize_bits;
+	unsigned int bs = dir->i_sb->s_blocksize;
+	unsigned int need = BASEFS_DIR_REC_LEN(name->len);
+	struct basefs_dir_entry *de, *de1;
+	unsigned int offset, rec_len, used;
+	struct buffer_head *bh;
+	u64 n = 0, nblocks = basefs_dir_blocks(dir);
+	u64 pblk;
+	bool new;
+	int err;
+
+	if (index) {
+		de = basefs_index_find(dir, index, name, &bh, NULL, NULL);
+		if (!IS_ERR(de)) {
+			brelse(bh);
+			return -EEXIST;
+		}
+		if (PTR_ERR(de) != -ENOENT)
+			return PTR_ERR(de);
+		n = min(bi->i_dir_hint, nblocks);
+	}
+
+	for (; n < nblocks; n++) {
+		bh = basefs_dir_bread(dir, n);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		for (offset = 0; offset < bs; offset += rec_len) {
+			de = basefs_entry_at(bh, offset);
+			if (!basefs_check_entry(dir, de, offset)) {
+				brelse(bh);
+				return -EFSCORRUPTED;
+			}
+			if (basefs_match(name, de)) {
+				brelse(bh);
+				return -EEXIST;
+			}
+			rec_len = le32_to_cpu(de->rec_len);
+			used = basefs_entry_used(de);
+			if (rec_len - used >= need)
+				goto got_it;
+		}
+		brelse(bh);
+	}
+
+	/* No room: append a block holding one unused entry. */
+	err = basefs_map_blocks(dir, nblocks, 1, true, &pblk, &new);
+	if (err < 0)
+		return err;
+	bh = sb_getblk(dir->i_sb, pblk);
+	if (!bh)
+		return -ENOMEM;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bs);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	de = basefs_entry_at(bh, 0);
+	de->rec_len = cpu_to_le32(bs);
+	rec_len = bs;
+	used = 0;
+	i_size_write(dir, (nblocks + 1) << dir->i_sb->s_blocksize_bits);
+
+got_it:
+	lock_buffer(bh);
+	if (used) {
+		de1 = (struct basefs_dir_entry *)((char *)de + used);
+		de1->rec_len = cpu_to_le32(rec_len - used);
+		de->rec_len = cpu_to_le32(used);
+		de = de1;
+	}
+	de->name_len = name->len;
+	memcpy(de->name, name->name, name->len);
+	de->file_type = fs_umode_to_ftype(inode->i_mode);
+	de->reserved = 0;
+	de->inode = cpu_to_le64(inode->i_ino);
+	unlock_buffer(bh);
+
+	if (index) {
+		bi->i_dir_hint = n;
+		if (basefs_index_add(index, dir, de,
+				     (n << bits) + ((char *)de - bh->b_data)))
+			basefs_dir_drop_index(dir);
+		else
+			basefs_bloom_add(dir, basefs_dir_hash(dir, name->name,
+							      name->len) >> 32);
+	}
+	basefs_dir_changed(dir, bh);
+	return 0;
+}
+
+/*
+ * basefs_delete_entry - Remove 'name' from 'dir'.  The record is folded
+ * into the previous one of its block, or marked unused if it is first.
+ */
+int basefs_delete_entry(struct inode *dir, const struct qstr *name)
+{
+	struct basefs_inode_info *bi = BASEFS_I(dir);
+	struct basefs_dir_entry *de, *prev;
+	struct buffer_head *bh;
+	u64 pos;
+
+	de = basefs_find_entry(dir, name, &bh, &prev, &pos);
+	if (IS_ERR(de))
+		return PTR_ERR(de);
+	if (bi->i_dir_index) {
+		basefs_index_del(bi->i_dir_index, dir, name, pos);
+		bi->i_dir_hint = min(bi->i_dir_hint,
+				     pos >> dir->i_sb->s_blocksize_bits);
+	}
+
+	lock_buffer(bh);
+	if (prev)
+		le32_add_cpu(&prev->rec_len, le32_to_cpu(de->rec_len));
+	else
+		de->inode = 0;
+	unlock_buffer(bh);
+	basefs_dir_changed(dir, bh);
+	return 0;
+}
+
+/* basefs_set_link - Point the existing entry 'name' at 'inode' (rename). */
+int basefs_set_link(struct inode *dir, const struct qstr *name,
+		    struct inode *inode)
+{
+	struct basefs_dir_entry *de;
+	struct buffer_head *bh;
+
+	de = basefs_find_entry(dir, name, &bh, NULL, NULL);
+	if (IS_ERR(de))
+		return PTR_ERR(de);
+
+	lock_buffer(bh);
+	de->inode = cpu_to_le64(inode->i_ino);
+	de->file_type = fs_umode_to_ftype(inode->i_mode);
+	unlock_buffer(bh);
+	basefs_dir_changed(dir, bh);
+	return 0;
+}
+
+/* True if 'dir' has no entries ("." and ".." are not stored). */
+bool basefs_empty_dir(struct inode *dir)
+{
+	unsigned int bs = dir->i_sb->s_blocksize;
+	struct basefs_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned int offset;
+	u64 n;
+
+	for (n = 0; n < basefs_dir_blocks(dir); n++) {
+		bh = basefs_dir_bread(dir, n);
+		if (IS_ERR(bh))
+			return false;
+		for (offset = 0; offset < bs;
+		     offset += le32_to_cpu(de->rec_len)) {
+			de = basefs_entry_at(bh, offset);
+			if (!basefs_check_entry(dir, de, offset) || de->inode) {
+				brelse(bh);
+				return false;
+			}
+		}
+		brelse(bh);
+	}
+	return true;
+}
+
+/*
+ * Listing a dataset directory is mostly followed by a stat of every
+ * entry, and each stat of an inode not in memory reads its inode table
+ * block: one small random read per file.  So readdir starts reading
+ * the directory blocks ahead of the one it is in, and the inode table
+ * blocks of the entries it returns, all under one plug.  By the time
+ * the caller stats them the blocks are in the buffer cache or on their
+ * way, read in one sorted sweep.  Entries created together name nearby
+ * inodes, so consecutive entries mostly share a table block, and only
+ * a change of block starts a read.  The file type comes from the entry
+ * itself, so scandir() and find never need the inode at all.
+ */
+static void basefs_readdir_ahead(struct inode *dir, u64 n, u64 *ra)
+{
+	u64 end = min_t(u64, n + 1 + BASEFS_DIR_READAHEAD,
+			basefs_dir_blocks(dir));
+	u64 pblk;
+	int ret, i;
+
+	if (*ra <= n)
+		*ra = n + 1;
+	while (*ra < end) {
+		ret = basefs_map_blocks(dir, *ra, end - *ra, false, &pblk, NULL);
+		if (ret <= 0)
+			break;
+		for (i = 0; i < ret; i++)
+			sb_breadahead(dir->i_sb, pblk + i);
+		*ra += ret;
+	}
+}
+
+static void basefs_inode_ahead(struct inode *dir, u64 ino, u64 *last)
+{
+	unsigned int offset;
+	u64 blk;
+
+	blk = basefs_inode_block(dir->i_sb, ino, &offset);
+	if (blk && blk != *last) {
+		sb_breadahead(dir->i_sb, blk);
+		*last = blk;
+	}
+}
+
+/*
+ * basefs_readdir - ctx->pos is 2 + the byte offset of the next entry in
+ * the directory data (0 and 1 are "." and "..").  A position inside a
+ * block that no longer starts an entry resumes at the next one.
+ */
+static int basefs_readdir(struct file *file, struct dir_context *ctx)
+{
+	struct inode *dir = file_inode(file);
+	unsigned int bits = dir->i_sb->s_blocksize_bits;
+	unsigned int bs = dir->i_sb->s_blocksize;
+	struct basefs_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned int offset, start;
+	u64 n, ra = 0, last = 0;
+	struct blk_plug plug;
+	int ret = 0;
+
+	if (!dir_emit_dots(file, ctx))
+		return 0;
+
+	blk_start_plug(&plug);
+	for (n = (ctx->pos - 2) >> bits; n < basefs_dir_blocks(dir); n++) {
+		start = (ctx->pos - 2) & (bs - 1);
+		basefs_readdir_ahead(dir, n, &ra);
+		bh = basefs_dir_bread(dir, n);
+		if (IS_ERR(bh)) {
+			ret = PTR_ERR(bh);
+			break;
+		}
+		for (offset = 0; offset < bs;
+		     offset += le32_to_cpu(de->rec_len)) {
+			de = basefs_entry_at(bh, offset);
+			if (!basefs_check_entry(dir, de, offset)) {
+				ret = -EFSCORRUPTED;
+				break;
+			}
+			if (offset < start)
+				continue;
+			if (de->inode) {
+				if (!dir_emit(ctx, de->name, de->name_len,
+					      le64_to_cpu(de->inode),
+					      fs_ftype_to_dtype(de->file_type)))
+					break;
+				basefs_inode_ahead(dir, le64_to_cpu(de->inode),
+						   &last);
+			}
+			ctx->pos = 2 + (n << bits) + offset +
+				   le32_to_cpu(de->rec_len);
+		}
+		brelse(bh);
+		if (offset < bs)
+			break;
+		ctx->pos = 2 + ((n + 1) << bits);
+	}
+	blk_finish_plug(&plug);
+	return ret;
+}
+
+/*
+ * BASEFS_IOC_DIR_XATTR (see basefs_ioctl.h): one "user." attribute of
+ * many entries in one call.  A loader fetching the labels of a dataset
+ * otherwise makes a getxattr per sample, each a system call, a path walk
+ * and, with a cold cache, a read of its inode table block.  Here the
+ * walk is the directory's own, block by block: the table blocks of a
+ * block's entries are read ahead together, then each entry is looked up
+ * and its attribute read, mostly from the tail of the inode, which came
+ * with the table block.  req.pos is a byte offset in the directory data,
+ * readdir's position less 2.  Each entry is looked up by name and its
+ * value read with vfs_getxattr(), so it gets what getxattr(2) would
+ * give it: the same permission and LSM checks, and -ENODATA for user.
+ * attributes of symlinks and device nodes.
+ */
+static long basefs_dir_xattr(struct file *file, void __user *argp)
+{
+	struct inode *dir = file_inode(file);
+	struct mnt_idmap *idmap = file_mnt_idmap(file);
+	struct super_block *sb = dir->i_sb;
+	unsigned int bits = sb->s_blocksize_bits;
+	unsigned int bs = sb->s_blocksize;
+	struct basefs_dir_xattr_rec *rec;
+	struct basefs_dir_xattr req;
+	struct basefs_dir_entry *de;
+	unsigned int offset, start;
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	struct dentry *dentry;
+	u64 n, last = 0, used = 0;
+	char __user *ubuf;
+	bool full = false;
+	u32 len, rec_len;
+	int vlen, ret = 0;
+	char *blk;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	req.name[sizeof(req.name) - 1] = '\0';
+	if (strncmp(req.name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN) ||
+	    !req.name[XATTR_USER_PREFIX_LEN])
+		return -EOPNOTSUPP;
+	/* A value fits in a block; the longest record is one more. */
+	rec = kvmalloc(ALIGN(sizeof(*rec) + 255 + bs, 8), GFP_KERNEL);
+	blk = kvmalloc(bs, GFP_KERNEL);
+	if (!rec || !blk) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ubuf = u64_to_user_ptr(req.buf);
+	req.nr = 0;
+	req.flags = 0;
+
+	for (n = req.pos >> bits; ; n++) {
+		start = req.pos & (bs - 1);
+		/*
+		 * Each block is checked and copied with the directory
+		 * locked, then its entries are looked up with it unlocked,
+		 * as a path walk would.
+		 */
+		inode_lock_shared(dir);
+		if (n >= basefs_dir_blocks(dir)) {
+			inode_unlock_shared(dir);
+			break;
+		}
+		bh = basefs_dir_bread(dir, n);
+		if (IS_ERR(bh)) {
+			inode_unlock_shared(dir);
+			ret = PTR_ERR(bh);
+			break;
+		}
+		blk_start_plug(&plug);
+		for (offset = 0; offset < bs;
+		     offset += le32_to_cpu(de->rec_len)) {
+			de = basefs_entry_at(bh, offset);
+			if (!basefs_check_entry(dir, de, offset)) {
+				ret = -EFSCORRUPTED;
+				break;
+			}
+			if (offset >= start && de->inode)
+				basefs_inode_ahead(dir, le64_to_cpu(de->inode),
+						   &last);
+		}
+		blk_finish_plug(&plug);
+		memcpy(blk, bh->b_data, bs);
+		brelse(bh);
+		inode_unlock_shared(dir);
+		if (ret)
+			break;
+
+		for (offset = 0; offset < bs;
+		     offset += le32_to_cpu(de->rec_len)) {
+			de = (struct basefs_dir_entry *)(blk + offset);
+			if (offset < start || !de->inode)
+				continue;
+			dentry = lookup_one_unlocked(idmap, de->name,
+						     file->f_path.dentry,
+						     de->name_len);
+			if (IS_ERR(dentry)) {
+				vlen = PTR_ERR(dentry);
+			} else {
+				vlen = -ENOENT;
+				if (!d_is_negative(dentry))
+					vlen = vfs_getxattr(idmap, dentry, req.name,
+							    rec->name + de->name_len,
+							    bs);
+				dput(dentry);
+			}
+			len = sizeof(*rec) + de->name_len + max(vlen, 0);
+			rec_len = ALIGN(len, 8);
+			if (used + rec_len > req.buf_len) {
+				full = true;
+				break;
+			}
+			rec->ino = le64_to_cpu(de->inode);
+			rec->rec_len = rec_len;
+			rec->value_len = vlen;
+			rec->name_len = de->name_len;
+			rec->file_type = de->file_type;
+			rec->reserved0 = 0;
+			rec->reserved = 0;
+			memcpy(rec->name, de->name, de->name_len);
+			memset((void *)rec + len, 0, rec_len - len);
+			if (copy_to_user(ubuf + used, rec, rec_len)) {
+				ret = -EFAULT;
+				break;
+			}
+			used += rec_len;
+			req.nr++;
+		}
+		if (ret)
+			break;
+		/* Where the next call resumes: the entry that did not fit. */
+		req.pos = (n << bits) + offset;
+		if (full)
+			break;
+		cond_resched();
+	}
+out:
+	kvfree(blk);
+	kvfree(rec);
+
+	if (ret)
+		return ret;
+	if (full && !req.nr)
+		return -ERANGE;
+	if (!full)
+		req.flags |= BASEFS_DIR_XATTR_EOF;
+	if (copy_to_user(argp, &req, sizeof(req)))
+		return -EFAULT;
+	return 0;
+}
+
+static long basefs_dir_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	switch (cmd) {
+	case BASEFS_IOC_DIR_XATTR:
+		return basefs_dir_xattr(file, (void __user *)arg);
+	case BASEFS_IOC_CREATE_BATCH:
+		return basefs_create_batch(file, (void __user *)arg);
+	}
+	return -ENOTTY;
+}
+
+const struct file_operations basefs_dir_ops = {
+	.llseek         = generic_file_llseek,
+	.read           = generic_read_dir,
+	.iterate_shared = basefs_readdir,
+	.unlocked_ioctl = basefs_dir_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.fsync          = basefs_fsync,
+};
@@ -0,0 +1,447 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "diskio.h"
+
+/*
+ * There is no liburing in our build environment, so the ring is driven
+ * with the raw system calls.  Only a handful of operations are needed:
+ * setup, register buffers, and enter (submit + wait).
+ */
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			   unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+static int sys_uring_register(int fd, unsigned opcode, void *arg,
+			      unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * diskio_ring_init - Set up an io_uring instance with 'nr_slots' entries
+ * and map its rings.  Returns 0 or a negative errno; on failure the caller
+ * keeps using the pwrite() engine.
+ */
+static int diskio_ring_init(struct diskio *io)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = sys_uring_setup(io->nr_slots, &p);
+	if (fd < 0)
+		return -errno;
+
+	io->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	io->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (io->cq_ring_sz > io->sq_ring_sz)
+			io->sq_ring_sz = io->cq_ring_sz;
+		io->cq_ring_sz = io->sq_ring_sz;
+	}
+
+	io->sq_ring = mmap(NULL, io->sq_ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (io->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		io->cq_ring = io->sq_ring;
+	} else {
+		io->cq_ring = mmap(NULL, io->cq_ring_sz, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, fd,
+				   IORING_OFF_CQ_RING);
+		if (io->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	io->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	io->sqes = mmap(NULL, io->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (io->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	io->sq_head  = (unsigned *)((char *)io->sq_ring + p.sq_off.head);
+	io->sq_tail  = (unsigned *)((char *)io->sq_ring + p.sq_off.tail);
+	io->sq_mask  = (unsigned *)((char *)io->sq_ring + p.sq_off.ring_mask);
+	io->sq_array = (unsigned *)((char *)io->sq_ring + p.sq_off.array);
+	io->cq_head  = (unsigned *)((char *)io->cq_ring + p.cq_off.head);
+	io->cq_tail  = (unsigned *)((char *)io->cq_ring + p.cq_off.tail);
+	io->cq_mask  = (unsigned *)((char *)io->cq_ring + p.cq_off.ring_mask);
+	io->cqes     = (char *)io->cq_ring + p.cq_off.cqes;
+	io->ring_fd  = fd;
+	return 0;
+
+fail_cq:
+	if (io->cq_ring != io->sq_ring)
+		munmap(io->cq_ring, io->cq_ring_sz);
+fail_sq:
+	munmap(io->sq_ring, io->sq_ring_sz);
+fail:
+	close(fd);
+	return -ENOMEM;
+}
+
+/*
+ * diskio_register_bufs - Pin the staging buffers in the kernel so each
+ * write skips the per-I/O page lookup.  This needs enough RLIMIT_MEMLOCK;
+ * if the kernel refuses we silently use ordinary writes.
+ */
+static void diskio_register_bufs(struct diskio *io)
+{
+	struct iovec *iov;
+	unsigned int i;
+
+	iov = calloc(io->nr_slots, sizeof(*iov));
+	if (!iov)
+		return;
+	for (i = 0; i < io->nr_slots; i++) {
+		iov[i].iov_base = io->slots[i].buf;
+		iov[i].iov_len  = io->opts.chunk_size;
+	}
+	if (sys_uring_register(io->ring_fd, IORING_REGISTER_BUFFERS,
+			       iov, io->nr_slots) == 0)
+		io->fixed = 1;
+	free(iov);
+}
+
+/*
+ * diskio_pwrite_all - Synchronous write helper, also used to finish a
+ * short write reported by the ring.
+ */
+static int diskio_pwrite_all(int fd, const char *buf, size_t len, uint64_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, (off_t)off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		buf += ret;
+		len -= (size_t)ret;
+		off += (uint64_t)ret;
+	}
+	return 0;
+}
+
+/*
+ * diskio_reap - Consume every completion currently in the CQ ring,
+ * releasing the staging buffers they belong to.
+ */
+static void diskio_reap(struct diskio *io)
+{
+	unsigned head = *io->cq_head;
+	unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	struct diskio_slot *slot;
+	int ret;
+
+	while (head != tail) {
+		cqe = (struct io_uring_cqe *)io->cqes + (head & *io->cq_mask);
+		slot = &io->slots[cqe->user_data];
+
+		if (cqe->res < 0) {
+			if (!io->error)
+				io->error = cqe->res;
+		} else if ((size_t)cqe->res < slot->len) {
+			ret = diskio_pwrite_all(io->fd,
+						(char *)slot->buf + cqe->res,
+						slot->len - (size_t)cqe->res,
+						slot->off + (uint64_t)cqe->res);
+			if (ret && !io->error)
+				io->error = ret;
+		}
+
+		slot->busy = 0;
+		slot->len = 0;
+		io->inflight--;
+		head++;
+	}
+	__atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * diskio_wait - Block until at least 'nr' more writes have completed.
+ */
+static int diskio_wait(struct diskio *io, unsigned int nr)
+{
+	int ret;
+
+	while (nr && io->inflight) {
+		ret = sys_uring_enter(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+		diskio_reap(io);
+		nr--;
+	}
+	return io->error;
+}
+
+/*
+ * diskio_submit - Send the current staging buffer to the device.
+ */
+static int diskio_submit(struct diskio *io)
+{
+	struct diskio_slot *slot;
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+	int ret;
+
+	if (io->cur < 0)
+		return 0;
+	slot = &io->slots[io->cur];
+	io->cur = -1;
+	if (!slot->len)
+		return 0;
+
+	io->bytes += slot->len;
+	io->submits++;
+
+	if (io->ring_fd < 0) {
+		ret = diskio_pwrite_all(io->fd, slot->buf, slot->len, slot->off);
+		slot->len = 0;
+		if (ret && !io->error)
+			io->error = ret;
+		return ret;
+	}
+
+	tail = *io->sq_tail;
+	idx = tail & *io->sq_mask;
+	sqe = (struct io_uring_sqe *)io->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = io->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd        = io->fd;
+	sqe->addr      = (uint64_t)(uintptr_t)slot->buf;
+	sqe->len       = (uint32_t)slot->len;
+	sqe->off       = slot->off;
+	sqe->user_data = (uint64_t)(slot - io->slots);
+	if (io->fixed)
+		sqe->buf_index = (uint16_t)(slot - io->slots);
+	io->sq_array[idx] = idx;
+	__atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	slot->busy = 1;
+	io->inflight++;
+
+	do {
+		ret = sys_uring_enter(io->ring_fd, 1, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+
+	diskio_reap(io);
+	return io->error;
+}
+
+/*
+ * diskio_get_slot - Return the index of an idle staging buffer, waiting
+ * for an in-flight write to finish if the queue is full.
+ */
+static int diskio_get_slot(struct diskio *io)
+{
+	unsigned int i;
+	int ret;
+
+	for (;;) {
+		for (i = 0; i < io->nr_slots; i++) {
+			if (!io->slots[i].busy)
+				return (int)i;
+		}
+		ret = diskio_wait(io, 1);
+		if (ret)
+			return ret;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * diskio_open - Prepare an engine writing to 'fd'.  'opts' may be NULL for
+ * the defaults.  The fd stays owned by the caller.
+ */
+int diskio_open(struct diskio *io, int fd, const struct diskio_opts *opts)
+{
+	unsigned int i;
+
+	memset(io, 0, sizeof(*io));
+	io->fd = fd;
+	io->ring_fd = -1;
+	io->cur = -1;
+	if (opts)
+		io->opts = *opts;
+	if (!io->opts.queue_depth)
+		io->opts.queue_depth = DISKIO_DEFAULT_QUEUE_DEPTH;
+	if (!io->opts.chunk_size)
+		io->opts.chunk_size = DISKIO_DEFAULT_CHUNK_SIZE;
+	if (io->opts.chunk_size % DISKIO_ALIGN)
+		return -EINVAL;
+
+	/* The pwrite() engine is synchronous, a single buffer is enough. */
+	io->nr_slots = io->opts.no_uring ? 1 : io->opts.queue_depth;
+	io->slots = calloc(io->nr_slots, sizeof(*io->slots));
+	if (!io->slots)
+		return -ENOMEM;
+	for (i = 0; i < io->nr_slots; i++) {
+		if (posix_memalign(&io->slots[i].buf, DISKIO_ALIGN,
+				   io->opts.chunk_size)) {
+			io->nr_slots = i;
+			diskio_close(io);
+			return -ENOMEM;
+		}
+	}
+
+	if (!io->opts.no_uring && diskio_ring_init(io) == 0) {
+		if (io->opts.fixed_bufs)
+			diskio_register_bufs(io);
+	} else {
+		/* Fall back to pwrite(); release the buffers we won't use. */
+		for (i = 1; i < io->nr_slots; i++)
+			free(io->slots[i].buf);
+		io->nr_slots = 1;
+	}
+	return 0;
+}
+
+/*
+ * diskio_write - Queue 'len' bytes from 'data' for offset 'off'.
+ * The data is copied, so the caller may reuse its buffer immediately.
+ * With O_DIRECT, offsets and lengths must be DISKIO_ALIGN multiples.
+ */
+int diskio_write(struct diskio *io, const void *data, size_t len, uint64_t off)
+{
+	const char *src = data;
+	struct diskio_slot *slot;
+	size_t n;
+	int ret;
+
+	if (io->error)
+		return io->error;
+	if (io->opts.direct && ((off | len) % DISKIO_ALIGN))
+		return -EINVAL;
+
+	while (len) {
+		slot = io->cur >= 0 ? &io->slots[io->cur] : NULL;
+		if (slot && (slot->off + slot->len != off ||
+			     slot->len == io->opts.chunk_size)) {
+			ret = diskio_submit(io);
+			if (ret)
+				return ret;
+			slot = NULL;
+		}
+		if (!slot) {
+			ret = diskio_get_slot(io);
+			if (ret < 0)
+				return ret;
+			io->cur = ret;
+			slot = &io->slots[ret];
+			slot->off = off;
+			slot->len = 0;
+		}
+
+		n = io->opts.chunk_size - slot->len;
+		if (n > len)
+			n = len;
+		if (src)
+			memcpy((char *)slot->buf + slot->len, src, n);
+		else
+			memset((char *)slot->buf + slot->len, 0, n);
+		slot->len += n;
+		off += n;
+		len -= n;
+		if (src)
+			src += n;
+	}
+	return 0;
+}
+
+/*
+ * diskio_zero - Write zeroes over [off, off + len).
+ */
+int diskio_zero(struct diskio *io, uint64_t off, uint64_t len)
+{
+	size_t n;
+	int ret;
+
+	while (len) {
+		n = len > io->opts.chunk_size ? io->opts.chunk_size : (size_t)len;
+		ret = diskio_write(io, NULL, n, off);
+		if (ret)
+			return ret;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * diskio_flush - Submit the partially filled buffer and wait for every
+ * outstanding write.  Does not fsync.
+ */
+int diskio_flush(struct diskio *io)
+{
+	int ret;
+
+	ret = diskio_submit(io);
+	if (ret)
+		return ret;
+	if (io->ring_fd >= 0)
+		return diskio_wait(io, io->inflight);
+	return io->error;
+}
+
+/*
+ * diskio_close - Flush and tear the engine down.  Returns the first
+ * error seen over the engine's lifetime.
+ */
+int diskio_close(struct diskio *io)
+{
+	unsigned int i;
+	int ret = 0;
+
+	if (io->slots)
+		ret = diskio_flush(io);
+
+	if (io->ring_fd >= 0) {
+		munmap(io->sqes, io->sqes_sz);
+		if (io->cq_ring != io->sq_ring)
+			munmap(io->cq_ring, io->cq_ring_sz);
+		munmap(io->sq_ring, io->sq_ring_sz);
+		close(io->ring_fd);
+		io->ring_fd = -1;
+	}
+	for (i = 0; i < io->nr_slots; i++)
+		free(io->slots[i].buf);
+	free(io->slots);
+	io->slots = NULL;
+	io->nr_slots = 0;
+	return ret;
+}
+
+const char *diskio_engine(const struct diskio *io)
+{
+	if (io->ring_fd < 0)
+		return "pwrite";
+	return io->fixed ? "io_uring (fixed buffers)" : "io_uring";
+}
@@ -0,0 +1,72 @@
+#ifndef _BASEFS_DISKIO_H
+#define _BASEFS_DISKIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Batched write engine for the BaseFS user-space tools.
+ *
+ * Callers hand in (buffer, length, offset) writes.  Writes that continue
+ * the previous one are merged into a large staging buffer, and full
+ * staging buffers are submitted through io_uring so that up to
+ * 'queue_depth' of them are in flight at once.  When io_uring is not
+ * available (old kernel, seccomp, ...) the same interface falls back to
+ * plain pwrite() calls.
+ */
+
+#define DISKIO_DEFAULT_QUEUE_DEPTH  32
+#define DISKIO_DEFAULT_CHUNK_SIZE   (1024 * 1024)
+#define DISKIO_ALIGN                4096
+
+struct diskio_opts {
+	unsigned int queue_depth;  /* staging buffers kept in flight */
+	size_t       chunk_size;   /* bytes per submitted write */
+	int          no_uring;     /* force the pwrite() fallback */
+	int          direct;       /* fd uses O_DIRECT: keep writes aligned */
+	int          fixed_bufs;   /* register staging buffers with the ring */
+};
+
+struct diskio_slot {
+	void     *buf;
+	size_t    len;
+	uint64_t  off;
+	int       busy;
+};
+
+struct diskio {
+	int fd;
+	struct diskio_opts opts;
+
+	/* io_uring state (ring_fd < 0 means the pwrite() engine is used) */
+	int       ring_fd;
+	int       fixed;          /* buffers registered with the ring */
+	void     *sq_ring;
+	void     *cq_ring;
+	size_t    sq_ring_sz;
+	size_t    cq_ring_sz;
+	void     *sqes;
+	size_t    sqes_sz;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void     *cqes;
+
+	struct diskio_slot *slots;
+	unsigned int nr_slots;
+	unsigned int inflight;
+	int          cur;         /* slot being filled, -1 if none */
+	int          error;       /* first error seen (negative errno) */
+
+	/* statistics */
+	uint64_t bytes;
+	uint64_t submits;
+};
+
+int diskio_open(struct diskio *io, int fd, const struct diskio_opts *opts);
+int diskio_write(struct diskio *io, const void *data, size_t len, uint64_t off);
+int diskio_zero(struct diskio *io, uint64_t off, uint64_t len);
+int diskio_flush(struct diskio *io);
+int diskio_close(struct diskio *io);
+const char *diskio_engine(const struct diskio *io);
+
+#endif /* _BASEFS_DISKIO_H */
@@ -0,0 +1,810 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "libbasefs.h"
+
+/*
+ * dumpfs - Inspect a BaseFS image without mounting it.
+ *
+ * Prints the superblock, free-space fragmentation, per-file extent
+ * statistics, how local each directory's inodes and data are, the state
+ * of the root index area and a map of how full each region of the image
+ * is.  Meant for answering "why does this dataset read slowly":
+ * fragmented files, scattered free space, a directory whose inodes or
+ * data are strewn over the image, or data that is spread thinly over it.
+ */
+
+#define DUMPFS_MAP_WIDTH   64
+#define DUMPFS_MAP_ROWS    16
+#define DUMPFS_TOP_FILES   10
+#define DUMPFS_HIST_BUCKETS 40
+/* A file starting this few blocks past the previous one's end is "near". */
+#define DUMPFS_NEAR_BLOCKS 64
+
+struct dumpfs_file {
+	char     *path;
+	uint64_t  ino;
+	uint64_t  size;
+	uint64_t  blocks;
+	uint32_t  nr_extents;
+	uint32_t  tree_blocks;     /* extent tree blocks, 0 if inline */
+	int       inline_data;     /* data kept in the inode, no blocks */
+	uint64_t  first_block;     /* of logical block 0, 0 if none */
+	uint64_t  end_block;       /* after the last extent */
+};
+
+/*
+ * Locality of one directory, taking its entries in readdir order the
+ * way a dataset walk stats and reads them.
+ */
+struct dumpfs_dir {
+	char     *path;
+	uint32_t  group;           /* of the directory's inode */
+	uint64_t  entries;
+	uint64_t  table_blocks;    /* distinct inode table blocks */
+	uint64_t  table_jumps;     /* to a block neither the same nor next */
+	uint64_t  data_files;      /* files with blocks */
+	uint64_t  data_steps;      /* from one such file to the next */
+	uint64_t  data_near;       /* steps forward by less than NEAR_BLOCKS */
+	uint64_t  data_in_group;   /* starting in the directory's group */
+};
+
+struct dumpfs_state {
+	struct bfs_image *img;
+	int               all_files;
+	int               all_dirs;
+
+	/* directory walk queue */
+	uint64_t         *queue;
+	char            **queue_path;
+	uint64_t          queue_len;
+	uint64_t          queue_cap;
+
+	struct dumpfs_file *files;
+	uint64_t          nr_files;
+	uint64_t          files_cap;
+	uint64_t          nr_dirs;
+	uint64_t          nr_symlinks;
+	uint64_t          errors;
+
+	/* inodes with xattrs in their tail, and the xattr block of each other */
+	uint64_t          xattr_inline;
+	uint64_t         *xattr_blocks;
+	uint64_t          xattr_refs;
+	uint64_t          xattr_cap;
+
+	struct dumpfs_dir *dirs;
+	uint64_t          dirs_len;
+	uint64_t          dirs_cap;
+
+	/* walk context for the dirent callback */
+	const char       *cur_path;
+	struct dumpfs_dir cur_dir;
+	uint64_t         *cur_blocks;  /* inode table block of each entry */
+	uint64_t          cur_blocks_cap;
+	uint64_t          last_end;    /* end_block of the previous file */
+};
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *p = xrealloc(NULL, len);
+
+	snprintf(p, len, "%s/%s", strcmp(dir, "/") ? dir : "", name);
+	return p;
+}
+
+/* Journal location and what its superblock says is left to replay. */
+static void print_journal(const struct bfs_image *img)
+{
+	const struct basefs_super_block *sb = &img->sb;
+	const struct basefs_journal_super *jsb;
+	uint8_t *block = malloc(img->block_size);
+
+	printf("  journal:             %u blocks at %llu",
+	       le32toh(sb->journal_blocks),
+	       (unsigned long long)le64toh(sb->journal_start));
+	if (!block || bfs_read_blocks(img, le64toh(sb->journal_start), 1, block)) {
+		printf(", unreadable\n");
+		free(block);
+		return;
+	}
+	jsb = (const struct basefs_journal_super *)block;
+	if (le32toh(jsb->header.magic) != BASEFS_JOURNAL_MAGIC ||
+	    le32toh(jsb->header.type) != BASEFS_JT_SUPER ||
+	    le32toh(jsb->checksum) != basefs_journal_super_csum(jsb))
+		printf(", bad superblock\n");
+	else if (jsb->start)
+		printf(", replay from log block %u (sequence %llu)\n",
+		       le32toh(jsb->start),
+		       (unsigned long long)le64toh(jsb->header.sequence));
+	else
+		printf(", empty (next sequence %llu)\n",
+		       (unsigned long long)le64toh(jsb->header.sequence));
+	free(block);
+}
+
+static void print_super(const struct bfs_image *img)
+{
+	const struct basefs_super_block *sb = &img->sb;
+	uint64_t uninit = 0;
+	uint32_t g, lazy = 0;
+	time_t t;
+	int i;
+
+	printf("Superblock\n");
+	printf("  magic:               0x%08x\n", le32toh(sb->magic));
+	printf("  version:             %u\n", le32toh(sb->version));
+	printf("  uuid:                ");
+	for (i = 0; i < 16; i++)
+		printf("%02x%s", sb->uuid[i],
+		       (i == 3 || i == 5 || i == 7 || i == 9) ? "-" : "");
+	printf("\n");
+	printf("  block size:          %u\n", img->block_size);
+	printf("  inode size:          %u\n", img->inode_size);
+	printf("  blocks:              %llu (%llu free)\n",
+	       (unsigned long long)img->blocks_count,
+	       (unsigned long long)le64toh(sb->free_blocks_count));
+	printf("  inodes:              %llu (%llu free)\n",
+	       (unsigned long long)img->inodes_count,
+	       (unsigned long long)le64toh(sb->free_inodes_count));
+	printf("  groups:              %u x %u blocks, %u inodes each\n",
+	       img->groups_count, img->blocks_per_group,
+	       img->inodes_per_group);
+	printf("  inode table:         %u blocks per group\n",
+	       img->itable_blocks);
+	for (g = 0; g < img->groups_count; g++) {
+		uint32_t init = basefs_itable_init(&img->gdt[g],
+						   img->itable_blocks);
+
+		if (init < img->itable_blocks) {
+			lazy++;
+			uninit += img->itable_blocks - init;
+		}
+	}
+	if (lazy)
+		printf("  uninitialized:       %llu inode table blocks in %u groups\n",
+		       (unsigned long long)uninit, lazy);
+	printf("  group descriptors:   %u blocks at %llu, %u spare\n",
+	       le32toh(sb->gdt_blocks),
+	       (unsigned long long)le64toh(sb->gdt_start),
+	       le32toh(sb->reserved_gdt_blocks));
+	printf("  root index area:     %u blocks at %llu\n",
+	       le32toh(sb->index_blocks),
+	       (unsigned long long)le64toh(sb->index_start));
+	if (le32toh(sb->feature_compat) & BASEFS_FEATURE_COMPAT_JOURNAL)
+		print_journal(img);
+	printf("  first group block:   %llu\n",
+	       (unsigned long long)img->first_group_block);
+	printf("  features:            compat 0x%x, ro_compat 0x%x, incompat 0x%x\n",
+	       le32toh(sb->feature_compat), le32toh(sb->feature_ro_compat),
+	       le32toh(sb->feature_incompat));
+	if (le32toh(sb->feature_ro_compat) & BASEFS_FEATURE_RO_COMPAT_SB_CSUM)
+		printf("  checksum:            0x%08x (%s)\n",
+		       le32toh(sb->checksum),
+		       img->sb_csum_bad ? "BAD" : "ok");
+	t = (time_t)le64toh(sb->mkfs_time);
+	printf("  created:             %s", ctime(&t));
+	t = (time_t)le64toh(sb->wtime);
+	printf("  last written:        %s", ctime(&t));
+}
+
+static void print_groups(const struct bfs_image *img)
+{
+	const struct basefs_group_desc *gd;
+	uint32_t g;
+
+	printf("\nGroups\n");
+	printf("  %6s %12s %8s %10s %10s %6s %7s\n", "group", "start", "blocks",
+	       "free blks", "free inos", "dirs", "itable");
+	for (g = 0; g < img->groups_count; g++) {
+		gd = &img->gdt[g];
+		printf("  %6u %12llu %8u %10u %10u %6u %7u\n", g,
+		       (unsigned long long)bfs_group_start(img, g),
+		       bfs_group_len(img, g),
+		       le32toh(gd->free_blocks_count),
+		       le32toh(gd->free_inodes_count),
+		       le32toh(gd->used_dirs_count),
+		       basefs_itable_init(gd, img->itable_blocks));
+	}
+}
+
+/* Index of the power-of-two bucket holding 'len' (1, 2-3, 4-7, ...). */
+static int hist_bucket(uint64_t len)
+{
+	int b = 0;
+
+	while (len >>= 1)
+		b++;
+	return b;
+}
+
+/*
+ * scan_bitmaps - Walk every group's block bitmap once, collecting free
+ * extents (runs of clear bits) and the used-block count per map cell.
+ */
+static int scan_bitmaps(const struct bfs_image *img, uint64_t *cells,
+			uint64_t nr_cells)
+{
+	uint64_t hist[DUMPFS_HIST_BUCKETS] = { 0 };
+	uint64_t nr_free = 0, free_blocks = 0, largest = 0;
+	uint64_t run = 0, start, blk;
+	uint8_t *bitmap;
+	uint32_t g, i, len;
+	int b, ret;
+
+	bitmap = xrealloc(NULL, img->block_size);
+
+	/* The fixed area in front of group 0 is all metadata. */
+	for (blk = 0; blk < img->first_group_block; blk++)
+		cells[blk * nr_cells / img->blocks_count]++;
+
+	for (g = 0; g < img->groups_count; g++) {
+		ret = bfs_read_blocks(img, le64toh(img->gdt[g].block_bitmap), 1,
+				      bitmap);
+		if (ret) {
+			free(bitmap);
+			return ret;
+		}
+		start = bfs_group_start(img, g);
+		len = bfs_group_len(img, g);
+		for (i = 0; i <= len; i++) {
+			if (i < len && !bfs_test_bit(bitmap, i)) {
+				run++;
+				continue;
+			}
+			if (i < len)
+				cells[(start + i) * nr_cells / img->blocks_count]++;
+			if (run) {
+				nr_free++;
+				free_blocks += run;
+				if (run > largest)
+					largest = run;
+				hist[hist_bucket(run)]++;
+				run = 0;
+			}
+		}
+	}
+	free(bitmap);
+
+	printf("\nFree space\n");
+	printf("  free blocks:         %llu (%.1f%%)\n",
+	       (unsigned long long)free_blocks,
+	       100.0 * free_blocks / img->blocks_count);
+	printf("  free extents:        %llu\n", (unsigned long long)nr_free);
+	printf("  largest free extent: %llu blocks\n",
+	       (unsigned long long)largest);
+	printf("  average free extent: %.1f blocks\n",
+	       nr_free ? (double)free_blocks / nr_free : 0.0);
+	if (free_blocks)
+		printf("  fragmentation:       %.1f%% of free space outside the largest extent\n",
+		       100.0 * (free_blocks - largest) / free_blocks);
+	printf("  histogram (extent length in blocks: count):\n");
+	for (b = 0; b < DUMPFS_HIST_BUCKETS; b++) {
+		if (hist[b])
+			printf("    %12llu-%-12llu %llu\n",
+			       1ULL << b, (2ULL << b) - 1,
+			       (unsigned long long)hist[b]);
+	}
+	return 0;
+}
+
+static void queue_dir(struct dumpfs_state *s, uint64_t ino, char *path)
+{
+	if (s->queue_len == s->queue_cap) {
+		s->queue_cap = s->queue_cap ? s->queue_cap * 2 : 256;
+		s->queue = xrealloc(s->queue, s->queue_cap * sizeof(*s->queue));
+		s->queue_path = xrealloc(s->queue_path,
+					 s->queue_cap * sizeof(*s->queue_path));
+	}
+	s->queue[s->queue_len] = ino;
+	s->queue_path[s->queue_len] = path;
+	s->queue_len++;
+}
+
+static int count_extent(const struct basefs_extent *ex, void *arg)
+{
+	struct dumpfs_file *f = arg;
+
+	if (!f->nr_extents++ && !le64toh(ex->lblk))
+		f->first_block = le64toh(ex->pblk);
+	f->end_block = le64toh(ex->pblk) + le32toh(ex->len);
+	f->blocks += le32toh(ex->len);
+	return 0;
+}
+
+static int count_tree_block(uint64_t blk, void *arg)
+{
+	struct dumpfs_file *f = arg;
+
+	(void)blk;
+	f->tree_blocks++;
+	return 0;
+}
+
+static uint32_t group_of_block(const struct bfs_image *img, uint64_t blk)
+{
+	if (blk < img->first_group_block)
+		return UINT32_MAX;
+	return (uint32_t)((blk - img->first_group_block) /
+			  img->blocks_per_group);
+}
+
+static void dir_begin(struct dumpfs_state *s, uint64_t ino)
+{
+	memset(&s->cur_dir, 0, sizeof(s->cur_dir));
+	s->cur_dir.group = (uint32_t)((ino - 1) / s->img->inodes_per_group);
+	s->last_end = 0;
+}
+
+/* Entry 'ino' of the current directory: where its inode is. */
+static void dir_entry_table(struct dumpfs_state *s, uint64_t ino)
+{
+	struct dumpfs_dir *d = &s->cur_dir;
+	uint64_t blk, prev;
+	uint32_t offset;
+
+	blk = bfs_inode_block(s->img, ino, &offset);
+	if (d->entries) {
+		prev = s->cur_blocks[d->entries - 1];
+		if (blk != prev && blk != prev + 1)
+			d->table_jumps++;
+	}
+	if (d->entries == s->cur_blocks_cap) {
+		s->cur_blocks_cap = s->cur_blocks_cap ? s->cur_blocks_cap * 2 : 1024;
+		s->cur_blocks = xrealloc(s->cur_blocks,
+					 s->cur_blocks_cap * sizeof(*s->cur_blocks));
+	}
+	s->cur_blocks[d->entries++] = blk;
+}
+
+/* Regular file 'f' of the current directory: where its data starts. */
+static void dir_entry_data(struct dumpfs_state *s, const struct dumpfs_file *f)
+{
+	struct dumpfs_dir *d = &s->cur_dir;
+
+	if (!f->first_block)
+		return;
+	d->data_files++;
+	if (s->last_end) {
+		d->data_steps++;
+		if (f->first_block >= s->last_end &&
+		    f->first_block - s->last_end < DUMPFS_NEAR_BLOCKS)
+			d->data_near++;
+	}
+	if (group_of_block(s->img, f->first_block) == d->group)
+		d->data_in_group++;
+	s->last_end = f->end_block;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void dir_end(struct dumpfs_state *s, const char *path)
+{
+	struct dumpfs_dir *d = &s->cur_dir;
+	uint64_t i;
+
+	if (!d->entries)
+		return;
+	qsort(s->cur_blocks, d->entries, sizeof(*s->cur_blocks), cmp_u64);
+	for (i = 0; i < d->entries; i++)
+		if (!i || s->cur_blocks[i] != s->cur_blocks[i - 1])
+			d->table_blocks++;
+	if (s->dirs_len == s->dirs_cap) {
+		s->dirs_cap = s->dirs_cap ? s->dirs_cap * 2 : 256;
+		s->dirs = xrealloc(s->dirs, s->dirs_cap * sizeof(*s->dirs));
+	}
+	d->path = strdup(path);
+	s->dirs[s->dirs_len++] = *d;
+}
+
+static void count_xattrs(struct dumpfs_state *s, const struct basefs_inode *di)
+{
+	if (le32toh(di->flags) & BASEFS_INODE_INLINE_XATTR)
+		s->xattr_inline++;
+	if (!di->xattr_block)
+		return;
+	if (s->xattr_refs == s->xattr_cap) {
+		s->xattr_cap = s->xattr_cap ? s->xattr_cap * 2 : 1024;
+		s->xattr_blocks = xrealloc(s->xattr_blocks,
+					   s->xattr_cap * sizeof(*s->xattr_blocks));
+	}
+	s->xattr_blocks[s->xattr_refs++] = le64toh(di->xattr_block);
+}
+
+static int walk_entry(const struct basefs_dir_entry *de, const char *name,
+		      void *arg)
+{
+	struct dumpfs_state *s = arg;
+	struct dumpfs_file *f;
+	struct basefs_inode di;
+	uint64_t ino = le64toh(de->inode);
+	int ret;
+
+	if (bfs_read_inode(s->img, ino, &di)) {
+		fprintf(stderr, "%s/%s: bad inode %llu\n", s->cur_path, name,
+			(unsigned long long)ino);
+		s->errors++;
+		return 0;
+	}
+	dir_entry_table(s, ino);
+	count_xattrs(s, &di);
+
+	if (S_ISDIR(le16toh(di.mode))) {
+		s->nr_dirs++;
+		queue_dir(s, ino, join_path(s->cur_path, name));
+		return 0;
+	}
+	if (S_ISLNK(le16toh(di.mode)))
+		s->nr_symlinks++;
+	if (!S_ISREG(le16toh(di.mode)))
+		return 0;
+
+	if (s->nr_files == s->files_cap) {
+		s->files_cap = s->files_cap ? s->files_cap * 2 : 1024;
+		s->files = xrealloc(s->files, s->files_cap * sizeof(*s->files));
+	}
+	f = &s->files[s->nr_files++];
+	f->path = join_path(s->cur_path, name);
+	f->ino = ino;
+	f->size = le64toh(di.size);
+	f->nr_extents = 0;
+	f->tree_blocks = 0;
+	f->blocks = 0;
+	f->inline_data = !!(le32toh(di.flags) & BASEFS_INODE_INLINE_DATA);
+	f->first_block = 0;
+	f->end_block = 0;
+	ret = bfs_for_each_extent(s->img, &di, count_extent, count_tree_block, f);
+	if (ret) {
+		fprintf(stderr, "%s: bad block map: %s\n", f->path, strerror(-ret));
+		s->errors++;
+	}
+	dir_entry_data(s, f);
+	return 0;
+}
+
+static int cmp_fragmented(const void *a, const void *b)
+{
+	const struct dumpfs_file *fa = a, *fb = b;
+
+	if (fa->nr_extents != fb->nr_extents)
+		return fa->nr_extents < fb->nr_extents ? 1 : -1;
+	return fa->size < fb->size ? 1 : fa->size > fb->size ? -1 : 0;
+}
+
+/*
+ * scan_files - Walk the namespace from the root and report extent counts,
+ * average extent length and tail slack.
+ */
+static void scan_files(struct dumpfs_state *s)
+{
+	struct bfs_image *img = s->img;
+	struct basefs_inode di;
+	uint64_t head, total_ext = 0, total_blocks = 0, total_bytes = 0;
+	uint64_t multi = 0, trees = 0, tree_blocks = 0, i, shown;
+	uint64_t inlined = 0, inline_bytes = 0, xblocks = 0;
+	int ret;
+
+	queue_dir(s, le32toh(img->sb.root_ino), strdup("/"));
+	s->nr_dirs = 1;
+	for (head = 0; head < s->queue_len; head++) {
+		s->cur_path = s->queue_path[head];
+		dir_begin(s, s->queue[head]);
+		ret = bfs_read_inode(img, s->queue[head], &di);
+		if (!ret && !head)
+			count_xattrs(s, &di);
+		if (!ret)
+			ret = bfs_for_each_dirent(img, &di, walk_entry, s);
+		if (ret) {
+			fprintf(stderr, "%s: cannot read directory: %s\n",
+				s->cur_path, strerror(-ret));
+			s->errors++;
+		}
+		dir_end(s, s->cur_path);
+	}
+
+	for (i = 0; i < s->nr_files; i++) {
+		if (s->files[i].inline_data) {
+			inlined++;
+			inline_bytes += s->files[i].size;
+			continue;
+		}
+		total_ext += s->files[i].nr_extents;
+		total_blocks += s->files[i].blocks;
+		total_bytes += s->files[i].size;
+		if (s->files[i].nr_extents > 1)
+			multi++;
+		if (s->files[i].tree_blocks)
+			trees++;
+		tree_blocks += s->files[i].tree_blocks;
+	}
+	qsort(s->xattr_blocks, s->xattr_refs, sizeof(*s->xattr_blocks), cmp_u64);
+	for (i = 0; i < s->xattr_refs; i++)
+		if (!i || s->xattr_blocks[i] != s->xattr_blocks[i - 1])
+			xblocks++;
+
+	printf("\nFiles\n");
+	printf("  directories:         %llu\n", (unsigned long long)s->nr_dirs);
+	printf("  symlinks:            %llu\n",
+	       (unsigned long long)s->nr_symlinks);
+	printf("  regular files:       %llu (%llu with more than one extent)\n",
+	       (unsigned long long)s->nr_files, (unsigned long long)multi);
+	printf("  extents:             %llu (%.2f per file)\n",
+	       (unsigned long long)total_ext,
+	       s->nr_files ? (double)total_ext / s->nr_files : 0.0);
+	printf("  average extent:      %.1f blocks\n",
+	       total_ext ? (double)total_blocks / total_ext : 0.0);
+	printf("  extent trees:        %llu files, %llu tree blocks\n",
+	       (unsigned long long)trees, (unsigned long long)tree_blocks);
+	printf("  inline data:         %llu files, %llu bytes in inodes\n",
+	       (unsigned long long)inlined, (unsigned long long)inline_bytes);
+	printf("  xattrs:              %llu inodes in the inode, %llu in %llu blocks (%.1f inodes per block)\n",
+	       (unsigned long long)s->xattr_inline,
+	       (unsigned long long)s->xattr_refs, (unsigned long long)xblocks,
+	       xblocks ? (double)s->xattr_refs / xblocks : 0.0);
+	if (total_blocks)
+		printf("  tail slack:          %.1f%% of allocated file blocks\n",
+		       100.0 - 100.0 * total_bytes /
+		       ((double)total_blocks * img->block_size));
+
+	qsort(s->files, s->nr_files, sizeof(*s->files), cmp_fragmented);
+	shown = s->all_files ? s->nr_files :
+		(s->nr_files < DUMPFS_TOP_FILES ? s->nr_files : DUMPFS_TOP_FILES);
+	if (shown) {
+		printf("  %s:\n", s->all_files ? "all files" : "most fragmented");
+		printf("    %8s %14s %8s %12s  %s\n", "extents", "size", "inode",
+		       "avg extent", "path");
+	}
+	for (i = 0; i < shown; i++) {
+		struct dumpfs_file *f = &s->files[i];
+
+		printf("    %8u %14llu %8llu %12.1f  %s\n", f->nr_extents,
+		       (unsigned long long)f->size, (unsigned long long)f->ino,
+		       f->nr_extents ? (double)f->blocks / f->nr_extents : 0.0,
+		       f->path);
+	}
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+	return whole ? 100.0 * part / whole : 0.0;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+	const struct dumpfs_dir *da = a, *db = b;
+
+	return da->entries < db->entries ? 1 : da->entries > db->entries ? -1 : 0;
+}
+
+/*
+ * print_locality - How far a walk that stats and reads every directory's
+ * entries in readdir order has to move: the inode table blocks it reads
+ * against the fewest that could hold as many inodes, how often it jumps
+ * elsewhere in the table, and how many files start right after the one
+ * before them, or at least in their directory's group.
+ */
+static void print_locality(struct dumpfs_state *s)
+{
+	const struct bfs_image *img = s->img;
+	struct dumpfs_dir t, *d;
+	uint64_t i, shown, best = 0;
+	uint64_t per_block = img->block_size / img->inode_size;
+
+	memset(&t, 0, sizeof(t));
+	for (i = 0; i < s->dirs_len; i++) {
+		d = &s->dirs[i];
+		t.entries += d->entries;
+		t.table_blocks += d->table_blocks;
+		t.table_jumps += d->table_jumps;
+		t.data_files += d->data_files;
+		t.data_steps += d->data_steps;
+		t.data_near += d->data_near;
+		t.data_in_group += d->data_in_group;
+		best += (d->entries + per_block - 1) / per_block;
+	}
+
+	printf("\nLocality (directory entries in readdir order)\n");
+	printf("  inode table:         %llu entries in %llu blocks (%llu at best), %llu jumps\n",
+	       (unsigned long long)t.entries,
+	       (unsigned long long)t.table_blocks, (unsigned long long)best,
+	       (unsigned long long)t.table_jumps);
+	printf("  file data:           %llu files, %.1f%% start in their directory's group\n",
+	       (unsigned long long)t.data_files,
+	       percent(t.data_in_group, t.data_files));
+	printf("                       %.1f%% start less than %d blocks after the previous one\n",
+	       percent(t.data_near, t.data_steps), DUMPFS_NEAR_BLOCKS);
+
+	qsort(s->dirs, s->dirs_len, sizeof(*s->dirs), cmp_entries);
+	shown = s->all_dirs ? s->dirs_len :
+		(s->dirs_len < DUMPFS_TOP_FILES ? s->dirs_len : DUMPFS_TOP_FILES);
+	if (shown) {
+		printf("  %s:\n", s->all_dirs ? "all directories" : "largest directories");
+		printf("    %8s %8s %8s %8s %7s %7s  %s\n", "entries", "tbl blks",
+		       "best", "jumps", "near", "group", "path");
+	}
+	for (i = 0; i < shown; i++) {
+		d = &s->dirs[i];
+		printf("    %8llu %8llu %8llu %8llu %6.1f%% %6.1f%%  %s\n",
+		       (unsigned long long)d->entries,
+		       (unsigned long long)d->table_blocks,
+		       (unsigned long long)((d->entries + per_block - 1) / per_block),
+		       (unsigned long long)d->table_jumps,
+		       percent(d->data_near, d->data_steps),
+		       percent(d->data_in_group, d->data_files), d->path);
+	}
+}
+
+/*
+ * print_index - Show what the reserved root B+ tree area holds.
+ */
+static int print_index(const struct bfs_image *img)
+{
+	uint32_t nr = le32toh(img->sb.index_blocks);
+	uint64_t start = le64toh(img->sb.index_start);
+	uint32_t i, j, used = 0;
+	uint8_t *buf;
+	int ret;
+
+	printf("\nRoot index\n");
+	if (!nr) {
+		printf("  no index area\n");
+		return 0;
+	}
+	buf = xrealloc(NULL, img->block_size);
+	for (i = 0; i < nr; i++) {
+		ret = bfs_read_blocks(img, start + i, 1, buf);
+		if (ret) {
+			free(buf);
+			return ret;
+		}
+		for (j = 0; j < img->block_size; j++) {
+			if (buf[j]) {
+				used++;
+				break;
+			}
+		}
+	}
+	free(buf);
+	printf("  %u of %u blocks in use%s\n", used, nr,
+	       used ? "" : " (no B+ tree stored yet)");
+	return 0;
+}
+
+/*
+ * print_map - One character per region, darker means fuller:
+ * ' ' empty, '@' completely used (data or metadata).
+ */
+static void print_map(const struct bfs_image *img, const uint64_t *cells,
+		      uint64_t nr_cells, uint32_t width)
+{
+	static const char shades[] = " .:-=+*#%@";
+	uint64_t c, first, last, span;
+	int level;
+
+	printf("\nLayout map (%llu regions of ~%llu blocks, ' ' empty .. '@' full)\n",
+	       (unsigned long long)nr_cells,
+	       (unsigned long long)((img->blocks_count + nr_cells - 1) / nr_cells));
+	for (c = 0; c < nr_cells; c++) {
+		if (c % width == 0)
+			printf("  %12llu |",
+			       (unsigned long long)(c * img->blocks_count / nr_cells));
+		/* Blocks b with b * nr_cells / blocks_count == c. */
+		first = (c * img->blocks_count + nr_cells - 1) / nr_cells;
+		last = ((c + 1) * img->blocks_count + nr_cells - 1) / nr_cells;
+		span = last > first ? last - first : 1;
+		level = (int)((cells[c] * (sizeof(shades) - 2) + span - 1) / span);
+		if (level > (int)sizeof(shades) - 2)
+			level = (int)sizeof(shades) - 2;
+		putchar(shades[level]);
+		if (c % width == width - 1 || c == nr_cells - 1)
+			printf("|\n");
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-g] [-f] [-d] [-w width] [-r rows] <image-file>\n"
+		"  -g        print every group descriptor\n"
+		"  -f        list every regular file, not just the most fragmented\n"
+		"  -d        show the locality of every directory, not just the largest\n"
+		"  -w width  layout map width (default %d)\n"
+		"  -r rows   layout map rows (default %d)\n",
+		prog, DUMPFS_MAP_WIDTH, DUMPFS_MAP_ROWS);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bfs_image img;
+	struct dumpfs_state s;
+	uint32_t width = DUMPFS_MAP_WIDTH, rows = DUMPFS_MAP_ROWS;
+	uint64_t *cells, nr_cells;
+	int groups = 0;
+	int opt, ret;
+
+	memset(&s, 0, sizeof(s));
+	while ((opt = getopt(argc, argv, "gfdw:r:")) != -1) {
+		switch (opt) {
+		case 'g':
+			groups = 1;
+			break;
+		case 'f':
+			s.all_files = 1;
+			break;
+		case 'd':
+			s.all_dirs = 1;
+			break;
+		case 'w':
+			width = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rows = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 1 || !width || !rows) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = bfs_open(&img, argv[optind], 0);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	s.img = &img;
+
+	nr_cells = (uint64_t)width * rows;
+	if (nr_cells > img.blocks_count)
+		nr_cells = img.blocks_count;
+	cells = calloc(nr_cells, sizeof(*cells));
+	if (!cells) {
+		fprintf(stderr, "out of memory\n");
+		bfs_close(&img);
+		return 1;
+	}
+
+	print_super(&img);
+	if (groups)
+		print_groups(&img);
+	ret = scan_bitmaps(&img, cells, nr_cells);
+	if (!ret) {
+		scan_files(&s);
+		print_locality(&s);
+		ret = print_index(&img);
+	}
+	if (!ret)
+		print_map(&img, cells, nr_cells, width);
+	if (ret)
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+
+	free(cells);
+	bfs_close(&img);
+	return ret || s.errors ? 1 : 0;
+}
@@ -0,0 +1,706 @@
+#include "basefs.h"
+
+/*
+ * Extent map of a file.
+ *
+ * Up to BASEFS_INLINE_EXTENTS extents live in the inode.  A file that
+ * needs more, a fragmented one, moves them to a leaf block and keeps the
+ * root of a B+ tree over its leaves in the inode instead (the layout is
+ * described in basefs_disk.h), so mapping a block of a file of any size
+ * and shape costs a few block reads, not a walk of a block list.
+ *
+ * The tree only grows at the root.  When a leaf is full the highest full
+ * node on the way down to it is split, and the walk retried, until the
+ * leaf has room.  A node that is only ever appended to (the last one of
+ * a file written front to back) is left full and a new one started
+ * after it, so sequential files get full leaves.  Truncate frees the
+ * leaves and index blocks it empties, and moves the extents back into
+ * the inode once they fit there again.
+ *
+ * Everything here runs with i_map_lock held, and inside a handle when it
+ * changes the map.  Changes to the root are logged by the callers, who
+ * mark the inode dirty once they drop the lock.  Tree blocks are counted
+ * in i_blocks like data blocks.
+ */
+
+/* Root, index or leaf node on the walk down to a leaf. */
+struct basefs_ext_path {
+	struct buffer_head *bh;             /* NULL for the root */
+	struct basefs_extent_header *hdr;
+	int pos;                            /* entry followed, see below */
+};
+
+static inline u64 ext_lblk(const struct basefs_extent *ex)
+{
+	return le64_to_cpu(ex->lblk);
+}
+
+static inline u64 ext_pblk(const struct basefs_extent *ex)
+{
+	return le64_to_cpu(ex->pblk);
+}
+
+static inline u32 ext_len(const struct basefs_extent *ex)
+{
+	return le32_to_cpu(ex->len);
+}
+
+static inline bool basefs_has_tree(struct basefs_inode_info *bi)
+{
+	return bi->i_flags & BASEFS_INODE_EXTENT_TREE;
+}
+
+static inline struct basefs_extent_header *basefs_ext_root(struct basefs_inode_info *bi)
+{
+	return (struct basefs_extent_header *)bi->i_data;
+}
+
+static inline struct basefs_extent_idx *eh_idx(struct basefs_extent_header *hdr)
+{
+	return (struct basefs_extent_idx *)(hdr + 1);
+}
+
+static inline struct basefs_extent *eh_ext(struct basefs_extent_header *hdr)
+{
+	return (struct basefs_extent *)(hdr + 1);
+}
+
+static inline int eh_nr(const struct basefs_extent_header *hdr)
+{
+	return le16_to_cpu(hdr->nr);
+}
+
+static inline int eh_depth(const struct basefs_extent_header *hdr)
+{
+	return le16_to_cpu(hdr->depth);
+}
+
+static inline bool eh_full(const struct basefs_extent_header *hdr)
+{
+	return le16_to_cpu(hdr->nr) == le16_to_cpu(hdr->max);
+}
+
+static void basefs_ext_init_header(struct basefs_extent_header *hdr, u16 max,
+				   u16 depth)
+{
+	hdr->magic = cpu_to_le32(BASEFS_EXTENT_MAGIC);
+	hdr->nr = 0;
+	hdr->max = cpu_to_le16(max);
+	hdr->depth = cpu_to_le16(depth);
+}
+
+static bool basefs_ext_header_ok(const struct basefs_extent_header *hdr,
+				 u16 max, u16 depth)
+{
+	return le32_to_cpu(hdr->magic) == BASEFS_EXTENT_MAGIC &&
+	       le16_to_cpu(hdr->max) == max &&
+	       le16_to_cpu(hdr->depth) == depth &&
+	       eh_nr(hdr) <= max && (eh_nr(hdr) || !depth);
+}
+
+/*
+ * basefs_ext_check - Sanity check the block map iget just read, so that
+ * the rest of this file can trust the root.
+ */
+int basefs_ext_check(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_extent_header *root = basefs_ext_root(bi);
+
+	if (!basefs_has_tree(bi)) {
+		if (bi->i_nr_extents <= BASEFS_INLINE_EXTENTS)
+			return 0;
+		basefs_msg(inode->i_sb, KERN_ERR, "inode %lu has %u extents",
+			   inode->i_ino, bi->i_nr_extents);
+		return -EFSCORRUPTED;
+	}
+	if (!bi->i_nr_extents && eh_depth(root) >= 1 &&
+	    eh_depth(root) <= BASEFS_EXTENT_MAX_DEPTH &&
+	    basefs_ext_header_ok(root, BASEFS_EXTENT_ROOT_MAX, eh_depth(root)))
+		return 0;
+	basefs_msg(inode->i_sb, KERN_ERR, "inode %lu has a bad extent tree root",
+		   inode->i_ino);
+	return -EFSCORRUPTED;
+}
+
+/* Read tree block 'blk', which should be a node at 'depth'. */
+static struct buffer_head *basefs_ext_read(struct inode *inode, u64 blk,
+					   u16 depth)
+{
+	struct super_block *sb = inode->i_sb;
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct buffer_head *bh;
+
+	if (blk < sbi->first_group_block || blk >= sbi->blocks_count) {
+		basefs_msg(sb, KERN_ERR, "inode %lu: extent tree points at block %llu",
+			   inode->i_ino, blk);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	bh = sb_bread(sb, blk);
+	if (!bh) {
+		basefs_msg(sb, KERN_ERR, "inode %lu: cannot read extent tree block %llu",
+			   inode->i_ino, blk);
+		return ERR_PTR(-EIO);
+	}
+	if (!basefs_ext_header_ok((struct basefs_extent_header *)bh->b_data,
+				  basefs_extent_node_max(sb->s_blocksize, depth),
+				  depth)) {
+		basefs_msg(sb, KERN_ERR, "inode %lu: bad extent tree block %llu",
+			   inode->i_ino, blk);
+		brelse(bh);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	return bh;
+}
+
+/*
+ * Allocate an empty tree node at 'depth', near the inode.  The caller
+ * fills it in and logs it.
+ */
+static struct buffer_head *basefs_ext_new_node(struct inode *inode, u16 depth)
+{
+	struct super_block *sb = inode->i_sb;
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct buffer_head *bh;
+	u32 count = 1;
+	u64 goal, blk;
+	int ret;
+
+	goal = basefs_group_first_block(sbi->first_group_block,
+					sbi->blocks_per_group,
+					BASEFS_I(inode)->i_block_group) +
+	       basefs_group_overhead(sbi->itable_blocks);
+	ret = basefs_new_blocks(sb, goal, 1, &count, &blk);
+	if (ret)
+		return ERR_PTR(ret);
+	bh = sb_getblk(sb, blk);
+	if (!bh) {
+		basefs_free_blocks(sb, blk, 1);
+		return ERR_PTR(-ENOMEM);
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	basefs_ext_init_header((struct basefs_extent_header *)bh->b_data,
+			       basefs_extent_node_max(sb->s_blocksize, depth),
+			       depth);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	inode_add_bytes(inode, sb->s_blocksize);
+	return bh;
+}
+
+/*
+ * Free the tree node of 'p'.  Without a journal its buffer must not be
+ * written back over whatever the block holds next.
+ */
+static void basefs_ext_free_node(struct inode *inode, struct basefs_ext_path *p)
+{
+	struct super_block *sb = inode->i_sb;
+	u64 blk = p->bh->b_blocknr;
+
+	if (BASEFS_SB(sb)->journal)
+		brelse(p->bh);
+	else
+		bforget(p->bh);
+	p->bh = NULL;
+	basefs_free_meta_blocks(sb, blk, 1);
+	inode_sub_bytes(inode, sb->s_blocksize);
+}
+
+/* Log a changed node of the path; the root goes with the inode. */
+static void basefs_ext_dirty(struct inode *inode, struct basefs_ext_path *p)
+{
+	if (p->bh)
+		basefs_journal_dirty(inode->i_sb, p->bh, inode);
+}
+
+/* Last extent of 'ex' starting at or before 'lblk', -1 if none does. */
+static int basefs_ext_search(const struct basefs_extent *ex, int nr, u64 lblk)
+{
+	int lo = 0, hi = nr - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ext_lblk(&ex[mid]) <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return lo - 1;
+}
+
+/* Last index entry starting at or before 'lblk', the first if none does. */
+static int basefs_ext_search_idx(struct basefs_extent_header *hdr, u64 lblk)
+{
+	struct basefs_extent_idx *idx = eh_idx(hdr);
+	int lo = 1, hi = eh_nr(hdr) - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (le64_to_cpu(idx[mid].lblk) <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return lo - 1;
+}
+
+static void basefs_ext_put_path(struct basefs_ext_path *path, int depth)
+{
+	int level;
+
+	for (level = 1; level <= depth; level++)
+		brelse(path[level].bh);
+}
+
+/*
+ * basefs_ext_find - Walk from the root down to the leaf whose range
+ * holds file block 'lblk'.  path[0] is the root and path[depth] the
+ * leaf; 'pos' is the index entry followed down, and in the leaf the
+ * extent found by basefs_ext_search().  U64_MAX finds the last leaf.
+ * Returns the depth, or a negative errno.  Release the path with
+ * basefs_ext_put_path().
+ */
+static int basefs_ext_find(struct inode *inode, u64 lblk,
+			   struct basefs_ext_path *path)
+{
+	struct basefs_extent_header *hdr = basefs_ext_root(BASEFS_I(inode));
+	int depth = eh_depth(hdr), level;
+	struct buffer_head *bh;
+	u64 blk;
+
+	path[0].bh = NULL;
+	path[0].hdr = hdr;
+	for (level = 0; level < depth; level++) {
+		hdr = path[level].hdr;
+		path[level].pos = basefs_ext_search_idx(hdr, lblk);
+		blk = le64_to_cpu(eh_idx(hdr)[path[level].pos].block);
+		bh = basefs_ext_read(inode, blk, depth - level - 1);
+		if (IS_ERR(bh)) {
+			basefs_ext_put_path(path, level);
+			return PTR_ERR(bh);
+		}
+		path[level + 1].bh = bh;
+		path[level + 1].hdr = (struct basefs_extent_header *)bh->b_data;
+	}
+	hdr = path[depth].hdr;
+	path[depth].pos = basefs_ext_search(eh_ext(hdr), eh_nr(hdr), lblk);
+	return depth;
+}
+
+/*
+ * basefs_ext_lookup - Find the extent mapping file block 'iblock', or
+ * the one before it if the block is a hole (pos->len is 0 if there is
+ * none in the same leaf).  pos->next is where the next mapping may
+ * start at the earliest, U64_MAX if nothing is mapped past 'iblock'.
+ * Called with i_map_lock held, or on an immutable image.
+ */
+int basefs_ext_lookup(struct inode *inode, u64 iblock,
+		      struct basefs_ext_pos *pos)
+{
+	struct basefs_ext_path path[BASEFS_EXTENT_MAX_DEPTH + 1];
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_extent *ex;
+	int i, nr, depth = 0, level;
+
+	if (basefs_has_tree(bi)) {
+		depth = basefs_ext_find(inode, iblock, path);
+		if (depth < 0)
+			return depth;
+		ex = eh_ext(path[depth].hdr);
+		nr = eh_nr(path[depth].hdr);
+		i = path[depth].pos;
+	} else {
+		ex = bi->i_extents;
+		nr = bi->i_nr_extents;
+		i = basefs_ext_search(ex, nr, iblock);
+	}
+
+	pos->len = 0;
+	if (i >= 0) {
+		pos->lblk = ext_lblk(&ex[i]);
+		pos->pblk = ext_pblk(&ex[i]);
+		pos->len = ext_len(&ex[i]);
+	}
+	pos->next = U64_MAX;
+	if (i + 1 < nr) {
+		pos->next = ext_lblk(&ex[i + 1]);
+	} else {
+		/* Past the leaf: the next subtree starts no earlier. */
+		for (level = depth - 1; level >= 0; level--) {
+			if (path[level].pos + 1 < eh_nr(path[level].hdr)) {
+				pos->next = le64_to_cpu(eh_idx(path[level].hdr)
+							[path[level].pos + 1].lblk);
+				break;
+			}
+		}
+	}
+	if (depth)
+		basefs_ext_put_path(path, depth);
+	return 0;
+}
+
+/*
+ * basefs_ext_add - Record [lblk, lblk + len) -> pblk in the sorted array
+ * 'ex' of *nr extents, with room for 'max', merging with the neighbours
+ * where both logical and physical ranges touch.  Returns -EFBIG if a
+ * new slot would be needed and all are taken.
+ */
+static int basefs_ext_add(struct basefs_extent *ex, int *nr, int max,
+			  u64 lblk, u64 pblk, u32 len)
+{
+	int index = basefs_ext_search(ex, *nr, lblk) + 1;
+
+	if (index > 0 &&
+	    ext_lblk(&ex[index - 1]) + ext_len(&ex[index - 1]) == lblk &&
+	    ext_pblk(&ex[index - 1]) + ext_len(&ex[index - 1]) == pblk) {
+		le32_add_cpu(&ex[index - 1].len, len);
+		/* Filled the gap up to the next extent? */
+		if (index < *nr && lblk + len == ext_lblk(&ex[index]) &&
+		    pblk + len == ext_pblk(&ex[index])) {
+			le32_add_cpu(&ex[index - 1].len, ext_len(&ex[index]));
+			memmove(&ex[index], &ex[index + 1],
+				(*nr - index - 1) * sizeof(*ex));
+			memset(&ex[*nr - 1], 0, sizeof(*ex));
+			(*nr)--;
+		}
+		return 0;
+	}
+	if (index < *nr && lblk + len == ext_lblk(&ex[index]) &&
+	    pblk + len == ext_pblk(&ex[index])) {
+		ex[index].lblk = cpu_to_le64(lblk);
+		ex[index].pblk = cpu_to_le64(pblk);
+		le32_add_cpu(&ex[index].len, len);
+		return 0;
+	}
+	if (*nr == max)
+		return -EFBIG;
+
+	memmove(&ex[index + 1], &ex[index], (*nr - index) * sizeof(*ex));
+	ex[index].lblk = cpu_to_le64(lblk);
+	ex[index].pblk = cpu_to_le64(pblk);
+	ex[index].len = cpu_to_le32(len);
+	ex[index].reserved = 0;
+	(*nr)++;
+	return 0;
+}
+
+/* Move the inline extents to a leaf under a new root in the inode. */
+static int basefs_ext_spill(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_extent_header *root = basefs_ext_root(bi), *leaf;
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+
+	bh = basefs_ext_new_node(inode, 0);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	leaf = (struct basefs_extent_header *)bh->b_data;
+	memcpy(eh_ext(leaf), bi->i_extents,
+	       bi->i_nr_extents * sizeof(struct basefs_extent));
+	leaf->nr = cpu_to_le16(bi->i_nr_extents);
+	basefs_journal_dirty(sb, bh, inode);
+
+	memset(bi->i_data, 0, sizeof(bi->i_data));
+	basefs_ext_init_header(root, BASEFS_EXTENT_ROOT_MAX, 1);
+	root->nr = cpu_to_le16(1);
+	eh_idx(root)[0].block = cpu_to_le64(bh->b_blocknr);
+	brelse(bh);
+	bi->i_nr_extents = 0;
+	bi->i_flags |= BASEFS_INODE_EXTENT_TREE;
+	basefs_set_incompat(sb, BASEFS_FEATURE_INCOMPAT_EXTENT_TREE);
+	return 0;
+}
+
+/* The root is full: move its entries to a new node below it. */
+static int basefs_ext_grow(struct inode *inode, int depth)
+{
+	struct basefs_extent_header *root = basefs_ext_root(BASEFS_I(inode));
+	struct basefs_extent_header *hdr;
+	struct buffer_head *bh;
+
+	if (depth == BASEFS_EXTENT_MAX_DEPTH)
+		return -EFBIG;
+	bh = basefs_ext_new_node(inode, depth);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	hdr = (struct basefs_extent_header *)bh->b_data;
+	memcpy(eh_idx(hdr), eh_idx(root),
+	       eh_nr(root) * sizeof(struct basefs_extent_idx));
+	hdr->nr = root->nr;
+	basefs_journal_dirty(inode->i_sb, bh, inode);
+
+	memset(eh_idx(root), 0,
+	       BASEFS_EXTENT_ROOT_MAX * sizeof(struct basefs_extent_idx));
+	root->nr = cpu_to_le16(1);
+	root->depth = cpu_to_le16(depth + 1);
+	eh_idx(root)[0].block = cpu_to_le64(bh->b_blocknr);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Split the full node path[level] (not the root, whose parent has room)
+ * in two for an insert at 'lblk', moving its upper entries to a new
+ * node after it.
+ */
+static int basefs_ext_split(struct inode *inode, struct basefs_ext_path *path,
+			    int level, u64 lblk)
+{
+	struct basefs_extent_header *hdr = path[level].hdr, *parent, *new;
+	size_t size = eh_depth(hdr) ? sizeof(struct basefs_extent_idx) :
+				      sizeof(struct basefs_extent);
+	int nr = eh_nr(hdr), at, m;
+	struct basefs_extent_idx *pidx;
+	struct buffer_head *bh;
+	u64 sep;
+
+	/*
+	 * Going past the last entry, as a file written front to back does:
+	 * a leaf starts a new one and stays full, an index node only gives
+	 * its last entry away.
+	 */
+	if (path[level].pos == nr - 1)
+		m = eh_depth(hdr) ? nr - 1 : nr;
+	else
+		m = nr / 2;
+	if (m == nr)
+		sep = lblk;
+	else if (eh_depth(hdr))
+		sep = le64_to_cpu(eh_idx(hdr)[m].lblk);
+	else
+		sep = ext_lblk(&eh_ext(hdr)[m]);
+
+	bh = basefs_ext_new_node(inode, eh_depth(hdr));
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	new = (struct basefs_extent_header *)bh->b_data;
+	memcpy(new + 1, (char *)(hdr + 1) + m * size, (nr - m) * size);
+	new->nr = cpu_to_le16(nr - m);
+	memset((char *)(hdr + 1) + m * size, 0, (nr - m) * size);
+	hdr->nr = cpu_to_le16(m);
+	basefs_journal_dirty(inode->i_sb, bh, inode);
+	basefs_ext_dirty(inode, &path[level]);
+
+	parent = path[level - 1].hdr;
+	pidx = eh_idx(parent);
+	at = path[level - 1].pos + 1;
+	memmove(&pidx[at + 1], &pidx[at],
+		(eh_nr(parent) - at) * sizeof(*pidx));
+	pidx[at].lblk = cpu_to_le64(sep);
+	pidx[at].block = cpu_to_le64(bh->b_blocknr);
+	le16_add_cpu(&parent->nr, 1);
+	basefs_ext_dirty(inode, &path[level - 1]);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * basefs_ext_insert - Map file blocks [lblk, lblk + len), a hole until
+ * now, to pblk.  Moves the map into a tree when the inode has no slot
+ * left for it.
+ */
+int basefs_ext_insert(struct inode *inode, u64 lblk, u64 pblk, u32 len)
+{
+	struct basefs_ext_path path[BASEFS_EXTENT_MAX_DEPTH + 1];
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_extent_header *leaf;
+	int nr, depth, level, ret;
+
+	if (!basefs_has_tree(bi)) {
+		nr = bi->i_nr_extents;
+		ret = basefs_ext_add(bi->i_extents, &nr, BASEFS_INLINE_EXTENTS,
+				     lblk, pblk, len);
+		bi->i_nr_extents = nr;
+		if (ret != -EFBIG)
+			return ret;
+		ret = basefs_ext_spill(inode);
+		if (ret)
+			return ret;
+	}
+
+	for (;;) {
+		depth = basefs_ext_find(inode, lblk, path);
+		if (depth < 0)
+			return depth;
+		leaf = path[depth].hdr;
+		nr = eh_nr(leaf);
+		ret = basefs_ext_add(eh_ext(leaf), &nr, le16_to_cpu(leaf->max),
+				     lblk, pblk, len);
+		if (ret != -EFBIG) {
+			leaf->nr = cpu_to_le16(nr);
+			basefs_ext_dirty(inode, &path[depth]);
+			basefs_ext_put_path(path, depth);
+			return ret;
+		}
+
+		/* Split the highest full node, or grow at a full root. */
+		for (level = depth; level > 0; level--)
+			if (!eh_full(path[level - 1].hdr))
+				break;
+		if (level)
+			ret = basefs_ext_split(inode, path, level, lblk);
+		else
+			ret = basefs_ext_grow(inode, depth);
+		basefs_ext_put_path(path, depth);
+		if (ret)
+			return ret;
+	}
+}
+
+/*
+ * Free what lies from file block 'first' on in the last extents of the
+ * array 'ex', at most *budget of them.  Returns true once an extent that
+ * stays (wholly or cut short) is reached.
+ */
+static bool basefs_ext_trim(struct inode *inode, struct basefs_extent *ex,
+			    int *nr, u64 first, int *budget)
+{
+	struct super_block *sb = inode->i_sb;
+	struct basefs_extent *e;
+	u64 lblk, keep;
+	u32 len;
+
+	while (*nr && *budget) {
+		e = &ex[*nr - 1];
+		lblk = ext_lblk(e);
+		len = ext_len(e);
+		if (lblk + len <= first)
+			return true;
+		keep = lblk >= first ? 0 : first - lblk;
+		if (S_ISDIR(inode->i_mode))
+			basefs_free_meta_blocks(sb, ext_pblk(e) + keep,
+						len - keep);
+		else
+			basefs_free_blocks(sb, ext_pblk(e) + keep, len - keep);
+		inode_sub_bytes(inode, (loff_t)(len - keep) << sb->s_blocksize_bits);
+		(*budget)--;
+		if (keep) {
+			e->len = cpu_to_le32(keep);
+			return true;
+		}
+		memset(e, 0, sizeof(*e));
+		(*nr)--;
+	}
+	return false;
+}
+
+/*
+ * Free the empty node path[level] and take it out of its parent, and
+ * the parent as well if that leaves it empty.  An empty root leaves an
+ * inode without extents.
+ */
+static void basefs_ext_drop(struct inode *inode, struct basefs_ext_path *path,
+			    int level)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_extent_header *parent;
+	struct basefs_extent_idx *pidx;
+	int at, nr;
+
+	for (; level > 0; level--) {
+		basefs_ext_free_node(inode, &path[level]);
+		parent = path[level - 1].hdr;
+		pidx = eh_idx(parent);
+		at = path[level - 1].pos;
+		nr = eh_nr(parent) - 1;
+		memmove(&pidx[at], &pidx[at + 1], (nr - at) * sizeof(*pidx));
+		memset(&pidx[nr], 0, sizeof(*pidx));
+		parent->nr = cpu_to_le16(nr);
+		if (nr) {
+			basefs_ext_dirty(inode, &path[level - 1]);
+			return;
+		}
+	}
+	memset(bi->i_data, 0, sizeof(bi->i_data));
+	bi->i_flags &= ~BASEFS_INODE_EXTENT_TREE;
+	bi->i_nr_extents = 0;
+}
+
+/*
+ * Once a truncate is done, pull a lone child into the root while its
+ * entries fit there, down to moving the extents back into the inode.
+ */
+static int basefs_ext_shrink(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_extent_header *root = basefs_ext_root(bi), *hdr;
+	struct basefs_ext_path child;
+	int depth, nr;
+
+	while (basefs_has_tree(bi) && eh_nr(root) == 1) {
+		depth = eh_depth(root);
+		child.bh = basefs_ext_read(inode,
+					   le64_to_cpu(eh_idx(root)[0].block),
+					   depth - 1);
+		if (IS_ERR(child.bh))
+			return PTR_ERR(child.bh);
+		hdr = (struct basefs_extent_header *)child.bh->b_data;
+		nr = eh_nr(hdr);
+		if (depth == 1 && nr <= BASEFS_INLINE_EXTENTS) {
+			memset(bi->i_data, 0, sizeof(bi->i_data));
+			memcpy(bi->i_extents, eh_ext(hdr),
+			       nr * sizeof(struct basefs_extent));
+			bi->i_nr_extents = nr;
+			bi->i_flags &= ~BASEFS_INODE_EXTENT_TREE;
+		} else if (depth > 1 && nr <= BASEFS_EXTENT_ROOT_MAX) {
+			memcpy(eh_idx(root), eh_idx(hdr),
+			       nr * sizeof(struct basefs_extent_idx));
+			root->nr = cpu_to_le16(nr);
+			root->depth = cpu_to_le16(depth - 1);
+		} else {
+			brelse(child.bh);
+			break;
+		}
+		basefs_ext_free_node(inode, &child);
+	}
+	return 0;
+}
+
+/*
+ * basefs_ext_truncate - Unmap the blocks from file block 'first' on and
+ * free them, last extent first.  Stops after 'budget' extents so that
+ * the caller can spread a large file over several transactions: returns
+ * 1 if there is more to free, 0 once done, or a negative errno.
+ */
+int basefs_ext_truncate(struct inode *inode, u64 first, int budget)
+{
+	struct basefs_ext_path path[BASEFS_EXTENT_MAX_DEPTH + 1];
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_extent_header *leaf;
+	int nr, depth, left;
+	bool reached;
+
+	if (!basefs_has_tree(bi)) {
+		nr = bi->i_nr_extents;
+		left = INT_MAX;
+		basefs_ext_trim(inode, bi->i_extents, &nr, first, &left);
+		bi->i_nr_extents = nr;
+		return 0;
+	}
+
+	for (;;) {
+		depth = basefs_ext_find(inode, U64_MAX, path);
+		if (depth < 0)
+			return depth;
+		leaf = path[depth].hdr;
+		nr = eh_nr(leaf);
+		left = budget;
+		reached = basefs_ext_trim(inode, eh_ext(leaf), &nr, first,
+					  &budget);
+		leaf->nr = cpu_to_le16(nr);
+		if (!nr)
+			basefs_ext_drop(inode, path, depth);
+		else if (budget != left)
+			basefs_ext_dirty(inode, &path[depth]);
+		basefs_ext_put_path(path, depth);
+		if (!basefs_has_tree(bi))
+			return 0;
+		if (reached)
+			break;
+		if (!budget)
+			return 1;
+	}
+	return basefs_ext_shrink(inode);
+}
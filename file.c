@@ -0,0 +1,690 @@
+#include <linux/log2.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/blkdev.h>
+#include <linux/pagevec.h>
+#include <linux/writeback.h>
+#include "basefs.h"
+
+/*
+ * Block mapping.
+ *
+ * A file's blocks are described by extents sorted by logical block, kept
+ * in the inode or, past BASEFS_INLINE_EXTENTS, in a tree (extents.c).
+ * New blocks are asked for right after the physical end of the extent
+ * before them, so a file written front to back keeps extending one
+ * extent.
+ *
+ * Regular files do not allocate block by block: they reserve a window
+ * (basefs_reserve_window()) sized from the run being allocated and the
+ * size of the file, and take blocks from its front.  The rest of the
+ * window is theirs alone, so files written at the same time do not end
+ * up interleaved, and each new window is asked for right after the old
+ * one so the extent keeps growing when nobody took the space behind it.
+ * The window is given back when the last writer closes the file, on
+ * truncate and on evict.
+ *
+ * Allocation is delayed: write() only reserves space for new blocks and
+ * leaves their buffers mapped to BASEFS_DELAY_BLOCK with BH_Delay set.
+ * Writeback first allocates every run of consecutive delayed blocks in
+ * the folios it is about to write at once (basefs_da_map()), so a
+ * checkpoint written in small pieces, or next to other streams, still
+ * gets extents as long as the runs, and maps the delayed buffers to the
+ * blocks while their folios are locked; then it writes the folios out.
+ *
+ * Files small enough to live in their inode have no blocks at all until
+ * they outgrow it: the address space operations hand them to inline.c.
+ */
+
+/* Reservation window for allocating 'count' blocks, see above. */
+static u32 basefs_prealloc_window(struct inode *inode, u32 count)
+{
+	u64 want = inode->i_blocks >> (inode->i_blkbits - 9);
+
+	want = clamp_t(u64, want, max_t(u32, count, BASEFS_MIN_PREALLOC),
+		       BASEFS_MAX_PREALLOC);
+	return (u32)roundup_pow_of_two((unsigned long)want);
+}
+
+/*
+ * Where new blocks for the file should go: right after 'after', the end
+ * of the extent before them, if there is one (nonzero).
+ * A file's first blocks go in the inode's group, at one of 16 offsets
+ * picked by the inode number so that files written at the same time do
+ * not queue up behind each other.  (Allocation happens in writeback, so
+ * the writer's pid would only tell flusher threads apart.)  A file whose
+ * first window is already large is a stream (a checkpoint, a shard): it
+ * starts in a group picked by the inode number instead, so concurrent
+ * streams have whole groups to grow into.  With the orlov mount option
+ * small files start at the front of their group instead, so the files
+ * of a directory, which share a group, lie in the order they were
+ * written and a walk over them reads forward.
+ */
+static u64 basefs_alloc_goal(struct inode *inode, u64 after, u32 window)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(inode->i_sb);
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	u32 overhead = basefs_group_overhead(sbi->itable_blocks);
+	u32 group = bi->i_block_group, nr, colour = 0;
+
+	if (after)
+		return after;
+	if (S_ISREG(inode->i_mode) && window >= BASEFS_STREAM_WINDOW) {
+		group = (group + inode->i_ino) % sbi->groups_count;
+	} else if (S_ISREG(inode->i_mode) && !sbi->orlov) {
+		nr = basefs_group_nr_blocks(sbi->blocks_count,
+					    sbi->first_group_block,
+					    sbi->blocks_per_group, group);
+		if (nr > overhead)
+			colour = (inode->i_ino % 16) *
+				 ((nr - overhead) / 16);
+	}
+	return basefs_group_first_block(sbi->first_group_block,
+					sbi->blocks_per_group, group) +
+	       overhead + colour;
+}
+
+/* Give the reserved window back.  Called with i_map_lock held. */
+static void __basefs_discard_prealloc(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+
+	if (bi->i_prealloc_len)
+		basefs_release_window(inode->i_sb, bi->i_prealloc_start,
+				      bi->i_prealloc_len);
+	bi->i_prealloc_start = 0;
+	bi->i_prealloc_len = 0;
+}
+
+void basefs_discard_prealloc(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+
+	mutex_lock(&bi->i_map_lock);
+	__basefs_discard_prealloc(inode);
+	mutex_unlock(&bi->i_map_lock);
+}
+
+/*
+ * basefs_alloc_blocks - Allocate up to *count blocks to go after the
+ * extent ending at 'after', see basefs_alloc_goal().  Regular files take
+ * them from their window.  Called with i_map_lock held.
+ */
+static int basefs_alloc_blocks(struct inode *inode, u64 after,
+			       u32 *count, u64 *start)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	u32 n;
+	u64 goal;
+	int ret;
+
+	if (!S_ISREG(inode->i_mode))
+		return basefs_new_blocks(sb, basefs_alloc_goal(inode, after, 0),
+					 *count, count, start);
+
+	n = basefs_prealloc_window(inode, *count);
+	goal = basefs_alloc_goal(inode, after, n);
+	if (!bi->i_prealloc_len || bi->i_prealloc_start != goal) {
+		/* The file moved on (or never had one): start a new window. */
+		__basefs_discard_prealloc(inode);
+		ret = basefs_reserve_window(sb, goal, &n,
+					    &bi->i_prealloc_start);
+		if (ret)
+			return ret;
+		bi->i_prealloc_len = n;
+	}
+
+	n = min(*count, bi->i_prealloc_len);
+	ret = basefs_claim_blocks(sb, bi->i_prealloc_start, n);
+	if (ret)
+		return ret;
+	*start = bi->i_prealloc_start;
+	*count = n;
+	bi->i_prealloc_start += n;
+	bi->i_prealloc_len -= n;
+	return 0;
+}
+
+/*
+ * basefs_map_blocks - Map up to 'max_blocks' blocks starting at file
+ * block 'iblock'.  Returns how many contiguous blocks starting at *pblk
+ * were mapped, 0 for a hole when 'create' is false, or a negative errno.
+ * With 'create', a hole is filled with newly allocated blocks and *new
+ * (if not NULL) is set.  The inode is marked dirty by the callers of
+ * __basefs_map_blocks() once they drop i_map_lock, see
+ * basefs_dirty_inode().
+ */
+static int __basefs_map_blocks(struct inode *inode, sector_t iblock,
+			       u32 max_blocks, bool create, u64 *pblk,
+			       bool *new)
+{
+	struct super_block *sb = inode->i_sb;
+	struct basefs_ext_pos pos;
+	u32 count;
+	u64 start;
+	int ret;
+
+	if (new)
+		*new = false;
+
+	/* Inline data is not a block map, see inline.c. */
+	if (BASEFS_I(inode)->i_flags & BASEFS_INODE_INLINE_DATA)
+		return create ? -EIO : 0;
+
+	ret = basefs_ext_lookup(inode, iblock, &pos);
+	if (ret)
+		return ret;
+	if (pos.len && iblock < pos.lblk + pos.len) {
+		*pblk = pos.pblk + (iblock - pos.lblk);
+		return (int)min_t(u64, max_blocks, pos.lblk + pos.len - iblock);
+	}
+
+	if (!create)
+		return 0;
+
+	/* Fill the hole only up to the next extent. */
+	count = (u32)min_t(u64, max_blocks, pos.next - iblock);
+
+	ret = basefs_alloc_blocks(inode, pos.len ? pos.pblk + pos.len : 0,
+				  &count, &start);
+	if (ret)
+		return ret;
+
+	ret = basefs_ext_insert(inode, iblock, start, count);
+	if (ret) {
+		basefs_free_blocks(sb, start, count);
+		__basefs_discard_prealloc(inode);
+		return ret;
+	}
+	inode_add_bytes(inode, (loff_t)count << sb->s_blocksize_bits);
+
+	*pblk = start;
+	if (new)
+		*new = true;
+	return count;
+}
+
+int basefs_map_blocks(struct inode *inode, sector_t iblock, u32 max_blocks,
+		      bool create, u64 *pblk, bool *new)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	bool allocated = false;
+	struct basefs_handle h;
+	int ret;
+
+	/* Nothing changes the map of an immutable image: no lock needed. */
+	if (!create && BASEFS_SB(inode->i_sb)->immutable)
+		return __basefs_map_blocks(inode, iblock, max_blocks, false,
+					   pblk, new);
+
+	if (create)
+		basefs_journal_start(inode->i_sb, &h);
+	mutex_lock(&bi->i_map_lock);
+	ret = __basefs_map_blocks(inode, iblock, max_blocks, create, pblk,
+				  &allocated);
+	mutex_unlock(&bi->i_map_lock);
+	if (create) {
+		if (allocated)
+			mark_inode_dirty(inode);
+		basefs_journal_stop(inode->i_sb, &h);
+	}
+	if (new)
+		*new = allocated;
+	return ret;
+}
+
+/*
+ * basefs_get_block - get_block_t for the generic buffer and mpage code.
+ * Maps as many blocks as b_size asks for, so readahead and writeback
+ * can build large bios.
+ */
+int basefs_get_block(struct inode *inode, sector_t iblock,
+		     struct buffer_head *bh_result, int create)
+{
+	u32 max_blocks = bh_result->b_size >> inode->i_blkbits;
+	bool new;
+	u64 pblk;
+	int ret;
+
+	ret = basefs_map_blocks(inode, iblock, max_blocks ? max_blocks : 1,
+				create, &pblk, &new);
+	if (ret <= 0)
+		return ret;
+
+	/*
+	 * A delayed block basefs_da_map() could not allocate: its
+	 * reservation is used up.
+	 */
+	if (buffer_delay(bh_result))
+		basefs_release_delalloc(inode->i_sb, 1);
+	map_bh(bh_result, inode->i_sb, pblk);
+	bh_result->b_size = (size_t)ret << inode->i_blkbits;
+	if (new)
+		set_buffer_new(bh_result);
+	return 0;
+}
+
+/*
+ * basefs_truncate_blocks - Free every block past the one holding byte
+ * 'size' - 1.  A file with many extents is freed BASEFS_TRUNCATE_EXTENTS
+ * at a time, each batch in a handle of its own, so callers that want
+ * the transactions to commit in between must not hold a handle.
+ */
+void basefs_truncate_blocks(struct inode *inode, loff_t size)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	u64 first = (size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	struct basefs_handle h;
+	int ret;
+
+	if (basefs_has_inline_data(inode)) {
+		basefs_truncate_inline(inode, size);
+		return;
+	}
+
+	do {
+		basefs_journal_start(sb, &h);
+		mutex_lock(&bi->i_map_lock);
+		__basefs_discard_prealloc(inode);
+		ret = basefs_ext_truncate(inode, first, BASEFS_TRUNCATE_EXTENTS);
+		mutex_unlock(&bi->i_map_lock);
+
+		inode->i_mtime = inode_set_ctime_current(inode);
+		mark_inode_dirty(inode);
+		basefs_journal_stop(sb, &h);
+	} while (ret > 0);
+
+	if (ret < 0)
+		basefs_msg(sb, KERN_ERR, "inode %lu: truncate failed (%d), blocks may be leaked",
+			   inode->i_ino, ret);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Address space operations                                                    */
+
+static int basefs_read_folio(struct file *file, struct folio *folio)
+{
+	int ret;
+
+	if (basefs_has_inline_data(folio->mapping->host)) {
+		ret = basefs_read_inline(folio->mapping->host, folio);
+		folio_unlock(folio);
+		return ret;
+	}
+	return mpage_read_folio(folio, basefs_get_block);
+}
+
+/* Inline files have nothing to read ahead: read_folio copies the data. */
+static void basefs_readahead(struct readahead_control *rac)
+{
+	if (basefs_has_inline_data(rac->mapping->host))
+		return;
+	mpage_readahead(rac, basefs_get_block);
+}
+
+/*
+ * basefs_da_get_block_prep - get_block_t for write_begin.  A hole is not
+ * filled yet: one block of free space is reserved and the buffer is
+ * marked delayed, to be allocated at writeback.
+ */
+int basefs_da_get_block_prep(struct inode *inode, sector_t iblock,
+			     struct buffer_head *bh, int create)
+{
+	u64 pblk;
+	int ret;
+
+	ret = basefs_map_blocks(inode, iblock, 1, false, &pblk, NULL);
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		map_bh(bh, inode->i_sb, pblk);
+		return 0;
+	}
+
+	ret = basefs_reserve_delalloc(inode->i_sb, 1);
+	if (ret)
+		return ret;
+	map_bh(bh, inode->i_sb, BASEFS_DELAY_BLOCK);
+	set_buffer_new(bh);
+	set_buffer_delay(bh);
+	return 0;
+}
+
+/* Most folios one run keeps locked while it is allocated and mapped. */
+#define BASEFS_DA_RUN_FOLIOS    512
+
+/*
+ * A run of consecutive delayed blocks being gathered by basefs_da_map(),
+ * with the folios holding them, locked and referenced.
+ */
+struct basefs_da_run {
+	sector_t start;
+	u64 len;
+	unsigned int nr;
+	struct folio *folios[BASEFS_DA_RUN_FOLIOS];
+};
+
+/* Map the delayed buffers of file blocks 'lblk'.. to 'pblk'..; count them. */
+static u32 basefs_da_map_buffers(struct inode *inode, struct basefs_da_run *run,
+				 sector_t lblk, u64 pblk, u32 count)
+{
+	unsigned int bits = inode->i_blkbits;
+	struct buffer_head *head, *bh;
+	sector_t blk;
+	u32 mapped = 0;
+	unsigned int i;
+
+	for (i = 0; i < run->nr; i++) {
+		head = folio_buffers(run->folios[i]);
+		blk = (sector_t)folio_pos(run->folios[i]) >> bits;
+		bh = head;
+		do {
+			if (buffer_delay(bh) && blk >= lblk && blk - lblk < count) {
+				map_bh(bh, inode->i_sb, pblk + (blk - lblk));
+				clear_buffer_delay(bh);
+				clear_buffer_new(bh);
+				mapped++;
+			}
+			blk++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	return mapped;
+}
+
+/*
+ * Allocate the blocks of 'run', in as few extents as the allocator can
+ * give, and map its buffers to them while its folios are still locked,
+ * so that a truncate cannot come in between and nothing is allocated
+ * twice.  Each buffer's reservation is used up as it stops being
+ * delayed.  Blocks past EOF are left alone: their folios are being
+ * truncated and nobody would free what we allocated for them.  Then the
+ * folios are unlocked, except 'cur', which the caller holds.
+ */
+static void basefs_da_flush(struct inode *inode, struct basefs_da_run *run,
+			    struct folio *cur)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned int bits = inode->i_blkbits;
+	sector_t lblk = run->start;
+	u64 len = run->len, eof, pblk;
+	u32 mapped = 0;
+	unsigned int i;
+	int ret;
+
+	eof = (i_size_read(inode) + (1 << bits) - 1) >> bits;
+	if (lblk + len > eof)
+		len = eof > lblk ? eof - lblk : 0;
+	while (len) {
+		/* A handle each: a fragmented run may split tree nodes. */
+		ret = basefs_map_blocks(inode, lblk, (u32)min_t(u64, len, INT_MAX),
+					true, &pblk, NULL);
+		if (ret <= 0)
+			break;	/* writeback will report it, block by block */
+		clean_bdev_aliases(sb->s_bdev, pblk, ret);
+		mapped += basefs_da_map_buffers(inode, run, lblk, pblk, ret);
+		lblk += ret;
+		len -= ret;
+	}
+	if (mapped)
+		basefs_release_delalloc(sb, mapped);
+
+	for (i = 0; i < run->nr; i++) {
+		if (run->folios[i] != cur)
+			folio_unlock(run->folios[i]);
+		folio_put(run->folios[i]);
+	}
+	run->nr = 0;
+	run->len = 0;
+}
+
+/*
+ * basefs_da_map - Allocate blocks for the delayed buffers of the dirty
+ * folios writeback is about to write, one run of consecutive file
+ * blocks at a time, and map the buffers.  Like write_cache_pages() it
+ * starts at the cyclic writeback index, and it looks at no more folios
+ * than the call will write, so a file written back in slices is not
+ * rescanned from the start each time.  Buffers it leaves delayed (no
+ * space, no memory) are allocated by basefs_get_block() when the folio
+ * is written.
+ */
+static void basefs_da_map(struct address_space *mapping,
+			  struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	unsigned int bits = inode->i_blkbits;
+	pgoff_t index = mapping->writeback_index, end = ULONG_MAX;
+	long budget = wbc->nr_to_write;
+	struct buffer_head *head, *bh;
+	struct basefs_da_run *run;
+	struct folio_batch fbatch;
+	struct folio *folio;
+	unsigned int i, nr;
+	sector_t lblk;
+	bool held;
+
+	if (!wbc->range_cyclic) {
+		index = wbc->range_start >> PAGE_SHIFT;
+		end = wbc->range_end >> PAGE_SHIFT;
+	}
+	run = kmalloc(sizeof(*run), GFP_NOFS);
+	if (!run)
+		return;
+	run->nr = 0;
+	run->len = 0;
+
+	folio_batch_init(&fbatch);
+	while (index <= end && budget > 0) {
+		nr = filemap_get_folios_tag(mapping, &index, end,
+					    PAGECACHE_TAG_DIRTY, &fbatch);
+		if (!nr)
+			break;
+		for (i = 0; i < nr && budget > 0; i++) {
+			folio = fbatch.folios[i];
+			budget -= folio_nr_pages(folio);
+
+			folio_lock(folio);
+			head = folio_buffers(folio);
+			if (folio->mapping != mapping || !head) {
+				folio_unlock(folio);
+				continue;
+			}
+			held = false;
+			lblk = (sector_t)folio_pos(folio) >> bits;
+			bh = head;
+			do {
+				if (buffer_delay(bh)) {
+					if (run->len &&
+					    (run->start + run->len != lblk ||
+					     (!held && run->nr == BASEFS_DA_RUN_FOLIOS))) {
+						basefs_da_flush(inode, run, folio);
+						held = false;
+					}
+					if (!run->len)
+						run->start = lblk;
+					run->len++;
+					if (!held) {
+						folio_get(folio);
+						run->folios[run->nr++] = folio;
+						held = true;
+					}
+				}
+				lblk++;
+				bh = bh->b_this_page;
+			} while (bh != head);
+			if (!held)
+				folio_unlock(folio);
+		}
+		folio_batch_release(&fbatch);
+		cond_resched();
+	}
+	if (run->len)
+		basefs_da_flush(inode, run, NULL);
+	kfree(run);
+}
+
+static int basefs_write_folio(struct folio *folio,
+			      struct writeback_control *wbc, void *data)
+{
+	if (basefs_has_inline_data(folio->mapping->host))
+		return basefs_write_inline_folio(folio);
+	return block_write_full_page(&folio->page, basefs_get_block, wbc);
+}
+
+static int basefs_writepages(struct address_space *mapping,
+			     struct writeback_control *wbc)
+{
+	struct blk_plug plug;
+	int ret;
+
+	basefs_da_map(mapping, wbc);
+
+	blk_start_plug(&plug);
+	ret = write_cache_pages(mapping, wbc, basefs_write_folio, NULL);
+	blk_finish_plug(&plug);
+	return ret;
+}
+
+/* Drop blocks instantiated past EOF by a failed or short write. */
+static void basefs_write_failed(struct address_space *mapping, loff_t to)
+{
+	struct inode *inode = mapping->host;
+
+	if (to > inode->i_size) {
+		truncate_pagecache(inode, inode->i_size);
+		basefs_truncate_blocks(inode, inode->i_size);
+	}
+}
+
+static int basefs_write_begin(struct file *file, struct address_space *mapping,
+			      loff_t pos, unsigned int len,
+			      struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	int ret;
+
+	if (basefs_has_inline_data(inode)) {
+		if (pos + len <= basefs_inline_max(inode))
+			return basefs_write_inline_begin(inode, pagep);
+		ret = basefs_convert_inline(inode);
+		if (ret)
+			return ret;
+	}
+
+	ret = block_write_begin(mapping, pos, len, pagep,
+				basefs_da_get_block_prep);
+	if (ret < 0)
+		basefs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+static int basefs_write_end(struct file *file, struct address_space *mapping,
+			    loff_t pos, unsigned int len, unsigned int copied,
+			    struct page *page, void *fsdata)
+{
+	int ret;
+
+	if (basefs_has_inline_data(mapping->host))
+		return basefs_write_inline_end(mapping->host, pos, copied,
+					       page_folio(page));
+
+	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (ret < len)
+		basefs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+/*
+ * Invalidating a folio drops its delayed buffers (discard_buffer() clears
+ * BH_Delay), so give their reservations back first.  Only buffers wholly
+ * inside the range are dropped.
+ */
+static void basefs_invalidate_folio(struct folio *folio, size_t offset,
+				    size_t length)
+{
+	struct buffer_head *head = folio_buffers(folio), *bh;
+	size_t curr = 0, stop = offset + length;
+	u32 delayed = 0;
+
+	bh = head;
+	if (bh) {
+		do {
+			if (curr + bh->b_size > stop)
+				break;
+			if (curr >= offset && buffer_delay(bh))
+				delayed++;
+			curr += bh->b_size;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+
+	block_invalidate_folio(folio, offset, length);
+	if (delayed)
+		basefs_release_delalloc(folio->mapping->host->i_sb, delayed);
+}
+
+/* FIBMAP must see real blocks: write delayed ones out first. */
+static sector_t basefs_bmap(struct address_space *mapping, sector_t block)
+{
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
+	return generic_block_bmap(mapping, block, basefs_get_block);
+}
+
+const struct address_space_operations basefs_aops = {
+	.dirty_folio           = block_dirty_folio,
+	.invalidate_folio      = basefs_invalidate_folio,
+	.read_folio            = basefs_read_folio,
+	.readahead             = basefs_readahead,
+	.writepages            = basefs_writepages,
+	.write_begin           = basefs_write_begin,
+	.write_end             = basefs_write_end,
+	.bmap                  = basefs_bmap,
+	.migrate_folio         = buffer_migrate_folio,
+	.is_partially_uptodate = block_is_partially_uptodate,
+	.error_remove_page     = generic_error_remove_page,
+};
+
+/*
+ * basefs_fsync - With a journal, write the data and commit the
+ * transaction that last logged the inode, which also flushes the data
+ * to the medium.  If that transaction is already committed only the
+ * cache is flushed, and fsync()s running at the same time share the
+ * commit and the flush.
+ */
+int basefs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	int ret;
+
+	if (!BASEFS_SB(inode->i_sb)->journal)
+		return generic_file_fsync(file, start, end, datasync);
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+	return basefs_journal_force(inode->i_sb,
+				    READ_ONCE(BASEFS_I(inode)->i_sync_tid));
+}
+
+/* The last writer gone, nobody will grow into the window. */
+static int basefs_release_file(struct inode *inode, struct file *filp)
+{
+	if ((filp->f_mode & FMODE_WRITE) &&
+	    atomic_read(&inode->i_writecount) == 1)
+		basefs_discard_prealloc(inode);
+	return 0;
+}
+
+const struct file_operations basefs_file_ops = {
+	.llseek       = generic_file_llseek,
+	.read_iter    = generic_file_read_iter,
+	.write_iter   = generic_file_write_iter,
+	.mmap         = generic_file_mmap,
+	.release      = basefs_release_file,
+	.fsync        = basefs_fsync,
+	.splice_read  = filemap_splice_read,
+	.splice_write = iter_file_splice_write,
+};
@@ -0,0 +1,1237 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mount.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+
+#include "basefs_ioctl.h"
+
+/*
+ * fsbench - Benchmarks for a mounted BaseFS.
+ *
+ *   fsbench write [-s size] [-b bufsize] [-j threads] [-f] [-e] <dir>
+ *
+ *     Write scaling: for 1, 2, 4, ... up to 'threads' writers, each
+ *     thread (pinned to its own CPU) writes one file of 'size' bytes in
+ *     'bufsize' writes, the way training ranks dump their checkpoint
+ *     shards at the same time.  Prints the aggregate throughput and the
+ *     speedup over one writer; -f adds an fsync per file, -e counts the
+ *     extents of each file with FIBMAP (needs root).
+ *
+ *   fsbench fsync [-s size] [-j threads] [-r rounds] <dir>
+ *
+ *     Checkpoint storm: 'threads' threads each write a file of 'size'
+ *     bytes, then all fsync() at once.  Prints the fsync latencies and,
+ *     from the journal statistics in /proc/fs/basefs, how many commits
+ *     and cache flushes the storm took.
+ *
+ *   fsbench mount [-r runs] [-w] <dir> <image-or-device>...
+ *
+ *     Mount latency: mounts each image (through a loop device if it is
+ *     a regular file) on 'dir' 'runs' times and prints the time taken by
+ *     mount(2), by the first allocating write and by umount(2), next to
+ *     the image size.  Caches are dropped before every mount unless -w
+ *     is given.  Needs root.
+ *
+ *   fsbench dir [-n entries] [-l lookups] [-w] [-k] [-x] <dir>
+ *
+ *     Large directories: creates 'entries' empty files in one new
+ *     directory, like a flat dataset of samples, printing the create
+ *     rate as it grows, then looks up 'lookups' of them and as many
+ *     names that do not exist, in scattered order, and unlinks them all
+ *     again unless -k is given.  In between it lists the directory and
+ *     stats every entry, like "ls -l" or os.scandir() over a dataset,
+ *     and counts entries readdir returned without a file type.  The
+ *     rates should not fall as the directory grows.  Caches are dropped
+ *     before the lookups and the listing unless -w is given (needs
+ *     root), so they reach the file system; the first lookup is timed
+ *     on its own, and the lookups of missing names report how many the
+ *     directory's bloom filter answered.  -x gives every entry a "user.label" attribute and
+ *     reads them all back, once with a getxattr() per entry and once
+ *     with BASEFS_IOC_DIR_XATTR, a buffer of them per call.
+ *
+ *   fsbench create [-n files] [-s size] [-b batch] [-k] <dir>
+ *
+ *     Bulk create: writes 'files' files of 'size' bytes into a new
+ *     directory with an open(O_CREAT), a write and a close each, like a
+ *     preprocessing job writing out its samples, then as many into a
+ *     second one with BASEFS_IOC_CREATE_BATCH, 'batch' files per call.
+ *     Prints both create rates, counting the syncfs() that makes the
+ *     files durable, and removes the files unless -k is given.  The
+ *     ioctl only takes data for files that fit in the inode (128 bytes
+ *     with the default inode size).
+ */
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* Parse a size with an optional K, M or G suffix. */
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'g': case 'G':
+		v <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		v <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		v <<= 10;
+	}
+	return v;
+}
+
+/* Number of physically contiguous runs in the file, or -1. */
+static long count_extents(int fd)
+{
+	struct stat st;
+	long extents = 0;
+	int blocks, b, prev = -1, phys;
+
+	if (fstat(fd, &st) || !st.st_blksize)
+		return -1;
+	blocks = (int)((st.st_size + st.st_blksize - 1) / st.st_blksize);
+	for (b = 0; b < blocks; b++) {
+		phys = b;
+		if (ioctl(fd, FIBMAP, &phys))
+			return -1;
+		if (phys && phys != prev + 1)
+			extents++;
+		prev = phys;
+	}
+	return extents;
+}
+
+/* ------------------------------------------------------------------------- */
+/* write                                                                       */
+
+struct write_ctx {
+	const char        *dir;
+	uint64_t           size;
+	size_t             bufsize;
+	int                do_fsync;
+	int                do_extents;
+	unsigned int       nr_threads;
+	pthread_barrier_t  barrier;
+};
+
+struct write_thread {
+	struct write_ctx  *c;
+	pthread_t          tid;
+	unsigned int       index;
+	char              *buf;
+	double             start, end;
+	long               extents;
+	int                err;
+};
+
+static void *write_worker(void *arg)
+{
+	struct write_thread *t = arg;
+	struct write_ctx *c = t->c;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char path[4096];
+	cpu_set_t set;
+	uint64_t done;
+	ssize_t n;
+	int fd;
+
+	CPU_ZERO(&set);
+	CPU_SET(t->index % (cpus > 0 ? cpus : 1), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	snprintf(path, sizeof(path), "%s/fsbench.%u", c->dir, t->index);
+
+	pthread_barrier_wait(&c->barrier);
+	t->start = now_sec();
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		t->err = errno;
+		return NULL;
+	}
+	for (done = 0; done < c->size; done += (uint64_t)n) {
+		n = write(fd, t->buf, c->size - done < c->bufsize ?
+				      c->size - done : c->bufsize);
+		if (n <= 0) {
+			t->err = n < 0 ? errno : EIO;
+			break;
+		}
+	}
+	if (!t->err && c->do_fsync && fsync(fd))
+		t->err = errno;
+	t->end = now_sec();
+	t->extents = c->do_extents ? count_extents(fd) : -1;
+	close(fd);
+	return NULL;
+}
+
+/* One round with c->nr_threads writers; returns MiB/s or -1. */
+static double write_round(struct write_ctx *c, struct write_thread *t,
+			  double *extents)
+{
+	double start = 0, end = 0, mib;
+	long total_ext = 0;
+	char path[4096];
+	unsigned int i;
+	int failed = 0;
+
+	pthread_barrier_init(&c->barrier, NULL, c->nr_threads);
+	for (i = 0; i < c->nr_threads; i++) {
+		t[i].c = c;
+		t[i].index = i;
+		t[i].err = 0;
+		pthread_create(&t[i].tid, NULL, write_worker, &t[i]);
+	}
+	for (i = 0; i < c->nr_threads; i++) {
+		pthread_join(t[i].tid, NULL);
+		if (t[i].err) {
+			fprintf(stderr, "writer %u: %s\n", i, strerror(t[i].err));
+			failed = 1;
+		}
+		if (!i || t[i].start < start)
+			start = t[i].start;
+		if (t[i].end > end)
+			end = t[i].end;
+		if (t[i].extents < 0 || total_ext < 0)
+			total_ext = -1;
+		else
+			total_ext += t[i].extents;
+	}
+	pthread_barrier_destroy(&c->barrier);
+
+	/* Drop the files and make the space reusable before the next round. */
+	for (i = 0; i < c->nr_threads; i++) {
+		snprintf(path, sizeof(path), "%s/fsbench.%u", c->dir, i);
+		unlink(path);
+	}
+	sync();
+
+	*extents = c->do_extents && total_ext >= 0 ?
+		   (double)total_ext / c->nr_threads : -1;
+	mib = (double)c->size * c->nr_threads / 1048576.0;
+	return failed || end <= start ? -1 : mib / (end - start);
+}
+
+static int cmd_write(int argc, char *argv[])
+{
+	struct write_ctx c = { .size = 256ULL << 20, .bufsize = 1 << 20 };
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int max_threads = cpus > 0 ? (unsigned int)cpus : 1;
+	struct write_thread *t;
+	double rate, base = 0, extents;
+	unsigned int n, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:b:j:fe")) != -1) {
+		switch (opt) {
+		case 's':
+			c.size = parse_size(optarg);
+			break;
+		case 'b':
+			c.bufsize = (size_t)parse_size(optarg);
+			break;
+		case 'j':
+			max_threads = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			c.do_fsync = 1;
+			break;
+		case 'e':
+			c.do_extents = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (argc - optind != 1 || !c.size || !c.bufsize || !max_threads)
+		return -1;
+	c.dir = argv[optind];
+
+	t = calloc(max_threads, sizeof(*t));
+	if (!t)
+		return 1;
+	for (i = 0; i < max_threads; i++) {
+		t[i].buf = xmalloc(c.bufsize);
+		memset(t[i].buf, 0xa5 ^ i, c.bufsize);
+	}
+
+	printf("%u MiB per writer in %zu KiB writes%s\n",
+	       (unsigned int)(c.size >> 20), c.bufsize >> 10,
+	       c.do_fsync ? ", fsync" : "");
+	printf("%8s %12s %8s%s\n", "writers", "MiB/s", "speedup",
+	       c.do_extents ? "  extents/file" : "");
+	for (n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+		c.nr_threads = n;
+		rate = write_round(&c, t, &extents);
+		if (rate < 0) {
+			printf("%8u %12s\n", n, "failed");
+			break;
+		}
+		if (n == 1)
+			base = rate;
+		printf("%8u %12.1f %7.2fx", n, rate, base > 0 ? rate / base : 0.0);
+		if (c.do_extents)
+			printf("  %12.1f", extents);
+		printf("\n");
+		if (n == max_threads)
+			break;
+	}
+
+	for (i = 0; i < max_threads; i++)
+		free(t[i].buf);
+	free(t);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* fsync                                                                       */
+
+struct fsync_ctx {
+	const char        *dir;
+	uint64_t           size;
+	const char        *buf;
+	pthread_barrier_t  written;   /* all files written */
+	pthread_barrier_t  go;        /* counters read, fsync */
+};
+
+struct fsync_thread {
+	struct fsync_ctx  *c;
+	pthread_t          tid;
+	unsigned int       index;
+	double             latency;
+	int                err;
+};
+
+static void *fsync_worker(void *arg)
+{
+	struct fsync_thread *t = arg;
+	struct fsync_ctx *c = t->c;
+	char path[4096];
+	uint64_t done;
+	double start;
+	ssize_t n = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/fsbench.sync.%u", c->dir, t->index);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		t->err = errno;
+	for (done = 0; fd >= 0 && done < c->size; done += (uint64_t)n) {
+		n = write(fd, c->buf, c->size - done < (1 << 20) ?
+				      c->size - done : (1 << 20));
+		if (n <= 0) {
+			t->err = n < 0 ? errno : EIO;
+			break;
+		}
+	}
+	pthread_barrier_wait(&c->written);
+	pthread_barrier_wait(&c->go);
+	if (fd < 0)
+		return NULL;
+	start = now_sec();
+	if (!t->err && fsync(fd))
+		t->err = errno;
+	t->latency = now_sec() - start;
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Open /proc/fs/basefs/<device>/'file' of the file system holding 'dir'.
+ */
+static FILE *proc_open(const char *dir, const char *file)
+{
+	char path[256], line[256], name[64] = "";
+	struct stat st;
+	FILE *f;
+
+	if (stat(dir, &st))
+		return NULL;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/uevent",
+		 major(st.st_dev), minor(st.st_dev));
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "DEVNAME=%63s", name) == 1)
+			break;
+	fclose(f);
+	if (!*name)
+		return NULL;
+
+	snprintf(path, sizeof(path), "/proc/fs/basefs/%s/%s", name, file);
+	return fopen(path, "r");
+}
+
+/*
+ * Commits and cache flushes so far of the journal of the file system
+ * holding 'dir', from /proc/fs/basefs/<device>/journal.
+ */
+static int journal_counts(const char *dir, unsigned long long *commits,
+			  unsigned long long *flushes)
+{
+	unsigned long long blocks;
+	char line[256];
+	int found = 0;
+	FILE *f;
+
+	f = proc_open(dir, "journal");
+	if (!f)
+		return -1;
+	while (!found && fgets(line, sizeof(line), f))
+		found = sscanf(line, "%llu transactions, %llu log blocks, %llu cache flushes",
+			       commits, &blocks, flushes) == 3;
+	fclose(f);
+	return found ? 0 : -1;
+}
+
+/*
+ * Index searches checked against a directory bloom filter so far, and
+ * how many it answered and let through wrongly, from
+ * /proc/fs/basefs/<device>/dir.
+ */
+static int bloom_counts(const char *dir, unsigned long long c[3])
+{
+	unsigned long long pct;
+	char line[256];
+	int found = 0;
+	FILE *f;
+
+	f = proc_open(dir, "dir");
+	if (!f)
+		return -1;
+	while (found < 2 && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%llu index searches", &c[0]) == 1)
+			found++;
+		else if (sscanf(line, "%llu answered by the filter (%llu%%), %llu false",
+				&c[1], &pct, &c[2]) == 3)
+			found++;
+	}
+	fclose(f);
+	return found == 2 ? 0 : -1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmd_fsync(int argc, char *argv[])
+{
+	struct fsync_ctx c = { .size = 1 << 20 };
+	unsigned long long commits[2], flushes[2];
+	unsigned int nr_threads = 64, rounds = 5, r, i;
+	struct fsync_thread *t;
+	double *lat, sum;
+	char path[4096];
+	char *buf;
+	int opt, stats, failed = 0;
+
+	while ((opt = getopt(argc, argv, "s:j:r:")) != -1) {
+		switch (opt) {
+		case 's':
+			c.size = parse_size(optarg);
+			break;
+		case 'j':
+			nr_threads = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rounds = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (argc - optind != 1 || !nr_threads || !rounds)
+		return -1;
+	c.dir = argv[optind];
+
+	buf = xmalloc(1 << 20);
+	memset(buf, 0x5a, 1 << 20);
+	c.buf = buf;
+	t = calloc(nr_threads, sizeof(*t));
+	lat = calloc(nr_threads, sizeof(*lat));
+	if (!t || !lat)
+		return 1;
+
+	printf("%u threads, %llu KiB each, then fsync at once\n", nr_threads,
+	       (unsigned long long)(c.size >> 10));
+	printf("%6s %10s %10s %10s %8s %8s\n", "round", "avg ms", "p99 ms",
+	       "max ms", "commits", "flushes");
+	for (r = 0; r < rounds && !failed; r++) {
+		pthread_barrier_init(&c.written, NULL, nr_threads + 1);
+		pthread_barrier_init(&c.go, NULL, nr_threads + 1);
+		for (i = 0; i < nr_threads; i++) {
+			t[i].c = &c;
+			t[i].index = i;
+			t[i].err = 0;
+			pthread_create(&t[i].tid, NULL, fsync_worker, &t[i]);
+		}
+		pthread_barrier_wait(&c.written);
+		stats = !journal_counts(c.dir, &commits[0], &flushes[0]);
+		pthread_barrier_wait(&c.go);
+
+		sum = 0;
+		for (i = 0; i < nr_threads; i++) {
+			pthread_join(t[i].tid, NULL);
+			if (t[i].err) {
+				fprintf(stderr, "thread %u: %s\n", i,
+					strerror(t[i].err));
+				failed = 1;
+			}
+			lat[i] = t[i].latency * 1000;
+			sum += lat[i];
+		}
+		stats = stats && !journal_counts(c.dir, &commits[1], &flushes[1]);
+		pthread_barrier_destroy(&c.written);
+		pthread_barrier_destroy(&c.go);
+
+		qsort(lat, nr_threads, sizeof(*lat), cmp_double);
+		printf("%6u %10.2f %10.2f %10.2f", r + 1, sum / nr_threads,
+		       lat[(nr_threads * 99) / 100], lat[nr_threads - 1]);
+		if (stats)
+			printf(" %8llu %8llu\n", commits[1] - commits[0],
+			       flushes[1] - flushes[0]);
+		else
+			printf(" %8s %8s\n", "-", "-");
+
+		for (i = 0; i < nr_threads; i++) {
+			snprintf(path, sizeof(path), "%s/fsbench.sync.%u",
+				 c.dir, i);
+			unlink(path);
+		}
+		sync();
+	}
+
+	free(lat);
+	free(t);
+	free(buf);
+	return failed;
+}
+
+/* ------------------------------------------------------------------------- */
+/* mount                                                                       */
+
+/*
+ * Attach 'image' to a free loop device, named in 'dev', and return an
+ * open descriptor of it, or -1.  The device goes away by itself once
+ * that descriptor is closed and nothing is mounted from it.
+ */
+static int loop_attach(const char *image, char *dev, size_t len)
+{
+	struct loop_info64 info;
+	int ctl, fd, lfd, nr;
+
+	ctl = open("/dev/loop-control", O_RDWR);
+	if (ctl < 0)
+		return -1;
+	nr = ioctl(ctl, LOOP_CTL_GET_FREE);
+	close(ctl);
+	if (nr < 0)
+		return -1;
+	snprintf(dev, len, "/dev/loop%d", nr);
+
+	fd = open(image, O_RDWR);
+	if (fd < 0)
+		return -1;
+	lfd = open(dev, O_RDWR);
+	if (lfd < 0) {
+		close(fd);
+		return -1;
+	}
+	if (ioctl(lfd, LOOP_SET_FD, fd)) {
+		close(lfd);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	memset(&info, 0, sizeof(info));
+	info.lo_flags = LO_FLAGS_AUTOCLEAR;
+	ioctl(lfd, LOOP_SET_STATUS64, &info);
+	return lfd;
+}
+
+static void drop_caches(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0)
+		return;
+	if (write(fd, "3", 1) != 1)
+		perror("drop_caches");
+	close(fd);
+}
+
+/* Size of the image or device in bytes, or 0. */
+static uint64_t image_size(const char *path)
+{
+	uint64_t size = 0;
+	struct stat st;
+	int fd;
+
+	if (stat(path, &st))
+		return 0;
+	if (S_ISREG(st.st_mode))
+		return (uint64_t)st.st_size;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (ioctl(fd, BLKGETSIZE64, &size))
+		size = 0;
+	close(fd);
+	return size;
+}
+
+/*
+ * One mount of 'dev' on 'dir': the mount itself, then the first write
+ * that has to allocate (create a file, write a block, fsync), then the
+ * unmount.  Times in seconds; returns -1 on failure.
+ */
+static int mount_once(const char *dev, const char *dir, int cold,
+		      double *t_mount, double *t_write, double *t_umount)
+{
+	static char block[4096];
+	char path[4096];
+	double t0, t1, t2, t3;
+	int fd, ret = 0;
+
+	if (cold)
+		drop_caches();
+	t0 = now_sec();
+	if (mount(dev, dir, "basefs", 0, NULL)) {
+		fprintf(stderr, "mount %s: %s\n", dev, strerror(errno));
+		return -1;
+	}
+	t1 = now_sec();
+	snprintf(path, sizeof(path), "%s/fsbench.mount", dir);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, block, sizeof(block)) != sizeof(block) ||
+	    fsync(fd)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	t2 = now_sec();
+	unlink(path);
+	sync();
+
+	t3 = now_sec();
+	if (umount(dir)) {
+		fprintf(stderr, "umount %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	*t_umount = now_sec() - t3;
+	*t_mount = t1 - t0;
+	*t_write = t2 - t1;
+	return ret;
+}
+
+static int cmd_mount(int argc, char *argv[])
+{
+	double t_mount, t_write, t_umount, sum_mount, sum_write, sum_umount;
+	double min_mount;
+	unsigned int runs = 5, r;
+	const char *dir, *image;
+	char dev[64];
+	struct stat st;
+	int cold = 1, opt, i, lfd, failed = 0;
+
+	while ((opt = getopt(argc, argv, "r:w")) != -1) {
+		switch (opt) {
+		case 'r':
+			runs = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			cold = 0;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (argc - optind < 2 || !runs)
+		return -1;
+	dir = argv[optind];
+
+	printf("%u %s mounts per image\n", runs, cold ? "cold" : "warm");
+	printf("%-32s %10s %12s %12s %14s %12s\n", "image", "GiB",
+	       "mount ms", "min ms", "first write ms", "umount ms");
+	for (i = optind + 1; i < argc; i++) {
+		image = argv[i];
+		if (stat(image, &st)) {
+			fprintf(stderr, "%s: %s\n", image, strerror(errno));
+			failed = 1;
+			continue;
+		}
+		lfd = -1;
+		if (S_ISREG(st.st_mode)) {
+			lfd = loop_attach(image, dev, sizeof(dev));
+			if (lfd < 0) {
+				fprintf(stderr, "%s: cannot attach a loop device: %s\n",
+					image, strerror(errno));
+				failed = 1;
+				continue;
+			}
+		} else {
+			snprintf(dev, sizeof(dev), "%s", image);
+		}
+
+		sum_mount = sum_write = sum_umount = 0;
+		min_mount = 0;
+		for (r = 0; r < runs; r++) {
+			if (mount_once(dev, dir, cold, &t_mount, &t_write,
+				       &t_umount))
+				break;
+			sum_mount += t_mount;
+			sum_write += t_write;
+			sum_umount += t_umount;
+			if (!r || t_mount < min_mount)
+				min_mount = t_mount;
+		}
+		if (r < runs) {
+			printf("%-32s %10.1f %12s\n", image,
+			       image_size(dev) / 1073741824.0, "failed");
+			failed = 1;
+		} else {
+			printf("%-32s %10.1f %12.2f %12.2f %14.2f %12.2f\n",
+			       image, image_size(dev) / 1073741824.0,
+			       sum_mount * 1e3 / runs, min_mount * 1e3,
+			       sum_write * 1e3 / runs, sum_umount * 1e3 / runs);
+		}
+		if (lfd >= 0)
+			close(lfd);
+	}
+	return failed;
+}
+
+/* ------------------------------------------------------------------------- */
+/* dir                                                                         */
+
+/* Name of entry 'i', or of a name that is not there. */
+static void dir_name(char *buf, size_t len, uint64_t i, int missing)
+{
+	snprintf(buf, len, "%s_%010llu.jpg", missing ? "missing" : "sample",
+		 (unsigned long long)i);
+}
+
+/* A step coprime with 'n': i * step % n visits every entry once. */
+static uint64_t dir_step(uint64_t n)
+{
+	uint64_t step, a, b, t;
+
+	for (step = n / 2 + 7919;; step++) {
+		for (a = step, b = n; b; a = b, b = t)
+			t = a % b;
+		if (a == 1)
+			return step;
+	}
+}
+
+/* readdir of the whole directory and a stat of every entry. */
+static int list_dir(int dfd, int cold)
+{
+	uint64_t listed = 0, untyped = 0;
+	struct dirent *d;
+	struct stat st;
+	double start;
+	DIR *dir;
+	int fd;
+
+	if (cold)
+		drop_caches();
+	fd = openat(dfd, ".", O_RDONLY | O_DIRECTORY);
+	dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (!dir) {
+		fprintf(stderr, "opendir: %s\n", strerror(errno));
+		return 1;
+	}
+	start = now_sec();
+	while ((d = readdir(dir))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if (d->d_type == DT_UNKNOWN)
+			untyped++;
+		if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			fprintf(stderr, "stat %s: %s\n", d->d_name, strerror(errno));
+			break;
+		}
+		listed++;
+	}
+	printf("listed and stat'ed %llu entries (%s): %.0f/s, %llu without type\n",
+	       (unsigned long long)listed, cold ? "cold" : "warm",
+	       listed / (now_sec() - start), (unsigned long long)untyped);
+	closedir(dir);
+	return 0;
+}
+
+#define LABEL_BUF_SIZE (1 << 20)
+
+/* The "user.label" of every entry: getxattr() each, then the bulk ioctl. */
+static int label_dir(int dfd, const char *path, int cold)
+{
+	struct basefs_dir_xattr_rec *rec;
+	struct basefs_dir_xattr req;
+	uint64_t got = 0, calls = 0, off;
+	char full[4096 + 256], value[64], *buf;
+	struct dirent *d;
+	double start;
+	DIR *dir;
+	uint32_t i;
+	int fd;
+
+	if (cold)
+		drop_caches();
+	fd = openat(dfd, ".", O_RDONLY | O_DIRECTORY);
+	dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (!dir) {
+		fprintf(stderr, "opendir: %s\n", strerror(errno));
+		return 1;
+	}
+	start = now_sec();
+	while ((d = readdir(dir))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		snprintf(full, sizeof(full), "%s/%s", path, d->d_name);
+		if (lgetxattr(full, "user.label", value, sizeof(value)) < 0) {
+			fprintf(stderr, "getxattr %s: %s\n", full, strerror(errno));
+			break;
+		}
+		got++;
+	}
+	printf("getxattr of %llu labels (%s): %.0f/s\n",
+	       (unsigned long long)got, cold ? "cold" : "warm",
+	       got / (now_sec() - start));
+	closedir(dir);
+
+	if (cold)
+		drop_caches();
+	buf = xmalloc(LABEL_BUF_SIZE);
+	memset(&req, 0, sizeof(req));
+	strcpy(req.name, "user.label");
+	req.buf = (uintptr_t)buf;
+	req.buf_len = LABEL_BUF_SIZE;
+	got = 0;
+	start = now_sec();
+	do {
+		if (ioctl(dfd, BASEFS_IOC_DIR_XATTR, &req)) {
+			fprintf(stderr, "BASEFS_IOC_DIR_XATTR: %s\n",
+				strerror(errno));
+			break;
+		}
+		calls++;
+		for (i = 0, off = 0; i < req.nr; i++, off += rec->rec_len) {
+			rec = (struct basefs_dir_xattr_rec *)(buf + off);
+			if (rec->value_len >= 0)
+				got++;
+		}
+	} while (!(req.flags & BASEFS_DIR_XATTR_EOF));
+	printf("BASEFS_IOC_DIR_XATTR: %llu labels in %llu calls (%s): %.0f/s\n",
+	       (unsigned long long)got, (unsigned long long)calls,
+	       cold ? "cold" : "warm", got / (now_sec() - start));
+	free(buf);
+	return 0;
+}
+
+static int cmd_dir(int argc, char *argv[])
+{
+	uint64_t entries = 10000000, lookups = 1000000, i, step, report;
+	double start, last, now;
+	unsigned long long bloom[3], after[3];
+	char path[4096], name[64], label[16];
+	int cold = 1, keep = 0, labels = 0, have_bloom, opt, dfd, fd;
+	struct stat st;
+
+	while ((opt = getopt(argc, argv, "n:l:wkx")) != -1) {
+		switch (opt) {
+		case 'n':
+			entries = strtoull(optarg, NULL, 10);
+			break;
+		case 'l':
+			lookups = strtoull(optarg, NULL, 10);
+			break;
+		case 'w':
+			cold = 0;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'x':
+			labels = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (argc - optind != 1 || !entries)
+		return -1;
+	if (lookups > entries)
+		lookups = entries;
+
+	snprintf(path, sizeof(path), "%s/fsbench.dir", argv[optind]);
+	if (mkdir(path, 0755) || (dfd = open(path, O_RDONLY | O_DIRECTORY)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	printf("%llu entries in %s\n", (unsigned long long)entries, path);
+	printf("%12s %14s\n", "entries", "creates/s");
+	report = entries >= 10 ? entries / 10 : 1;
+	start = last = now_sec();
+	for (i = 0; i < entries; i++) {
+		dir_name(name, sizeof(name), i, 0);
+		fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "create %s: %s\n", name, strerror(errno));
+			close(dfd);
+			return 1;
+		}
+		snprintf(label, sizeof(label), "class%03llu",
+			 (unsigned long long)(i % 1000));
+		if (labels &&
+		    fsetxattr(fd, "user.label", label, strlen(label), 0)) {
+			fprintf(stderr, "setxattr %s: %s\n", name, strerror(errno));
+			close(fd);
+			close(dfd);
+			return 1;
+		}
+		close(fd);
+		if ((i + 1) % report == 0 || i + 1 == entries) {
+			now = now_sec();
+			printf("%12llu %14.0f\n", (unsigned long long)i + 1,
+			       ((i + 1) % report ? (i + 1) % report : report) /
+			       (now - last));
+			last = now;
+		}
+	}
+	printf("created %llu entries in %.1f s\n", (unsigned long long)entries,
+	       now_sec() - start);
+
+	if (cold)
+		drop_caches();
+	else
+		sync();
+	step = dir_step(entries);
+	start = now_sec();
+	dir_name(name, sizeof(name), step % entries, 0);
+	if (fstatat(dfd, name, &st, 0))
+		fprintf(stderr, "stat %s: %s\n", name, strerror(errno));
+	printf("first lookup (%s): %.2f ms\n", cold ? "cold" : "warm",
+	       (now_sec() - start) * 1e3);
+
+	start = now_sec();
+	for (i = 2; i <= lookups; i++) {
+		dir_name(name, sizeof(name), i * step % entries, 0);
+		if (fstatat(dfd, name, &st, 0)) {
+			fprintf(stderr, "stat %s: %s\n", name, strerror(errno));
+			break;
+		}
+	}
+	if (lookups > 1)
+		printf("%llu lookups: %.0f/s\n", (unsigned long long)lookups - 1,
+		       (lookups - 1) / (now_sec() - start));
+
+	have_bloom = !bloom_counts(path, bloom);
+	start = now_sec();
+	for (i = 0; i < lookups; i++) {
+		dir_name(name, sizeof(name), i, 1);
+		if (!fstatat(dfd, name, &st, 0) || errno != ENOENT) {
+			fprintf(stderr, "stat %s: not ENOENT\n", name);
+			break;
+		}
+	}
+	if (lookups)
+		printf("%llu lookups of missing names: %.0f/s\n",
+		       (unsigned long long)lookups,
+		       lookups / (now_sec() - start));
+	if (have_bloom && !bloom_counts(path, after) && after[0] > bloom[0])
+		printf("bloom filter answered %llu of %llu index searches, %llu false positives\n",
+		       after[1] - bloom[1], after[0] - bloom[0],
+		       after[2] - bloom[2]);
+
+	if (list_dir(dfd, cold))
+		return 1;
+	if (labels && label_dir(dfd, path, cold))
+		return 1;
+
+	if (!keep) {
+		start = now_sec();
+		for (i = 0; i < entries; i++) {
+			dir_name(name, sizeof(name), i * step % entries, 0);
+			if (unlinkat(dfd, name, 0))
+				fprintf(stderr, "unlink %s: %s\n", name,
+					strerror(errno));
+		}
+		printf("%llu unlinks: %.0f/s\n", (unsigned long long)entries,
+		       entries / (now_sec() - start));
+		if (rmdir(path))
+			fprintf(stderr, "rmdir %s: %s\n", path, strerror(errno));
+	}
+	close(dfd);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* create                                                                      */
+
+/* Unlink the 'files' entries of 'path' and the directory itself. */
+static void remove_files(int dfd, const char *path, uint64_t files)
+{
+	char name[64];
+	uint64_t i;
+
+	for (i = 0; i < files; i++) {
+		dir_name(name, sizeof(name), i, 0);
+		if (unlinkat(dfd, name, 0) && errno != ENOENT)
+			fprintf(stderr, "unlink %s: %s\n", name, strerror(errno));
+	}
+	if (rmdir(path))
+		fprintf(stderr, "rmdir %s: %s\n", path, strerror(errno));
+}
+
+/* A new directory 'base'/'name', opened; -1 on failure. */
+static int create_dir(const char *base, const char *name, char *path,
+		      size_t len)
+{
+	int dfd = -1;
+
+	snprintf(path, len, "%s/%s", base, name);
+	if (mkdir(path, 0755) || (dfd = open(path, O_RDONLY | O_DIRECTORY)) < 0)
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return dfd;
+}
+
+/* One file per open(O_CREAT)/write/close; returns the files made. */
+static uint64_t create_each(int dfd, uint64_t files, const char *data,
+			    size_t size)
+{
+	char name[64];
+	uint64_t i;
+	int fd;
+
+	for (i = 0; i < files; i++) {
+		dir_name(name, sizeof(name), i, 0);
+		fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "create %s: %s\n", name, strerror(errno));
+			break;
+		}
+		if (size && write(fd, data, size) != (ssize_t)size) {
+			fprintf(stderr, "write %s: %s\n", name, strerror(errno));
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+	return i;
+}
+
+/* The same files through BASEFS_IOC_CREATE_BATCH; returns the files made. */
+static uint64_t create_batch(int dfd, uint64_t files, uint32_t batch,
+			     const char *data, size_t size)
+{
+	size_t rec_len = (sizeof(struct basefs_create_rec) + 32 + size + 7) &
+			 ~(size_t)7;
+	struct basefs_create_batch req;
+	struct basefs_create_rec *rec;
+	uint64_t i = 0, created = 0;
+	uint32_t n, done, k;
+	char *buf, *p;
+
+	buf = xmalloc(rec_len * batch);
+	while (i < files) {
+		/* Fill in the next batch of records. */
+		n = files - i < batch ? files - i : batch;
+		memset(buf, 0, rec_len * n);
+		for (k = 0; k < n; k++) {
+			rec = (struct basefs_create_rec *)(buf + k * rec_len);
+			dir_name(rec->name, 32, i + k, 0);
+			rec->name_len = strlen(rec->name);
+			rec->rec_len = rec_len;
+			rec->size = size;
+			rec->data_len = size;
+			memcpy(rec->name + rec->name_len, data, size);
+		}
+		/* A call may stop early; go on from the first record not done. */
+		for (p = buf, done = 0; done < n; p += (size_t)req.nr * rec_len) {
+			memset(&req, 0, sizeof(req));
+			req.buf = (uintptr_t)p;
+			req.buf_len = (n - done) * rec_len;
+			req.nr = n - done;
+			req.mode = 0644;
+			if (ioctl(dfd, BASEFS_IOC_CREATE_BATCH, &req)) {
+				fprintf(stderr, "BASEFS_IOC_CREATE_BATCH: %s\n",
+					strerror(errno));
+				goto out;
+			}
+			for (k = 0; k < req.nr; k++) {
+				rec = (struct basefs_create_rec *)(p + k * rec_len);
+				if (rec->result)
+					fprintf(stderr, "create %.*s: %s\n",
+						rec->name_len, rec->name,
+						strerror(-rec->result));
+			}
+			created += req.created;
+			done += req.nr;
+		}
+		i += n;
+	}
+out:
+	free(buf);
+	return created;
+}
+
+static int cmd_create(int argc, char *argv[])
+{
+	uint64_t files = 1000000, made;
+	uint32_t batch = 4096;
+	size_t size = 100;
+	char path[2][4096], *data;
+	int keep = 0, opt, dfd, pass;
+	double start, synced;
+
+	while ((opt = getopt(argc, argv, "n:s:b:k")) != -1) {
+		switch (opt) {
+		case 'n':
+			files = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (argc - optind != 1 || !files || !batch || size > 4096 ||
+	    (uint64_t)batch * (sizeof(struct basefs_create_rec) + 40 + size) >
+	    BASEFS_CREATE_BATCH_MAX)
+		return -1;
+
+	data = xmalloc(size ? size : 1);
+	memset(data, 'x', size);
+	printf("%llu files of %zu bytes\n", (unsigned long long)files, size);
+	for (pass = 0; pass < 2; pass++) {
+		dfd = create_dir(argv[optind], pass ? "fsbench.create.batch" :
+				 "fsbench.create.each", path[pass],
+				 sizeof(path[pass]));
+		if (dfd < 0)
+			return 1;
+		start = now_sec();
+		if (pass)
+			made = create_batch(dfd, files, batch, data, size);
+		else
+			made = create_each(dfd, files, data, size);
+		synced = now_sec();
+		syncfs(dfd);
+		if (pass)
+			printf("BASEFS_IOC_CREATE_BATCH, %u per call", batch);
+		else
+			printf("open/write/close");
+		printf(": %llu files in %.2f s, %.0f/s (%.0f/s before syncfs)\n",
+		       (unsigned long long)made, now_sec() - start,
+		       made / (now_sec() - start), made / (synced - start));
+		if (!keep)
+			remove_files(dfd, path[pass], files);
+		close(dfd);
+		if (made != files)
+			break;
+	}
+	free(data);
+	return made == files ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s <command> [options] <dir> ...\n"
+		"  write [-s size] [-b bufsize] [-j threads] [-f] [-e] <dir>\n"
+		"        parallel writers, one file each; throughput per writer count\n"
+		"        -s bytes per file (default 256M), -b write size (default 1M)\n"
+		"        -j most writers (default: online CPUs), -f fsync each file,\n"
+		"        -e count extents per file (FIBMAP, needs root)\n"
+		"  fsync [-s size] [-j threads] [-r rounds] <dir>\n"
+		"        checkpoint storm: every thread writes a file, then all\n"
+		"        fsync at once; fsync latency and journal commits/flushes\n"
+		"        -s bytes per file (default 1M), -j threads (default 64),\n"
+		"        -r rounds (default 5)\n"
+		"  mount [-r runs] [-w] <dir> <image-or-device>...\n"
+		"        mount latency per image: mount, first allocating write,\n"
+		"        umount; -r mounts per image (default 5), -w keep caches\n"
+		"  dir [-n entries] [-l lookups] [-w] [-k] [-x] <dir>\n"
+		"        one large directory: create rate as it grows, lookups of\n"
+		"        present and missing names, listing with a stat of each\n"
+		"        entry, unlinks; -n entries (default 10000000), -l lookups\n"
+		"        (default 1000000), -w keep caches, -k keep the entries,\n"
+		"        -x label each entry and read the labels back one by one\n"
+		"        and in bulk\n"
+		"  create [-n files] [-s size] [-b batch] [-k] <dir>\n"
+		"        small-file creates: open/write/close per file against\n"
+		"        BASEFS_IOC_CREATE_BATCH; -n files (default 1000000),\n"
+		"        -s bytes per file (default 100, at most 4096), -b files\n"
+		"        per ioctl (default 4096), -k keep the files\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = -1;
+
+	if (argc >= 2 && !strcmp(argv[1], "write"))
+		ret = cmd_write(argc - 1, argv + 1);
+	else if (argc >= 2 && !strcmp(argv[1], "fsync"))
+		ret = cmd_fsync(argc - 1, argv + 1);
+	else if (argc >= 2 && !strcmp(argv[1], "mount"))
+		ret = cmd_mount(argc - 1, argv + 1);
+	else if (argc >= 2 && !strcmp(argv[1], "dir"))
+		ret = cmd_dir(argc - 1, argv + 1);
+	else if (argc >= 2 && !strcmp(argv[1], "create"))
+		ret = cmd_create(argc - 1, argv + 1);
+	if (ret < 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	return ret;
+}
@@ -0,0 +1,935 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libbasefs.h"
+
+/*
+ * fsckfs - Consistency checker for BaseFS images.
+ *
+ * The check runs in three passes:
+ *
+ *   1. superblock and group descriptor geometry (serial, cheap)
+ *   2. every group's inode bitmap and the initialized part of its inode
+ *      table, plus the data of the directories found there.  Groups are handed out to worker threads
+ *      one at a time, so each thread scans a disjoint range of metadata
+ *      blocks.  Before scanning a group a worker asks the kernel to read
+ *      ahead the metadata of the group it will most likely take next.
+ *      Blocks claimed by extents are recorded in a shared bitmap with
+ *      atomic operations, which also catches blocks claimed twice.
+ *      Xattr blocks can be shared, so the inodes pointing at them are
+ *      only collected, and the blocks checked once all are known.
+ *   3. per group again: compare the on-disk block and inode bitmaps, free
+ *      counts and link counts with what pass 2 found, and fix them with -y.
+ *
+ * Exit status follows e2fsck: 0 clean, 1 errors fixed, 4 errors left,
+ * 8 operational error.
+ */
+
+#define FSCK_EXIT_OK         0
+#define FSCK_EXIT_FIXED      1
+#define FSCK_EXIT_UNCORRECTED 4
+#define FSCK_EXIT_ERROR      8
+
+#define FSCK_INODE_USED      0x01
+#define FSCK_INODE_DIR       0x02
+
+/* An inode pointing at an xattr block. */
+struct fsck_xref {
+	uint64_t blk;
+	uint64_t ino;
+};
+
+struct fsck_ctx {
+	struct bfs_image img;
+	int              repair;
+	unsigned int     nr_threads;
+
+	uint8_t         *claimed;      /* block bitmap rebuilt from extents */
+	uint8_t         *block_bitmaps; /* on-disk bitmaps, one block per group */
+	uint8_t         *inode_bitmaps;
+	uint8_t         *inode_state;  /* FSCK_INODE_* per inode, index ino - 1 */
+	uint32_t        *refs;         /* directory entries naming each inode */
+	uint32_t        *subdirs;      /* subdirectories of each directory */
+	uint16_t        *links;        /* on-disk link count of each inode */
+	struct fsck_xref *xrefs;       /* xattr block references, under lock */
+	size_t           nr_xrefs;
+	size_t           max_xrefs;
+
+	uint32_t         next_group;   /* work distribution for the passes */
+	uint64_t         errors;
+	uint64_t         fixed;
+	uint64_t         bytes_read;
+	uint64_t         inodes_used;
+	uint64_t         xattr_inodes; /* inodes with attributes in the tail */
+	int              fatal;
+
+	pthread_mutex_t  lock;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Report a problem; 'fixable' problems count as fixed when -y is given. */
+static void fsck_report(struct fsck_ctx *c, int fixable, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&c->lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	if (fixable && c->repair) {
+		printf(" [fixed]\n");
+		c->fixed++;
+	} else {
+		printf("\n");
+		c->errors++;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void *xcalloc(size_t n, size_t size)
+{
+	void *p = calloc(n ? n : 1, size);
+
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(FSCK_EXIT_ERROR);
+	}
+	return p;
+}
+
+static uint32_t group_overhead(const struct bfs_image *img)
+{
+	return basefs_group_overhead(img->itable_blocks);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Pass 1: superblock and descriptors                                         */
+
+static int check_super(struct fsck_ctx *c)
+{
+	struct bfs_image *img = &c->img;
+	struct basefs_super_block *sb = &img->sb;
+	uint64_t gdt_start = le64toh(sb->gdt_start);
+	uint32_t gdt_blocks = le32toh(sb->gdt_blocks);
+	uint64_t index_start = le64toh(sb->index_start);
+	uint32_t index_blocks = le32toh(sb->index_blocks);
+	uint64_t journal_start = le64toh(sb->journal_start);
+	uint32_t journal_blocks = le32toh(sb->journal_blocks);
+	uint64_t groups, last_start;
+	uint32_t g, inodes_per_block;
+	int bad = 0, lazy = 0;
+
+	if (le32toh(sb->feature_incompat) & ~BASEFS_FEATURE_INCOMPAT_SUPP) {
+		printf("Superblock has unsupported incompat features 0x%x\n",
+		       le32toh(sb->feature_incompat));
+		return -1;
+	}
+	/* The image is only consistent together with the journal. */
+	if (le32toh(sb->feature_incompat) & BASEFS_FEATURE_INCOMPAT_RECOVER) {
+		printf("Journal needs recovery: mount and unmount the image first\n");
+		return -1;
+	}
+	if (le32toh(sb->feature_ro_compat) & ~BASEFS_FEATURE_RO_COMPAT_SUPP) {
+		printf("Superblock has unsupported ro_compat features 0x%x\n",
+		       le32toh(sb->feature_ro_compat));
+		if (c->repair)
+			return -1;
+	}
+	/* Rewritten with the other repairs, which refreshes the checksum. */
+	if (img->sb_csum_bad)
+		fsck_report(c, 1, "Superblock checksum 0x%08x, should be 0x%08x",
+			    le32toh(sb->checksum), basefs_super_csum(sb));
+
+	inodes_per_block = img->block_size / img->inode_size;
+	if (img->blocks_per_group != img->block_size * 8 ||
+	    img->inodes_per_group > img->block_size * 8 ||
+	    img->inodes_per_group % inodes_per_block ||
+	    img->itable_blocks != img->inodes_per_group / inodes_per_block) {
+		printf("Superblock group geometry is inconsistent\n");
+		bad = 1;
+	}
+	if (gdt_start != 1 ||
+	    index_start != gdt_start + gdt_blocks +
+			   le32toh(sb->reserved_gdt_blocks) ||
+	    img->first_group_block != index_start + index_blocks +
+				      journal_blocks) {
+		printf("Superblock region layout is inconsistent\n");
+		bad = 1;
+	}
+	if ((le32toh(sb->feature_compat) & BASEFS_FEATURE_COMPAT_JOURNAL) ?
+	    journal_start != index_start + index_blocks ||
+	    journal_blocks < BASEFS_JOURNAL_MIN_BLOCKS :
+	    journal_start || journal_blocks) {
+		printf("Superblock journal location %llu+%u is inconsistent\n",
+		       (unsigned long long)journal_start, journal_blocks);
+		bad = 1;
+	}
+	if (img->first_group_block >= img->blocks_count) {
+		printf("First group lies beyond the end of the image\n");
+		return -1;
+	}
+	groups = (img->blocks_count - img->first_group_block +
+		  img->blocks_per_group - 1) / img->blocks_per_group;
+	if (groups != img->groups_count ||
+	    img->inodes_count != (uint64_t)img->groups_count * img->inodes_per_group) {
+		printf("Superblock counts %u groups / %llu inodes, geometry says %llu / %llu\n",
+		       img->groups_count, (unsigned long long)img->inodes_count,
+		       (unsigned long long)groups,
+		       (unsigned long long)groups * img->inodes_per_group);
+		bad = 1;
+	}
+	last_start = bfs_group_start(img, img->groups_count - 1);
+	if (last_start + group_overhead(img) >= img->blocks_count) {
+		printf("Last group is too small for its metadata\n");
+		bad = 1;
+	}
+	if (le32toh(sb->root_ino) != BASEFS_ROOT_INO) {
+		printf("Unexpected root inode %u\n", le32toh(sb->root_ino));
+		bad = 1;
+	}
+	if (bad)
+		return -1;
+
+	for (g = 0; g < img->groups_count; g++) {
+		uint64_t start = bfs_group_start(img, g);
+		const struct basefs_group_desc *gd = &img->gdt[g];
+
+		if (le64toh(gd->block_bitmap) != start ||
+		    le64toh(gd->inode_bitmap) != start + 1 ||
+		    le64toh(gd->inode_table) != start + BASEFS_GROUP_META_BLOCKS) {
+			printf("Group %u descriptor points outside its group\n", g);
+			bad = 1;
+		}
+		if (basefs_itable_init(gd, img->itable_blocks) > img->itable_blocks) {
+			printf("Group %u has %u of its %u inode table blocks initialized\n",
+			       g, le32toh(gd->itable_init), img->itable_blocks);
+			bad = 1;
+		}
+		if (le16toh(gd->flags) & BASEFS_BG_ITABLE_UNINIT)
+			lazy = 1;
+	}
+	if (lazy && !(le32toh(sb->feature_ro_compat) &
+		      BASEFS_FEATURE_RO_COMPAT_LAZY_ITABLE)) {
+		fsck_report(c, 1, "Inode tables are not all initialized but the lazy inode table feature is not set");
+		sb->feature_ro_compat = htole32(le32toh(sb->feature_ro_compat) |
+						BASEFS_FEATURE_RO_COMPAT_LAZY_ITABLE);
+	}
+	return bad ? -1 : 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Pass 2: inode tables and directories                                       */
+
+/* Ask the kernel to start reading a group's bitmaps and inode table. */
+static void readahead_group(struct fsck_ctx *c, uint32_t g)
+{
+	struct bfs_image *img = &c->img;
+
+	if (g >= img->groups_count)
+		return;
+	posix_fadvise(img->fd, (off_t)(bfs_group_start(img, g) * img->block_size),
+		      (off_t)group_overhead(img) * img->block_size,
+		      POSIX_FADV_WILLNEED);
+}
+
+static int claim_block(struct fsck_ctx *c, uint64_t blk)
+{
+	uint8_t bit = (uint8_t)(1U << (blk & 7));
+
+	return __atomic_fetch_or(&c->claimed[blk >> 3], bit,
+				 __ATOMIC_RELAXED) & bit;
+}
+
+struct extent_check {
+	struct fsck_ctx *c;
+	uint64_t         ino;
+	uint32_t         index;        /* extents seen so far */
+	uint64_t         total;        /* blocks mapped, tree blocks included */
+};
+
+/* Is [blk, blk + len) inside one group's data area? */
+static int in_data_area(const struct bfs_image *img, uint64_t blk, uint32_t len)
+{
+	uint64_t gstart;
+	uint32_t g;
+
+	if (blk < img->first_group_block)
+		return 0;
+	g = (uint32_t)((blk - img->first_group_block) / img->blocks_per_group);
+	gstart = bfs_group_start(img, g);
+	return g < img->groups_count &&
+	       blk >= gstart + group_overhead(img) &&
+	       blk + len <= gstart + bfs_group_len(img, g);
+}
+
+static int check_one_extent(const struct basefs_extent *ex, void *arg)
+{
+	struct extent_check *e = arg;
+	struct fsck_ctx *c = e->c;
+	uint64_t pblk = le64toh(ex->pblk), b;
+	uint32_t len = le32toh(ex->len), dup;
+	uint32_t i = e->index++;
+
+	/* An extent must sit inside one group's data area. */
+	if (pblk < c->img.first_group_block) {
+		fsck_report(c, 0, "Inode %llu extent %u maps fixed metadata block %llu",
+			    (unsigned long long)e->ino, i,
+			    (unsigned long long)pblk);
+		return 0;
+	}
+	if (!in_data_area(&c->img, pblk, len)) {
+		fsck_report(c, 0, "Inode %llu extent %u (%llu+%u) overlaps group metadata or the image end",
+			    (unsigned long long)e->ino, i,
+			    (unsigned long long)pblk, len);
+		return 0;
+	}
+
+	dup = 0;
+	for (b = pblk; b < pblk + len; b++)
+		dup += claim_block(c, b) ? 1 : 0;
+	if (dup)
+		fsck_report(c, 0, "Inode %llu extent %u shares %u blocks with another inode",
+			    (unsigned long long)e->ino, i, dup);
+	e->total += len;
+	return 0;
+}
+
+/* A tree block must be a data block nobody else uses. */
+static int check_extent_node(uint64_t blk, void *arg)
+{
+	struct extent_check *e = arg;
+	struct fsck_ctx *c = e->c;
+
+	if (!in_data_area(&c->img, blk, 1)) {
+		fsck_report(c, 0, "Inode %llu extent tree block %llu is not in a data area",
+			    (unsigned long long)e->ino, (unsigned long long)blk);
+		return -EUCLEAN;
+	}
+	if (claim_block(c, blk))
+		fsck_report(c, 0, "Inode %llu extent tree block %llu is used by another inode",
+			    (unsigned long long)e->ino, (unsigned long long)blk);
+	e->total++;
+	return 0;
+}
+
+/*
+ * check_extents - Validate an inode's block map, inline or in an extent
+ * tree, and claim its blocks.  Returns the number of blocks mapped,
+ * tree blocks included.
+ */
+static uint64_t check_extents(struct fsck_ctx *c, uint64_t ino,
+			      const struct basefs_inode *di)
+{
+	struct extent_check e = { .c = c, .ino = ino };
+	int ret;
+
+	ret = bfs_for_each_extent(&c->img, di, check_one_extent,
+				  check_extent_node, &e);
+	if (ret == -EUCLEAN)
+		fsck_report(c, 0, "Inode %llu has a malformed block map (extent %u)",
+			    (unsigned long long)ino, e.index);
+	else if (ret)
+		fsck_report(c, 0, "Inode %llu block map cannot be read: %s",
+			    (unsigned long long)ino, strerror(-ret));
+	return e.total;
+}
+
+struct dir_walk {
+	struct fsck_ctx *c;
+	uint64_t         ino;
+	uint32_t         subdirs;
+};
+
+static int check_dirent(const struct basefs_dir_entry *de, const char *name,
+			void *arg)
+{
+	struct dir_walk *w = arg;
+	struct fsck_ctx *c = w->c;
+	uint64_t child = le64toh(de->inode);
+
+	if (child > c->img.inodes_count) {
+		fsck_report(c, 0, "Directory %llu entry '%s' names inode %llu beyond the table",
+			    (unsigned long long)w->ino, name,
+			    (unsigned long long)child);
+		return 0;
+	}
+	if (!de->name_len || strchr(name, '/') ||
+	    strlen(name) != de->name_len ||
+	    !strcmp(name, ".") || !strcmp(name, "..")) {
+		fsck_report(c, 0, "Directory %llu has an invalid entry name",
+			    (unsigned long long)w->ino);
+		return 0;
+	}
+
+	__atomic_fetch_add(&c->refs[child - 1], 1, __ATOMIC_RELAXED);
+	if (de->file_type == BASEFS_FT_DIR)
+		w->subdirs++;
+	return 0;
+}
+
+static void check_dir(struct fsck_ctx *c, uint64_t ino,
+		      const struct basefs_inode *di)
+{
+	struct dir_walk w = { .c = c, .ino = ino };
+	int ret;
+
+	if (le64toh(di->size) % c->img.block_size)
+		fsck_report(c, 0, "Directory %llu size is not a multiple of the block size",
+			    (unsigned long long)ino);
+	ret = bfs_for_each_dirent(&c->img, di, check_dirent, &w);
+	if (ret)
+		fsck_report(c, 0, "Directory %llu is corrupt: %s",
+			    (unsigned long long)ino, strerror(-ret));
+	c->subdirs[ino - 1] = w.subdirs;
+	__atomic_fetch_add(&c->bytes_read, le64toh(di->size), __ATOMIC_RELAXED);
+}
+
+/*
+ * A file kept in its inode has no block map and fits in it: in 'data'
+ * alone if the tail holds xattrs.
+ */
+static void check_inline_data(struct fsck_ctx *c, uint64_t ino,
+			      const struct basefs_inode *di)
+{
+	uint64_t size = le64toh(di->size);
+	uint32_t max = basefs_inline_data_max(c->img.inode_size);
+
+	if (le32toh(di->flags) & BASEFS_INODE_INLINE_XATTR)
+		max = BASEFS_INODE_DATA_SIZE;
+	if (!S_ISREG(le16toh(di->mode)) || di->nr_extents ||
+	    (le32toh(di->flags) & BASEFS_INODE_EXTENT_TREE) || size > max)
+		fsck_report(c, 0, "Inode %llu has malformed inline data (size %llu)",
+			    (unsigned long long)ino, (unsigned long long)size);
+	else if (size && !(le32toh(c->img.sb.feature_incompat) &
+			   BASEFS_FEATURE_INCOMPAT_INLINE_DATA))
+		fsck_report(c, 0, "Inode %llu has inline data but the inline data feature is not set",
+			    (unsigned long long)ino);
+}
+
+static void check_inline_xattr(struct fsck_ctx *c, uint64_t ino,
+			       const struct basefs_inode *di)
+{
+	uint32_t len = c->img.inode_size - sizeof(*di);
+
+	__atomic_fetch_add(&c->xattr_inodes, 1, __ATOMIC_RELAXED);
+	if (basefs_xattr_area_used(di + 1, len) < 0)
+		fsck_report(c, 0, "Inode %llu has malformed inline xattrs",
+			    (unsigned long long)ino);
+}
+
+static void add_xref(struct fsck_ctx *c, uint64_t ino, uint64_t blk)
+{
+	pthread_mutex_lock(&c->lock);
+	if (c->nr_xrefs == c->max_xrefs) {
+		c->max_xrefs = c->max_xrefs ? 2 * c->max_xrefs : 64;
+		c->xrefs = realloc(c->xrefs, c->max_xrefs * sizeof(*c->xrefs));
+		if (!c->xrefs) {
+			fprintf(stderr, "out of memory\n");
+			exit(FSCK_EXIT_ERROR);
+		}
+	}
+	c->xrefs[c->nr_xrefs].blk = blk;
+	c->xrefs[c->nr_xrefs].ino = ino;
+	c->nr_xrefs++;
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void check_inode(struct fsck_ctx *c, uint64_t ino,
+			const struct basefs_inode *di)
+{
+	uint16_t mode = le16toh(di->mode);
+	uint64_t blocks;
+
+	if (!S_ISREG(mode) && !S_ISDIR(mode) && !S_ISLNK(mode) &&
+	    !S_ISCHR(mode) && !S_ISBLK(mode) && !S_ISFIFO(mode) &&
+	    !S_ISSOCK(mode)) {
+		fsck_report(c, 0, "Inode %llu has invalid mode 0%o",
+			    (unsigned long long)ino, mode);
+		return;
+	}
+
+	c->inode_state[ino - 1] = FSCK_INODE_USED |
+				  (S_ISDIR(mode) ? FSCK_INODE_DIR : 0);
+	c->links[ino - 1] = le16toh(di->links_count);
+	__atomic_fetch_add(&c->inodes_used, 1, __ATOMIC_RELAXED);
+
+	if (S_ISLNK(mode) && !di->nr_extents &&
+	    !(le32toh(di->flags) & BASEFS_INODE_EXTENT_TREE) &&
+	    le64toh(di->size) >= BASEFS_INODE_DATA_SIZE)
+		fsck_report(c, 0, "Inode %llu: symlink too long to be stored inline",
+			    (unsigned long long)ino);
+	if (le32toh(di->flags) & BASEFS_INODE_INLINE_DATA)
+		check_inline_data(c, ino, di);
+	if (le32toh(di->flags) & BASEFS_INODE_INLINE_XATTR)
+		check_inline_xattr(c, ino, di);
+	if (di->xattr_block)
+		add_xref(c, ino, le64toh(di->xattr_block));
+
+	blocks = check_extents(c, ino, di);
+	if (blocks != le64toh(di->blocks))
+		fsck_report(c, 0, "Inode %llu block count %llu, extents map %llu",
+			    (unsigned long long)ino,
+			    (unsigned long long)le64toh(di->blocks),
+			    (unsigned long long)blocks);
+
+	if (S_ISDIR(mode))
+		check_dir(c, ino, di);
+}
+
+static int scan_group(struct fsck_ctx *c, uint32_t g, uint8_t *itable)
+{
+	struct bfs_image *img = &c->img;
+	const struct basefs_group_desc *gd = &img->gdt[g];
+	uint8_t *ibitmap = c->inode_bitmaps + (uint64_t)g * img->block_size;
+	uint8_t *bbitmap = c->block_bitmaps + (uint64_t)g * img->block_size;
+	uint32_t init = basefs_itable_init(gd, img->itable_blocks);
+	const struct basefs_inode *di;
+	uint64_t ino;
+	uint32_t i;
+	int ret;
+
+	/*
+	 * Past 'init' the table holds no inode in use, whatever it holds:
+	 * an inode there that the bitmap has in use is found as a bitmap
+	 * error by pass 3.
+	 */
+	ret = bfs_read_blocks(img, le64toh(gd->block_bitmap), 1, bbitmap);
+	if (!ret)
+		ret = bfs_read_blocks(img, le64toh(gd->inode_bitmap), 1, ibitmap);
+	if (!ret && init)
+		ret = bfs_read_blocks(img, le64toh(gd->inode_table), init, itable);
+	if (ret)
+		return ret;
+	__atomic_fetch_add(&c->bytes_read,
+			   (uint64_t)(BASEFS_GROUP_META_BLOCKS + init) *
+			   img->block_size, __ATOMIC_RELAXED);
+
+	for (i = 0; i < (uint64_t)init * img->block_size / img->inode_size &&
+		    i < img->inodes_per_group; i++) {
+		di = (const struct basefs_inode *)(itable +
+						   (uint64_t)i * img->inode_size);
+		ino = (uint64_t)g * img->inodes_per_group + i + 1;
+		if (!di->mode)
+			continue;
+		if (!di->links_count) {
+			/* Deleted but never cleared: just an unused slot. */
+			continue;
+		}
+		check_inode(c, ino, di);
+	}
+	return 0;
+}
+
+static void *scan_worker(void *arg)
+{
+	struct fsck_ctx *c = arg;
+	uint8_t *itable;
+	uint32_t g;
+	int ret;
+
+	itable = xcalloc(c->img.itable_blocks, c->img.block_size);
+	for (;;) {
+		g = __atomic_fetch_add(&c->next_group, 1, __ATOMIC_RELAXED);
+		if (g >= c->img.groups_count)
+			break;
+		readahead_group(c, g + c->nr_threads);
+		ret = scan_group(c, g, itable);
+		if (ret) {
+			fsck_report(c, 0, "Group %u: cannot read metadata: %s",
+				    g, strerror(-ret));
+			c->fatal = 1;
+		}
+	}
+	free(itable);
+	return NULL;
+}
+
+static int cmp_xref(const void *a, const void *b)
+{
+	const struct fsck_xref *x = a, *y = b;
+
+	if (x->blk != y->blk)
+		return x->blk < y->blk ? -1 : 1;
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/*
+ * Xattr blocks, once the scan has found every inode pointing at one:
+ * each must be a data block no file uses, well formed, and count
+ * exactly the inodes pointing at it.  The hash only finds blocks to
+ * share, so a wrong one is simply rewritten.  Serial: there are few.
+ */
+static void check_xattr_blocks(struct fsck_ctx *c)
+{
+	struct bfs_image *img = &c->img;
+	uint32_t len = img->block_size - sizeof(struct basefs_xattr_header);
+	struct basefs_xattr_header *hdr;
+	uint8_t *buf = xcalloc(1, img->block_size);
+	uint64_t blk, ino;
+	uint32_t hash;
+	size_t i, j;
+	int dirty;
+	long used;
+
+	hdr = (struct basefs_xattr_header *)buf;
+	qsort(c->xrefs, c->nr_xrefs, sizeof(*c->xrefs), cmp_xref);
+	for (i = 0; i < c->nr_xrefs; i = j) {
+		blk = c->xrefs[i].blk;
+		ino = c->xrefs[i].ino;
+		for (j = i + 1; j < c->nr_xrefs && c->xrefs[j].blk == blk; j++)
+			;
+		if (!in_data_area(img, blk, 1)) {
+			fsck_report(c, 0, "Inode %llu xattr block %llu is not in a data area",
+				    (unsigned long long)ino, (unsigned long long)blk);
+			continue;
+		}
+		if (claim_block(c, blk)) {
+			fsck_report(c, 0, "Inode %llu xattr block %llu is also file data",
+				    (unsigned long long)ino, (unsigned long long)blk);
+			continue;
+		}
+		if (bfs_read_blocks(img, blk, 1, buf)) {
+			fsck_report(c, 0, "Xattr block %llu cannot be read",
+				    (unsigned long long)blk);
+			continue;
+		}
+		__atomic_fetch_add(&c->bytes_read, img->block_size,
+				   __ATOMIC_RELAXED);
+		used = basefs_xattr_area_used(hdr + 1, len);
+		if (le32toh(hdr->magic) != BASEFS_XATTR_MAGIC || used < 0) {
+			fsck_report(c, 0, "Inode %llu xattr block %llu is corrupt",
+				    (unsigned long long)ino, (unsigned long long)blk);
+			continue;
+		}
+
+		dirty = 0;
+		if (le32toh(hdr->refcount) != j - i) {
+			fsck_report(c, 1, "Xattr block %llu reference count %u, should be %zu",
+				    (unsigned long long)blk,
+				    le32toh(hdr->refcount), j - i);
+			hdr->refcount = htole32((uint32_t)(j - i));
+			dirty = 1;
+		}
+		hash = basefs_crc32c(~0U, hdr + 1, (size_t)used);
+		if (le32toh(hdr->hash) != hash) {
+			fsck_report(c, 1, "Xattr block %llu hash 0x%08x, should be 0x%08x",
+				    (unsigned long long)blk, le32toh(hdr->hash),
+				    hash);
+			hdr->hash = htole32(hash);
+			dirty = 1;
+		}
+		if (c->repair && dirty)
+			bfs_write_blocks(img, blk, 1, buf);
+	}
+	free(buf);
+
+	if ((c->nr_xrefs || c->xattr_inodes) &&
+	    !(le32toh(img->sb.feature_compat) & BASEFS_FEATURE_COMPAT_XATTR)) {
+		fsck_report(c, 1, "Inodes have xattrs but the xattr feature is not set");
+		img->sb.feature_compat = htole32(le32toh(img->sb.feature_compat) |
+						 BASEFS_FEATURE_COMPAT_XATTR);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* Pass 3: bitmaps, counts and links                                          */
+
+static uint32_t popcount_range(const uint8_t *map, uint32_t nr)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < nr; i++)
+		n += (uint32_t)bfs_test_bit(map, i);
+	return n;
+}
+
+static void fix_links(struct fsck_ctx *c, uint64_t ino, uint32_t links)
+{
+	struct basefs_inode di;
+
+	if (!c->repair)
+		return;
+	if (bfs_read_inode(&c->img, ino, &di) == 0) {
+		di.links_count = htole16((uint16_t)links);
+		bfs_write_inode(&c->img, ino, &di);
+	}
+}
+
+static void verify_group(struct fsck_ctx *c, uint32_t g)
+{
+	struct bfs_image *img = &c->img;
+	struct basefs_group_desc *gd = &img->gdt[g];
+	uint8_t *bbitmap = c->block_bitmaps + (uint64_t)g * img->block_size;
+	uint8_t *ibitmap = c->inode_bitmaps + (uint64_t)g * img->block_size;
+	uint64_t start = bfs_group_start(img, g);
+	uint32_t len = bfs_group_len(img, g);
+	uint32_t overhead = group_overhead(img);
+	uint32_t i, used, want, bad_blocks = 0, bad_inodes = 0;
+	uint32_t free_blocks, free_inodes = 0, dirs = 0;
+	uint64_t ino, expect_links;
+	uint8_t state;
+	int bbitmap_dirty = 0, ibitmap_dirty = 0;
+
+	/* Block bitmap: metadata, claimed data, and the tail past the end. */
+	for (i = 0; i < img->blocks_per_group; i++) {
+		want = i < overhead || i >= len ||
+		       bfs_test_bit(c->claimed, start + i);
+		if (want == (uint32_t)bfs_test_bit(bbitmap, i))
+			continue;
+		bad_blocks++;
+		if (want)
+			bfs_set_bit(bbitmap, i);
+		else
+			bfs_clear_bit(bbitmap, i);
+		bbitmap_dirty = 1;
+	}
+	if (bad_blocks)
+		fsck_report(c, 1, "Group %u: %u block bitmap differences",
+			    g, bad_blocks);
+	used = popcount_range(bbitmap, len);
+	free_blocks = len - used;
+
+	for (i = 0; i < img->block_size * 8; i++) {
+		ino = (uint64_t)g * img->inodes_per_group + i + 1;
+		want = i >= img->inodes_per_group ||
+		       (c->inode_state[ino - 1] & FSCK_INODE_USED);
+		if (want != (uint32_t)bfs_test_bit(ibitmap, i)) {
+			bad_inodes++;
+			if (want)
+				bfs_set_bit(ibitmap, i);
+			else
+				bfs_clear_bit(ibitmap, i);
+			ibitmap_dirty = 1;
+		}
+		if (i >= img->inodes_per_group)
+			continue;
+
+		state = c->inode_state[ino - 1];
+		if (!(state & FSCK_INODE_USED)) {
+			free_inodes++;
+			if (c->refs[ino - 1])
+				fsck_report(c, 0, "Inode %llu is free but named by %u directory entries",
+					    (unsigned long long)ino,
+					    c->refs[ino - 1]);
+			continue;
+		}
+
+		if (state & FSCK_INODE_DIR) {
+			dirs++;
+			expect_links = 2 + c->subdirs[ino - 1];
+			if (ino != BASEFS_ROOT_INO && c->refs[ino - 1] != 1)
+				fsck_report(c, 0, "Directory %llu is named by %u entries",
+					    (unsigned long long)ino,
+					    c->refs[ino - 1]);
+		} else {
+			expect_links = c->refs[ino - 1];
+		}
+		if (!c->refs[ino - 1] && ino != BASEFS_ROOT_INO) {
+			fsck_report(c, 0, "Inode %llu is in use but not in any directory",
+				    (unsigned long long)ino);
+			continue;
+		}
+		if (c->links[ino - 1] != expect_links) {
+			fsck_report(c, 1, "Inode %llu link count %u, should be %llu",
+				    (unsigned long long)ino, c->links[ino - 1],
+				    (unsigned long long)expect_links);
+			fix_links(c, ino, (uint32_t)expect_links);
+		}
+	}
+	if (bad_inodes)
+		fsck_report(c, 1, "Group %u: %u inode bitmap differences",
+			    g, bad_inodes);
+
+	if (le32toh(gd->free_blocks_count) != free_blocks ||
+	    le32toh(gd->free_inodes_count) != free_inodes ||
+	    le32toh(gd->used_dirs_count) != dirs) {
+		fsck_report(c, 1, "Group %u: counts %u/%u/%u (free blocks/free inodes/dirs), should be %u/%u/%u",
+			    g, le32toh(gd->free_blocks_count),
+			    le32toh(gd->free_inodes_count),
+			    le32toh(gd->used_dirs_count),
+			    free_blocks, free_inodes, dirs);
+		gd->free_blocks_count = htole32(free_blocks);
+		gd->free_inodes_count = htole32(free_inodes);
+		gd->used_dirs_count = htole32(dirs);
+	}
+
+	if (c->repair && bbitmap_dirty)
+		bfs_write_blocks(img, le64toh(gd->block_bitmap), 1, bbitmap);
+	if (c->repair && ibitmap_dirty)
+		bfs_write_blocks(img, le64toh(gd->inode_bitmap), 1, ibitmap);
+}
+
+static void *verify_worker(void *arg)
+{
+	struct fsck_ctx *c = arg;
+	uint32_t g;
+
+	for (;;) {
+		g = __atomic_fetch_add(&c->next_group, 1, __ATOMIC_RELAXED);
+		if (g >= c->img.groups_count)
+			break;
+		verify_group(c, g);
+	}
+	return NULL;
+}
+
+static int run_threads(struct fsck_ctx *c, void *(*fn)(void *))
+{
+	pthread_t *tids = xcalloc(c->nr_threads, sizeof(*tids));
+	unsigned int i, started = 0;
+
+	c->next_group = 0;
+	for (i = 0; i < c->nr_threads; i++) {
+		if (pthread_create(&tids[i], NULL, fn, c))
+			break;
+		started++;
+	}
+	if (!started)
+		fn(c);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	return 0;
+}
+
+static void check_totals(struct fsck_ctx *c)
+{
+	struct bfs_image *img = &c->img;
+	uint64_t free_blocks = 0, free_inodes = 0;
+	uint32_t g;
+
+	for (g = 0; g < img->groups_count; g++) {
+		free_blocks += le32toh(img->gdt[g].free_blocks_count);
+		free_inodes += le32toh(img->gdt[g].free_inodes_count);
+	}
+	if (le64toh(img->sb.free_blocks_count) != free_blocks ||
+	    le64toh(img->sb.free_inodes_count) != free_inodes) {
+		fsck_report(c, 1, "Superblock free counts %llu/%llu, should be %llu/%llu",
+			    (unsigned long long)le64toh(img->sb.free_blocks_count),
+			    (unsigned long long)le64toh(img->sb.free_inodes_count),
+			    (unsigned long long)free_blocks,
+			    (unsigned long long)free_inodes);
+		img->sb.free_blocks_count = htole64(free_blocks);
+		img->sb.free_inodes_count = htole64(free_inodes);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-y] [-j threads] <image-file>\n"
+		"  -y          repair bitmaps, free counts and link counts\n"
+		"  -j threads  worker threads (default: online CPUs)\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fsck_ctx c;
+	struct bfs_image *img = &c.img;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double start, elapsed;
+	int opt, ret;
+
+	memset(&c, 0, sizeof(c));
+	c.nr_threads = cpus > 0 ? (unsigned int)cpus : 1;
+	while ((opt = getopt(argc, argv, "yj:")) != -1) {
+		switch (opt) {
+		case 'y':
+			c.repair = 1;
+			break;
+		case 'j':
+			c.nr_threads = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return FSCK_EXIT_ERROR;
+		}
+	}
+	if (argc - optind != 1 || !c.nr_threads) {
+		usage(argv[0]);
+		return FSCK_EXIT_ERROR;
+	}
+
+	ret = bfs_open(img, argv[optind], c.repair);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return FSCK_EXIT_ERROR;
+	}
+	pthread_mutex_init(&c.lock, NULL);
+	if (c.nr_threads > img->groups_count)
+		c.nr_threads = img->groups_count;
+
+	start = now_sec();
+	printf("Pass 1: superblock and group descriptors\n");
+	if (check_super(&c) < 0) {
+		printf("Geometry is damaged, not checking further.\n");
+		bfs_close(img);
+		return FSCK_EXIT_UNCORRECTED;
+	}
+
+	c.claimed = xcalloc((img->blocks_count + 7) / 8, 1);
+	c.block_bitmaps = xcalloc(img->groups_count, img->block_size);
+	c.inode_bitmaps = xcalloc(img->groups_count, img->block_size);
+	c.inode_state = xcalloc(img->inodes_count, 1);
+	c.refs = xcalloc(img->inodes_count, sizeof(*c.refs));
+	c.subdirs = xcalloc(img->inodes_count, sizeof(*c.subdirs));
+	c.links = xcalloc(img->inodes_count, sizeof(*c.links));
+
+	printf("Pass 2: inode tables and directories (%u threads)\n",
+	       c.nr_threads);
+	run_threads(&c, scan_worker);
+	if (c.fatal) {
+		bfs_close(img);
+		return FSCK_EXIT_ERROR;
+	}
+	if (!(c.inode_state[BASEFS_ROOT_INO - 1] & FSCK_INODE_DIR))
+		fsck_report(&c, 0, "Root inode is not a directory");
+	check_xattr_blocks(&c);
+
+	printf("Pass 3: bitmaps, counts and link counts\n");
+	run_threads(&c, verify_worker);
+	check_totals(&c);
+
+	if (c.repair && c.fixed) {
+		if (bfs_write_gdt(img) || bfs_write_super(img) || fsync(img->fd)) {
+			fprintf(stderr, "%s: writing repairs failed\n", argv[optind]);
+			bfs_close(img);
+			return FSCK_EXIT_ERROR;
+		}
+	}
+	elapsed = now_sec() - start;
+
+	printf("%s: %llu/%llu inodes, %llu groups, %llu errors, %llu fixed\n",
+	       argv[optind], (unsigned long long)c.inodes_used,
+	       (unsigned long long)img->inodes_count,
+	       (unsigned long long)img->groups_count,
+	       (unsigned long long)c.errors, (unsigned long long)c.fixed);
+	printf("Scanned %.1f MiB of metadata in %.3f s (%.1f MiB/s, %.0f inodes/s)\n",
+	       c.bytes_read / 1048576.0, elapsed,
+	       elapsed > 0 ? c.bytes_read / 1048576.0 / elapsed : 0.0,
+	       elapsed > 0 ? c.inodes_used / elapsed : 0.0);
+
+	bfs_close(img);
+	if (c.errors)
+		return FSCK_EXIT_UNCORRECTED;
+	return c.fixed ? FSCK_EXIT_FIXED : FSCK_EXIT_OK;
+}
@@ -0,0 +1,314 @@
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include "basefs.h"
+
+/*
+ * Inline data.
+ *
+ * A regular file of at most basefs_inline_data_max() bytes can keep its
+ * data in its inode (BASEFS_INODE_INLINE_DATA): the first
+ * BASEFS_INODE_DATA_SIZE bytes in i_data, where the block map would be,
+ * and the rest in the tail of the on-disk inode past struct
+ * basefs_inode, which only the inode table block holds.  Opening and
+ * reading such a file costs no I/O beyond the inode table block, and it
+ * takes no block: with 128K blocks a 300 byte label file would otherwise
+ * cost a whole one.
+ *
+ * New regular files start out inline.  Their data is copied into folio
+ * 0 of the page cache when it is read, and written to the inode by
+ * write_end (or by writeback, for mmap writes), so the folio stays clean
+ * and the inode table block is logged like any other inode change.  A
+ * write or truncate past the limit moves the data to a delayed block
+ * first (basefs_convert_inline()); files never go back to being inline.
+ * While the tail holds xattrs (see xattr.c) the limit is i_data alone.
+ *
+ * The flag only changes with i_rwsem and folio 0 locked.  The data is
+ * changed with the inode table buffer and i_map_lock held, in that order
+ * as in __basefs_write_inode(), and read with i_map_lock held, except on
+ * an immutable mount, where nothing changes it.
+ */
+
+static inline void *basefs_inline_tail(struct basefs_inode *raw)
+{
+	return raw + 1;
+}
+
+/*
+ * basefs_inline_check - Sanity check an inline inode iget just read:
+ * only a regular file with no block map and no blocks can be one.
+ */
+int basefs_inline_check(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+
+	if (!(bi->i_flags & BASEFS_INODE_INLINE_DATA))
+		return 0;
+	if (S_ISREG(inode->i_mode) && !bi->i_nr_extents && !inode->i_blocks &&
+	    !(bi->i_flags & BASEFS_INODE_EXTENT_TREE) &&
+	    inode->i_size <= basefs_inline_max(inode))
+		return 0;
+	basefs_msg(inode->i_sb, KERN_ERR, "inode %lu has bad inline data (size %lld)",
+		   inode->i_ino, inode->i_size);
+	return -EFSCORRUPTED;
+}
+
+/*
+ * basefs_read_inline - Fill locked folio 'folio' from the inline data
+ * and mark it uptodate.  Only folio 0 has any data.
+ */
+int basefs_read_inline(struct inode *inode, struct folio *folio)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	/* Nothing changes the data of an immutable image: no lock needed. */
+	bool lock = !BASEFS_SB(inode->i_sb)->immutable;
+	struct basefs_inode *raw = NULL;
+	struct buffer_head *bh = NULL;
+	size_t size = 0, head;
+	void *kaddr;
+
+	if (folio->index)
+		goto zero;
+	if (basefs_inline_max(inode) > BASEFS_INODE_DATA_SIZE) {
+		raw = basefs_get_raw_inode(inode->i_sb, inode->i_ino, &bh);
+		if (IS_ERR(raw))
+			return PTR_ERR(raw);
+	}
+
+	kaddr = kmap_local_folio(folio, 0);
+	if (lock)
+		mutex_lock(&bi->i_map_lock);
+	size = min_t(loff_t, i_size_read(inode),
+		     basefs_inline_max(inode));
+	head = min_t(size_t, size, BASEFS_INODE_DATA_SIZE);
+	memcpy(kaddr, bi->i_data, head);
+	if (size > head)
+		memcpy(kaddr + head, basefs_inline_tail(raw), size - head);
+	if (lock)
+		mutex_unlock(&bi->i_map_lock);
+	kunmap_local(kaddr);
+	brelse(bh);
+zero:
+	folio_zero_segment(folio, size, folio_size(folio));
+	folio_mark_uptodate(folio);
+	return 0;
+}
+
+static void basefs_inline_copy(void *dst, const void *src, size_t len)
+{
+	if (src)
+		memcpy(dst, src, len);
+	else
+		memset(dst, 0, len);
+}
+
+/*
+ * Copy 'len' bytes from 'buf', or zeroes if it is NULL, to 'pos' in the
+ * inline data and log the inode table block.  Called inside a handle.
+ */
+static int basefs_inline_write(struct inode *inode, const char *buf,
+			       size_t pos, size_t len)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct basefs_inode *raw;
+	struct buffer_head *bh;
+	size_t head = 0;
+
+	raw = basefs_get_raw_inode(sb, inode->i_ino, &bh);
+	if (IS_ERR(raw))
+		return PTR_ERR(raw);
+
+	lock_buffer(bh);
+	mutex_lock(&bi->i_map_lock);
+	if (pos < BASEFS_INODE_DATA_SIZE) {
+		head = min_t(size_t, len, BASEFS_INODE_DATA_SIZE - pos);
+		basefs_inline_copy(bi->i_data + pos, buf, head);
+		memcpy(raw->data + pos, bi->i_data + pos, head);
+	}
+	if (len > head)
+		basefs_inline_copy(basefs_inline_tail(raw) +
+				   (pos + head - BASEFS_INODE_DATA_SIZE),
+				   buf ? buf + head : NULL, len - head);
+	mutex_unlock(&bi->i_map_lock);
+	unlock_buffer(bh);
+
+	basefs_journal_dirty(sb, bh, inode);
+	brelse(bh);
+	return 0;
+}
+
+/* write_begin of a write that stays inline: folio 0, uptodate. */
+int basefs_write_inline_begin(struct inode *inode, struct page **pagep)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct folio *folio;
+	int ret;
+
+	folio = __filemap_get_folio(mapping, 0, FGP_WRITEBEGIN,
+				    mapping_gfp_mask(mapping));
+	if (IS_ERR(folio))
+		return PTR_ERR(folio);
+	if (!folio_test_uptodate(folio)) {
+		ret = basefs_read_inline(inode, folio);
+		if (ret) {
+			folio_unlock(folio);
+			folio_put(folio);
+			return ret;
+		}
+	}
+	*pagep = &folio->page;
+	return 0;
+}
+
+/* write_end of such a write: the copied bytes go to the inode. */
+int basefs_write_inline_end(struct inode *inode, loff_t pos,
+			    unsigned int copied, struct folio *folio)
+{
+	struct super_block *sb = inode->i_sb;
+	struct basefs_handle h;
+	void *kaddr;
+	int ret = 0;
+
+	basefs_journal_start(sb, &h);
+	if (copied) {
+		kaddr = kmap_local_folio(folio, 0);
+		ret = basefs_inline_write(inode, kaddr + pos, pos, copied);
+		kunmap_local(kaddr);
+		if (!ret)
+			basefs_set_incompat(sb, BASEFS_FEATURE_INCOMPAT_INLINE_DATA);
+	}
+	if (!ret && pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+	folio_unlock(folio);
+	folio_put(folio);
+	if (!ret)
+		mark_inode_dirty(inode);
+	basefs_journal_stop(sb, &h);
+	return ret ? ret : copied;
+}
+
+/*
+ * basefs_write_inline_folio - Writeback of a folio of an inline file,
+ * dirtied through mmap: copy it to the inode.  mmap cannot grow the
+ * file, so the data still fits.
+ */
+int basefs_write_inline_folio(struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	loff_t size = i_size_read(inode);
+	struct basefs_handle h;
+	void *kaddr;
+	int ret = 0;
+
+	if (!folio->index && size) {
+		basefs_journal_start(inode->i_sb, &h);
+		kaddr = kmap_local_folio(folio, 0);
+		ret = basefs_inline_write(inode, kaddr, 0, size);
+		kunmap_local(kaddr);
+		basefs_journal_stop(inode->i_sb, &h);
+	}
+	folio_start_writeback(folio);
+	folio_unlock(folio);
+	folio_end_writeback(folio);
+	return ret;
+}
+
+/*
+ * basefs_convert_inline - Move the data of an inline file to a delayed
+ * block, ahead of a write or truncate that does not fit in the inode.
+ * Called with i_rwsem held.  Space for the block is reserved before the
+ * inode changes, so a full file system leaves the file as it was.
+ */
+int basefs_convert_inline(struct inode *inode)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	loff_t size = i_size_read(inode);
+	struct basefs_handle h;
+	struct folio *folio;
+	int ret = 0;
+
+	folio = __filemap_get_folio(mapping, 0, FGP_WRITEBEGIN,
+				    mapping_gfp_mask(mapping));
+	if (IS_ERR(folio))
+		return PTR_ERR(folio);
+	if (!basefs_has_inline_data(inode))
+		goto out;
+	if (!folio_test_uptodate(folio)) {
+		ret = basefs_read_inline(inode, folio);
+		if (ret)
+			goto out;
+	}
+	/* Still inline: the block map reads as a hole, so this reserves. */
+	if (size) {
+		ret = __block_write_begin(&folio->page, 0, size,
+					  basefs_da_get_block_prep);
+		if (ret)
+			goto out;
+	}
+
+	basefs_journal_start(sb, &h);
+	ret = basefs_inline_write(inode, NULL, 0, basefs_inline_max(inode));
+	if (!ret) {
+		mutex_lock(&bi->i_map_lock);
+		bi->i_flags &= ~BASEFS_INODE_INLINE_DATA;
+		mutex_unlock(&bi->i_map_lock);
+		mark_inode_dirty(inode);
+	}
+	basefs_journal_stop(sb, &h);
+	if (!ret && size)
+		block_commit_write(&folio->page, 0, size);
+out:
+	folio_unlock(folio);
+	folio_put(folio);
+	return ret;
+}
+
+/*
+ * basefs_truncate_inline - Zero the inline data from 'size' on, so a
+ * later extension reads zeroes.
+ */
+void basefs_truncate_inline(struct inode *inode, loff_t size)
+{
+	u32 max = basefs_inline_max(inode);
+	struct basefs_handle h;
+
+	basefs_journal_start(inode->i_sb, &h);
+	if (size < max && basefs_inline_write(inode, NULL, size, max - size))
+		basefs_msg(inode->i_sb, KERN_ERR, "inode %lu: cannot truncate inline data",
+			   inode->i_ino);
+	inode->i_mtime = inode_set_ctime_current(inode);
+	mark_inode_dirty(inode);
+	basefs_journal_stop(inode->i_sb, &h);
+}
+
+/*
+ * basefs_inline_fill - Give a new inode, not linked yet, its size and
+ * its first 'len' bytes of data (BASEFS_IOC_CREATE_BATCH).  Data only
+ * goes in the inode; a file too large for it stops being inline and is
+ * a hole.  Called inside a handle.
+ */
+int basefs_inline_fill(struct inode *inode, const char *buf, size_t len,
+		       loff_t size)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	int ret;
+
+	if (size > basefs_inline_max(inode)) {
+		if (len)
+			return -EINVAL;
+		mutex_lock(&bi->i_map_lock);
+		bi->i_flags &= ~BASEFS_INODE_INLINE_DATA;
+		mutex_unlock(&bi->i_map_lock);
+	} else if (len) {
+		ret = basefs_inline_write(inode, buf, 0, len);
+		if (ret)
+			return ret;
+		basefs_set_incompat(inode->i_sb,
+				    BASEFS_FEATURE_INCOMPAT_INLINE_DATA);
+	}
+	i_size_write(inode, size);
+	mark_inode_dirty(inode);
+	return 0;
+}
@@ -0,0 +1,984 @@
+#include <linux/random.h>
+#include <linux/namei.h>
+#include <linux/pagemap.h>
+#include <linux/mount.h>
+#include <linux/security.h>
+#include <linux/fsnotify.h>
+#include <linux/uaccess.h>
+#include "basefs.h"
+
+/*
+ * basefs_inode_block - Inode table block holding inode 'ino', and in
+ * *offset the inode's byte offset in it.  0 if there is no such inode.
+ */
+u64 basefs_inode_block(struct super_block *sb, unsigned long ino,
+		       unsigned int *offset)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_group_desc *gd;
+	u64 pos;
+
+	if (ino < 1 || ino > sbi->inodes_count)
+		return 0;
+	gd = basefs_get_group_desc(sb, (ino - 1) / sbi->inodes_per_group, NULL);
+	if (!gd)
+		return 0;
+	pos = (u64)((ino - 1) % sbi->inodes_per_group) * sbi->inode_size;
+	*offset = pos & (sb->s_blocksize - 1);
+	return le64_to_cpu(gd->inode_table) + (pos >> sb->s_blocksize_bits);
+}
+
+/*
+ * basefs_get_raw_inode - Locate on-disk inode 'ino'.  Returns a pointer
+ * into *bhp, which the caller must brelse().
+ */
+struct basefs_inode *basefs_get_raw_inode(struct super_block *sb,
+					  unsigned long ino,
+					  struct buffer_head **bhp)
+{
+	struct buffer_head *bh;
+	unsigned int offset;
+	u64 blk;
+
+	blk = basefs_inode_block(sb, ino, &offset);
+	if (!blk) {
+		basefs_msg(sb, KERN_ERR, "bad inode number %lu", ino);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	bh = sb_bread(sb, blk);
+	if (!bh) {
+		basefs_msg(sb, KERN_ERR, "cannot read inode table block of inode %lu",
+			   ino);
+		return ERR_PTR(-EIO);
+	}
+	*bhp = bh;
+	return (struct basefs_inode *)(bh->b_data + offset);
+}
+
+/* Short symlink targets live in the inode instead of a data block. */
+static bool basefs_inline_symlink(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+
+	return S_ISLNK(inode->i_mode) && !bi->i_nr_extents &&
+	       !(bi->i_flags & BASEFS_INODE_EXTENT_TREE) &&
+	       inode->i_size < BASEFS_INODE_DATA_SIZE;
+}
+
+static void basefs_set_inode_ops(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+
+	if (S_ISREG(inode->i_mode)) {
+		inode->i_op = &basefs_inode_ops;
+		inode->i_fop = &basefs_file_ops;
+		inode->i_mapping->a_ops = &basefs_aops;
+	} else if (S_ISDIR(inode->i_mode)) {
+		inode->i_op = &basefs_dir_inode_ops;
+		inode->i_fop = &basefs_dir_ops;
+	} else if (S_ISLNK(inode->i_mode)) {
+		if (basefs_inline_symlink(inode)) {
+			inode->i_op = &basefs_fast_symlink_inode_ops;
+			inode->i_link = (char *)bi->i_data;
+			nd_terminate_link(bi->i_data, inode->i_size,
+					  sizeof(bi->i_data) - 1);
+		} else {
+			inode->i_op = &basefs_symlink_inode_ops;
+			inode_nohighmem(inode);
+			inode->i_mapping->a_ops = &basefs_aops;
+		}
+	} else {
+		/* No device numbers on disk; makefs skips special files. */
+		init_special_inode(inode, inode->i_mode, 0);
+	}
+}
+
+/*
+ * basefs_iget - Get the in-memory inode for 'ino', reading it from the
+ * inode table the first time.
+ */
+struct inode *basefs_iget(struct super_block *sb, unsigned long ino)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_inode_info *bi;
+	struct basefs_inode *raw;
+	struct buffer_head *bh;
+	struct inode *inode;
+	int ret;
+
+	inode = iget_locked(sb, ino);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	bi = BASEFS_I(inode);
+	/* Nothing in a table block never written is in use. */
+	if (!basefs_itable_ready(sb, ino)) {
+		ret = -ESTALE;
+		goto bad_inode;
+	}
+	raw = basefs_get_raw_inode(sb, ino, &bh);
+	if (IS_ERR(raw)) {
+		ret = PTR_ERR(raw);
+		goto bad_inode;
+	}
+
+	inode->i_mode = le16_to_cpu(raw->mode);
+	i_uid_write(inode, le32_to_cpu(raw->uid));
+	i_gid_write(inode, le32_to_cpu(raw->gid));
+	set_nlink(inode, le16_to_cpu(raw->links_count));
+	if (!inode->i_nlink || !inode->i_mode) {
+		brelse(bh);
+		ret = -ESTALE;
+		goto bad_inode;
+	}
+	inode->i_size = le64_to_cpu(raw->size);
+	inode->i_atime.tv_sec = le64_to_cpu(raw->atime);
+	inode->i_atime.tv_nsec = 0;
+	inode->i_mtime.tv_sec = le64_to_cpu(raw->mtime);
+	inode->i_mtime.tv_nsec = 0;
+	inode_set_ctime(inode, le64_to_cpu(raw->ctime), 0);
+	inode->i_blocks = le64_to_cpu(raw->blocks) <<
+			  (sb->s_blocksize_bits - 9);
+	inode->i_generation = le32_to_cpu(raw->generation);
+
+	bi->i_flags = le32_to_cpu(raw->flags);
+	bi->i_nr_extents = le16_to_cpu(raw->nr_extents);
+	memcpy(bi->i_data, raw->data, sizeof(bi->i_data));
+	bi->i_xattr_block = le64_to_cpu(raw->xattr_block);
+	bi->i_block_group = (ino - 1) / sbi->inodes_per_group;
+	brelse(bh);
+
+	ret = basefs_ext_check(inode);
+	if (!ret)
+		ret = basefs_inline_check(inode);
+	if (ret)
+		goto bad_inode;
+
+	basefs_set_inode_ops(inode);
+	unlock_new_inode(inode);
+	return inode;
+
+bad_inode:
+	iget_failed(inode);
+	return ERR_PTR(ret);
+}
+
+static int __basefs_write_inode(struct inode *inode, bool do_sync)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct basefs_inode *raw;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	raw = basefs_get_raw_inode(sb, inode->i_ino, &bh);
+	if (IS_ERR(raw))
+		return PTR_ERR(raw);
+
+	lock_buffer(bh);
+	raw->mode = cpu_to_le16(inode->i_mode);
+	raw->links_count = cpu_to_le16(inode->i_nlink);
+	raw->uid = cpu_to_le32(i_uid_read(inode));
+	raw->gid = cpu_to_le32(i_gid_read(inode));
+	raw->size = cpu_to_le64(inode->i_size);
+	raw->atime = cpu_to_le64(inode->i_atime.tv_sec);
+	raw->mtime = cpu_to_le64(inode->i_mtime.tv_sec);
+	raw->ctime = cpu_to_le64(inode_get_ctime(inode).tv_sec);
+	raw->generation = cpu_to_le32(inode->i_generation);
+
+	mutex_lock(&bi->i_map_lock);
+	raw->flags = cpu_to_le32(bi->i_flags);
+	raw->blocks = cpu_to_le64(inode->i_blocks >>
+				  (sb->s_blocksize_bits - 9));
+	raw->nr_extents = cpu_to_le16(bi->i_nr_extents);
+	memcpy(raw->data, bi->i_data, sizeof(raw->data));
+	raw->xattr_block = cpu_to_le64(bi->i_xattr_block);
+	mutex_unlock(&bi->i_map_lock);
+	unlock_buffer(bh);
+
+	basefs_journal_dirty(sb, bh, inode);
+	if (do_sync) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh)) {
+			basefs_msg(sb, KERN_ERR, "I/O error syncing inode %lu",
+				   inode->i_ino);
+			ret = -EIO;
+		}
+	}
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * With a journal, basefs_dirty_inode() logs every change as it is made
+ * and writeback has nothing left to copy; a synchronous write only has
+ * to wait for the transaction that holds the inode.  sync(2) commits
+ * everything at once from ->sync_fs instead.
+ */
+int basefs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	if (!BASEFS_SB(inode->i_sb)->journal)
+		return __basefs_write_inode(inode,
+					    wbc->sync_mode == WB_SYNC_ALL);
+	if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync)
+		return 0;
+	return basefs_journal_force(inode->i_sb,
+				    READ_ONCE(BASEFS_I(inode)->i_sync_tid));
+}
+
+/*
+ * basefs_dirty_inode - Called by mark_inode_dirty().  With a journal the
+ * inode is copied to its inode table block and logged right away, in
+ * the same transaction as the change that dirtied it.  Must not be
+ * called with i_map_lock held.
+ */
+void basefs_dirty_inode(struct inode *inode, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct basefs_handle h;
+
+	if (!BASEFS_SB(sb)->journal || !(flags & I_DIRTY_INODE))
+		return;
+	basefs_journal_start(sb, &h);
+	__basefs_write_inode(inode, false);
+	basefs_journal_stop(sb, &h);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Inode allocation                                                            */
+
+/*
+ * Orlov placement of a new directory (orlov mount option).  A directory
+ * in the root is usually a dataset of its own, so it goes where there
+ * is the most room for one: to the group with the fewest directories
+ * among those with at least the average number of free inodes and free
+ * blocks, searched from a random group so that they spread.  Deeper
+ * directories stay in their parent's group, or the first one after it,
+ * that has not taken more than its share of directories and still has
+ * a quarter of the average free inodes and blocks; failing that they
+ * are placed like top-level ones.  Called with ialloc_lock held.
+ */
+static u32 basefs_orlov_group(struct super_block *sb, struct inode *dir)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 ngroups = sbi->groups_count, parent = BASEFS_I(dir)->i_block_group;
+	u32 group, best = parent, best_dirs = U32_MAX, max_dirs, i;
+	u64 avg_inodes, avg_blocks, ndirs = 0;
+	struct basefs_group_desc *gd;
+	u32 inodes, dirs;
+	u64 blocks;
+
+	for (group = 0; group < ngroups; group++) {
+		gd = basefs_get_group_desc(sb, group, NULL);
+		ndirs += le32_to_cpu(gd->used_dirs_count);
+	}
+	avg_inodes = div_u64(percpu_counter_read_positive(&sbi->free_inodes),
+			     ngroups);
+	avg_blocks = div_u64(percpu_counter_read_positive(&sbi->free_blocks),
+			     ngroups);
+
+	if (dir != d_inode(sb->s_root)) {
+		max_dirs = div_u64(ndirs, ngroups) + sbi->inodes_per_group / 16;
+		for (i = 0, group = parent; i < ngroups; i++) {
+			gd = basefs_get_group_desc(sb, group, NULL);
+			inodes = le32_to_cpu(gd->free_inodes_count);
+			blocks = le32_to_cpu(gd->free_blocks_count);
+			dirs = le32_to_cpu(gd->used_dirs_count);
+			if (inodes && inodes >= avg_inodes / 4 &&
+			    blocks >= avg_blocks / 4 && dirs < max_dirs)
+				return group;
+			if (++group == ngroups)
+				group = 0;
+		}
+	}
+
+	group = get_random_u32_below(ngroups);
+	for (i = 0; i < ngroups; i++) {
+		gd = basefs_get_group_desc(sb, group, NULL);
+		inodes = le32_to_cpu(gd->free_inodes_count);
+		blocks = le32_to_cpu(gd->free_blocks_count);
+		dirs = le32_to_cpu(gd->used_dirs_count);
+		if (inodes && inodes >= avg_inodes && blocks >= avg_blocks &&
+		    dirs < best_dirs) {
+			best = group;
+			best_dirs = dirs;
+		}
+		if (++group == ngroups)
+			group = 0;
+	}
+	return best;
+}
+
+/*
+ * basefs_new_inode - Allocate an inode number and set up a new in-core
+ * inode for it.  The search starts in the parent's group so a
+ * directory's files stay close to it.  With the orlov mount option new
+ * directories are spread out instead (basefs_orlov_group()), and an
+ * inode in its parent's group takes the first free one after the
+ * parent's, not the first in the group: the files of a directory then
+ * fill one run of the inode table, and stat'ing them in readdir order
+ * reads it front to back.  Returns a locked I_NEW inode.
+ */
+struct inode *basefs_new_inode(struct inode *dir, umode_t mode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_inode_info *bi;
+	struct basefs_group_desc *gd = NULL;
+	struct buffer_head *gd_bh = NULL, *bh = NULL;
+	struct inode *inode;
+	unsigned long bit = 0, goal;
+	u32 group, i;
+	int err;
+
+	inode = new_inode(sb);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	bi = BASEFS_I(inode);
+
+	mutex_lock(&sbi->ialloc_lock);
+	group = BASEFS_I(dir)->i_block_group;
+	if (sbi->orlov && S_ISDIR(mode))
+		group = basefs_orlov_group(sb, dir);
+	for (i = 0; i < sbi->groups_count; i++) {
+		gd = basefs_get_group_desc(sb, group, &gd_bh);
+		if (le32_to_cpu(gd->free_inodes_count)) {
+			bh = sb_bread(sb, le64_to_cpu(gd->inode_bitmap));
+			if (!bh) {
+				err = -EIO;
+				goto fail_unlock;
+			}
+			goal = 0;
+			if (sbi->orlov && group == BASEFS_I(dir)->i_block_group)
+				goal = (dir->i_ino - 1) % sbi->inodes_per_group;
+			bit = find_next_zero_bit_le(bh->b_data,
+						    sbi->inodes_per_group, goal);
+			if (bit >= sbi->inodes_per_group)
+				bit = find_first_zero_bit_le(bh->b_data,
+							     sbi->inodes_per_group);
+			if (bit < sbi->inodes_per_group)
+				break;
+			basefs_msg(sb, KERN_ERR, "group %u: free inode count %u but bitmap full",
+				   group, le32_to_cpu(gd->free_inodes_count));
+			brelse(bh);
+			bh = NULL;
+		}
+		if (++group == sbi->groups_count)
+			group = 0;
+	}
+	if (!bh) {
+		err = -ENOSPC;
+		goto fail_unlock;
+	}
+	err = basefs_itable_init_upto(sb, group,
+				      ((u64)bit * sbi->inode_size >>
+				       sb->s_blocksize_bits) + 1);
+	if (err) {
+		brelse(bh);
+		goto fail_unlock;
+	}
+
+	__set_bit_le(bit, bh->b_data);
+	basefs_journal_dirty(sb, bh, NULL);
+	brelse(bh);
+	le32_add_cpu(&gd->free_inodes_count, -1);
+	if (S_ISDIR(mode))
+		le32_add_cpu(&gd->used_dirs_count, 1);
+	basefs_journal_dirty(sb, gd_bh, NULL);
+	mutex_unlock(&sbi->ialloc_lock);
+	percpu_counter_dec(&sbi->free_inodes);
+	basefs_mark_sb_dirty(sb);
+
+	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
+	inode->i_ino = (unsigned long)group * sbi->inodes_per_group + bit + 1;
+	inode->i_blocks = 0;
+	inode->i_mtime = inode->i_atime = inode_set_ctime_current(inode);
+	inode->i_generation = get_random_u32();
+	/* Regular files start inline, until they outgrow the inode. */
+	bi->i_flags = S_ISREG(mode) ? BASEFS_INODE_INLINE_DATA : 0;
+	bi->i_nr_extents = 0;
+	memset(bi->i_data, 0, sizeof(bi->i_data));
+	bi->i_xattr_block = 0;
+	bi->i_block_group = group;
+
+	if (insert_inode_locked(inode) < 0) {
+		basefs_msg(sb, KERN_ERR, "inode number %lu is already in use",
+			   inode->i_ino);
+		err = -EIO;
+		goto fail;
+	}
+	mark_inode_dirty(inode);
+	return inode;
+
+fail_unlock:
+	mutex_unlock(&sbi->ialloc_lock);
+fail:
+	make_bad_inode(inode);
+	iput(inode);
+	return ERR_PTR(err);
+}
+
+/*
+ * basefs_release_inode - Clear the on-disk inode and give its number
+ * back.  Called when the last link and the last user are gone.
+ */
+static void basefs_release_inode(struct super_block *sb, unsigned long ino,
+				 bool is_dir)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 group = (ino - 1) / sbi->inodes_per_group;
+	u32 bit = (ino - 1) % sbi->inodes_per_group;
+	struct basefs_group_desc *gd;
+	struct buffer_head *gd_bh, *bh;
+	struct basefs_inode *raw;
+
+	raw = basefs_get_raw_inode(sb, ino, &bh);
+	if (!IS_ERR(raw)) {
+		lock_buffer(bh);
+		memset(raw, 0, sbi->inode_size);
+		unlock_buffer(bh);
+		basefs_journal_dirty(sb, bh, NULL);
+		brelse(bh);
+	}
+
+	mutex_lock(&sbi->ialloc_lock);
+	gd = basefs_get_group_desc(sb, group, &gd_bh);
+	bh = sb_bread(sb, le64_to_cpu(gd->inode_bitmap));
+	if (!bh) {
+		basefs_msg(sb, KERN_ERR, "cannot read inode bitmap, inode %lu leaked",
+			   ino);
+		goto out;
+	}
+	if (!__test_and_clear_bit_le(bit, bh->b_data)) {
+		basefs_msg(sb, KERN_ERR, "inode %lu was already free", ino);
+	} else {
+		le32_add_cpu(&gd->free_inodes_count, 1);
+		if (is_dir)
+			le32_add_cpu(&gd->used_dirs_count, -1);
+		basefs_journal_dirty(sb, gd_bh, NULL);
+		percpu_counter_inc(&sbi->free_inodes);
+		basefs_mark_sb_dirty(sb);
+	}
+	basefs_journal_dirty(sb, bh, NULL);
+	brelse(bh);
+out:
+	mutex_unlock(&sbi->ialloc_lock);
+}
+
+void basefs_evict_inode(struct inode *inode)
+{
+	bool want_delete = !inode->i_nlink && !is_bad_inode(inode);
+	bool is_dir = S_ISDIR(inode->i_mode);
+	struct super_block *sb = inode->i_sb;
+	struct basefs_handle h;
+
+	/*
+	 * A large file is freed over several transactions, before the one
+	 * that frees the inode: a crash in between leaves an unlinked inode
+	 * holding what is left of it.
+	 */
+	truncate_inode_pages_final(&inode->i_data);
+	if (want_delete) {
+		inode->i_size = 0;
+		if (!basefs_inline_symlink(inode) &&
+		    !basefs_has_inline_data(inode))
+			basefs_truncate_blocks(inode, 0);
+	} else if (S_ISREG(inode->i_mode) && !BASEFS_SB(sb)->immutable) {
+		basefs_discard_prealloc(inode);
+	}
+	if (is_dir)
+		basefs_dir_drop_index(inode);
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+	if (want_delete) {
+		basefs_journal_start(sb, &h);
+		basefs_xattr_delete_inode(inode);
+		basefs_release_inode(sb, inode->i_ino, is_dir);
+		basefs_journal_stop(sb, &h);
+	}
+}
+
+int basefs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+		   struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	bool truncate = false;
+	struct basefs_handle h;
+	int err;
+
+	err = setattr_prepare(idmap, dentry, attr);
+	if (err)
+		return err;
+
+	if ((attr->ia_valid & ATTR_SIZE) &&
+	    attr->ia_size != i_size_read(inode)) {
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (basefs_has_inline_data(inode)) {
+			if (attr->ia_size > basefs_inline_max(inode)) {
+				err = basefs_convert_inline(inode);
+				if (err)
+					return err;
+			}
+		} else if (attr->ia_size < inode->i_size) {
+			err = block_truncate_page(inode->i_mapping,
+						  attr->ia_size,
+						  basefs_get_block);
+			if (err)
+				return err;
+		}
+		truncate_setsize(inode, attr->ia_size);
+		truncate = true;
+	}
+
+	/*
+	 * The page cache is done with.  The blocks are freed in
+	 * transactions of their own, the attributes change in one more.
+	 */
+	if (truncate)
+		basefs_truncate_blocks(inode, attr->ia_size);
+	basefs_journal_start(inode->i_sb, &h);
+	setattr_copy(idmap, inode, attr);
+	mark_inode_dirty(inode);
+	return basefs_journal_stop(inode->i_sb, &h);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Namespace operations                                                        */
+
+static struct dentry *basefs_lookup(struct inode *dir, struct dentry *dentry,
+				    unsigned int flags)
+{
+	struct inode *inode = NULL;
+	ino_t ino;
+	int err;
+
+	if (dentry->d_name.len > BASEFS_NAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	/* A missing name leaves a negative dentry: d_splice_alias(NULL). */
+	err = basefs_inode_by_name(dir, &dentry->d_name, &ino);
+	if (err && err != -ENOENT)
+		return ERR_PTR(err);
+	if (!err) {
+		inode = basefs_iget(dir->i_sb, ino);
+		if (inode == ERR_PTR(-ESTALE)) {
+			basefs_msg(dir->i_sb, KERN_ERR,
+				   "directory %lu names deleted inode %lu",
+				   dir->i_ino, (unsigned long)ino);
+			return ERR_PTR(-EFSCORRUPTED);
+		}
+	}
+	return d_splice_alias(inode, dentry);
+}
+
+static int basefs_add_nondir(struct dentry *dentry, struct inode *inode)
+{
+	int err = basefs_add_link(dentry, inode);
+
+	if (!err) {
+		d_instantiate_new(dentry, inode);
+		return 0;
+	}
+	inode_dec_link_count(inode);
+	discard_new_inode(inode);
+	return err;
+}
+
+/*
+ * Each operation below is one handle, so the directory entry, the
+ * inode and the bitmaps it touches reach the disk together or not at
+ * all.
+ */
+static int basefs_create(struct mnt_idmap *idmap, struct inode *dir,
+			 struct dentry *dentry, umode_t mode, bool excl)
+{
+	struct basefs_handle h;
+	struct inode *inode;
+	int err, ret;
+
+	basefs_journal_start(dir->i_sb, &h);
+	inode = basefs_new_inode(dir, mode);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto out;
+	}
+	basefs_set_inode_ops(inode);
+	mark_inode_dirty(inode);
+	err = basefs_add_nondir(dentry, inode);
+out:
+	ret = basefs_journal_stop(dir->i_sb, &h);
+	return err ? err : ret;
+}
+
+/*
+ * One file of a BASEFS_IOC_CREATE_BATCH, as basefs_create() but with
+ * its size and data set before the entry makes it visible.
+ */
+static int basefs_create_one(struct inode *dir, struct dentry *dentry,
+			     umode_t mode, const struct basefs_create_rec *rec)
+{
+	struct inode *inode;
+	int err;
+
+	err = security_inode_create(dir, dentry, mode);
+	if (err)
+		return err;
+	inode = basefs_new_inode(dir, mode);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	basefs_set_inode_ops(inode);
+	err = basefs_inline_fill(inode, rec->name + rec->name_len,
+				 rec->data_len, rec->size);
+	if (err) {
+		inode_dec_link_count(inode);
+		discard_new_inode(inode);
+		return err;
+	}
+	err = basefs_add_nondir(dentry, inode);
+	if (!err)
+		fsnotify_create(dir, dentry);
+	return err;
+}
+
+/*
+ * basefs_create_batch - BASEFS_IOC_CREATE_BATCH (see basefs_ioctl.h).
+ * Writing a dataset of small files costs an open(O_CREAT), a write and
+ * a close per file, each a system call and a path walk, and the create
+ * a handle of its own.  Here the records are copied in and back out at
+ * once, outside the handle, the directory is locked once and all the files share one outer handle,
+ * so they land in one transaction, which the call ends before it grows
+ * large enough to need committing (basefs_journal_full()).
+ */
+long basefs_create_batch(struct file *file, void __user *argp)
+{
+	struct inode *dir = file_inode(file);
+	struct mnt_idmap *idmap = file_mnt_idmap(file);
+	struct super_block *sb = dir->i_sb;
+	struct basefs_create_batch req;
+	struct basefs_create_rec *rec;
+	struct basefs_handle h;
+	struct dentry *dentry;
+	u32 i, pos = 0;
+	umode_t mode;
+	void *buf;
+	char __user *ubuf;
+	int err, ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (req.buf_len > BASEFS_CREATE_BATCH_MAX)
+		return -EINVAL;
+	ubuf = u64_to_user_ptr(req.buf);
+	buf = kvmalloc(req.buf_len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (copy_from_user(buf, ubuf, req.buf_len)) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+	ret = mnt_want_write_file(file);
+	if (ret)
+		goto out_free;
+	mode = S_IFREG | (req.mode & S_IALLUGO & ~current_umask());
+	req.created = 0;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	ret = inode_permission(idmap, dir, MAY_WRITE | MAY_EXEC);
+	if (!ret && IS_DEADDIR(dir))
+		ret = -ENOENT;
+	if (ret)
+		goto out_unlock;
+	/* As for open(O_CREAT): no setgid file in a group not ours. */
+	mode = mode_strip_sgid(idmap, dir, mode);
+	basefs_journal_start(sb, &h);
+	for (i = 0; i < req.nr; i++) {
+		/* A bad record fails the call that starts with it. */
+		rec = buf + pos;
+		if (req.buf_len - pos < sizeof(*rec) ||
+		    rec->rec_len % 8 || rec->rec_len > req.buf_len - pos ||
+		    rec->rec_len < sizeof(*rec) + rec->name_len +
+				   (u64)rec->data_len) {
+			if (!i)
+				ret = -EINVAL;
+			break;
+		}
+		rec->ino = 0;
+		if (!rec->name_len) {
+			err = -ENOENT;
+		} else if (rec->size > sb->s_maxbytes) {
+			err = -EFBIG;
+		} else if (rec->data_len > rec->size) {
+			err = -EINVAL;
+		} else {
+			dentry = lookup_one(idmap, rec->name, file->f_path.dentry,
+					    rec->name_len);
+			if (IS_ERR(dentry)) {
+				err = PTR_ERR(dentry);
+			} else {
+				err = -EEXIST;
+				if (d_is_negative(dentry))
+					err = basefs_create_one(dir, dentry, mode,
+								rec);
+				if (!err) {
+					rec->ino = d_inode(dentry)->i_ino;
+					req.created++;
+				}
+				dput(dentry);
+			}
+		}
+		rec->result = err;
+		pos += rec->rec_len;
+		if (basefs_journal_full(sb) || fatal_signal_pending(current)) {
+			i++;
+			break;
+		}
+		cond_resched();
+	}
+	err = basefs_journal_stop(sb, &h);
+	if (!ret)
+		ret = err;
+	req.nr = i;
+out_unlock:
+	inode_unlock(dir);
+	mnt_drop_write_file(file);
+	/*
+	 * Results go back only now: a fault on the user buffer must not
+	 * happen inside the handle, holding the transaction open.
+	 */
+	if (pos && copy_to_user(ubuf, buf, pos) && !ret)
+		ret = -EFAULT;
+out_free:
+	kvfree(buf);
+	if (!ret && copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
+	return ret;
+}
+
+static int basefs_symlink(struct mnt_idmap *idmap, struct inode *dir,
+			  struct dentry *dentry, const char *symname)
+{
+	struct super_block *sb = dir->i_sb;
+	unsigned int len = strlen(symname) + 1;
+	struct basefs_handle h;
+	struct inode *inode;
+	int err, ret;
+
+	if (len > sb->s_blocksize)
+		return -ENAMETOOLONG;
+
+	basefs_journal_start(sb, &h);
+	inode = basefs_new_inode(dir, S_IFLNK | S_IRWXUGO);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto out;
+	}
+
+	if (len > BASEFS_INODE_DATA_SIZE) {
+		inode->i_op = &basefs_symlink_inode_ops;
+		inode_nohighmem(inode);
+		inode->i_mapping->a_ops = &basefs_aops;
+		err = page_symlink(inode, symname, len);
+		if (err) {
+			inode_dec_link_count(inode);
+			discard_new_inode(inode);
+			goto out;
+		}
+	} else {
+		inode->i_op = &basefs_fast_symlink_inode_ops;
+		inode->i_link = (char *)BASEFS_I(inode)->i_data;
+		memcpy(inode->i_link, symname, len);
+		inode->i_size = len - 1;
+	}
+	mark_inode_dirty(inode);
+	err = basefs_add_nondir(dentry, inode);
+out:
+	ret = basefs_journal_stop(sb, &h);
+	return err ? err : ret;
+}
+
+static int basefs_link(struct dentry *old_dentry, struct inode *dir,
+		       struct dentry *dentry)
+{
+	struct inode *inode = d_inode(old_dentry);
+	struct basefs_handle h;
+	int err, ret;
+
+	basefs_journal_start(dir->i_sb, &h);
+	inode_set_ctime_current(inode);
+	inode_inc_link_count(inode);
+	ihold(inode);
+
+	err = basefs_add_link(dentry, inode);
+	if (!err) {
+		d_instantiate(dentry, inode);
+	} else {
+		inode_dec_link_count(inode);
+		iput(inode);
+	}
+	ret = basefs_journal_stop(dir->i_sb, &h);
+	return err ? err : ret;
+}
+
+static int basefs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct basefs_handle h;
+	int err, ret;
+
+	basefs_journal_start(dir->i_sb, &h);
+	err = basefs_delete_entry(dir, &dentry->d_name);
+	if (!err) {
+		inode_set_ctime_to_ts(inode, inode_get_ctime(dir));
+		inode_dec_link_count(inode);
+	}
+	ret = basefs_journal_stop(dir->i_sb, &h);
+	return err ? err : ret;
+}
+
+static int basefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
+			struct dentry *dentry, umode_t mode)
+{
+	struct basefs_handle h;
+	struct inode *inode;
+	int err, ret;
+
+	basefs_journal_start(dir->i_sb, &h);
+	inode_inc_link_count(dir);
+
+	inode = basefs_new_inode(dir, S_IFDIR | mode);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto out_dir;
+	}
+	basefs_set_inode_ops(inode);
+	inode_inc_link_count(inode);  /* "." */
+
+	err = basefs_add_link(dentry, inode);
+	if (err)
+		goto out_fail;
+
+	d_instantiate_new(dentry, inode);
+	goto out;
+
+out_fail:
+	inode_dec_link_count(inode);
+	inode_dec_link_count(inode);
+	discard_new_inode(inode);
+out_dir:
+	inode_dec_link_count(dir);
+out:
+	ret = basefs_journal_stop(dir->i_sb, &h);
+	return err ? err : ret;
+}
+
+static int basefs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct basefs_handle h;
+	int err, ret;
+
+	if (!basefs_empty_dir(inode))
+		return -ENOTEMPTY;
+
+	basefs_journal_start(dir->i_sb, &h);
+	err = basefs_unlink(dir, dentry);
+	if (!err) {
+		inode->i_size = 0;
+		inode_dec_link_count(inode);
+		inode_dec_link_count(dir);
+	}
+	ret = basefs_journal_stop(dir->i_sb, &h);
+	return err ? err : ret;
+}
+
+static int __basefs_rename(struct inode *old_dir, struct dentry *old_dentry,
+			   struct inode *new_dir, struct dentry *new_dentry)
+{
+	struct inode *old_inode = d_inode(old_dentry);
+	struct inode *new_inode = d_inode(new_dentry);
+	bool is_dir = S_ISDIR(old_inode->i_mode);
+	int err;
+
+	if (new_inode) {
+		if (is_dir && !basefs_empty_dir(new_inode))
+			return -ENOTEMPTY;
+		err = basefs_set_link(new_dir, &new_dentry->d_name, old_inode);
+		if (err)
+			return err;
+		inode_set_ctime_current(new_inode);
+		if (is_dir)
+			drop_nlink(new_inode);
+		inode_dec_link_count(new_inode);
+	} else {
+		if (is_dir && new_dir != old_dir &&
+		    new_dir->i_nlink >= BASEFS_LINK_MAX)
+			return -EMLINK;
+		err = basefs_add_link(new_dentry, old_inode);
+		if (err)
+			return err;
+		if (is_dir)
+			inode_inc_link_count(new_dir);
+	}
+
+	inode_set_ctime_current(old_inode);
+	mark_inode_dirty(old_inode);
+
+	err = basefs_delete_entry(old_dir, &old_dentry->d_name);
+	if (!err && is_dir)
+		inode_dec_link_count(old_dir);
+	return err;
+}
+
+static int basefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
+			 struct dentry *old_dentry, struct inode *new_dir,
+			 struct dentry *new_dentry, unsigned int flags)
+{
+	struct basefs_handle h;
+	int err, ret;
+
+	if (flags & ~RENAME_NOREPLACE)
+		return -EINVAL;
+
+	/* Both entries change in the same transaction. */
+	basefs_journal_start(old_dir->i_sb, &h);
+	err = __basefs_rename(old_dir, old_dentry, new_dir, new_dentry);
+	ret = basefs_journal_stop(old_dir->i_sb, &h);
+	return err ? err : ret;
+}
+
+const struct inode_operations basefs_dir_inode_ops = {
+	.lookup  = basefs_lookup,
+	.create  = basefs_create,
+	.link    = basefs_link,
+	.unlink  = basefs_unlink,
+	.symlink = basefs_symlink,
+	.mkdir   = basefs_mkdir,
+	.rmdir   = basefs_rmdir,
+	.rename  = basefs_rename,
+	.setattr = basefs_setattr,
+	.getattr = simple_getattr,
+	.listxattr = basefs_listxattr,
+};
+
+/* Regular files. */
+const struct inode_operations basefs_inode_ops = {
+	.setattr = basefs_setattr,
+	.getattr = simple_getattr,
+	.listxattr = basefs_listxattr,
+};
+
+/* Symlinks, with the target in i_data or in a block. */
+const struct inode_operations basefs_fast_symlink_inode_ops = {
+	.get_link  = simple_get_link,
+	.getattr   = simple_getattr,
+	.listxattr = basefs_listxattr,
+};
+
+const struct inode_operations basefs_symlink_inode_ops = {
+	.get_link  = page_get_link,
+	.getattr   = simple_getattr,
+	.listxattr = basefs_listxattr,
+};
@@ -0,0 +1,180 @@
+#include <linux/blkdev.h>
+#include "basefs.h"
+
+/*
+ * Lazy inode tables.
+ *
+ * The inode tables are most of the metadata of a large image: with the
+ * default layout a 10 TB image has about 160 GB of them, nearly all
+ * unused.  makefs writes only the blocks holding the inodes it creates
+ * and marks the rest of each table uninitialized (BASEFS_BG_ITABLE_UNINIT
+ * and itable_init in the group descriptor, see basefs_disk.h), so the
+ * image is made in the time it takes to write what is in it.
+ *
+ * The kernel writes the rest.  Allocating an inode past a group's
+ * itable_init zeroes the table up to it first, a BASEFS_ITABLE_CHUNK at
+ * least, and a background work zeroes the remaining tables one chunk
+ * at a time at the init_itable= rate (MB/s), which is low enough not to
+ * compete with the reads of a training job.  When no group is left it
+ * clears RO_COMPAT_LAZY_ITABLE.
+ *
+ * Zeroed blocks are written through the buffer cache, so later reads of
+ * the table find them, and waited for before the descriptor change is
+ * logged: the commit's cache flush makes them durable first, and a
+ * crash before it leaves them uninitialized, which is still correct.
+ * itable_init only grows, under ialloc_lock; iget reads it without.
+ */
+
+/* Blocks written and waited for at once. */
+#define BASEFS_ITABLE_BATCH     16
+
+/* Write zeroes over 'count' blocks from 'start' and wait for them. */
+static int basefs_itable_zero(struct super_block *sb, u64 start, u32 count)
+{
+	struct buffer_head *bhs[BASEFS_ITABLE_BATCH];
+	struct blk_plug plug;
+	u32 i, n;
+	int ret = 0;
+
+	while (count && !ret) {
+		n = min_t(u32, count, BASEFS_ITABLE_BATCH);
+		blk_start_plug(&plug);
+		for (i = 0; i < n; i++) {
+			bhs[i] = sb_getblk(sb, start + i);
+			lock_buffer(bhs[i]);
+			memset(bhs[i]->b_data, 0, sb->s_blocksize);
+			set_buffer_uptodate(bhs[i]);
+			mark_buffer_dirty(bhs[i]);
+			unlock_buffer(bhs[i]);
+			write_dirty_buffer(bhs[i], REQ_SYNC);
+		}
+		blk_finish_plug(&plug);
+		for (i = 0; i < n; i++) {
+			wait_on_buffer(bhs[i]);
+			if (!buffer_uptodate(bhs[i]))
+				ret = -EIO;
+			brelse(bhs[i]);
+		}
+		start += n;
+		count -= n;
+	}
+	return ret;
+}
+
+/*
+ * basefs_itable_init_upto - Make sure the first 'blocks' inode table
+ * blocks of 'group' are initialized, zeroing at least a chunk past
+ * itable_init if they are not.  Called with ialloc_lock held, inside a
+ * handle.
+ */
+int basefs_itable_init_upto(struct super_block *sb, u32 group, u32 blocks)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 chunk = max_t(u32, BASEFS_ITABLE_CHUNK >> sb->s_blocksize_bits, 1);
+	struct basefs_group_desc *gd;
+	struct buffer_head *gd_bh;
+	u32 init;
+	int ret;
+
+	gd = basefs_get_group_desc(sb, group, &gd_bh);
+	init = basefs_itable_init(gd, sbi->itable_blocks);
+	if (blocks <= init)
+		return 0;
+	blocks = min(max(blocks, init + chunk), sbi->itable_blocks);
+
+	ret = basefs_itable_zero(sb, le64_to_cpu(gd->inode_table) + init,
+				 blocks - init);
+	if (ret) {
+		basefs_msg(sb, KERN_ERR, "group %u: cannot initialize inode table (%d)",
+			   group, ret);
+		return ret;
+	}
+	WRITE_ONCE(gd->itable_init, cpu_to_le32(blocks));
+	if (blocks == sbi->itable_blocks)
+		WRITE_ONCE(gd->flags,
+			   gd->flags & ~cpu_to_le16(BASEFS_BG_ITABLE_UNINIT));
+	basefs_journal_dirty(sb, gd_bh, NULL);
+	return 0;
+}
+
+/* False if inode 'ino' lies in a part of its table not written yet. */
+bool basefs_itable_ready(struct super_block *sb, unsigned long ino)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_group_desc *gd;
+	u64 pos;
+
+	if (ino < 1 || ino > sbi->inodes_count)
+		return true;
+	gd = basefs_get_group_desc(sb, (ino - 1) / sbi->inodes_per_group, NULL);
+	if (!gd)
+		return true;
+	pos = (u64)((ino - 1) % sbi->inodes_per_group) * sbi->inode_size;
+	return (pos >> sb->s_blocksize_bits) <
+	       basefs_itable_init(gd, sbi->itable_blocks);
+}
+
+/*
+ * The background work: zero one chunk of the first group that still
+ * needs it, then come back when the rate allows the next.
+ */
+void basefs_itable_work(struct work_struct *work)
+{
+	struct basefs_sb_info *sbi = container_of(to_delayed_work(work),
+						  struct basefs_sb_info,
+						  itable_work);
+	struct super_block *sb = sbi->sb;
+	u32 chunk = max_t(u32, BASEFS_ITABLE_CHUNK >> sb->s_blocksize_bits, 1);
+	struct basefs_group_desc *gd = NULL;
+	struct basefs_handle h;
+	unsigned long delay;
+	u32 g;
+	int ret = 0;
+
+	if (sb_rdonly(sb))
+		return;
+	basefs_journal_start(sb, &h);
+	mutex_lock(&sbi->ialloc_lock);
+	for (g = sbi->itable_group; g < sbi->groups_count; g++) {
+		gd = basefs_get_group_desc(sb, g, NULL);
+		if (le16_to_cpu(gd->flags) & BASEFS_BG_ITABLE_UNINIT)
+			break;
+	}
+	sbi->itable_group = g;
+	if (g < sbi->groups_count)
+		ret = basefs_itable_init_upto(sb, g,
+					      le32_to_cpu(gd->itable_init) + 1);
+	else
+		basefs_clear_ro_compat(sb, BASEFS_FEATURE_RO_COMPAT_LAZY_ITABLE);
+	mutex_unlock(&sbi->ialloc_lock);
+	basefs_journal_stop(sb, &h);
+
+	if (g == sbi->groups_count || ret)
+		return;
+	delay = div64_u64((u64)chunk * sb->s_blocksize * HZ,
+			  (u64)sbi->itable_rate << 20);
+	queue_delayed_work(system_unbound_wq, &sbi->itable_work,
+			   max(delay, 1UL));
+}
+
+/*
+ * basefs_itable_start - Start the background zeroing, for a mount that
+ * is or is becoming writable, if the image has tables left to zero and
+ * init_itable= is not 0.
+ */
+void basefs_itable_start(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	if (!sbi->itable_rate ||
+	    !(le32_to_cpu(sbi->raw_sb->feature_ro_compat) &
+	      BASEFS_FEATURE_RO_COMPAT_LAZY_ITABLE))
+		return;
+	queue_delayed_work(system_unbound_wq, &sbi->itable_work, HZ);
+}
+
+/* Stop it, on unmount or remount read-only. */
+void basefs_itable_stop(struct super_block *sb)
+{
+	cancel_delayed_work_sync(&BASEFS_SB(sb)->itable_work);
+}
@@ -0,0 +1,1303 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/seq_file.h>
+#include <linux/wait.h>
+#include "basefs.h"
+
+/*
+ * Metadata journal.
+ *
+ * The on-disk format is described in basefs_disk.h.  Only metadata is
+ * logged (superblock, descriptors, bitmaps, inode table and directory
+ * blocks); file data goes straight to its blocks as before, so after a
+ * crash a file may show stale data in blocks it was just given, but the
+ * metadata is always that of the last committed transaction.
+ *
+ * Every change to a metadata buffer happens inside a handle
+ * (basefs_journal_start() / basefs_journal_stop()), which holds
+ * handle_sem for read.  The buffer is then handed to
+ * basefs_journal_dirty(): it joins the running transaction and stays
+ * pinned in the buffer cache, but is never marked dirty, so the block
+ * device's writeback cannot write it home before it is in the log.
+ * Handles nest (the outer one is found in current->journal_info) and
+ * run with GFP_NOFS, since reclaim entering the file system could need
+ * a commit that waits for the handle.
+ *
+ * A commit (under commit_mutex):
+ *
+ *   1. waits for the home writes of the previous transaction;
+ *   2. takes handle_sem for write, so no handle is running, copies every
+ *      buffer of the transaction and opens the next one;
+ *   3. writes descriptors, copies and revoke records to the log as one
+ *      sequential run, then the commit block with a cache flush before
+ *      it and FUA, so the whole transaction is durable once it is;
+ *   4. writes the copies to their home blocks without waiting.
+ *
+ * Many handles share one transaction, so a burst of creates or unlinks
+ * costs one log write and one flush per commit, not a synchronous write
+ * per block.  Commits happen every commit interval (the commit= mount
+ * option), when a transaction grows past soft_limit buffers, on fsync()
+ * of something it holds and on sync.
+ *
+ * fsync()s are batched.  Those arriving while a commit is being written
+ * queue on commit_mutex and are all served by the next one, and one that
+ * finds its transaction already committed only needs a cache flush if
+ * none has been issued since it was called.  When fsync()s of several
+ * tasks come in, each new task also waits for up to the average commit
+ * time (at most max_batch_time) before committing a transaction that
+ * young, so that the others join it instead of each paying a commit of
+ * its own; one task fsync()ing alone never waits.
+ *
+ * The journal superblock is rewritten with each transaction to point at
+ * the one before it, whose home writes the new commit's flush makes
+ * durable.  The superblock on disk therefore never lags more than two
+ * transactions, and a transaction may take at most a third of the log
+ * (max_txn) so that the two the superblock may still point at are never
+ * overwritten.  A larger transaction first empties the log.
+ *
+ * Blocks that held metadata cannot be reused until the transaction that
+ * freed them is checkpointed (basefs_free_meta_blocks()), and they are
+ * revoked so that replay does not write an older copy over them.
+ */
+
+struct basefs_jbuf {
+	struct list_head list;
+	struct buffer_head *bh;
+	struct basefs_txn *txn;
+	struct page *copy;          /* frozen image, from commit to checkpoint */
+};
+
+struct basefs_jrevoke {
+	struct list_head list;
+	u64 start;
+	u32 count;
+	u64 seq;                    /* replay only */
+};
+
+struct basefs_txn {
+	u64 seq;
+	struct list_head buffers;
+	u32 nr_buffers;
+	struct list_head revokes;
+	u32 nr_revokes;
+	u64 start_ns;               /* first change */
+	u32 nr_sync;                /* sync requests waiting for it */
+};
+
+/* Commit batch sizes are counted in power-of-two buckets: 1, 2-3, ... */
+#define BASEFS_BATCH_BUCKETS    8
+
+struct basefs_journal_stats {
+	u64 commits;
+	u64 sync_commits;           /* commits that sync requests waited for */
+	u64 sync_requests;          /* fsync(), sync inode writes, DIRSYNC */
+	u64 sync_shared;            /* ... found their transaction committed */
+	u64 log_blocks;
+	u64 commit_ns;              /* total time spent writing commits */
+	u32 max_batch;
+	u64 batch[BASEFS_BATCH_BUCKETS];
+};
+
+struct basefs_journal {
+	struct super_block *sb;
+	u64 first;                  /* journal_start */
+	u32 nr_blocks;
+	u32 max_txn;                /* log blocks one transaction may take */
+	u32 soft_limit;             /* buffers that trigger a commit */
+	u32 tags_per_desc;
+	u32 ranges_per_revoke;
+	unsigned int order;         /* of a block's pages */
+	unsigned long commit_interval;  /* jiffies */
+	u64 max_batch_ns;
+
+	struct rw_semaphore handle_sem;
+	spinlock_t list_lock;       /* running's lists, bh->b_private */
+	struct basefs_txn *running;
+	u32 running_nr;             /* buffers and revokes in running */
+
+	struct mutex commit_mutex;  /* everything below */
+	u64 commit_seq;             /* last transaction committed */
+	struct basefs_txn *checkpoint;  /* committed, home writes in flight */
+	u32 head;                   /* next log block to write */
+	u32 last_start;             /* log start of the last commit, 0: none */
+	u64 last_seq;
+	bool reset_tail;            /* empty the log before the next commit */
+	bool log_dirty;             /* the log needs emptying at unmount */
+	bool recover_set;           /* we set INCOMPAT_RECOVER */
+	bool aborted;
+	u64 flush_started;          /* cache flushes issued ... */
+	u64 flush_done;             /* ... and the last one completed */
+	u64 avg_commit_ns;
+	struct basefs_journal_stats stats;
+	struct delayed_work commit_work;
+	pid_t last_sync_pid;        /* task of the last batched sync request */
+
+	atomic_t io_pending;
+	wait_queue_head_t io_wait;
+	int io_error;
+};
+
+static inline u32 basefs_jnext(struct basefs_journal *j, u32 pos)
+{
+	return pos + 1 < j->nr_blocks ? pos + 1 : 1;
+}
+
+/* Log blocks a transaction with these many buffers and revokes takes. */
+static u32 basefs_txn_blocks(struct basefs_journal *j, u32 nr_buffers,
+			     u32 nr_revokes)
+{
+	return DIV_ROUND_UP(nr_buffers, j->tags_per_desc) + nr_buffers +
+	       DIV_ROUND_UP(nr_revokes, j->ranges_per_revoke) + 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Journal I/O                                                                 */
+
+/*
+ * Log blocks and checkpoint copies are written with bios of their own,
+ * bypassing the buffer cache: the cached buffers keep the live contents.
+ */
+static void basefs_jio_end(struct bio *bio)
+{
+	struct basefs_journal *j = bio->bi_private;
+
+	if (bio->bi_status)
+		WRITE_ONCE(j->io_error, blk_status_to_errno(bio->bi_status));
+	if (atomic_dec_and_test(&j->io_pending))
+		wake_up(&j->io_wait);
+	bio_put(bio);
+}
+
+static void basefs_jio_submit(struct basefs_journal *j, struct page *page,
+			      u64 blk, blk_opf_t opf)
+{
+	struct super_block *sb = j->sb;
+	struct bio *bio;
+
+	bio = bio_alloc(sb->s_bdev, 1, opf, GFP_NOFS);
+	bio->bi_iter.bi_sector = blk << (sb->s_blocksize_bits - SECTOR_SHIFT);
+	__bio_add_page(bio, page, sb->s_blocksize, 0);
+	bio->bi_end_io = basefs_jio_end;
+	bio->bi_private = j;
+	atomic_inc(&j->io_pending);
+	submit_bio(bio);
+}
+
+/* Wait for every bio submitted so far; returns the first error seen. */
+static int basefs_jio_wait(struct basefs_journal *j)
+{
+	wait_event(j->io_wait, !atomic_read(&j->io_pending));
+	return xchg(&j->io_error, 0);
+}
+
+static int basefs_jread(struct basefs_journal *j, struct page *page, u32 pos)
+{
+	basefs_jio_submit(j, page, j->first + pos, REQ_OP_READ | REQ_META);
+	return basefs_jio_wait(j);
+}
+
+/* A zeroed block-sized page, queued on 'pages' to be freed after I/O. */
+static struct page *basefs_jpage(struct basefs_journal *j,
+				 struct list_head *pages)
+{
+	struct page *page = alloc_pages(GFP_NOFS | __GFP_NOFAIL, j->order);
+
+	memset(page_address(page), 0, j->sb->s_blocksize);
+	list_add(&page->lru, pages);
+	return page;
+}
+
+static void basefs_jpages_free(struct basefs_journal *j,
+			       struct list_head *pages)
+{
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, pages, lru) {
+		list_del(&page->lru);
+		__free_pages(page, j->order);
+	}
+}
+
+static void *basefs_jblock(struct basefs_journal *j, struct list_head *pages,
+			   struct page **pagep, u32 type, u64 seq)
+{
+	struct basefs_journal_header *h;
+
+	*pagep = basefs_jpage(j, pages);
+	h = page_address(*pagep);
+	h->magic = cpu_to_le32(BASEFS_JOURNAL_MAGIC);
+	h->type = cpu_to_le32(type);
+	h->sequence = cpu_to_le64(seq);
+	return h;
+}
+
+/* Queue a journal superblock write: replay 'start' expecting 'seq'. */
+static void basefs_journal_write_super(struct basefs_journal *j,
+				       struct list_head *pages, u32 start,
+				       u64 seq, blk_opf_t flags)
+{
+	struct basefs_journal_super *jsb;
+	struct page *page;
+
+	jsb = basefs_jblock(j, pages, &page, BASEFS_JT_SUPER, seq);
+	jsb->block_size = cpu_to_le32(j->sb->s_blocksize);
+	jsb->nr_blocks = cpu_to_le32(j->nr_blocks);
+	jsb->start = cpu_to_le32(start);
+	jsb->checksum = cpu_to_le32(basefs_journal_super_csum(jsb));
+	basefs_jio_submit(j, page, j->first,
+			  REQ_OP_WRITE | REQ_SYNC | REQ_META | flags);
+}
+
+/*
+ * basefs_journal_reset_tail - Make every home write so far durable and
+ * point the journal superblock at 'start' (0: the log is empty).
+ */
+static int basefs_journal_reset_tail(struct basefs_journal *j, u32 start,
+				     u64 seq)
+{
+	LIST_HEAD(pages);
+	int ret;
+
+	ret = blkdev_issue_flush(j->sb->s_bdev);
+	if (ret)
+		return ret;
+	j->flush_done = ++j->flush_started;
+	basefs_journal_write_super(j, &pages, start, seq, REQ_FUA);
+	ret = basefs_jio_wait(j);
+	basefs_jpages_free(j, &pages);
+	if (!ret)
+		j->last_start = 0;
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Transactions                                                                */
+
+static struct basefs_txn *basefs_txn_alloc(u64 seq)
+{
+	struct basefs_txn *t = kmalloc(sizeof(*t), GFP_NOFS | __GFP_NOFAIL);
+
+	t->seq = seq;
+	INIT_LIST_HEAD(&t->buffers);
+	t->nr_buffers = 0;
+	INIT_LIST_HEAD(&t->revokes);
+	t->nr_revokes = 0;
+	t->start_ns = 0;
+	t->nr_sync = 0;
+	return t;
+}
+
+/*
+ * The running transaction just got its first change: the commit interval
+ * starts now.  Called with list_lock held.
+ */
+static void basefs_txn_first_change(struct basefs_journal *j,
+				    struct basefs_txn *t)
+{
+	if (t->nr_buffers || t->nr_revokes)
+		return;
+	t->start_ns = ktime_get_ns();
+	queue_delayed_work(system_long_wq, &j->commit_work,
+			   READ_ONCE(j->commit_interval));
+}
+
+/*
+ * basefs_txn_release - Unpin the buffers of a transaction that is done
+ * with.  If it was checkpointed, the blocks it freed can be reused.
+ */
+static void basefs_txn_release(struct basefs_journal *j, struct basefs_txn *t,
+			       bool checkpointed)
+{
+	struct basefs_jbuf *jb, *jtmp;
+	struct basefs_jrevoke *rv, *rtmp;
+
+	list_for_each_entry_safe(jb, jtmp, &t->buffers, list) {
+		spin_lock(&j->list_lock);
+		if (jb->bh->b_private == jb)
+			jb->bh->b_private = NULL;
+		spin_unlock(&j->list_lock);
+		brelse(jb->bh);
+		if (jb->copy)
+			__free_pages(jb->copy, j->order);
+		kfree(jb);
+	}
+	list_for_each_entry_safe(rv, rtmp, &t->revokes, list) {
+		if (checkpointed)
+			basefs_reuse_blocks(j->sb, rv->start, rv->count);
+		kfree(rv);
+	}
+	kfree(t);
+}
+
+static void basefs_journal_abort(struct basefs_journal *j, int err)
+{
+	if (j->aborted)
+		return;
+	j->aborted = true;
+	basefs_msg(j->sb, KERN_CRIT,
+		   "journal aborted (%d), the file system is now read-only",
+		   err);
+	j->sb->s_flags |= SB_RDONLY;
+}
+
+/*
+ * basefs_journal_reap - Wait for the home writes of the transaction
+ * committed last and release it.  Called with commit_mutex held.
+ */
+static int basefs_journal_reap(struct basefs_journal *j)
+{
+	struct basefs_txn *t = j->checkpoint;
+	int ret;
+
+	if (!t)
+		return 0;
+	ret = basefs_jio_wait(j);
+	j->checkpoint = NULL;
+	basefs_txn_release(j, t, !ret);
+	return ret;
+}
+
+/*
+ * basefs_journal_write_txn - Write transaction 't' to the log and commit
+ * it.  Called with commit_mutex held and no I/O in flight.
+ */
+static int basefs_journal_write_txn(struct basefs_journal *j,
+				    struct basefs_txn *t)
+{
+	struct super_block *sb = j->sb;
+	unsigned int bs = sb->s_blocksize;
+	struct basefs_journal_revoke *rb = NULL;
+	struct basefs_journal_commit *cb;
+	struct basefs_journal_desc *desc;
+	struct basefs_jbuf *jb, *it;
+	struct basefs_jrevoke *rv;
+	struct blk_plug plug;
+	struct page *page;
+	LIST_HEAD(pages);
+	u32 nr_blocks, left, chunk, i, start, pos, n = 0;
+	const blk_opf_t opf = REQ_OP_WRITE | REQ_SYNC | REQ_META;
+	u32 crc = ~0U;
+	u64 flush;
+	int ret;
+
+	nr_blocks = basefs_txn_blocks(j, t->nr_buffers, t->nr_revokes);
+	if (nr_blocks > j->nr_blocks - 1) {
+		basefs_msg(sb, KERN_ERR,
+			   "transaction of %u blocks does not fit in the %u block journal",
+			   nr_blocks, j->nr_blocks);
+		return -ENOSPC;
+	}
+	if (nr_blocks > j->max_txn || j->reset_tail) {
+		ret = basefs_journal_reset_tail(j, j->head, t->seq);
+		if (ret)
+			return ret;
+		/* Nothing behind a large transaction may overwrite it. */
+		j->reset_tail = nr_blocks > j->max_txn;
+	}
+
+	start = pos = j->head;
+	blk_start_plug(&plug);
+	if (j->last_start)
+		basefs_journal_write_super(j, &pages, j->last_start,
+					   j->last_seq, 0);
+	else
+		basefs_journal_write_super(j, &pages, start, t->seq, 0);
+
+	jb = list_first_entry_or_null(&t->buffers, struct basefs_jbuf, list);
+	for (left = t->nr_buffers; left; left -= chunk) {
+		chunk = min(left, j->tags_per_desc);
+		desc = basefs_jblock(j, &pages, &page, BASEFS_JT_DESC, t->seq);
+		desc->nr = cpu_to_le32(chunk);
+		it = jb;
+		for (i = 0; i < chunk; i++) {
+			desc->blocks[i] = cpu_to_le64(it->bh->b_blocknr);
+			it = list_next_entry(it, list);
+		}
+		crc = basefs_crc32c(crc, desc, bs);
+		basefs_jio_submit(j, page, j->first + pos, opf);
+		pos = basefs_jnext(j, pos);
+		n++;
+		for (i = 0; i < chunk; i++) {
+			crc = basefs_crc32c(crc, page_address(jb->copy), bs);
+			basefs_jio_submit(j, jb->copy, j->first + pos, opf);
+			pos = basefs_jnext(j, pos);
+			n++;
+			jb = list_next_entry(jb, list);
+		}
+	}
+
+	list_for_each_entry(rv, &t->revokes, list) {
+		if (!rb) {
+			rb = basefs_jblock(j, &pages, &page, BASEFS_JT_REVOKE,
+					   t->seq);
+		}
+		i = le32_to_cpu(rb->nr);
+		rb->ranges[i].start = cpu_to_le64(rv->start);
+		rb->ranges[i].count = cpu_to_le32(rv->count);
+		rb->nr = cpu_to_le32(i + 1);
+		if (i + 1 == j->ranges_per_revoke ||
+		    list_is_last(&rv->list, &t->revokes)) {
+			crc = basefs_crc32c(crc, rb, bs);
+			basefs_jio_submit(j, page, j->first + pos, opf);
+			pos = basefs_jnext(j, pos);
+			n++;
+			rb = NULL;
+		}
+	}
+	blk_finish_plug(&plug);
+	ret = basefs_jio_wait(j);
+	if (ret)
+		goto out;
+
+	cb = basefs_jblock(j, &pages, &page, BASEFS_JT_COMMIT, t->seq);
+	cb->nr_blocks = cpu_to_le32(n);
+	cb->checksum = cpu_to_le32(crc);
+	cb->commit_time = cpu_to_le64(ktime_get_real_seconds());
+	flush = ++j->flush_started;
+	basefs_jio_submit(j, page, j->first + pos,
+			  opf | REQ_PREFLUSH | REQ_FUA);
+	ret = basefs_jio_wait(j);
+	if (ret)
+		goto out;
+
+	j->flush_done = flush;
+	j->last_start = start;
+	j->last_seq = t->seq;
+	j->head = basefs_jnext(j, pos);
+	j->log_dirty = true;
+	j->stats.log_blocks += n + 2;  /* superblock and commit block too */
+out:
+	basefs_jpages_free(j, &pages);
+	return ret;
+}
+
+/* Write the copies of a committed transaction home, without waiting. */
+static void basefs_journal_checkpoint(struct basefs_journal *j,
+				      struct basefs_txn *t)
+{
+	struct basefs_jbuf *jb;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	list_for_each_entry(jb, &t->buffers, list)
+		basefs_jio_submit(j, jb->copy, jb->bh->b_blocknr,
+				  REQ_OP_WRITE | REQ_META);
+	blk_finish_plug(&plug);
+	j->checkpoint = t;
+}
+
+/*
+ * basefs_journal_do_commit - Commit the running transaction, if it holds
+ * anything, as described at the top.  Called with commit_mutex held and
+ * outside any handle.
+ */
+static int basefs_journal_do_commit(struct basefs_journal *j)
+{
+	unsigned int bs = j->sb->s_blocksize;
+	struct basefs_journal_stats *st = &j->stats;
+	struct basefs_txn *t, *next;
+	struct basefs_jbuf *jb;
+	u64 begin, ns;
+	u32 nr_sync;
+	int ret;
+
+	ret = basefs_journal_reap(j);
+	if (ret)
+		basefs_journal_abort(j, ret);
+	if (j->aborted)
+		return -EIO;
+
+	next = basefs_txn_alloc(0);
+	down_write(&j->handle_sem);
+	t = j->running;
+	if (list_empty(&t->buffers) && list_empty(&t->revokes)) {
+		up_write(&j->handle_sem);
+		kfree(next);
+		return 0;
+	}
+	next->seq = t->seq + 1;
+	spin_lock(&j->list_lock);
+	j->running = next;
+	j->running_nr = 0;
+	nr_sync = t->nr_sync;
+	spin_unlock(&j->list_lock);
+	list_for_each_entry(jb, &t->buffers, list) {
+		jb->copy = alloc_pages(GFP_NOFS | __GFP_NOFAIL, j->order);
+		lock_buffer(jb->bh);
+		memcpy(page_address(jb->copy), jb->bh->b_data, bs);
+		unlock_buffer(jb->bh);
+	}
+	up_write(&j->handle_sem);
+
+	begin = ktime_get_ns();
+	ret = basefs_journal_write_txn(j, t);
+	if (ret) {
+		basefs_journal_abort(j, ret);
+		basefs_txn_release(j, t, false);
+		return ret;
+	}
+	j->commit_seq = t->seq;
+	basefs_journal_checkpoint(j, t);
+
+	ns = ktime_get_ns() - begin;
+	WRITE_ONCE(j->avg_commit_ns,
+		   j->avg_commit_ns ? (j->avg_commit_ns * 3 + ns) / 4 : ns);
+	st->commits++;
+	st->commit_ns += ns;
+	if (nr_sync) {
+		st->sync_commits++;
+		st->max_batch = max(st->max_batch, nr_sync);
+		st->batch[min_t(u32, ilog2(nr_sync),
+				BASEFS_BATCH_BUCKETS - 1)]++;
+	}
+
+	/* Come back to release it even if nothing else is logged. */
+	queue_delayed_work(system_long_wq, &j->commit_work,
+			   READ_ONCE(j->commit_interval));
+	return 0;
+}
+
+static void basefs_journal_commit_work(struct work_struct *work)
+{
+	struct basefs_journal *j = container_of(to_delayed_work(work),
+						struct basefs_journal,
+						commit_work);
+
+	mutex_lock(&j->commit_mutex);
+	basefs_journal_do_commit(j);
+	mutex_unlock(&j->commit_mutex);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Handles                                                                     */
+
+void basefs_journal_start(struct super_block *sb, struct basefs_handle *h)
+{
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+
+	h->h_outer = current->journal_info;
+	h->h_sync = false;
+	if (!j || h->h_outer)
+		return;
+
+	if (READ_ONCE(j->running_nr) >= j->soft_limit)
+		basefs_journal_commit(sb);
+	h->h_nofs = memalloc_nofs_save();
+	down_read(&j->handle_sem);
+	current->journal_info = h;
+}
+
+/*
+ * basefs_journal_stop - End a handle.  If it (or a handle nested in it)
+ * asked for a synchronous change, commit and return the result.
+ */
+int basefs_journal_stop(struct super_block *sb, struct basefs_handle *h)
+{
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+	u64 tid;
+
+	if (!j)
+		return 0;
+	if (h->h_outer) {
+		h->h_outer->h_sync |= h->h_sync;
+		return 0;
+	}
+	current->journal_info = NULL;
+	tid = j->running->seq;
+	up_read(&j->handle_sem);
+	memalloc_nofs_restore(h->h_nofs);
+	return h->h_sync ? basefs_journal_force(sb, tid) : 0;
+}
+
+/*
+ * basefs_journal_full - Whether the running transaction has grown past
+ * the size at which the next handle commits it first.  A handle that
+ * changes many inodes, like a batch of creates, stops there so its
+ * transaction never outgrows the log.
+ */
+bool basefs_journal_full(struct super_block *sb)
+{
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+
+	return j && READ_ONCE(j->running_nr) >= j->soft_limit;
+}
+
+/*
+ * basefs_journal_dirty - Log the change just made to 'bh' in the running
+ * transaction.  'inode', if not NULL, is the inode whose fsync() must
+ * make the change durable.  Without a journal the buffer is simply
+ * marked dirty, and tied to 'inode' for fsync() as
+ * mark_buffer_dirty_inode() does.
+ */
+void basefs_journal_dirty(struct super_block *sb, struct buffer_head *bh,
+			  struct inode *inode)
+{
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+	struct basefs_jbuf *jb, *new = NULL;
+	struct basefs_txn *t;
+
+	if (!j) {
+		if (inode)
+			mark_buffer_dirty_inode(bh, inode);
+		else
+			mark_buffer_dirty(bh);
+		return;
+	}
+	WARN_ON_ONCE(!current->journal_info);
+
+	spin_lock(&j->list_lock);
+	for (;;) {
+		t = j->running;
+		jb = bh->b_private;
+		if (jb && jb->txn == t)
+			break;
+		if (new) {
+			new->bh = bh;
+			new->txn = t;
+			new->copy = NULL;
+			get_bh(bh);
+			list_add_tail(&new->list, &t->buffers);
+			bh->b_private = new;
+			basefs_txn_first_change(j, t);
+			t->nr_buffers++;
+			j->running_nr++;
+			new = NULL;
+			break;
+		}
+		spin_unlock(&j->list_lock);
+		new = kmalloc(sizeof(*new), GFP_NOFS | __GFP_NOFAIL);
+		spin_lock(&j->list_lock);
+	}
+	spin_unlock(&j->list_lock);
+	kfree(new);
+	if (inode)
+		WRITE_ONCE(BASEFS_I(inode)->i_sync_tid, t->seq);
+}
+
+/*
+ * basefs_journal_sync - 'bh' was changed for a synchronous operation
+ * (DIRSYNC).  The change is committed when the outermost handle stops.
+ */
+void basefs_journal_sync(struct super_block *sb, struct buffer_head *bh)
+{
+	struct basefs_handle *h = current->journal_info;
+
+	if (!BASEFS_SB(sb)->journal) {
+		sync_dirty_buffer(bh);
+		return;
+	}
+	if (h)
+		h->h_sync = true;
+}
+
+/*
+ * basefs_journal_revoke - Blocks [start, start + count), metadata until
+ * now, were freed in the running transaction.  A change to them still
+ * waiting in it is dropped, and a revoke record keeps replay from
+ * writing older copies over them.
+ */
+void basefs_journal_revoke(struct super_block *sb, u64 start, u32 count)
+{
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+	struct basefs_jrevoke *rv;
+	struct buffer_head *bh;
+	struct basefs_jbuf *jb;
+	struct basefs_txn *t;
+	u32 i;
+
+	rv = kmalloc(sizeof(*rv), GFP_NOFS | __GFP_NOFAIL);
+	rv->start = start;
+	rv->count = count;
+	rv->seq = 0;
+
+	for (i = 0; i < count; i++) {
+		bh = sb_find_get_block(sb, start + i);
+		if (!bh)
+			continue;
+		jb = NULL;
+		spin_lock(&j->list_lock);
+		if (bh->b_private &&
+		    ((struct basefs_jbuf *)bh->b_private)->txn == j->running) {
+			jb = bh->b_private;
+			list_del(&jb->list);
+			j->running->nr_buffers--;
+			bh->b_private = NULL;
+		}
+		spin_unlock(&j->list_lock);
+		if (jb) {
+			brelse(bh);
+			kfree(jb);
+		}
+		brelse(bh);
+	}
+
+	spin_lock(&j->list_lock);
+	t = j->running;
+	basefs_txn_first_change(j, t);
+	list_add_tail(&rv->list, &t->revokes);
+	t->nr_revokes++;
+	j->running_nr++;
+	spin_unlock(&j->list_lock);
+}
+
+/*
+ * basefs_journal_batch - A sync request is about to commit transaction
+ * 'tid'.  If the last one came from another task, others are likely on
+ * their way: give them until the transaction is as old as a commit
+ * takes, at most max_batch_ns, to join it.  Counts the request in the
+ * transaction's batch.
+ */
+static void basefs_journal_batch(struct basefs_journal *j, u64 tid)
+{
+	u64 wait = min(READ_ONCE(j->avg_commit_ns), READ_ONCE(j->max_batch_ns));
+	u64 age = 0;
+	ktime_t expires;
+	bool batch;
+
+	spin_lock(&j->list_lock);
+	if (j->running->seq != tid) {
+		spin_unlock(&j->list_lock);
+		return;
+	}
+	j->running->nr_sync++;
+	batch = wait && j->last_sync_pid != current->pid;
+	j->last_sync_pid = current->pid;
+	if (j->running->start_ns)
+		age = ktime_get_ns() - j->running->start_ns;
+	spin_unlock(&j->list_lock);
+
+	if (batch && age < wait) {
+		expires = ktime_add_ns(ktime_get(), wait - age);
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+	}
+}
+
+/*
+ * basefs_journal_force - Make transaction 'tid' durable, committing it if
+ * it is still running.  If it was committed already the device cache is
+ * flushed instead, unless a flush issued since the call covers it, so
+ * that data written before the call is durable too (fsync()).  Inside a
+ * handle the commit is left to the outermost basefs_journal_stop().
+ */
+int basefs_journal_force(struct super_block *sb, u64 tid)
+{
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+	struct basefs_handle *h = current->journal_info;
+	u64 flush;
+	int ret = 0;
+
+	if (!j)
+		return 0;
+	if (h) {
+		h->h_sync = true;
+		return 0;
+	}
+
+	flush = READ_ONCE(j->flush_started);
+	if (tid > READ_ONCE(j->commit_seq))
+		basefs_journal_batch(j, tid);
+	mutex_lock(&j->commit_mutex);
+	j->stats.sync_requests++;
+	if (j->aborted) {
+		ret = -EIO;
+	} else if (tid > j->commit_seq) {
+		ret = basefs_journal_do_commit(j);
+	} else if (j->flush_done <= flush) {
+		flush = ++j->flush_started;
+		ret = blkdev_issue_flush(sb->s_bdev);
+		if (!ret)
+			j->flush_done = flush;
+	} else {
+		j->stats.sync_shared++;
+	}
+	mutex_unlock(&j->commit_mutex);
+	return ret;
+}
+
+/*
+ * basefs_journal_stats_show - /proc/fs/basefs/<dev>/journal: commit
+ * counts, and how many sync requests each commit served.
+ */
+int basefs_journal_stats_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+	struct basefs_journal_stats st;
+	u64 flushes;
+	int i;
+
+	if (!j) {
+		seq_puts(m, "no journal\n");
+		return 0;
+	}
+	mutex_lock(&j->commit_mutex);
+	st = j->stats;
+	flushes = j->flush_started;
+	mutex_unlock(&j->commit_mutex);
+
+	seq_printf(m, "%u blocks, commit interval %lus, max batch time %lluus\n",
+		   j->nr_blocks, j->commit_interval / HZ,
+		   div_u64(j->max_batch_ns, NSEC_PER_USEC));
+	seq_printf(m, "%llu transactions, %llu log blocks, %llu cache flushes\n",
+		   st.commits, st.log_blocks, flushes);
+	seq_printf(m, "average commit time %lluus\n",
+		   st.commits ? div64_u64(st.commit_ns, st.commits * NSEC_PER_USEC) : 0);
+	seq_printf(m, "%llu sync requests, %llu served by a commit already made\n",
+		   st.sync_requests, st.sync_shared);
+	seq_printf(m, "%llu commits for sync requests, up to %u requests each:\n",
+		   st.sync_commits, st.max_batch);
+	for (i = 0; i < BASEFS_BATCH_BUCKETS; i++) {
+		if (i == BASEFS_BATCH_BUCKETS - 1)
+			seq_printf(m, "  %u+", 1U << i);
+		else if (i)
+			seq_printf(m, "  %u-%u", 1U << i, (2U << i) - 1);
+		else
+			seq_puts(m, "  1");
+		seq_printf(m, "\t%llu\n", st.batch[i]);
+	}
+	return 0;
+}
+
+/* basefs_journal_commit - Commit whatever is logged so far (sync). */
+int basefs_journal_commit(struct super_block *sb)
+{
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+	int ret;
+
+	if (!j)
+		return 0;
+	mutex_lock(&j->commit_mutex);
+	ret = basefs_journal_do_commit(j);
+	mutex_unlock(&j->commit_mutex);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Replay                                                                      */
+
+struct basefs_replay {
+	struct list_head revokes;   /* of complete transactions */
+	u64 end_seq;                /* first transaction not complete */
+	u64 nr_blocks;              /* copies written home */
+};
+
+static bool basefs_replay_revoked(struct basefs_replay *r, u64 blk, u64 seq)
+{
+	struct basefs_jrevoke *rv;
+
+	list_for_each_entry(rv, &r->revokes, list)
+		if (rv->seq >= seq && blk >= rv->start &&
+		    blk - rv->start < rv->count)
+			return true;
+	return false;
+}
+
+/* Write one logged copy home, through the buffer cache. */
+static int basefs_replay_block(struct basefs_journal *j,
+			       struct basefs_replay *r, u64 blk,
+			       struct page *page, u64 seq)
+{
+	struct super_block *sb = j->sb;
+	struct buffer_head *bh;
+
+	if (blk >= le64_to_cpu(BASEFS_SB(sb)->raw_sb->blocks_count) ||
+	    (blk >= j->first && blk < j->first + j->nr_blocks)) {
+		basefs_msg(sb, KERN_ERR,
+			   "journal transaction %llu logs invalid block %llu",
+			   seq, blk);
+		return -EFSCORRUPTED;
+	}
+	if (basefs_replay_revoked(r, blk, seq))
+		return 0;
+
+	bh = sb_getblk(sb, blk);
+	if (!bh)
+		return -ENOMEM;
+	lock_buffer(bh);
+	memcpy(bh->b_data, page_address(page), sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	r->nr_blocks++;
+	return 0;
+}
+
+/*
+ * basefs_journal_walk - Walk the log from block 'pos', where transaction
+ * 'seq' should start.  The scan pass checks each transaction, collects
+ * the revoke records of complete ones and sets r->end_seq; the replay
+ * pass then writes the copies of the transactions before it home.
+ */
+static int basefs_journal_walk(struct basefs_journal *j, u32 pos, u64 seq,
+			       struct basefs_replay *r, bool replay)
+{
+	unsigned int bs = j->sb->s_blocksize;
+	struct basefs_journal_header *h;
+	struct basefs_journal_desc *desc;
+	struct basefs_journal_revoke *rb;
+	struct basefs_journal_commit *cb;
+	struct basefs_jrevoke *rv, *tmp;
+	struct page *bpage, *cpage;
+	LIST_HEAD(pages);
+	LIST_HEAD(txn_revokes);
+	u32 crc, n, nr, i;
+	int ret = 0;
+
+	bpage = basefs_jpage(j, &pages);
+	cpage = basefs_jpage(j, &pages);
+	h = page_address(bpage);
+
+	while (!replay || seq < r->end_seq) {
+		crc = ~0U;
+		for (n = 0; n < j->nr_blocks; n++) {
+			ret = basefs_jread(j, bpage, pos);
+			if (ret)
+				goto out;
+			if (le32_to_cpu(h->magic) != BASEFS_JOURNAL_MAGIC ||
+			    le64_to_cpu(h->sequence) != seq)
+				goto end;
+			pos = basefs_jnext(j, pos);
+
+			switch (le32_to_cpu(h->type)) {
+			case BASEFS_JT_DESC:
+				desc = (struct basefs_journal_desc *)h;
+				nr = le32_to_cpu(desc->nr);
+				if (nr > j->tags_per_desc)
+					goto end;
+				crc = basefs_crc32c(crc, desc, bs);
+				for (i = 0; i < nr; i++, n++) {
+					ret = basefs_jread(j, cpage, pos);
+					if (ret)
+						goto out;
+					pos = basefs_jnext(j, pos);
+					crc = basefs_crc32c(crc, page_address(cpage),
+							    bs);
+					if (!replay)
+						continue;
+					ret = basefs_replay_block(j, r,
+							le64_to_cpu(desc->blocks[i]),
+							cpage, seq);
+					if (ret)
+						goto out;
+				}
+				break;
+			case BASEFS_JT_REVOKE:
+				rb = (struct basefs_journal_revoke *)h;
+				nr = le32_to_cpu(rb->nr);
+				if (nr > j->ranges_per_revoke)
+					goto end;
+				crc = basefs_crc32c(crc, rb, bs);
+				for (i = 0; i < nr && !replay; i++) {
+					rv = kmalloc(sizeof(*rv), GFP_KERNEL);
+					if (!rv) {
+						ret = -ENOMEM;
+						goto out;
+					}
+					rv->start = le64_to_cpu(rb->ranges[i].start);
+					rv->count = le32_to_cpu(rb->ranges[i].count);
+					rv->seq = seq;
+					list_add_tail(&rv->list, &txn_revokes);
+				}
+				break;
+			case BASEFS_JT_COMMIT:
+				cb = (struct basefs_journal_commit *)h;
+				if (le32_to_cpu(cb->nr_blocks) != n ||
+				    le32_to_cpu(cb->checksum) != crc)
+					goto end;
+				list_splice_tail_init(&txn_revokes, &r->revokes);
+				goto next_txn;
+			default:
+				goto end;
+			}
+		}
+		goto end;
+next_txn:
+		seq++;
+	}
+end:
+	if (!replay)
+		r->end_seq = seq;
+out:
+	list_for_each_entry_safe(rv, tmp, &txn_revokes, list)
+		kfree(rv);
+	basefs_jpages_free(j, &pages);
+	return ret;
+}
+
+static int basefs_journal_replay(struct basefs_journal *j, u32 start, u64 seq)
+{
+	struct super_block *sb = j->sb;
+	struct basefs_replay r = { .revokes = LIST_HEAD_INIT(r.revokes) };
+	struct basefs_jrevoke *rv, *tmp;
+	int ret;
+
+	ret = basefs_journal_walk(j, start, seq, &r, false);
+	if (!ret && r.end_seq > seq)
+		ret = basefs_journal_walk(j, start, seq, &r, true);
+	if (!ret)
+		ret = sync_blockdev(sb->s_bdev);
+	list_for_each_entry_safe(rv, tmp, &r.revokes, list)
+		kfree(rv);
+	if (ret)
+		return ret;
+
+	ret = basefs_journal_reset_tail(j, 0, r.end_seq);
+	if (ret)
+		return ret;
+	j->commit_seq = r.end_seq - 1;
+	basefs_msg(sb, KERN_INFO,
+		   "replayed %llu journal transactions, %llu blocks",
+		   r.end_seq - seq, r.nr_blocks);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Mount and unmount                                                           */
+
+/* Set or clear INCOMPAT_RECOVER, writing the superblock in place. */
+static int basefs_journal_set_recover(struct super_block *sb, bool on)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_super_block *raw = sbi->raw_sb;
+
+	lock_buffer(sbi->sbh);
+	if (on)
+		raw->feature_incompat |= cpu_to_le32(BASEFS_FEATURE_INCOMPAT_RECOVER);
+	else
+		raw->feature_incompat &= ~cpu_to_le32(BASEFS_FEATURE_INCOMPAT_RECOVER);
+	if (le32_to_cpu(raw->feature_ro_compat) & BASEFS_FEATURE_RO_COMPAT_SB_CSUM)
+		raw->checksum = cpu_to_le32(basefs_super_csum(raw));
+	unlock_buffer(sbi->sbh);
+	mark_buffer_dirty(sbi->sbh);
+	return sync_dirty_buffer(sbi->sbh);
+}
+
+/* Read and check the journal superblock. */
+static int basefs_journal_read_super(struct basefs_journal *j, u32 *start,
+				     u64 *seq)
+{
+	struct super_block *sb = j->sb;
+	struct basefs_journal_super *jsb;
+	struct page *page;
+	LIST_HEAD(pages);
+	int ret;
+
+	page = basefs_jpage(j, &pages);
+	jsb = page_address(page);
+	basefs_jio_submit(j, page, j->first, REQ_OP_READ | REQ_META);
+	ret = basefs_jio_wait(j);
+	if (ret)
+		goto out;
+	if (le32_to_cpu(jsb->header.magic) != BASEFS_JOURNAL_MAGIC ||
+	    le32_to_cpu(jsb->header.type) != BASEFS_JT_SUPER ||
+	    !le64_to_cpu(jsb->header.sequence) ||
+	    le32_to_cpu(jsb->checksum) != basefs_journal_super_csum(jsb) ||
+	    le32_to_cpu(jsb->block_size) != sb->s_blocksize ||
+	    le32_to_cpu(jsb->nr_blocks) != j->nr_blocks ||
+	    le32_to_cpu(jsb->start) >= j->nr_blocks) {
+		basefs_msg(sb, KERN_ERR, "bad journal superblock");
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+	*start = le32_to_cpu(jsb->start);
+	*seq = le64_to_cpu(jsb->header.sequence);
+out:
+	basefs_jpages_free(j, &pages);
+	return ret;
+}
+
+/*
+ * basefs_journal_load - Set up the journal at mount, replaying it first
+ * if the last mount did not empty it.  Replay writes to the device even
+ * for a read-only mount, as it has to happen before anything is read.
+ * Called right after the superblock is read.
+ */
+int basefs_journal_load(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_super_block *raw = sbi->raw_sb;
+	u32 incompat = le32_to_cpu(raw->feature_incompat);
+	struct basefs_journal *j;
+	u32 start;
+	u64 seq;
+	int ret;
+
+	if (!(le32_to_cpu(raw->feature_compat) & BASEFS_FEATURE_COMPAT_JOURNAL)) {
+		if (incompat & BASEFS_FEATURE_INCOMPAT_RECOVER) {
+			basefs_msg(sb, KERN_ERR, "needs recovery but has no journal");
+			return -EFSCORRUPTED;
+		}
+		return 0;
+	}
+	/* Immutable mounts leave the journal alone: it has to be empty. */
+	if (sbi->immutable) {
+		if (incompat & BASEFS_FEATURE_INCOMPAT_RECOVER) {
+			basefs_msg(sb, KERN_ERR, "journal needs recovery, mount read-write once first");
+			return -EROFS;
+		}
+		return 0;
+	}
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+	j->sb = sb;
+	j->first = le64_to_cpu(raw->journal_start);
+	j->nr_blocks = le32_to_cpu(raw->journal_blocks);
+	j->max_txn = (j->nr_blocks - 1) / 3;
+	j->soft_limit = j->max_txn / 2;
+	j->tags_per_desc = (sb->s_blocksize - sizeof(struct basefs_journal_desc)) /
+			   sizeof(__le64);
+	j->ranges_per_revoke = (sb->s_blocksize -
+				sizeof(struct basefs_journal_revoke)) /
+			       sizeof(struct basefs_journal_range);
+	j->order = get_order(sb->s_blocksize);
+	j->head = 1;
+	init_rwsem(&j->handle_sem);
+	spin_lock_init(&j->list_lock);
+	mutex_init(&j->commit_mutex);
+	INIT_DELAYED_WORK(&j->commit_work, basefs_journal_commit_work);
+	atomic_set(&j->io_pending, 0);
+	init_waitqueue_head(&j->io_wait);
+
+	if (j->nr_blocks < BASEFS_JOURNAL_MIN_BLOCKS || !j->first ||
+	    j->first + j->nr_blocks > le64_to_cpu(raw->first_group_block)) {
+		basefs_msg(sb, KERN_ERR, "invalid journal location %llu+%u",
+			   j->first, j->nr_blocks);
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	ret = basefs_journal_read_super(j, &start, &seq);
+	if (ret)
+		goto fail;
+	j->commit_seq = seq - 1;
+	if (start) {
+		if (bdev_read_only(sb->s_bdev)) {
+			basefs_msg(sb, KERN_ERR, "journal needs replay but the device is read-only");
+			ret = -EROFS;
+			goto fail;
+		}
+		ret = basefs_journal_replay(j, start, seq);
+		if (ret) {
+			basefs_msg(sb, KERN_ERR, "journal replay failed (%d)", ret);
+			goto fail;
+		}
+		/* Block 0 may have been replayed. */
+		if ((le32_to_cpu(raw->feature_ro_compat) &
+		     BASEFS_FEATURE_RO_COMPAT_SB_CSUM) &&
+		    le32_to_cpu(raw->checksum) != basefs_super_csum(raw)) {
+			basefs_msg(sb, KERN_ERR, "superblock checksum mismatch after replay");
+			ret = -EFSCORRUPTED;
+			goto fail;
+		}
+	}
+	j->running = basefs_txn_alloc(j->commit_seq + 1);
+	sbi->journal = j;
+	basefs_journal_set_options(sb);
+
+	incompat = le32_to_cpu(raw->feature_incompat);
+	if (!sb_rdonly(sb)) {
+		ret = basefs_journal_set_recover(sb, true);
+		j->recover_set = !ret;
+	} else if ((incompat & BASEFS_FEATURE_INCOMPAT_RECOVER) &&
+		   !bdev_read_only(sb->s_bdev)) {
+		ret = basefs_journal_set_recover(sb, false);
+	}
+	if (ret) {
+		sbi->journal = NULL;
+		kfree(j->running);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	kfree(j);
+	return ret;
+}
+
+/*
+ * Commit what is left, wait for it to reach its home blocks and empty the
+ * log, then clear INCOMPAT_RECOVER, so the next mount has nothing to
+ * replay.  Called after the last change.
+ */
+static int basefs_journal_empty(struct super_block *sb,
+				struct basefs_journal *j)
+{
+	int ret;
+
+	cancel_delayed_work_sync(&j->commit_work);
+	mutex_lock(&j->commit_mutex);
+	ret = basefs_journal_do_commit(j);
+	if (!ret)
+		ret = basefs_journal_reap(j);
+	if (!ret && j->log_dirty)
+		ret = basefs_journal_reset_tail(j, 0, j->running->seq);
+	mutex_unlock(&j->commit_mutex);
+	/* The commit queued the work to release it; that is done. */
+	cancel_delayed_work_sync(&j->commit_work);
+	if (!ret && j->recover_set) {
+		ret = basefs_journal_set_recover(sb, false);
+		j->recover_set = !!ret;
+	}
+	if (ret)
+		basefs_msg(sb, KERN_ERR, "journal not emptied (%d), it will be replayed at the next mount",
+			   ret);
+	return ret;
+}
+
+/* Take the commit= and max_batch_time= values, at mount or remount. */
+void basefs_journal_set_options(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_journal *j = sbi->journal;
+
+	if (!j)
+		return;
+	WRITE_ONCE(j->commit_interval, sbi->commit_interval);
+	WRITE_ONCE(j->max_batch_ns, (u64)sbi->max_batch_us * NSEC_PER_USEC);
+}
+
+/*
+ * basefs_journal_remount - A remount read-only empties the log like an
+ * unmount; a remount read-write sets INCOMPAT_RECOVER before the first
+ * transaction, like a read-write mount.
+ */
+int basefs_journal_remount(struct super_block *sb, bool rdonly)
+{
+	struct basefs_journal *j = BASEFS_SB(sb)->journal;
+	int ret;
+
+	if (!j)
+		return 0;
+	if (rdonly)
+		return basefs_journal_empty(sb, j);
+	if (j->recover_set)
+		return 0;
+	ret = basefs_journal_set_recover(sb, true);
+	j->recover_set = !ret;
+	return ret;
+}
+
+/*
+ * basefs_journal_destroy - Empty the journal and free it.  Called at
+ * unmount, after the last change.
+ */
+void basefs_journal_destroy(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_journal *j = sbi->journal;
+
+	if (!j)
+		return;
+	basefs_journal_empty(sb, j);
+	basefs_txn_release(j, j->running, false);
+	sbi->journal = NULL;
+	kfree(j);
+}
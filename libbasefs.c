@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libbasefs.h"
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t off)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, p, len, (off_t)off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		p += ret;
+		len -= (size_t)ret;
+		off += (uint64_t)ret;
+	}
+	return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t off)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, (off_t)off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		len -= (size_t)ret;
+		off += (uint64_t)ret;
+	}
+	return 0;
+}
+
+/*
+ * bfs_open - Open an image, check the superblock and load the group
+ * descriptor table.  A superblock checksum mismatch is not an error
+ * here, so fsckfs can repair it; it is left in img->sb_csum_bad.
+ */
+int bfs_open(struct bfs_image *img, const char *path, int writable)
+{
+	uint64_t gdt_bytes;
+	int ret;
+
+	memset(img, 0, sizeof(*img));
+	img->path = path;
+	img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (img->fd < 0)
+		return -errno;
+
+	ret = pread_all(img->fd, &img->sb, sizeof(img->sb), 0);
+	if (ret)
+		goto fail;
+
+	ret = -EINVAL;
+	if (le32toh(img->sb.magic) != BASEFS_MAGIC) {
+		fprintf(stderr, "%s: bad magic 0x%08x\n", path,
+			le32toh(img->sb.magic));
+		goto fail;
+	}
+	if (le32toh(img->sb.version) != BASEFS_FORMAT_VERSION) {
+		fprintf(stderr, "%s: unsupported format version %u\n", path,
+			le32toh(img->sb.version));
+		goto fail;
+	}
+
+	img->block_size        = le32toh(img->sb.block_size);
+	img->inode_size        = le32toh(img->sb.inode_size);
+	img->blocks_per_group  = le32toh(img->sb.blocks_per_group);
+	img->inodes_per_group  = le32toh(img->sb.inodes_per_group);
+	img->groups_count      = le32toh(img->sb.groups_count);
+	img->itable_blocks     = le32toh(img->sb.itable_blocks);
+	img->blocks_count      = le64toh(img->sb.blocks_count);
+	img->inodes_count      = le64toh(img->sb.inodes_count);
+	img->first_group_block = le64toh(img->sb.first_group_block);
+	img->sb_csum_bad       = !bfs_super_csum_ok(img);
+
+	if (img->block_size < BASEFS_MIN_BLOCK_SIZE ||
+	    img->block_size > BASEFS_MAX_BLOCK_SIZE ||
+	    (img->block_size & (img->block_size - 1)) ||
+	    img->inode_size < BASEFS_MIN_INODE_SIZE ||
+	    img->inode_size > img->block_size ||
+	    !img->groups_count || !img->inodes_per_group ||
+	    (uint64_t)le32toh(img->sb.gdt_blocks) * img->block_size <
+	    (uint64_t)img->groups_count * sizeof(struct basefs_group_desc)) {
+		fprintf(stderr, "%s: inconsistent superblock geometry\n", path);
+		goto fail;
+	}
+
+	gdt_bytes = (uint64_t)le32toh(img->sb.gdt_blocks) * img->block_size;
+	img->gdt = malloc(gdt_bytes);
+	if (!img->gdt) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	ret = bfs_read_blocks(img, le64toh(img->sb.gdt_start),
+			      le32toh(img->sb.gdt_blocks), img->gdt);
+	if (ret)
+		goto fail;
+	return 0;
+
+fail:
+	bfs_close(img);
+	return ret;
+}
+
+void bfs_close(struct bfs_image *img)
+{
+	free(img->gdt);
+	img->gdt = NULL;
+	if (img->fd >= 0)
+		close(img->fd);
+	img->fd = -1;
+}
+
+int bfs_read_blocks(const struct bfs_image *img, uint64_t blk, uint64_t nr,
+		    void *buf)
+{
+	if (blk + nr > img->blocks_count)
+		return -ERANGE;
+	return pread_all(img->fd, buf, nr * img->block_size,
+			 blk * img->block_size);
+}
+
+int bfs_write_blocks(const struct bfs_image *img, uint64_t blk, uint64_t nr,
+		     const void *buf)
+{
+	if (blk + nr > img->blocks_count)
+		return -ERANGE;
+	return pwrite_all(img->fd, buf, nr * img->block_size,
+			  blk * img->block_size);
+}
+
+/* True if the superblock has no checksum or a correct one. */
+int bfs_super_csum_ok(const struct bfs_image *img)
+{
+	return !(le32toh(img->sb.feature_ro_compat) &
+		 BASEFS_FEATURE_RO_COMPAT_SB_CSUM) ||
+	       le32toh(img->sb.checksum) == basefs_super_csum(&img->sb);
+}
+
+/* Write the superblock back, with a fresh checksum if it has one. */
+int bfs_write_super(struct bfs_image *img)
+{
+	int ret;
+
+	if (le32toh(img->sb.feature_ro_compat) & BASEFS_FEATURE_RO_COMPAT_SB_CSUM)
+		img->sb.checksum = htole32(basefs_super_csum(&img->sb));
+	ret = pwrite_all(img->fd, &img->sb, sizeof(img->sb), 0);
+	if (!ret)
+		img->sb_csum_bad = 0;
+	return ret;
+}
+
+int bfs_write_gdt(struct bfs_image *img)
+{
+	return bfs_write_blocks(img, le64toh(img->sb.gdt_start),
+				le32toh(img->sb.gdt_blocks), img->gdt);
+}
+
+uint64_t bfs_group_start(const struct bfs_image *img, uint32_t group)
+{
+	return basefs_group_first_block(img->first_group_block,
+					img->blocks_per_group, group);
+}
+
+uint32_t bfs_group_len(const struct bfs_image *img, uint32_t group)
+{
+	return basefs_group_nr_blocks(img->blocks_count,
+				      img->first_group_block,
+				      img->blocks_per_group, group);
+}
+
+/* Block holding inode 'ino', and its byte offset within that block. */
+uint64_t bfs_inode_block(const struct bfs_image *img, uint64_t ino,
+			 uint32_t *offset)
+{
+	uint32_t group = (uint32_t)((ino - 1) / img->inodes_per_group);
+	uint64_t index = (ino - 1) % img->inodes_per_group;
+	uint64_t byte = index * img->inode_size;
+
+	*offset = (uint32_t)(byte % img->block_size);
+	return le64toh(img->gdt[group].inode_table) + byte / img->block_size;
+}
+
+int bfs_read_inode(const struct bfs_image *img, uint64_t ino,
+		   struct basefs_inode *di)
+{
+	uint32_t offset;
+	uint64_t blk;
+
+	if (!ino || ino > img->inodes_count)
+		return -ERANGE;
+	blk = bfs_inode_block(img, ino, &offset);
+	return pread_all(img->fd, di, sizeof(*di),
+			 blk * img->block_size + offset);
+}
+
+int bfs_write_inode(const struct bfs_image *img, uint64_t ino,
+		    const struct basefs_inode *di)
+{
+	uint32_t offset;
+	uint64_t blk;
+
+	if (!ino || ino > img->inodes_count)
+		return -ERANGE;
+	blk = bfs_inode_block(img, ino, &offset);
+	return pwrite_all(img->fd, di, sizeof(*di),
+			  blk * img->block_size + offset);
+}
+
+struct extent_walk {
+	const struct bfs_image *img;
+	bfs_extent_fn fn;
+	bfs_node_fn   node;
+	void         *arg;
+	uint8_t      *bufs[BASEFS_EXTENT_MAX_DEPTH];  /* one block per level */
+};
+
+/*
+ * Walk the node 'hdr' at 'depth', which maps file blocks [lo, hi): its
+ * entries must be sorted inside that range, and the first index entry
+ * must start it.
+ */
+static int walk_extent_node(struct extent_walk *w,
+			    const struct basefs_extent_header *hdr,
+			    uint16_t depth, uint16_t max, uint64_t lo, uint64_t hi)
+{
+	const struct basefs_extent_idx *idx;
+	const struct basefs_extent *ex;
+	uint16_t nr = le16toh(hdr->nr), i;
+	uint64_t start, end, blk;
+	int ret;
+
+	if (le32toh(hdr->magic) != BASEFS_EXTENT_MAGIC ||
+	    le16toh(hdr->depth) != depth || le16toh(hdr->max) != max ||
+	    nr > max || (depth && !nr))
+		return -EUCLEAN;
+
+	if (!depth) {
+		ex = (const struct basefs_extent *)(hdr + 1);
+		for (i = 0; i < nr; i++) {
+			start = le64toh(ex[i].lblk);
+			end = start + le32toh(ex[i].len);
+			if (end <= start || start < lo || end > hi)
+				return -EUCLEAN;
+			lo = end;
+			ret = w->fn(&ex[i], w->arg);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	idx = (const struct basefs_extent_idx *)(hdr + 1);
+	for (i = 0; i < nr; i++) {
+		start = le64toh(idx[i].lblk);
+		end = i + 1 < nr ? le64toh(idx[i + 1].lblk) : hi;
+		blk = le64toh(idx[i].block);
+		if ((i == 0 && start != lo) || end <= start || end > hi ||
+		    blk < w->img->first_group_block ||
+		    blk >= w->img->blocks_count)
+			return -EUCLEAN;
+		if (w->node) {
+			ret = w->node(blk, w->arg);
+			if (ret)
+				return ret;
+		}
+		ret = bfs_read_blocks(w->img, blk, 1, w->bufs[depth - 1]);
+		if (ret)
+			return ret;
+		ret = walk_extent_node(w, (const struct basefs_extent_header *)
+					  w->bufs[depth - 1], depth - 1,
+				       basefs_extent_node_max(w->img->block_size,
+							      depth - 1),
+				       start, end);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+int bfs_for_each_extent(const struct bfs_image *img,
+			const struct basefs_inode *di, bfs_extent_fn fn,
+			bfs_node_fn node, void *arg)
+{
+	const struct basefs_extent_header *root =
+		(const struct basefs_extent_header *)di->data;
+	struct extent_walk w = { img, fn, node, arg, { NULL } };
+	uint16_t nr = le16toh(di->nr_extents), depth, i;
+	uint64_t next = 0;
+	int ret;
+
+	if (!(le32toh(di->flags) & BASEFS_INODE_EXTENT_TREE)) {
+		if (nr > BASEFS_INLINE_EXTENTS)
+			return -EUCLEAN;
+		for (i = 0; i < nr; i++) {
+			if (!le32toh(di->extents[i].len) ||
+			    le64toh(di->extents[i].lblk) < next)
+				return -EUCLEAN;
+			next = le64toh(di->extents[i].lblk) +
+			       le32toh(di->extents[i].len);
+			ret = fn(&di->extents[i], arg);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	depth = le16toh(root->depth);
+	if (nr || !depth || depth > BASEFS_EXTENT_MAX_DEPTH)
+		return -EUCLEAN;
+	for (i = 0; i < depth; i++) {
+		w.bufs[i] = malloc(img->block_size);
+		if (!w.bufs[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	ret = walk_extent_node(&w, root, depth, BASEFS_EXTENT_ROOT_MAX, 0,
+			       UINT64_MAX);
+out:
+	for (i = 0; i < depth; i++)
+		free(w.bufs[i]);
+	return ret;
+}
+
+struct read_data {
+	const struct bfs_image *img;
+	uint8_t  *buf;
+	uint64_t  nr_blocks;
+};
+
+static int read_extent(const struct basefs_extent *ex, void *arg)
+{
+	struct read_data *rd = arg;
+	uint64_t lblk = le64toh(ex->lblk);
+	uint64_t len = le32toh(ex->len);
+
+	if (lblk >= rd->nr_blocks)
+		return 0;
+	if (lblk + len > rd->nr_blocks)
+		len = rd->nr_blocks - lblk;
+	return bfs_read_blocks(rd->img, le64toh(ex->pblk), len,
+			       rd->buf + lblk * rd->img->block_size);
+}
+
+int bfs_read_data(const struct bfs_image *img, const struct basefs_inode *di,
+		  uint8_t **data, uint64_t *size)
+{
+	uint64_t bytes = le64toh(di->size);
+	struct read_data rd;
+	int ret;
+
+	/* Part of it would be past *di, in the rest of the inode. */
+	if (le32toh(di->flags) & BASEFS_INODE_INLINE_DATA)
+		return -EOPNOTSUPP;
+
+	rd.img = img;
+	rd.nr_blocks = (bytes + img->block_size - 1) / img->block_size;
+	rd.buf = calloc(1, rd.nr_blocks * img->block_size + 1);
+	if (!rd.buf)
+		return -ENOMEM;
+
+	ret = bfs_for_each_extent(img, di, read_extent, NULL, &rd);
+	if (ret) {
+		free(rd.buf);
+		return ret;
+	}
+
+	*data = rd.buf;
+	*size = bytes;
+	return 0;
+}
+
+/*
+ * bfs_for_each_dirent - Call 'fn' for every used entry of directory 'dir'.
+ * 'name' is NUL-terminated.  A nonzero return from 'fn' stops the walk and
+ * is returned.  Malformed entries end the walk with -EUCLEAN.
+ */
+int bfs_for_each_dirent(const struct bfs_image *img,
+			const struct basefs_inode *dir, bfs_dirent_fn fn,
+			void *arg)
+{
+	const struct basefs_dir_entry *de;
+	char name[BASEFS_NAME_LEN + 1];
+	uint8_t *data;
+	uint64_t size, off = 0;
+	uint32_t rec, in_block;
+	int ret;
+
+	ret = bfs_read_data(img, dir, &data, &size);
+	if (ret)
+		return ret;
+
+	while (off < size) {
+		de = (const struct basefs_dir_entry *)(data + off);
+		rec = le32toh(de->rec_len);
+		in_block = img->block_size - (uint32_t)(off % img->block_size);
+		if (rec < sizeof(*de) || rec > in_block || rec % BASEFS_DIR_PAD ||
+		    sizeof(*de) + de->name_len > rec) {
+			ret = -EUCLEAN;
+			break;
+		}
+		if (de->inode) {
+			memcpy(name, de->name, de->name_len);
+			name[de->name_len] = '\0';
+			ret = fn(de, name, arg);
+			if (ret)
+				break;
+		}
+		off += rec;
+	}
+
+	free(data);
+	return ret;
+}
@@ -0,0 +1,100 @@
+#ifndef _BASEFS_LIBBASEFS_H
+#define _BASEFS_LIBBASEFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "basefs_disk.h"
+
+/*
+ * Helpers shared by the user-space tools that read existing images
+ * (dumpfs, ...).  Functions return 0 or a negative errno.
+ *
+ * The superblock and group descriptors are kept in their on-disk (little
+ * endian) form; the geometry fields the tools use all the time are
+ * converted once into host order.
+ */
+struct bfs_image {
+	int       fd;
+	const char *path;
+	struct basefs_super_block sb;
+	struct basefs_group_desc *gdt;
+
+	uint32_t  block_size;
+	uint32_t  inode_size;
+	uint32_t  blocks_per_group;
+	uint32_t  inodes_per_group;
+	uint32_t  groups_count;
+	uint32_t  itable_blocks;
+	uint64_t  blocks_count;
+	uint64_t  inodes_count;
+	uint64_t  first_group_block;
+
+	int       sb_csum_bad;     /* checksum feature set, checksum wrong */
+};
+
+int  bfs_open(struct bfs_image *img, const char *path, int writable);
+void bfs_close(struct bfs_image *img);
+
+int bfs_read_blocks(const struct bfs_image *img, uint64_t blk, uint64_t nr,
+		    void *buf);
+int bfs_write_blocks(const struct bfs_image *img, uint64_t blk, uint64_t nr,
+		     const void *buf);
+int bfs_super_csum_ok(const struct bfs_image *img);
+int bfs_write_super(struct bfs_image *img);
+int bfs_write_gdt(struct bfs_image *img);
+
+uint64_t bfs_group_start(const struct bfs_image *img, uint32_t group);
+uint32_t bfs_group_len(const struct bfs_image *img, uint32_t group);
+uint64_t bfs_inode_block(const struct bfs_image *img, uint64_t ino,
+			 uint32_t *offset);
+
+int bfs_read_inode(const struct bfs_image *img, uint64_t ino,
+		   struct basefs_inode *di);
+int bfs_write_inode(const struct bfs_image *img, uint64_t ino,
+		    const struct basefs_inode *di);
+
+/*
+ * bfs_for_each_extent - Call 'fn' for every extent of the inode in
+ * logical order, whether they are inline or in an extent tree, and
+ * 'node' (if not NULL) for every tree block before it is read.  A
+ * nonzero return from either stops the walk and is returned.  A
+ * malformed map ends the walk with -EUCLEAN.
+ */
+typedef int (*bfs_extent_fn)(const struct basefs_extent *ex, void *arg);
+typedef int (*bfs_node_fn)(uint64_t blk, void *arg);
+int bfs_for_each_extent(const struct bfs_image *img,
+			const struct basefs_inode *di, bfs_extent_fn fn,
+			bfs_node_fn node, void *arg);
+
+/*
+ * bfs_read_data - Read the first 'size' bytes of the inode's data into a
+ * freshly malloc()ed buffer (holes read as zeroes).  Files with inline
+ * data are not supported (-EOPNOTSUPP): their data is in the inode.
+ */
+int bfs_read_data(const struct bfs_image *img, const struct basefs_inode *di,
+		  uint8_t **data, uint64_t *size);
+
+typedef int (*bfs_dirent_fn)(const struct basefs_dir_entry *de,
+			     const char *name, void *arg);
+int bfs_for_each_dirent(const struct bfs_image *img,
+			const struct basefs_inode *dir, bfs_dirent_fn fn,
+			void *arg);
+
+static inline int bfs_test_bit(const uint8_t *map, uint64_t nr)
+{
+	return (map[nr >> 3] >> (nr & 7)) & 1;
+}
+
+static inline void bfs_set_bit(uint8_t *map, uint64_t nr)
+{
+	map[nr >> 3] |= (uint8_t)(1U << (nr & 7));
+}
+
+static inline void bfs_clear_bit(uint8_t *map, uint64_t nr)
+{
+	map[nr >> 3] &= (uint8_t)~(1U << (nr & 7));
+}
+
+#endif /* _BASEFS_LIBBASEFS_H */
@@ -1,86 +1,1524 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "basefs_disk.h"
+#include "diskio.h"
 
-#define BASEFS_MAGIC               0x62617365
 #define BASEFS_DEFAULT_BLOCK_SIZE  4096
+#define BASEFS_DEFAULT_INODE_SIZE  BASEFS_MIN_INODE_SIZE
+#define BASEFS_DEFAULT_INODE_RATIO (16 * 1024)  /* bytes of data per inode */
+#define BASEFS_DEFAULT_INDEX_BLOCKS 16
+#define BASEFS_RESIZE_FACTOR       1024  /* default growth room for resizefs */
+#define BASEFS_MAX_RESERVED_GDT    1024
+#define BASEFS_MAX_JOURNAL_BLOCKS  16384 /* largest default journal */
 
 /*
- * This structure should match the on-disk BaseFS super_block layout.
- * We only need minimal fields for a demonstration.
+ * Geometry of the image being built.  Everything is in host order and
+ * in blocks unless noted otherwise; see basefs_disk.h for the layout.
  */
-struct basefs_super_block {
-	uint32_t magic;
+struct mkfs_layout {
+	uint32_t block_size;
+	uint32_t inode_size;
+	uint32_t blocks_per_group;
+	uint32_t inodes_per_group;
+	uint32_t itable_blocks;
+	uint32_t groups_count;
+	uint32_t gdt_blocks;
+	uint32_t reserved_gdt_blocks;
+	uint32_t index_blocks;
+	uint32_t journal_blocks;
 	uint64_t blocks_count;
-	uint64_t inodes_count;
+	uint64_t gdt_start;
+	uint64_t index_start;
+	uint64_t journal_start;
+	uint64_t first_group_block;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <image-file> <number-of-blocks>\n"
+		"  -d dir    copy the contents of 'dir', and their user.* xattrs,\n"
+		"            into the image\n"
+		"  -o file   lay out file data in the order listed in 'file'\n"
+		"  -r        reproducible: fixed timestamps, owner 0:0, derived uuid\n"
+		"  -T secs   timestamp used by -r (default $SOURCE_DATE_EPOCH or 0)\n"
+		"  -b size   block size in bytes (default %d)\n"
+		"  -I size   inode size in bytes (default %d); files of up to\n"
+		"            size - 128 bytes (at most 4096) are kept in the inode\n"
+		"  -i ratio  bytes of data per inode (default %d)\n"
+		"  -x count  blocks reserved for the root index (default %d)\n"
+		"  -G count  spare descriptor blocks for growing the image later\n"
+		"            (default: room for %dx growth, at most %d blocks)\n"
+		"  -J count  blocks for the metadata journal, 0 for none\n"
+		"            (default: 1/64 of the image, %d to %d blocks)\n"
+		"  -Z        write zeroes over the whole image instead of leaving it sparse;\n"
+		"            otherwise the unused part of each inode table is not written\n"
+		"            and the kernel zeroes it after mount\n"
+		"  -q depth  number of writes kept in flight (default %d)\n"
+		"  -D        open the image with O_DIRECT\n"
+		"  -R        register the write buffers with io_uring\n"
+		"  -P        use synchronous pwrite() instead of io_uring\n",
+		prog, BASEFS_DEFAULT_BLOCK_SIZE, BASEFS_DEFAULT_INODE_SIZE,
+		BASEFS_DEFAULT_INODE_RATIO, BASEFS_DEFAULT_INDEX_BLOCKS,
+		BASEFS_RESIZE_FACTOR, BASEFS_MAX_RESERVED_GDT,
+		BASEFS_JOURNAL_MIN_BLOCKS, BASEFS_MAX_JOURNAL_BLOCKS,
+		DISKIO_DEFAULT_QUEUE_DEPTH);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int is_power_of_2(uint32_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+static void set_bit_le(uint8_t *map, uint32_t nr)
+{
+	map[nr >> 3] |= (uint8_t)(1U << (nr & 7));
+}
+
+/*
+ * compute_layout - Fill in the geometry for an image of 'blocks_count'
+ * blocks.  The tail is trimmed if it is too small to hold a group's
+ * metadata plus at least one data block.  Returns 0 or -1 with a message.
+ */
+static int compute_layout(struct mkfs_layout *l, uint64_t blocks_count,
+			  uint32_t inode_ratio)
+{
+	uint32_t inodes_per_block = l->block_size / l->inode_size;
+	uint64_t ipg;
+	uint64_t max_gdt;
+	uint64_t groups;
+	uint64_t fixed;
+	uint64_t last_len;
+
+	l->blocks_per_group = l->block_size * 8;
+
+	/*
+	 * Unless -J said otherwise, 1/64 of the image goes to the journal.
+	 * Images too small to give it its minimum size without losing an
+	 * eighth of their space get none.
+	 */
+	if (l->journal_blocks == UINT32_MAX) {
+		uint64_t jb = blocks_count / 64;
+
+		if (jb < BASEFS_JOURNAL_MIN_BLOCKS)
+			jb = BASEFS_JOURNAL_MIN_BLOCKS;
+		if (jb > BASEFS_MAX_JOURNAL_BLOCKS)
+			jb = BASEFS_MAX_JOURNAL_BLOCKS;
+		l->journal_blocks = jb > blocks_count / 8 ? 0 : (uint32_t)jb;
+	}
+
+	/*
+	 * The descriptor table size depends on the group count, which
+	 * depends on the fixed area.  Sizing it for the upper bound of
+	 * groups is good enough: the real count can only be lower.
+	 */
+	fixed = 1 + (uint64_t)l->index_blocks + l->journal_blocks;
+	if (blocks_count <= fixed)
+		goto too_small;
+	groups = (blocks_count - fixed + l->blocks_per_group - 1) /
+		 l->blocks_per_group;
+	l->gdt_blocks = (uint32_t)((groups * sizeof(struct basefs_group_desc) +
+				    l->block_size - 1) / l->block_size);
+
+	/* Unless -G said otherwise, leave room to grow BASEFS_RESIZE_FACTOR times. */
+	if (l->reserved_gdt_blocks == UINT32_MAX) {
+		max_gdt = (groups * BASEFS_RESIZE_FACTOR *
+			   sizeof(struct basefs_group_desc) + l->block_size - 1) /
+			  l->block_size;
+		if (max_gdt > l->gdt_blocks + (uint64_t)BASEFS_MAX_RESERVED_GDT)
+			max_gdt = l->gdt_blocks + (uint64_t)BASEFS_MAX_RESERVED_GDT;
+		l->reserved_gdt_blocks = (uint32_t)(max_gdt - l->gdt_blocks);
+	}
+
+	l->gdt_start = 1;
+	l->index_start = l->gdt_start + l->gdt_blocks + l->reserved_gdt_blocks;
+	l->journal_start = l->index_start + l->index_blocks;
+	l->first_group_block = l->journal_start + l->journal_blocks;
+	fixed = l->first_group_block;
+	if (blocks_count <= fixed)
+		goto too_small;
+
+	groups = (blocks_count - fixed + l->blocks_per_group - 1) /
+		 l->blocks_per_group;
+
+	/*
+	 * Spread the inodes the ratio asks for evenly over the groups, in
+	 * whole inode table blocks, limited by what one inode bitmap covers.
+	 */
+	ipg = blocks_count * l->block_size / inode_ratio;
+	ipg = (ipg + groups - 1) / groups;
+	ipg = (ipg + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+	if (ipg < inodes_per_block)
+		ipg = inodes_per_block;
+	if (ipg > l->block_size * 8)
+		ipg = l->block_size * 8;
+	l->inodes_per_group = (uint32_t)ipg;
+	l->itable_blocks = l->inodes_per_group / inodes_per_block;
+
+	last_len = blocks_count - fixed - (groups - 1) * l->blocks_per_group;
+	if (last_len < basefs_group_overhead(l->itable_blocks) + 1) {
+		groups--;
+		blocks_count = fixed + groups * l->blocks_per_group;
+	}
+	if (!groups)
+		goto too_small;
+
+	l->groups_count = (uint32_t)groups;
+	l->blocks_count = blocks_count;
+	return 0;
+
+too_small:
+	fprintf(stderr, "Image of %llu blocks is too small for BaseFS.\n",
+		(unsigned long long)blocks_count);
+	return -1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Source tree.  Every file, directory and symlink copied into the image
+ * gets a node.  Nodes are created breadth first with the entries of each
+ * directory sorted by name (strcmp, not the locale), and the inode number
+ * is the position in that order.  This makes the numbering stable across
+ * runs and machines, and puts all entries of a directory in consecutive
+ * inode table slots.
+ */
+struct mkfs_extent {
+	uint64_t lblk;
+	uint64_t pblk;
+	uint32_t len;
+};
+
+/* The xattrs of one node in its inode's tail, or of several in a block. */
+struct mkfs_xattrs {
+	uint8_t  *area;               /* sorted entries, see basefs_disk.h */
+	uint32_t  len;
+	int       tail;
+	uint32_t  refcount;           /* nodes sharing the block */
+	uint64_t  blk;
+};
+
+struct mkfs_node {
+	char              *path;      /* path on the host */
+	char              *rel;       /* path relative to the source root */
+	const char        *name;      /* last component, points into rel */
+	struct stat        st;
+	uint64_t           ino;
+	struct mkfs_node **children;  /* directories only */
+	uint32_t           nr_children;
+	uint32_t           nr_subdirs;
+	uint64_t           size;      /* bytes of data stored in blocks */
+	uint32_t           nr_extents;
+	struct mkfs_extent extents[BASEFS_INLINE_EXTENTS];
+	int                placed;
+	int                inline_data;  /* file data kept in the inode */
+	struct mkfs_xattrs *xattrs;     /* user.* attributes, or NULL */
+};
+
+struct mkfs_tree {
+	struct mkfs_node **nodes;     /* nodes[ino - 1] */
+	uint64_t           nr_nodes;
+	uint64_t           cap;
+	struct mkfs_node **order;     /* nodes with data, in placement order */
+	uint64_t           nr_order;
+	uint64_t           nr_inline;   /* files with inline data */
+	uint64_t           nr_xattr;    /* nodes with attributes */
+	struct mkfs_xattrs **xblocks;   /* xattr blocks, in block order */
+	uint64_t           nr_xblocks;
+};
+
+struct mkfs_opts {
+	const char *src_dir;          /* populate from here, or NULL */
+	const char *order_file;       /* data placement order, or NULL */
+	int         reproducible;
+	uint64_t    fixed_time;       /* used when reproducible */
+	int         zero_fill;
+};
+
+/* Block allocation cursor: data is laid out front to back. */
+struct mkfs_alloc {
+	const struct mkfs_layout *l;
+	uint32_t  group;
+	uint64_t  next;
+	uint32_t *used;               /* data blocks used, per group */
 };
 
+static void *xcalloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static char *xasprintf_path(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *p = xcalloc(1, len);
+
+	snprintf(p, len, "%s%s%s", dir, *dir ? "/" : "", name);
+	return p;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int cmp_node_rel(const void *a, const void *b)
+{
+	const struct mkfs_node *na = *(const struct mkfs_node *const *)a;
+	const struct mkfs_node *nb = *(const struct mkfs_node *const *)b;
+
+	return strcmp(na->rel, nb->rel);
+}
+
+static uint8_t mode_to_ftype(mode_t mode)
+{
+	if (S_ISREG(mode))
+		return BASEFS_FT_REG_FILE;
+	if (S_ISDIR(mode))
+		return BASEFS_FT_DIR;
+	if (S_ISLNK(mode))
+		return BASEFS_FT_SYMLINK;
+	return BASEFS_FT_UNKNOWN;
+}
+
+static struct mkfs_node *tree_add(struct mkfs_tree *t, char *path, char *rel)
+{
+	struct mkfs_node *n = xcalloc(1, sizeof(*n));
+	const char *slash;
+
+	if (t->nr_nodes == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 1024;
+		t->nodes = realloc(t->nodes, t->cap * sizeof(*t->nodes));
+		if (!t->nodes) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	n->path = path;
+	n->rel = rel;
+	slash = strrchr(rel, '/');
+	n->name = slash ? slash + 1 : rel;
+	n->ino = BASEFS_ROOT_INO + t->nr_nodes;
+	t->nodes[t->nr_nodes++] = n;
+	return n;
+}
+
+/*
+ * scan_dir - Read the entries of directory node 'dir', sorted by name, and
+ * append a node for each supported one.  Device nodes, fifos and sockets
+ * are skipped with a warning.
+ */
+static int scan_dir(struct mkfs_tree *t, struct mkfs_node *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	char **names = NULL;
+	size_t nr = 0, cap = 0, i;
+	struct mkfs_node *n;
+
+	d = opendir(dir->path);
+	if (!d) {
+		perror(dir->path);
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (strlen(de->d_name) > BASEFS_NAME_LEN) {
+			fprintf(stderr, "%s/%s: name too long\n",
+				dir->path, de->d_name);
+			closedir(d);
+			return -1;
+		}
+		if (nr == cap) {
+			cap = cap ? cap * 2 : 64;
+			names = realloc(names, cap * sizeof(*names));
+			if (!names) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		names[nr++] = strdup(de->d_name);
+	}
+	closedir(d);
+
+	qsort(names, nr, sizeof(*names), cmp_name);
+	dir->children = xcalloc(nr ? nr : 1, sizeof(*dir->children));
+
+	for (i = 0; i < nr; i++) {
+		char *path = xasprintf_path(dir->path, names[i]);
+		struct stat st;
+
+		if (lstat(path, &st) < 0) {
+			perror(path);
+			return -1;
+		}
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) &&
+		    !S_ISLNK(st.st_mode)) {
+			fprintf(stderr, "%s: skipping special file\n", path);
+			free(path);
+			continue;
+		}
+		n = tree_add(t, path, xasprintf_path(dir->rel, names[i]));
+		n->st = st;
+		dir->children[dir->nr_children++] = n;
+		if (S_ISDIR(st.st_mode))
+			dir->nr_subdirs++;
+	}
+
+	for (i = 0; i < nr; i++)
+		free(names[i]);
+	free(names);
+	return 0;
+}
+
+/*
+ * build_tree - Create the node list.  Without a source directory the
+ * image just gets an empty root directory.
+ */
+static int build_tree(struct mkfs_tree *t, const struct mkfs_opts *o)
+{
+	struct mkfs_node *root;
+	uint64_t i;
+
+	memset(t, 0, sizeof(*t));
+	root = tree_add(t, strdup(o->src_dir ? o->src_dir : ""), strdup(""));
+
+	if (!o->src_dir) {
+		root->st.st_mode = S_IFDIR | 0755;
+		root->st.st_mtime = root->st.st_atime = root->st.st_ctime =
+			time(NULL);
+		root->children = xcalloc(1, sizeof(*root->children));
+		return 0;
+	}
+
+	if (stat(o->src_dir, &root->st) < 0 || !S_ISDIR(root->st.st_mode)) {
+		fprintf(stderr, "%s: not a directory\n", o->src_dir);
+		return -1;
+	}
+
+	/* nodes[] doubles as the BFS queue. */
+	for (i = 0; i < t->nr_nodes; i++) {
+		if (S_ISDIR(t->nodes[i]->st.st_mode) &&
+		    scan_dir(t, t->nodes[i]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Bytes of directory data needed for 'dir'. */
+static uint64_t dir_data_size(const struct mkfs_node *dir, uint32_t bs)
+{
+	uint64_t blocks = 0;
+	uint32_t off = bs;
+	uint32_t rec;
+	uint32_t i;
+
+	for (i = 0; i < dir->nr_children; i++) {
+		rec = BASEFS_DIR_REC_LEN(strlen(dir->children[i]->name));
+		if (off + rec > bs) {
+			blocks++;
+			off = 0;
+		}
+		off += rec;
+	}
+	return blocks * bs;
+}
+
+/*
+ * alloc_run - Take up to 'want' blocks at the cursor, up to where the
+ * next group's metadata sits in the way.  Returns how many, with the
+ * first in *pblk, or 0 if the image is full.
+ */
+static uint32_t alloc_run(struct mkfs_alloc *a, uint64_t want, uint64_t *pblk)
+{
+	const struct mkfs_layout *l = a->l;
+	uint64_t end;
+	uint32_t len;
+
+	for (;;) {
+		if (a->group >= l->groups_count)
+			return 0;
+		end = basefs_group_first_block(l->first_group_block,
+					       l->blocks_per_group, a->group) +
+		      basefs_group_nr_blocks(l->blocks_count,
+					     l->first_group_block,
+					     l->blocks_per_group, a->group);
+		if (a->next < end)
+			break;
+		if (++a->group >= l->groups_count)
+			return 0;
+		a->next = basefs_group_first_block(l->first_group_block,
+						   l->blocks_per_group,
+						   a->group) +
+			  basefs_group_overhead(l->itable_blocks);
+	}
+
+	len = (uint32_t)(end - a->next < want ? end - a->next : want);
+	*pblk = a->next;
+	a->used[a->group] += len;
+	a->next += len;
+	return len;
+}
+
+/*
+ * place_node - Allocate the data blocks of 'n' at the cursor.  Extents only
+ * break where a group's metadata sits in the way.
+ */
+static int place_node(struct mkfs_tree *t, struct mkfs_alloc *a,
+		      struct mkfs_node *n)
+{
+	const struct mkfs_layout *l = a->l;
+	uint64_t want = (n->size + l->block_size - 1) / l->block_size;
+	uint64_t lblk = 0, pblk;
+	uint32_t len;
+
+	n->placed = 1;
+	if (!want)
+		return 0;
+
+	while (want) {
+		if (n->nr_extents == BASEFS_INLINE_EXTENTS) {
+			fprintf(stderr, "%s: needs more than %zu extents\n",
+				n->path, BASEFS_INLINE_EXTENTS);
+			return -1;
+		}
+		len = alloc_run(a, want, &pblk);
+		if (!len) {
+			fprintf(stderr, "Image is full while placing %s.\n",
+				n->path);
+			return -1;
+		}
+		n->extents[n->nr_extents].lblk = lblk;
+		n->extents[n->nr_extents].pblk = pblk;
+		n->extents[n->nr_extents].len = len;
+		n->nr_extents++;
+		lblk += len;
+		want -= len;
+	}
+
+	t->order[t->nr_order++] = n;
+	return 0;
+}
+
+/* One user.* attribute while an area is being put together. */
+struct mkfs_xattr {
+	char     *name;               /* without the prefix */
+	size_t    name_len;
+	uint8_t  *value;
+	size_t    value_len;
+};
+
+static int cmp_xattr(const void *a, const void *b)
+{
+	const struct mkfs_xattr *x = a, *y = b;
+
+	if (x->name_len != y->name_len)
+		return x->name_len < y->name_len ? -1 : 1;
+	return memcmp(x->name, y->name, x->name_len);
+}
+
+/*
+ * read_xattrs - Build the xattr area of 'n' from the user.* attributes
+ * of its source: in its inode's tail if they fit there and inline data
+ * does not need it, in a block otherwise (see place_xattrs()).  Trusted
+ * and security attributes belong to the host and are not copied.  A
+ * source without xattr support just has none.
+ */
+static int read_xattrs(struct mkfs_tree *t, struct mkfs_node *n,
+		       const struct mkfs_layout *l)
+{
+	uint32_t tail = l->inode_size - sizeof(struct basefs_inode);
+	uint32_t cap = l->block_size - sizeof(struct basefs_xattr_header);
+	struct basefs_xattr_entry *e;
+	struct mkfs_xattr *xs = NULL;
+	size_t nr = 0, cap_xs = 0, i;
+	uint64_t total = 0, off;
+	char *names = NULL, *p;
+	ssize_t len, vlen;
+	int ret = 0;
+
+	if (S_ISLNK(n->st.st_mode))
+		return 0;
+	len = llistxattr(n->path, NULL, 0);
+	if (len > 0) {
+		names = xcalloc(1, (size_t)len);
+		len = llistxattr(n->path, names, (size_t)len);
+	}
+	if (len < 0 && errno != ENOTSUP) {
+		perror(n->path);
+		free(names);
+		return -1;
+	}
+
+	for (p = names; len > 0 && p < names + len; p += strlen(p) + 1) {
+		if (strncmp(p, "user.", 5) || !p[5])
+			continue;
+		if (nr == cap_xs) {
+			cap_xs = cap_xs ? cap_xs * 2 : 8;
+			xs = realloc(xs, cap_xs * sizeof(*xs));
+			if (!xs) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		xs[nr].name = p + 5;
+		xs[nr].name_len = strlen(p + 5);
+		xs[nr].value = NULL;
+		vlen = lgetxattr(n->path, p, NULL, 0);
+		if (vlen >= 0) {
+			xs[nr].value = xcalloc(1, vlen ? (size_t)vlen : 1);
+			vlen = lgetxattr(n->path, p, xs[nr].value, (size_t)vlen);
+		}
+		xs[nr].value_len = vlen > 0 ? (size_t)vlen : 0;
+		nr++;
+		if (vlen < 0) {
+			perror(n->path);
+			ret = -1;
+			break;
+		}
+		total += BASEFS_XATTR_ENTRY_LEN(xs[nr - 1].name_len,
+						xs[nr - 1].value_len);
+	}
+	if (!ret && total > cap) {
+		fprintf(stderr, "%s: xattrs need %llu bytes, more than a block holds\n",
+			n->path, (unsigned long long)total);
+		ret = -1;
+	}
+
+	if (!ret && nr) {
+		qsort(xs, nr, sizeof(*xs), cmp_xattr);
+		n->xattrs = xcalloc(1, sizeof(*n->xattrs));
+		n->xattrs->area = xcalloc(1, (size_t)total);
+		n->xattrs->len = (uint32_t)total;
+		n->xattrs->tail = total <= tail &&
+				  (!n->inline_data ||
+				   n->st.st_size <= BASEFS_INODE_DATA_SIZE);
+		for (i = 0, off = 0; i < nr; i++) {
+			e = (struct basefs_xattr_entry *)(n->xattrs->area + off);
+			e->name_len = (uint8_t)xs[i].name_len;
+			e->name_index = BASEFS_XATTR_INDEX_USER;
+			e->value_len = htole32((uint32_t)xs[i].value_len);
+			memcpy(e->name, xs[i].name, xs[i].name_len);
+			memcpy(e->name + xs[i].name_len, xs[i].value,
+			       xs[i].value_len);
+			off += BASEFS_XATTR_ENTRY_LEN(xs[i].name_len,
+						      xs[i].value_len);
+		}
+		t->nr_xattr++;
+	}
+
+	for (i = 0; i < nr; i++)
+		free(xs[i].value);
+	free(xs);
+	free(names);
+	return ret;
+}
+
+static int cmp_node_xattrs(const void *a, const void *b)
+{
+	const struct mkfs_node *na = *(const struct mkfs_node *const *)a;
+	const struct mkfs_node *nb = *(const struct mkfs_node *const *)b;
+	int ret;
+
+	if (na->xattrs->len != nb->xattrs->len)
+		return na->xattrs->len < nb->xattrs->len ? -1 : 1;
+	ret = memcmp(na->xattrs->area, nb->xattrs->area, na->xattrs->len);
+	if (ret)
+		return ret;
+	return na->ino < nb->ino ? -1 : 1;
+}
+
+/*
+ * place_xattrs - Give the nodes whose attributes are not in their tail
+ * xattr blocks, after all file data.  Nodes with the same attributes
+ * (the samples of one class, say) share a block, up to
+ * BASEFS_XATTR_REFCOUNT_MAX nodes each, as the kernel would share it.
+ */
+static int place_xattrs(struct mkfs_tree *t, struct mkfs_alloc *a)
+{
+	struct mkfs_xattrs *x = NULL;
+	struct mkfs_node **nodes, *n;
+	uint64_t i, nr = 0, blk;
+
+	nodes = xcalloc(t->nr_nodes, sizeof(*nodes));
+	for (i = 0; i < t->nr_nodes; i++) {
+		n = t->nodes[i];
+		if (n->xattrs && !n->xattrs->tail)
+			nodes[nr++] = n;
+	}
+	qsort(nodes, nr, sizeof(*nodes), cmp_node_xattrs);
+
+	t->xblocks = xcalloc(nr ? nr : 1, sizeof(*t->xblocks));
+	for (i = 0; i < nr; i++) {
+		n = nodes[i];
+		if (x && x->refcount < BASEFS_XATTR_REFCOUNT_MAX &&
+		    x->len == n->xattrs->len &&
+		    !memcmp(x->area, n->xattrs->area, x->len)) {
+			free(n->xattrs->area);
+			free(n->xattrs);
+			n->xattrs = x;
+			x->refcount++;
+			continue;
+		}
+		if (!alloc_run(a, 1, &blk)) {
+			fprintf(stderr, "Image is full while placing xattrs of %s.\n",
+				n->path);
+			free(nodes);
+			return -1;
+		}
+		x = n->xattrs;
+		x->blk = blk;
+		x->refcount = 1;
+		t->xblocks[t->nr_xblocks++] = x;
+	}
+	free(nodes);
+	return 0;
+}
+
+/*
+ * read_order_file - Place the files listed in 'file' (one path relative
+ * to the source directory per line, e.g. the sample order of the first
+ * training epoch) in that order.
+ */
+static int read_order_file(struct mkfs_tree *t, struct mkfs_alloc *a,
+			   const char *file)
+{
+	struct mkfs_node **by_rel;
+	struct mkfs_node key, *keyp = &key, **hit;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(file, "r");
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+
+	by_rel = xcalloc(t->nr_nodes, sizeof(*by_rel));
+	memcpy(by_rel, t->nodes, t->nr_nodes * sizeof(*by_rel));
+	qsort(by_rel, t->nr_nodes, sizeof(*by_rel), cmp_node_rel);
+
+	while ((len = getline(&line, &cap, f)) >= 0) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		key.rel = line;
+		while (key.rel[0] == '/' ||
+		       (key.rel[0] == '.' && key.rel[1] == '/'))
+			key.rel += key.rel[0] == '/' ? 1 : 2;
+		if (!key.rel[0] || key.rel[0] == '#')
+			continue;
+
+		hit = bsearch(&keyp, by_rel, t->nr_nodes, sizeof(*by_rel),
+			      cmp_node_rel);
+		if (!hit || S_ISDIR((*hit)->st.st_mode)) {
+			fprintf(stderr, "%s: '%s' is not a file in the source, ignored\n",
+				file, key.rel);
+			continue;
+		}
+		if ((*hit)->placed)
+			continue;
+		ret = place_node(t, a, *hit);
+		if (ret)
+			break;
+	}
+
+	free(line);
+	free(by_rel);
+	fclose(f);
+	return ret;
+}
+
+/*
+ * place_data - Decide where every node's data goes: all directory blocks
+ * first (so a tree walk reads one dense region), then the files from the
+ * order file, then everything else in inode order, then the xattr
+ * blocks.  Files small enough for the inode go there and need no blocks.
+ */
+static int place_data(struct mkfs_tree *t, struct mkfs_alloc *a,
+		      const struct mkfs_opts *o)
+{
+	const struct mkfs_layout *l = a->l;
+	struct mkfs_node *n;
+	uint64_t i;
+
+	t->order = xcalloc(t->nr_nodes, sizeof(*t->order));
+	a->group = 0;
+	a->next = l->first_group_block + basefs_group_overhead(l->itable_blocks);
+
+	for (i = 0; i < t->nr_nodes; i++) {
+		n = t->nodes[i];
+		if (S_ISDIR(n->st.st_mode)) {
+			n->size = dir_data_size(n, l->block_size);
+			if (place_node(t, a, n))
+				return -1;
+		} else if (S_ISREG(n->st.st_mode) && n->st.st_size > 0 &&
+			   (uint64_t)n->st.st_size <=
+			   basefs_inline_data_max(l->inode_size)) {
+			n->inline_data = 1;
+			t->nr_inline++;
+		} else if (S_ISREG(n->st.st_mode)) {
+			n->size = (uint64_t)n->st.st_size;
+		} else if ((uint64_t)n->st.st_size >= BASEFS_INODE_DATA_SIZE) {
+			/* Symlink target too long for the inode. */
+			n->size = (uint64_t)n->st.st_size;
+		}
+		if (o->src_dir && read_xattrs(t, n, l))
+			return -1;
+	}
+
+	if (o->order_file && read_order_file(t, a, o->order_file))
+		return -1;
+
+	for (i = 0; i < t->nr_nodes; i++) {
+		n = t->nodes[i];
+		if (!n->placed && place_node(t, a, n))
+			return -1;
+	}
+	return place_xattrs(t, a);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+ * fill_uuid - Random uuid, or in reproducible mode one derived from the
+ * tree (names, types, sizes) and the fixed timestamp, so that the same
+ * input always yields the same image.
+ */
+static void fill_uuid(uint8_t *uuid, const struct mkfs_tree *t,
+		      const struct mkfs_opts *o)
+{
+	uint64_t h1 = 0xcbf29ce484222325ULL;
+	uint64_t h2 = 0x84222325cbf29ce4ULL;
+	const struct mkfs_node *n;
+	uint64_t i, v;
+	int fd;
+
+	if (o->reproducible) {
+		for (i = 0; i < t->nr_nodes; i++) {
+			n = t->nodes[i];
+			v = ((uint64_t)n->st.st_mode << 48) ^ n->size;
+			h1 = fnv1a(h1, n->rel, strlen(n->rel) + 1);
+			h1 = fnv1a(h1, &v, sizeof(v));
+			h2 = fnv1a(h2, &v, sizeof(v));
+			h2 = fnv1a(h2, n->rel, strlen(n->rel) + 1);
+		}
+		h1 = fnv1a(h1, &o->fixed_time, sizeof(o->fixed_time));
+		h2 = fnv1a(h2, &t->nr_nodes, sizeof(t->nr_nodes));
+		memcpy(uuid, &h1, 8);
+		memcpy(uuid + 8, &h2, 8);
+		return;
+	}
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0 && read(fd, uuid, 16) == 16) {
+		close(fd);
+		return;
+	}
+	if (fd >= 0)
+		close(fd);
+	v = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+	memcpy(uuid, &v, sizeof(v));
+	memcpy(uuid + 8, &v, sizeof(v));
+}
+
+/* read() until 'len' bytes or end of file. */
+static ssize_t read_full(int fd, uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = read(fd, buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += (size_t)ret;
+	}
+	return (ssize_t)done;
+}
+
+/* Read the data of a small file into its inode: 'data', then the tail. */
+static void fill_inline_data(struct basefs_inode *di,
+			     const struct mkfs_node *n)
+{
+	uint8_t buf[BASEFS_INLINE_DATA_LIMIT] = { 0 };
+	size_t size = (size_t)n->st.st_size;
+	size_t head = size < BASEFS_INODE_DATA_SIZE ? size :
+		      BASEFS_INODE_DATA_SIZE;
+	int fd;
+
+	fd = open(n->path, O_RDONLY);
+	if (fd < 0 || read_full(fd, buf, size) < 0)
+		perror(n->path);
+	if (fd >= 0)
+		close(fd);
+	memcpy(di->data, buf, head);
+	memcpy(di + 1, buf + head, size - head);
+}
+
+static void fill_inode(struct basefs_inode *di, const struct mkfs_node *n,
+		       const struct mkfs_opts *o)
+{
+	uint64_t blocks = 0;
+	uint32_t i;
+
+	di->mode = htole16((uint16_t)n->st.st_mode);
+	if (S_ISDIR(n->st.st_mode))
+		di->links_count = htole16((uint16_t)(2 + n->nr_subdirs));
+	else
+		di->links_count = htole16(1);
+
+	if (o->reproducible) {
+		di->atime = di->mtime = di->ctime = htole64(o->fixed_time);
+	} else {
+		di->uid   = htole32(n->st.st_uid);
+		di->gid   = htole32(n->st.st_gid);
+		di->atime = htole64((uint64_t)n->st.st_atime);
+		di->mtime = htole64((uint64_t)n->st.st_mtime);
+		di->ctime = htole64((uint64_t)n->st.st_ctime);
+	}
+
+	if (S_ISDIR(n->st.st_mode))
+		di->size = htole64(n->size);
+	else
+		di->size = htole64((uint64_t)n->st.st_size);
+
+	for (i = 0; i < n->nr_extents; i++) {
+		di->extents[i].lblk = htole64(n->extents[i].lblk);
+		di->extents[i].pblk = htole64(n->extents[i].pblk);
+		di->extents[i].len  = htole32(n->extents[i].len);
+		blocks += n->extents[i].len;
+	}
+	di->nr_extents = htole16((uint16_t)n->nr_extents);
+	di->blocks = htole64(blocks);
+
+	if (n->inline_data) {
+		di->flags = htole32(BASEFS_INODE_INLINE_DATA);
+		fill_inline_data(di, n);
+	}
+	if (n->xattrs && n->xattrs->tail) {
+		di->flags |= htole32(BASEFS_INODE_INLINE_XATTR);
+		memcpy(di + 1, n->xattrs->area, n->xattrs->len);
+	} else if (n->xattrs) {
+		di->xattr_block = htole64(n->xattrs->blk);
+	}
+
+	/* Short symlink targets live in the inode itself. */
+	if (S_ISLNK(n->st.st_mode) && !n->nr_extents &&
+	    readlink(n->path, di->symlink, BASEFS_INODE_DATA_SIZE) < 0)
+		perror(n->path);
+}
+
+/* Directory blocks of 'dir', packed the same way dir_data_size() counts. */
+static void fill_dir_blocks(uint8_t *buf, const struct mkfs_node *dir,
+			    uint32_t bs)
+{
+	struct basefs_dir_entry *de = NULL;
+	const struct mkfs_node *c;
+	uint8_t *blk = buf - bs;
+	uint32_t off = bs;
+	uint32_t rec, i;
+	size_t name_len;
+
+	for (i = 0; i < dir->nr_children; i++) {
+		c = dir->children[i];
+		name_len = strlen(c->name);
+		rec = BASEFS_DIR_REC_LEN(name_len);
+		if (off + rec > bs) {
+			if (de)
+				de->rec_len = htole32(le32toh(de->rec_len) +
+						      bs - off);
+			blk += bs;
+			off = 0;
+		}
+		de = (struct basefs_dir_entry *)(blk + off);
+		de->inode     = htole64(c->ino);
+		de->rec_len   = htole32(rec);
+		de->name_len  = (uint8_t)name_len;
+		de->file_type = mode_to_ftype(c->st.st_mode);
+		memcpy(de->name, c->name, name_len);
+		off += rec;
+	}
+	if (de)
+		de->rec_len = htole32(le32toh(de->rec_len) + bs - off);
+}
+
+/*
+ * write_node_data - Write the data blocks of 'n' as its extents describe.
+ * Partial last blocks are zero-padded so the image does not depend on
+ * what the file previously contained.
+ */
+static int write_node_data(struct diskio *io, const struct mkfs_layout *l,
+			   const struct mkfs_node *n, uint8_t *buf,
+			   size_t buf_size)
+{
+	uint32_t bs = l->block_size;
+	uint64_t remain = n->size;
+	uint64_t left, off, chunk;
+	uint32_t i;
+	ssize_t got;
+	int fd = -1;
+	int ret = 0;
+
+	if (S_ISDIR(n->st.st_mode)) {
+		uint8_t *dirbuf = xcalloc(1, n->size);
+
+		fill_dir_blocks(dirbuf, n, bs);
+		for (i = 0; i < n->nr_extents && !ret; i++)
+			ret = diskio_write(io,
+					   dirbuf + n->extents[i].lblk * bs,
+					   (size_t)n->extents[i].len * bs,
+					   n->extents[i].pblk * bs);
+		free(dirbuf);
+		return ret;
+	}
+
+	if (S_ISLNK(n->st.st_mode)) {
+		memset(buf, 0, bs);
+		if (readlink(n->path, (char *)buf, bs - 1) < 0)
+			perror(n->path);
+		return diskio_write(io, buf, bs, n->extents[0].pblk * bs);
+	}
+
+	fd = open(n->path, O_RDONLY);
+	if (fd < 0) {
+		perror(n->path);
+		return -errno;
+	}
+
+	for (i = 0; i < n->nr_extents && !ret; i++) {
+		off = n->extents[i].pblk * bs;
+		left = (uint64_t)n->extents[i].len * bs;
+		while (left && !ret) {
+			chunk = left < buf_size ? left : buf_size;
+			got = read_full(fd, buf, chunk < remain ? chunk : remain);
+			if (got < 0) {
+				perror(n->path);
+				ret = -errno;
+				break;
+			}
+			memset(buf + got, 0, chunk - (uint64_t)got);
+			ret = diskio_write(io, buf, chunk, off);
+			remain -= (uint64_t)got;
+			off += chunk;
+			left -= chunk;
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+/* An xattr block: the header, the entries, zeroes after them. */
+static int write_xattr_block(struct diskio *io, const struct mkfs_layout *l,
+			     const struct mkfs_xattrs *x, uint8_t *block)
+{
+	struct basefs_xattr_header *hdr = (struct basefs_xattr_header *)block;
+
+	memset(block, 0, l->block_size);
+	hdr->magic    = htole32(BASEFS_XATTR_MAGIC);
+	hdr->refcount = htole32(x->refcount);
+	hdr->hash     = htole32(basefs_crc32c(~0U, x->area, x->len));
+	memcpy(hdr + 1, x->area, x->len);
+	return diskio_write(io, block, l->block_size, x->blk * l->block_size);
+}
+
+/*
+ * write_journal - Write an empty journal: its superblock, with nothing to
+ * replay and sequence 1 expected next, and zeroes over the log so that
+ * no block left there by an earlier file system can pass for one of
+ * ours.  'block' is a scratch buffer of one block.
+ */
+static int write_journal(struct diskio *io, const struct mkfs_layout *l,
+			 uint8_t *block)
+{
+	struct basefs_journal_super *jsb = (struct basefs_journal_super *)block;
+	uint32_t bs = l->block_size;
+	int ret;
+
+	memset(block, 0, bs);
+	jsb->header.magic    = htole32(BASEFS_JOURNAL_MAGIC);
+	jsb->header.type     = htole32(BASEFS_JT_SUPER);
+	jsb->header.sequence = htole64(1);
+	jsb->block_size      = htole32(bs);
+	jsb->nr_blocks       = htole32(l->journal_blocks);
+	jsb->start           = 0;
+	jsb->checksum        = htole32(basefs_journal_super_csum(jsb));
+
+	ret = diskio_write(io, block, bs, l->journal_start * bs);
+	if (!ret)
+		ret = diskio_zero(io, (l->journal_start + 1) * bs,
+				  (uint64_t)(l->journal_blocks - 1) * bs);
+	return ret;
+}
+
+/*
+ * write_image - Emit superblock, descriptor table, index area, journal and every
+ * group's bitmaps and inode table, then the file data in placement order.
+ * Both passes go in increasing block order so that the write engine can
+ * merge them into large sequential requests.
+ */
+static int write_image(struct diskio *io, const struct mkfs_layout *l,
+		       const struct mkfs_tree *t, const struct mkfs_alloc *a,
+		       const struct mkfs_opts *o)
+{
+	uint32_t bs = l->block_size;
+	struct basefs_super_block *sb;
+	struct basefs_group_desc *gdt;
+	uint64_t gdt_bytes = (uint64_t)l->gdt_blocks * bs;
+	uint64_t itable_bytes = (uint64_t)l->itable_blocks * bs;
+	uint64_t free_blocks = 0;
+	uint64_t now = o->reproducible ? o->fixed_time : (uint64_t)time(NULL);
+	uint64_t first_ino, ino;
+	uint8_t *block;
+	uint8_t *itable;
+	uint8_t *buf;
+	uint32_t overhead = basefs_group_overhead(l->itable_blocks);
+	uint32_t g, i, len, used, inodes, dirs, init;
+	uint64_t start;
+	int lazy = 0, ret = -ENOMEM;
+
+	block = aligned_alloc(DISKIO_ALIGN, bs);
+	gdt = aligned_alloc(DISKIO_ALIGN, gdt_bytes);
+	itable = aligned_alloc(DISKIO_ALIGN, itable_bytes);
+	buf = aligned_alloc(DISKIO_ALIGN, DISKIO_DEFAULT_CHUNK_SIZE);
+	if (!block || !gdt || !itable || !buf)
+		goto out;
+	memset(gdt, 0, gdt_bytes);
+
+	/* Group descriptors first: the superblock needs their totals. */
+	for (g = 0; g < l->groups_count; g++) {
+		start = basefs_group_first_block(l->first_group_block,
+						 l->blocks_per_group, g);
+		len = basefs_group_nr_blocks(l->blocks_count,
+					     l->first_group_block,
+					     l->blocks_per_group, g);
+		first_ino = (uint64_t)g * l->inodes_per_group + 1;
+		inodes = 0;
+		dirs = 0;
+		for (ino = first_ino; ino <= t->nr_nodes &&
+		     ino < first_ino + l->inodes_per_group; ino++) {
+			inodes++;
+			if (S_ISDIR(t->nodes[ino - 1]->st.st_mode))
+				dirs++;
+		}
+
+		gdt[g].block_bitmap = htole64(start);
+		gdt[g].inode_bitmap = htole64(start + 1);
+		gdt[g].inode_table  = htole64(start + BASEFS_GROUP_META_BLOCKS);
+		gdt[g].free_blocks_count = htole32(len - overhead - a->used[g]);
+		gdt[g].free_inodes_count = htole32(l->inodes_per_group - inodes);
+		gdt[g].used_dirs_count = htole32(dirs);
+		free_blocks += len - overhead - a->used[g];
+
+		/* Only the table blocks holding inodes are written. */
+		init = (uint32_t)(((uint64_t)inodes * l->inode_size + bs - 1) / bs);
+		if (!o->zero_fill && init < l->itable_blocks) {
+			gdt[g].flags = htole16(BASEFS_BG_ITABLE_UNINIT);
+			gdt[g].itable_init = htole32(init);
+			lazy = 1;
+		}
+	}
+
+	memset(block, 0, bs);
+	sb = (struct basefs_super_block *)block;
+	sb->magic             = htole32(BASEFS_MAGIC);
+	sb->version           = htole32(BASEFS_FORMAT_VERSION);
+	sb->blocks_count      = htole64(l->blocks_count);
+	sb->inodes_count      = htole64((uint64_t)l->groups_count *
+					l->inodes_per_group);
+	sb->free_blocks_count = htole64(free_blocks);
+	sb->free_inodes_count = htole64((uint64_t)l->groups_count *
+					l->inodes_per_group - t->nr_nodes);
+	sb->block_size        = htole32(bs);
+	sb->inode_size        = htole32(l->inode_size);
+	sb->blocks_per_group  = htole32(l->blocks_per_group);
+	sb->inodes_per_group  = htole32(l->inodes_per_group);
+	sb->groups_count      = htole32(l->groups_count);
+	sb->itable_blocks     = htole32(l->itable_blocks);
+	sb->gdt_start         = htole64(l->gdt_start);
+	sb->gdt_blocks        = htole32(l->gdt_blocks);
+	sb->reserved_gdt_blocks = htole32(l->reserved_gdt_blocks);
+	sb->index_start       = htole64(l->index_start);
+	sb->index_blocks      = htole32(l->index_blocks);
+	sb->first_group_block = htole64(l->first_group_block);
+	sb->journal_start     = htole64(l->journal_blocks ? l->journal_start : 0);
+	sb->journal_blocks    = htole32(l->journal_blocks);
+	sb->feature_compat    = htole32((l->index_blocks ?
+					 BASEFS_FEATURE_COMPAT_INDEX_AREA : 0) |
+					(l->reserved_gdt_blocks ?
+					 BASEFS_FEATURE_COMPAT_RESIZE_GDT : 0) |
+					(l->journal_blocks ?
+					 BASEFS_FEATURE_COMPAT_JOURNAL : 0) |
+					(t->nr_xattr ?
+					 BASEFS_FEATURE_COMPAT_XATTR : 0));
+	sb->feature_ro_compat = htole32(BASEFS_FEATURE_RO_COMPAT_SB_CSUM |
+					(lazy ?
+					 BASEFS_FEATURE_RO_COMPAT_LAZY_ITABLE : 0));
+	sb->feature_incompat  = htole32(t->nr_inline ?
+					BASEFS_FEATURE_INCOMPAT_INLINE_DATA : 0);
+	sb->root_ino          = htole32(BASEFS_ROOT_INO);
+	sb->mkfs_time         = htole64(now);
+	sb->wtime             = htole64(now);
+	fill_uuid(sb->uuid, t, o);
+	sb->checksum          = htole32(basefs_super_csum(sb));
+
+	ret = diskio_write(io, block, bs, 0);
+	if (!ret)
+		ret = diskio_write(io, gdt, gdt_bytes, l->gdt_start * bs);
+	if (!ret)
+		ret = diskio_zero(io, (l->gdt_start + l->gdt_blocks) * bs,
+				  (uint64_t)l->reserved_gdt_blocks * bs);
+	if (!ret)
+		ret = diskio_zero(io, l->index_start * bs,
+				  (uint64_t)l->index_blocks * bs);
+	if (!ret && l->journal_blocks)
+		ret = write_journal(io, l, block);
+	if (ret)
+		goto out;
+
+	for (g = 0; g < l->groups_count; g++) {
+		start = basefs_group_first_block(l->first_group_block,
+						 l->blocks_per_group, g);
+		len = basefs_group_nr_blocks(l->blocks_count,
+					     l->first_group_block,
+					     l->blocks_per_group, g);
+		used = overhead + a->used[g];
+		first_ino = (uint64_t)g * l->inodes_per_group + 1;
+
+		/* Block bitmap: metadata and data are a prefix of the group. */
+		memset(block, 0, bs);
+		for (i = 0; i < used; i++)
+			set_bit_le(block, i);
+		for (i = len; i < l->blocks_per_group; i++)
+			set_bit_le(block, i);
+		ret = diskio_write(io, block, bs, start * bs);
+		if (ret)
+			goto out;
+
+		/* Inode bitmap: inodes are numbered densely from 1. */
+		memset(block, 0, bs);
+		for (ino = first_ino; ino <= t->nr_nodes &&
+		     ino < first_ino + l->inodes_per_group; ino++)
+			set_bit_le(block, (uint32_t)(ino - first_ino));
+		for (i = l->inodes_per_group; i < bs * 8; i++)
+			set_bit_le(block, i);
+		ret = diskio_write(io, block, bs, (start + 1) * bs);
+		if (ret)
+			goto out;
+
+		init = basefs_itable_init(&gdt[g], l->itable_blocks);
+		memset(itable, 0, (uint64_t)init * bs);
+		for (ino = first_ino; ino <= t->nr_nodes &&
+		     ino < first_ino + l->inodes_per_group; ino++)
+			fill_inode((struct basefs_inode *)
+				   (itable + (ino - first_ino) * l->inode_size),
+				   t->nodes[ino - 1], o);
+		if (init)
+			ret = diskio_write(io, itable, (uint64_t)init * bs,
+					   (start + BASEFS_GROUP_META_BLOCKS) * bs);
+		if (ret)
+			goto out;
+
+		if (o->zero_fill) {
+			ret = diskio_zero(io, (start + used) * bs,
+					  (uint64_t)(len - used) * bs);
+			if (ret)
+				goto out;
+		}
+	}
+
+	for (ino = 0; ino < t->nr_order; ino++) {
+		ret = write_node_data(io, l, t->order[ino], buf,
+				      DISKIO_DEFAULT_CHUNK_SIZE);
+		if (ret)
+			goto out;
+	}
+	for (ino = 0; ino < t->nr_xblocks; ino++) {
+		ret = write_xattr_block(io, l, t->xblocks[ino], block);
+		if (ret)
+			goto out;
+	}
+
+	ret = diskio_flush(io);
+out:
+	free(buf);
+	free(itable);
+	free(gdt);
+	free(block);
+	return ret;
+}
+
 /*
  * Usage:
- *   makefs <image-file> <number-of-blocks>
+ *   makefs [options] <image-file> <number-of-blocks>
  *
  * Example:
  *   makefs basefs.img 1024
- * This creates a ~4 MB file (1024 * 4096) and writes a minimal superblock.
+ * This creates a ~4 MB file (1024 * 4096) with a superblock, group
+ * descriptors, bitmaps, inode tables and an empty root directory.
+ *
+ *   makefs -r -d dataset/ -o epoch0.txt dataset.img 262144
+ * Copies dataset/ into the image.  The result only depends on the
+ * source contents, and files are stored in the order of epoch0.txt so
+ * that the first epoch reads the image front to back.
+ *
+ * All writes go through the diskio engine (diskio.c), which batches them
+ * into large aligned requests and keeps several in flight with io_uring.
  */
 int main(int argc, char *argv[])
 {
 	int fd;
+	int opt;
+	int ret;
+	int open_flags = O_CREAT | O_RDWR;
+	uint32_t inode_ratio = BASEFS_DEFAULT_INODE_RATIO;
 	uint64_t blocks_count;
 	uint64_t total_size;
-	struct basefs_super_block sb;
+	struct mkfs_layout layout;
+	struct mkfs_opts opts;
+	struct mkfs_tree tree;
+	struct mkfs_alloc alloc;
+	const char *epoch;
+	int fixed_time_set = 0;
+	struct diskio_opts io_opts;
+	struct diskio io;
+	struct stat st;
+	double start;
+
+	memset(&layout, 0, sizeof(layout));
+	layout.block_size = BASEFS_DEFAULT_BLOCK_SIZE;
+	layout.inode_size = BASEFS_DEFAULT_INODE_SIZE;
+	layout.index_blocks = BASEFS_DEFAULT_INDEX_BLOCKS;
+	layout.reserved_gdt_blocks = UINT32_MAX;
+	layout.journal_blocks = UINT32_MAX;
+
+	memset(&opts, 0, sizeof(opts));
+	memset(&io_opts, 0, sizeof(io_opts));
+	while ((opt = getopt(argc, argv, "d:o:rT:b:I:i:x:G:J:Zq:DRP")) != -1) {
+		switch (opt) {
+		case 'd':
+			opts.src_dir = optarg;
+			break;
+		case 'o':
+			opts.order_file = optarg;
+			break;
+		case 'r':
+			opts.reproducible = 1;
+			break;
+		case 'T':
+			opts.fixed_time = strtoull(optarg, NULL, 10);
+			fixed_time_set = 1;
+			break;
+		case 'b':
+			layout.block_size = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'I':
+			layout.inode_size = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			inode_ratio = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			layout.index_blocks = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'G':
+			layout.reserved_gdt_blocks =
+				(uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'J':
+			layout.journal_blocks = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'Z':
+			opts.zero_fill = 1;
+			break;
+		case 'q':
+			io_opts.queue_depth = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'D':
+			io_opts.direct = 1;
+			open_flags |= O_DIRECT;
+			break;
+		case 'R':
+			io_opts.fixed_bufs = 1;
+			break;
+		case 'P':
+			io_opts.no_uring = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s <image-file> <number-of-blocks>\n", argv[0]);
+	if (!is_power_of_2(layout.block_size) ||
+	    layout.block_size < BASEFS_MIN_BLOCK_SIZE ||
+	    layout.block_size > BASEFS_MAX_BLOCK_SIZE) {
+		fprintf(stderr, "Block size must be a power of two in [%d, %d].\n",
+			BASEFS_MIN_BLOCK_SIZE, BASEFS_MAX_BLOCK_SIZE);
+		return 1;
+	}
+	if (!is_power_of_2(layout.inode_size) ||
+	    layout.inode_size < BASEFS_MIN_INODE_SIZE ||
+	    layout.inode_size > layout.block_size) {
+		fprintf(stderr, "Inode size must be a power of two in [%d, %u].\n",
+			BASEFS_MIN_INODE_SIZE, layout.block_size);
+		return 1;
+	}
+	if (!inode_ratio) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (layout.journal_blocks && layout.journal_blocks != UINT32_MAX &&
+	    layout.journal_blocks < BASEFS_JOURNAL_MIN_BLOCKS) {
+		fprintf(stderr, "A journal needs at least %d blocks.\n",
+			BASEFS_JOURNAL_MIN_BLOCKS);
 		return 1;
 	}
 
-	blocks_count = strtoull(argv[2], NULL, 10);
-	fd = open(argv[1], O_CREAT | O_RDWR, 0666);
+	if (opts.order_file && !opts.src_dir) {
+		fprintf(stderr, "-o needs a source directory (-d).\n");
+		return 1;
+	}
+	if (opts.reproducible && !fixed_time_set) {
+		epoch = getenv("SOURCE_DATE_EPOCH");
+		opts.fixed_time = epoch ? strtoull(epoch, NULL, 10) : 0;
+	}
+
+	blocks_count = strtoull(argv[optind + 1], NULL, 10);
+	if (compute_layout(&layout, blocks_count, inode_ratio) < 0)
+		return 1;
+
+	if (build_tree(&tree, &opts) < 0)
+		return 1;
+	if (tree.nr_nodes > (uint64_t)layout.groups_count * layout.inodes_per_group) {
+		fprintf(stderr, "%llu files need more inodes than the image has (%llu).\n",
+			(unsigned long long)tree.nr_nodes,
+			(unsigned long long)layout.groups_count *
+			layout.inodes_per_group);
+		return 1;
+	}
+	alloc.l = &layout;
+	alloc.used = xcalloc(layout.groups_count, sizeof(*alloc.used));
+	if (place_data(&tree, &alloc, &opts) < 0)
+		return 1;
+
+	fd = open(argv[optind], open_flags, 0666);
 	if (fd < 0) {
 		perror("open");
 		return 1;
 	}
 
 	/*
-	 * Expand the file to hold (blocks_count * block_size) bytes.
+	 * Expand the file to hold (blocks_count * block_size) bytes,
+	 * dropping whatever an older image left behind.
+	 * Block devices already have their size.
 	 */
-	total_size = blocks_count * (uint64_t)BASEFS_DEFAULT_BLOCK_SIZE;
-	if (ftruncate(fd, total_size) < 0) {
+	total_size = layout.blocks_count * (uint64_t)layout.block_size;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return 1;
+	}
+	if (S_ISREG(st.st_mode) &&
+	    (ftruncate(fd, 0) < 0 || ftruncate(fd, total_size) < 0)) {
 		perror("ftruncate");
 		close(fd);
 		return 1;
 	}
 
-	/*
-	 * Prepare and write the BaseFS superblock at the beginning (block #0).
-	 */
-	memset(&sb, 0, sizeof(sb));
-	sb.magic        = BASEFS_MAGIC;
-	sb.blocks_count = blocks_count;
-	sb.inodes_count = 0; /* can be updated later */
+	ret = diskio_open(&io, fd, &io_opts);
+	if (ret) {
+		fprintf(stderr, "diskio_open: %s\n", strerror(-ret));
+		close(fd);
+		return 1;
+	}
 
-	if (lseek(fd, 0, SEEK_SET) < 0) {
-		perror("lseek");
+	start = now_sec();
+	ret = write_image(&io, &layout, &tree, &alloc, &opts);
+	if (ret) {
+		fprintf(stderr, "write image: %s\n", strerror(-ret));
+		diskio_close(&io);
 		close(fd);
 		return 1;
 	}
 
-	if (write(fd, &sb, sizeof(sb)) != sizeof(sb)) {
-		perror("write superblock");
+	if (fsync(fd) < 0) {
+		perror("fsync");
+		diskio_close(&io);
 		close(fd);
 		return 1;
 	}
 
-	close(fd);
 	printf("Created BaseFS image '%s' with %llu blocks (%llu bytes total).\n",
-	       argv[1],
-	       (unsigned long long)blocks_count,
+	       argv[optind],
+	       (unsigned long long)layout.blocks_count,
 	       (unsigned long long)total_size);
+	printf("%u groups of %u blocks, %u inodes per group, %u-byte inodes.\n",
+	       layout.groups_count, layout.blocks_per_group,
+	       layout.inodes_per_group, layout.inode_size);
+	if (opts.src_dir)
+		printf("Copied %llu inodes from '%s', %llu files inline, %llu with xattrs (%llu xattr blocks).\n",
+		       (unsigned long long)tree.nr_nodes, opts.src_dir,
+		       (unsigned long long)tree.nr_inline,
+		       (unsigned long long)tree.nr_xattr,
+		       (unsigned long long)tree.nr_xblocks);
+	printf("Wrote %llu MiB in %llu requests via %s in %.3f s.\n",
+	       (unsigned long long)(io.bytes >> 20),
+	       (unsigned long long)io.submits,
+	       diskio_engine(&io), now_sec() - start);
+
+	diskio_close(&io);
+	close(fd);
 	return 0;
 }
@@ -0,0 +1,768 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "libbasefs.h"
+#include "diskio.h"
+
+/*
+ * resizefs - Grow or shrink an unmounted BaseFS image in place.
+ *
+ * Growing extends the image, lengthens the last group, and appends new
+ * groups.  Their bitmaps are written in block order through the diskio
+ * engine; their inode tables are left uninitialized for the kernel to
+ * zero in the background (see itable.c), so the cost does not grow with
+ * the inode count.  The descriptor table grows into the spare blocks
+ * makefs reserved after it (reserved_gdt_blocks).  The new metadata is
+ * on disk before the descriptors and the superblock that point to it,
+ * so an interrupted grow leaves the old file system intact.
+ *
+ * Shrinking drops the tail of the image.  Inodes in groups that
+ * disappear must be unused.  Data extents in the dropped range are
+ * copied to free space lower in the image and their inodes are
+ * repointed.  Everything is planned in memory first, so a shrink that
+ * cannot fit (no space, too many extents) changes nothing.  Files with
+ * an extent tree are not relocated: a shrink that would have to move
+ * one of their blocks or tree blocks is refused.  An xattr block moves
+ * once, however many inodes share it.  Run fsckfs after an interrupted
+ * shrink.
+ */
+
+#define RESIZE_COPY_CHUNK  DISKIO_DEFAULT_CHUNK_SIZE
+
+struct resize_ctx {
+	struct bfs_image img;
+	struct diskio    io;
+	uint64_t         new_blocks;
+	uint32_t         new_groups;
+	uint8_t         *bitmaps;      /* block bitmaps of the kept groups */
+	uint32_t         alloc_group;  /* first-fit cursor for relocation */
+};
+
+/* One contiguous piece of data that has to move during a shrink. */
+struct resize_move {
+	uint64_t ino;
+	uint64_t from;
+	uint64_t to;
+	uint32_t len;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xcalloc(size_t n, size_t size)
+{
+	void *p = calloc(n ? n : 1, size);
+
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static uint32_t overhead(const struct bfs_image *img)
+{
+	return basefs_group_overhead(img->itable_blocks);
+}
+
+/* Length of kept group 'g' once the image has shrunk to new_blocks. */
+static uint32_t kept_len(const struct resize_ctx *r, uint32_t g)
+{
+	uint64_t start = bfs_group_start(&r->img, g);
+
+	if (g == r->new_groups - 1)
+		return (uint32_t)(r->new_blocks - start);
+	return r->img.blocks_per_group;
+}
+
+/*
+ * plan_geometry - Work out the group count for 'blocks'.  A tail too short
+ * for a group's metadata plus one data block is dropped, so the result may
+ * be a little smaller than asked for.
+ */
+static int plan_geometry(struct resize_ctx *r, uint64_t blocks)
+{
+	struct bfs_image *img = &r->img;
+	uint64_t groups, last_len, gdt_needed;
+
+	if (blocks <= img->first_group_block + overhead(img)) {
+		fprintf(stderr, "%llu blocks is too small for this image\n",
+			(unsigned long long)blocks);
+		return -1;
+	}
+	groups = (blocks - img->first_group_block + img->blocks_per_group - 1) /
+		 img->blocks_per_group;
+	last_len = blocks - img->first_group_block -
+		   (groups - 1) * img->blocks_per_group;
+	if (last_len < overhead(img) + 1) {
+		groups--;
+		blocks = img->first_group_block + groups * img->blocks_per_group;
+	}
+
+	gdt_needed = (groups * sizeof(struct basefs_group_desc) +
+		      img->block_size - 1) / img->block_size;
+	if (gdt_needed > (uint64_t)le32toh(img->sb.gdt_blocks) +
+			 le32toh(img->sb.reserved_gdt_blocks)) {
+		fprintf(stderr, "Descriptor table has room for %llu groups, %llu needed; rebuild with a larger makefs -G\n",
+			(unsigned long long)(le32toh(img->sb.gdt_blocks) +
+					     le32toh(img->sb.reserved_gdt_blocks)) *
+			img->block_size / sizeof(struct basefs_group_desc),
+			(unsigned long long)groups);
+		return -1;
+	}
+
+	r->new_blocks = blocks;
+	r->new_groups = (uint32_t)groups;
+	return 0;
+}
+
+/*
+ * set_gdt_size - Move descriptor blocks between the table and its spare
+ * area so that exactly the blocks needed for new_groups are in use.
+ */
+static int set_gdt_size(struct resize_ctx *r)
+{
+	struct bfs_image *img = &r->img;
+	uint32_t total = le32toh(img->sb.gdt_blocks) +
+			 le32toh(img->sb.reserved_gdt_blocks);
+	uint32_t needed = (uint32_t)(((uint64_t)r->new_groups *
+				      sizeof(struct basefs_group_desc) +
+				      img->block_size - 1) / img->block_size);
+	uint32_t old = le32toh(img->sb.gdt_blocks);
+	void *gdt;
+
+	if (needed > old) {
+		gdt = realloc(img->gdt, (size_t)needed * img->block_size);
+		if (!gdt)
+			return -ENOMEM;
+		memset((char *)gdt + (size_t)old * img->block_size, 0,
+		       (size_t)(needed - old) * img->block_size);
+		img->gdt = gdt;
+	} else {
+		memset((char *)img->gdt + (size_t)r->new_groups *
+		       sizeof(struct basefs_group_desc), 0,
+		       (size_t)old * img->block_size -
+		       (size_t)r->new_groups * sizeof(struct basefs_group_desc));
+	}
+	img->sb.gdt_blocks = htole32(needed);
+	img->sb.reserved_gdt_blocks = htole32(total - needed);
+	if (total - needed)
+		img->sb.feature_compat |= htole32(BASEFS_FEATURE_COMPAT_RESIZE_GDT);
+	else
+		img->sb.feature_compat &= htole32(~BASEFS_FEATURE_COMPAT_RESIZE_GDT);
+	return 0;
+}
+
+/* Recompute the superblock totals from the descriptors. */
+static void update_super(struct resize_ctx *r)
+{
+	struct bfs_image *img = &r->img;
+	uint64_t free_blocks = 0, free_inodes = 0;
+	uint32_t g;
+
+	for (g = 0; g < r->new_groups; g++) {
+		free_blocks += le32toh(img->gdt[g].free_blocks_count);
+		free_inodes += le32toh(img->gdt[g].free_inodes_count);
+	}
+	img->sb.blocks_count = htole64(r->new_blocks);
+	img->sb.groups_count = htole32(r->new_groups);
+	img->sb.inodes_count = htole64((uint64_t)r->new_groups *
+				       img->inodes_per_group);
+	img->sb.free_blocks_count = htole64(free_blocks);
+	img->sb.free_inodes_count = htole64(free_inodes);
+	img->sb.wtime = htole64((uint64_t)time(NULL));
+}
+
+/* Write descriptors, then the superblock that makes them live. */
+static int commit(struct resize_ctx *r)
+{
+	struct bfs_image *img = &r->img;
+	int ret;
+
+	if (fsync(img->fd) < 0)
+		return -errno;
+	img->blocks_count = r->new_blocks > img->blocks_count ?
+			    r->new_blocks : img->blocks_count;
+	ret = bfs_write_gdt(img);
+	if (!ret && fsync(img->fd) < 0)
+		ret = -errno;
+	if (!ret)
+		ret = bfs_write_super(img);
+	if (!ret && fsync(img->fd) < 0)
+		ret = -errno;
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Grow                                                                        */
+
+static int grow(struct resize_ctx *r)
+{
+	struct bfs_image *img = &r->img;
+	uint32_t bs = img->block_size;
+	uint32_t old_groups = img->groups_count;
+	uint32_t last = old_groups - 1;
+	uint32_t old_len = bfs_group_len(img, last);
+	uint32_t new_len, g, i;
+	uint64_t start;
+	struct stat st;
+	uint8_t *block;
+	int ret;
+
+	if (fstat(img->fd, &st) < 0)
+		return -errno;
+	if (S_ISREG(st.st_mode)) {
+		if (ftruncate(img->fd, (off_t)(r->new_blocks * bs)) < 0)
+			return -errno;
+	} else if ((uint64_t)lseek(img->fd, 0, SEEK_END) < r->new_blocks * bs) {
+		fprintf(stderr, "Device is smaller than %llu blocks\n",
+			(unsigned long long)r->new_blocks);
+		return -ENOSPC;
+	}
+
+	ret = set_gdt_size(r);
+	if (ret)
+		return ret;
+
+	/* Blocks past the old end are now addressable. */
+	img->blocks_count = r->new_blocks;
+	block = xcalloc(1, bs);
+
+	/* The old last group gets longer: free its new tail. */
+	new_len = bfs_group_len(img, last);
+	if (new_len != old_len) {
+		ret = bfs_read_blocks(img, le64toh(img->gdt[last].block_bitmap),
+				      1, block);
+		if (ret)
+			goto out;
+		for (i = old_len; i < new_len; i++)
+			bfs_clear_bit(block, i);
+		ret = bfs_write_blocks(img, le64toh(img->gdt[last].block_bitmap),
+				       1, block);
+		if (ret)
+			goto out;
+		img->gdt[last].free_blocks_count =
+			htole32(le32toh(img->gdt[last].free_blocks_count) +
+				new_len - old_len);
+	}
+
+	/* New groups, written front to back. */
+	for (g = old_groups; g < r->new_groups; g++) {
+		start = bfs_group_start(img, g);
+		new_len = bfs_group_len(img, g);
+
+		memset(block, 0, bs);
+		for (i = 0; i < overhead(img); i++)
+			bfs_set_bit(block, i);
+		for (i = new_len; i < img->blocks_per_group; i++)
+			bfs_set_bit(block, i);
+		ret = diskio_write(&r->io, block, bs, start * bs);
+		if (ret)
+			goto out;
+
+		memset(block, 0, bs);
+		for (i = img->inodes_per_group; i < bs * 8; i++)
+			bfs_set_bit(block, i);
+		ret = diskio_write(&r->io, block, bs, (start + 1) * bs);
+		if (ret)
+			goto out;
+
+		img->gdt[g].block_bitmap = htole64(start);
+		img->gdt[g].inode_bitmap = htole64(start + 1);
+		img->gdt[g].inode_table  = htole64(start + BASEFS_GROUP_META_BLOCKS);
+		img->gdt[g].free_blocks_count = htole32(new_len - overhead(img));
+		img->gdt[g].free_inodes_count = htole32(img->inodes_per_group);
+		img->gdt[g].used_dirs_count = 0;
+		img->gdt[g].flags = htole16(BASEFS_BG_ITABLE_UNINIT);
+		img->gdt[g].itable_init = 0;
+	}
+	if (r->new_groups > old_groups)
+		img->sb.feature_ro_compat |=
+			htole32(BASEFS_FEATURE_RO_COMPAT_LAZY_ITABLE);
+	ret = diskio_flush(&r->io);
+	if (ret)
+		goto out;
+
+	update_super(r);
+	ret = commit(r);
+out:
+	free(block);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Shrink                                                                      */
+
+/*
+ * alloc_run - Find free space for up to 'want' blocks in the kept groups.
+ * Prefers the first run that fits whole; otherwise returns the first free
+ * run, shorter than asked.  Returns the length found, 0 when full.
+ */
+static uint32_t alloc_run(struct resize_ctx *r, uint32_t want, uint64_t *out)
+{
+	struct bfs_image *img = &r->img;
+	uint32_t pass, k, g, i, len, run, first = 0;
+	uint8_t *map;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (k = 0; k < r->new_groups; k++) {
+			g = (r->alloc_group + k) % r->new_groups;
+			map = r->bitmaps + (uint64_t)g * img->block_size;
+			len = kept_len(r, g);
+			run = 0;
+			for (i = overhead(img); i < len; i++) {
+				if (!bfs_test_bit(map, i)) {
+					if (!run++)
+						first = i;
+					if (run == want)
+						goto found;
+				} else if (pass && run) {
+					goto found;
+				} else {
+					run = 0;
+				}
+			}
+			if (pass && run)
+				goto found;
+		}
+	}
+	return 0;
+
+found:
+	for (i = first; i < first + run; i++)
+		bfs_set_bit(map, i);
+	r->alloc_group = g;
+	*out = bfs_group_start(img, g) + first;
+	return run;
+}
+
+/* Does any extent or tree block of an inode lie past the new end? */
+static int past_end_extent(const struct basefs_extent *ex, void *arg)
+{
+	const struct resize_ctx *r = arg;
+
+	return le64toh(ex->pblk) + le32toh(ex->len) > r->new_blocks;
+}
+
+static int past_end_node(uint64_t blk, void *arg)
+{
+	const struct resize_ctx *r = arg;
+
+	return blk >= r->new_blocks;
+}
+
+static int add_move(struct resize_move **moves, uint64_t *nr_moves,
+		    uint64_t *cap_moves, uint64_t ino, uint64_t from,
+		    uint64_t to, uint32_t len)
+{
+	if (*nr_moves == *cap_moves) {
+		*cap_moves = *cap_moves ? *cap_moves * 2 : 64;
+		*moves = realloc(*moves, *cap_moves * sizeof(**moves));
+		if (!*moves)
+			return -ENOMEM;
+	}
+	(*moves)[*nr_moves].ino = ino;
+	(*moves)[*nr_moves].from = from;
+	(*moves)[*nr_moves].to = to;
+	(*moves)[*nr_moves].len = len;
+	(*nr_moves)++;
+	return 0;
+}
+
+/*
+ * plan_inode - Rewrite the extent list of one inode so nothing lies at
+ * or beyond new_blocks, recording the copies needed.  Works on a copy;
+ * returns 1 if the inode changed, 0 if not, negative on failure.
+ */
+static int plan_inode(struct resize_ctx *r, uint64_t ino,
+		      struct basefs_inode *di, struct resize_move **moves,
+		      uint64_t *nr_moves, uint64_t *cap_moves)
+{
+	struct basefs_extent out[BASEFS_INLINE_EXTENTS * 4];
+	uint16_t nr = le16toh(di->nr_extents);
+	uint32_t nout = 0, i, len, got, keep;
+	uint64_t lblk, pblk, to;
+	int changed = 0, ret;
+
+	if (le32toh(di->flags) & BASEFS_INODE_EXTENT_TREE) {
+		ret = bfs_for_each_extent(&r->img, di, past_end_extent,
+					  past_end_node, r);
+		if (ret > 0) {
+			fprintf(stderr, "Inode %llu has an extent tree reaching past the new end, which cannot be relocated\n",
+				(unsigned long long)ino);
+			return -EOPNOTSUPP;
+		}
+		return ret;
+	}
+
+	for (i = 0; i < nr && i < BASEFS_INLINE_EXTENTS; i++) {
+		lblk = le64toh(di->extents[i].lblk);
+		pblk = le64toh(di->extents[i].pblk);
+		len  = le32toh(di->extents[i].len);
+
+		keep = pblk >= r->new_blocks ? 0 :
+		       (pblk + len > r->new_blocks ?
+			(uint32_t)(r->new_blocks - pblk) : len);
+		if (keep) {
+			out[nout].lblk = htole64(lblk);
+			out[nout].pblk = htole64(pblk);
+			out[nout].len = htole32(keep);
+			out[nout].reserved = 0;
+			nout++;
+		}
+		lblk += keep;
+		pblk += keep;
+		len -= keep;
+
+		while (len) {
+			changed = 1;
+			got = alloc_run(r, len, &to);
+			if (!got) {
+				fprintf(stderr, "Not enough free space to relocate inode %llu\n",
+					(unsigned long long)ino);
+				return -ENOSPC;
+			}
+			if (nout && le64toh(out[nout - 1].pblk) +
+				    le32toh(out[nout - 1].len) == to &&
+			    le64toh(out[nout - 1].lblk) +
+				    le32toh(out[nout - 1].len) == lblk) {
+				out[nout - 1].len =
+					htole32(le32toh(out[nout - 1].len) + got);
+			} else {
+				if (nout == BASEFS_INLINE_EXTENTS) {
+					fprintf(stderr, "Inode %llu would need more than %zu extents after relocation\n",
+						(unsigned long long)ino,
+						BASEFS_INLINE_EXTENTS);
+					return -ENOSPC;
+				}
+				out[nout].lblk = htole64(lblk);
+				out[nout].pblk = htole64(to);
+				out[nout].len = htole32(got);
+				out[nout].reserved = 0;
+				nout++;
+			}
+
+			ret = add_move(moves, nr_moves, cap_moves, ino, pblk,
+				       to, got);
+			if (ret)
+				return ret;
+
+			lblk += got;
+			pblk += got;
+			len -= got;
+		}
+	}
+	if (!changed)
+		return 0;
+	if (nout > BASEFS_INLINE_EXTENTS)
+		return -ENOSPC;
+
+	memset(di->extents, 0, sizeof(di->extents));
+	memcpy(di->extents, out, nout * sizeof(out[0]));
+	di->nr_extents = htole16((uint16_t)nout);
+	return 1;
+}
+
+/*
+ * plan_xattr - Repoint an inode whose xattr block lies past the new end
+ * at the block's new place, planning its copy the first time one of the
+ * inodes sharing it comes by.  Returns 1 if the inode changed.
+ */
+static int plan_xattr(struct resize_ctx *r, uint64_t ino,
+		      struct basefs_inode *di, struct resize_move **moves,
+		      uint64_t *nr_moves, uint64_t *cap_moves)
+{
+	uint64_t blk = le64toh(di->xattr_block), to, i;
+	int ret;
+
+	if (!blk || blk < r->new_blocks)
+		return 0;
+	for (i = 0; i < *nr_moves; i++) {
+		if ((*moves)[i].from == blk && (*moves)[i].len == 1) {
+			di->xattr_block = htole64((*moves)[i].to);
+			return 1;
+		}
+	}
+	if (!alloc_run(r, 1, &to)) {
+		fprintf(stderr, "Not enough free space to relocate the xattrs of inode %llu\n",
+			(unsigned long long)ino);
+		return -ENOSPC;
+	}
+	ret = add_move(moves, nr_moves, cap_moves, ino, blk, to, 1);
+	if (ret)
+		return ret;
+	di->xattr_block = htole64(to);
+	return 1;
+}
+
+static int cmp_move(const void *a, const void *b)
+{
+	const struct resize_move *ma = a, *mb = b;
+
+	return ma->from < mb->from ? -1 : ma->from > mb->from;
+}
+
+/* Copy the planned moves, reading the source in ascending order. */
+static int copy_moves(struct resize_ctx *r, struct resize_move *moves,
+		      uint64_t nr_moves)
+{
+	struct bfs_image *img = &r->img;
+	uint32_t bs = img->block_size;
+	uint32_t per_chunk = RESIZE_COPY_CHUNK / bs;
+	uint64_t i, done, n;
+	uint8_t *buf;
+	int ret = 0;
+
+	qsort(moves, nr_moves, sizeof(*moves), cmp_move);
+	buf = xcalloc(1, RESIZE_COPY_CHUNK);
+	for (i = 0; i < nr_moves && !ret; i++) {
+		for (done = 0; done < moves[i].len && !ret; done += n) {
+			n = moves[i].len - done;
+			if (n > per_chunk)
+				n = per_chunk;
+			ret = bfs_read_blocks(img, moves[i].from + done, n, buf);
+			if (!ret)
+				ret = diskio_write(&r->io, buf, n * bs,
+						   (moves[i].to + done) * bs);
+		}
+	}
+	free(buf);
+	if (!ret)
+		ret = diskio_flush(&r->io);
+	return ret;
+}
+
+static int shrink(struct resize_ctx *r)
+{
+	struct bfs_image *img = &r->img;
+	uint32_t bs = img->block_size;
+	struct resize_move *moves = NULL;
+	uint64_t nr_moves = 0, cap_moves = 0;
+	struct basefs_inode *changed = NULL;
+	uint64_t *changed_ino = NULL, nr_changed = 0, cap_changed = 0;
+	uint8_t *ibitmap, *itable;
+	struct basefs_inode di;
+	uint32_t g, i, len, used;
+	uint64_t ino, start;
+	int ret = 0, xret;
+
+	ibitmap = xcalloc(1, bs);
+	itable = xcalloc(img->itable_blocks, bs);
+	r->bitmaps = xcalloc(r->new_groups, bs);
+
+	/* Dropped groups must not hold any inode. */
+	for (g = r->new_groups; g < img->groups_count; g++) {
+		if (le32toh(img->gdt[g].free_inodes_count) != img->inodes_per_group) {
+			fprintf(stderr, "Group %u still holds inodes; cannot shrink below block %llu\n",
+				g, (unsigned long long)bfs_group_start(img, g));
+			ret = -EBUSY;
+			goto out;
+		}
+	}
+
+	/* Kept bitmaps; the future tail of the last group counts as used. */
+	for (g = 0; g < r->new_groups; g++) {
+		ret = bfs_read_blocks(img, le64toh(img->gdt[g].block_bitmap), 1,
+				      r->bitmaps + (uint64_t)g * bs);
+		if (ret)
+			goto out;
+	}
+	start = bfs_group_start(img, r->new_groups - 1);
+	for (i = (uint32_t)(r->new_blocks - start); i < img->blocks_per_group; i++)
+		bfs_set_bit(r->bitmaps + (uint64_t)(r->new_groups - 1) * bs, i);
+
+	/* Plan: find every extent reaching past the new end. */
+	for (g = 0; g < r->new_groups; g++) {
+		ret = bfs_read_blocks(img, le64toh(img->gdt[g].inode_bitmap), 1,
+				      ibitmap);
+		if (!ret)
+			ret = bfs_read_blocks(img, le64toh(img->gdt[g].inode_table),
+					      img->itable_blocks, itable);
+		if (ret)
+			goto out;
+		for (i = 0; i < img->inodes_per_group; i++) {
+			if (!bfs_test_bit(ibitmap, i))
+				continue;
+			memcpy(&di, itable + (uint64_t)i * img->inode_size,
+			       sizeof(di));
+			ino = (uint64_t)g * img->inodes_per_group + i + 1;
+			ret = plan_inode(r, ino, &di, &moves, &nr_moves,
+					 &cap_moves);
+			if (ret < 0)
+				goto out;
+			xret = plan_xattr(r, ino, &di, &moves, &nr_moves,
+					  &cap_moves);
+			if (xret < 0) {
+				ret = xret;
+				goto out;
+			}
+			if (!ret && !xret)
+				continue;
+			if (nr_changed == cap_changed) {
+				cap_changed = cap_changed ? cap_changed * 2 : 64;
+				changed = realloc(changed,
+						  cap_changed * sizeof(*changed));
+				changed_ino = realloc(changed_ino,
+						      cap_changed * sizeof(*changed_ino));
+				if (!changed || !changed_ino) {
+					ret = -ENOMEM;
+					goto out;
+				}
+			}
+			changed[nr_changed] = di;
+			changed_ino[nr_changed] = ino;
+			nr_changed++;
+		}
+	}
+
+	/* Execute: data first, then the inodes pointing at it. */
+	ret = copy_moves(r, moves, nr_moves);
+	if (!ret && fsync(img->fd) < 0)
+		ret = -errno;
+	for (ino = 0; ino < nr_changed && !ret; ino++)
+		ret = bfs_write_inode(img, changed_ino[ino], &changed[ino]);
+	if (ret)
+		goto out;
+
+	for (g = 0; g < r->new_groups; g++) {
+		len = kept_len(r, g);
+		used = 0;
+		for (i = 0; i < len; i++)
+			used += (uint32_t)bfs_test_bit(r->bitmaps + (uint64_t)g * bs, i);
+		img->gdt[g].free_blocks_count = htole32(len - used);
+		ret = bfs_write_blocks(img, le64toh(img->gdt[g].block_bitmap), 1,
+				       r->bitmaps + (uint64_t)g * bs);
+		if (ret)
+			goto out;
+	}
+
+	ret = set_gdt_size(r);
+	if (ret)
+		goto out;
+	update_super(r);
+	ret = commit(r);
+	if (!ret && ftruncate(img->fd, (off_t)(r->new_blocks * bs)) < 0 &&
+	    errno != EINVAL)
+		ret = -errno;
+	if (!ret)
+		printf("Relocated %llu extents of %llu inodes.\n",
+		       (unsigned long long)nr_moves,
+		       (unsigned long long)nr_changed);
+out:
+	free(changed);
+	free(changed_ino);
+	free(moves);
+	free(itable);
+	free(ibitmap);
+	free(r->bitmaps);
+	r->bitmaps = NULL;
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-q depth] [-P] <image-file> <new-number-of-blocks>\n"
+		"  -q depth  number of writes kept in flight (default %d)\n"
+		"  -P        use synchronous pwrite() instead of io_uring\n",
+		prog, DISKIO_DEFAULT_QUEUE_DEPTH);
+}
+
+int main(int argc, char *argv[])
+{
+	struct resize_ctx r;
+	struct diskio_opts io_opts;
+	uint64_t old_blocks, wanted;
+	double start;
+	int opt, ret;
+
+	memset(&r, 0, sizeof(r));
+	memset(&io_opts, 0, sizeof(io_opts));
+	while ((opt = getopt(argc, argv, "q:P")) != -1) {
+		switch (opt) {
+		case 'q':
+			io_opts.queue_depth = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			io_opts.no_uring = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = bfs_open(&r.img, argv[optind], 1);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	if (r.img.sb_csum_bad ||
+	    (le32toh(r.img.sb.feature_incompat) & ~BASEFS_FEATURE_INCOMPAT_SUPP) ||
+	    (le32toh(r.img.sb.feature_ro_compat) & ~BASEFS_FEATURE_RO_COMPAT_SUPP)) {
+		fprintf(stderr, "%s: %s; run fsckfs first\n", argv[optind],
+			r.img.sb_csum_bad ? "superblock checksum mismatch" :
+			"unsupported features");
+		bfs_close(&r.img);
+		return 1;
+	}
+	if (le32toh(r.img.sb.feature_incompat) & BASEFS_FEATURE_INCOMPAT_RECOVER) {
+		fprintf(stderr, "%s: journal needs recovery; mount and unmount it first\n",
+			argv[optind]);
+		bfs_close(&r.img);
+		return 1;
+	}
+	old_blocks = r.img.blocks_count;
+	wanted = strtoull(argv[optind + 1], NULL, 10);
+	if (plan_geometry(&r, wanted) < 0) {
+		bfs_close(&r.img);
+		return 1;
+	}
+	if (r.new_blocks == old_blocks) {
+		printf("%s already has %llu blocks.\n", argv[optind],
+		       (unsigned long long)old_blocks);
+		bfs_close(&r.img);
+		return 0;
+	}
+
+	ret = diskio_open(&r.io, r.img.fd, &io_opts);
+	if (ret) {
+		fprintf(stderr, "diskio_open: %s\n", strerror(-ret));
+		bfs_close(&r.img);
+		return 1;
+	}
+
+	start = now_sec();
+	ret = r.new_blocks > old_blocks ? grow(&r) : shrink(&r);
+	diskio_close(&r.io);
+	if (ret) {
+		fprintf(stderr, "%s: resize failed: %s\n", argv[optind],
+			strerror(-ret));
+		bfs_close(&r.img);
+		return 1;
+	}
+
+	printf("Resized '%s' from %llu to %llu blocks (%u groups) in %.3f s.\n",
+	       argv[optind], (unsigned long long)old_blocks,
+	       (unsigned long long)r.new_blocks, r.new_groups,
+	       now_sec() - start);
+	bfs_close(&r.img);
+	return 0;
+}
@@ -0,0 +1,1574 @@
+#include <linux/statfs.h>
+#include <linux/blkdev.h>
+#include <linux/bitops.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/parser.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include "basefs.h"
+
+/*
+ * basefs_msg - printk with the device name in front.
+ */
+void basefs_msg(struct super_block *sb, const char *level, const char *fmt, ...)
+{
+	struct va_format vaf;
+	va_list args;
+
+	va_start(args, fmt);
+	vaf.fmt = fmt;
+	vaf.va = &args;
+	printk("%sBaseFS (%s): %pV\n", level, sb->s_id, &vaf);
+	va_end(args);
+}
+
+/*
+ * basefs_get_group_desc - Descriptor of 'group' inside the cached
+ * descriptor table.  If bhp is not NULL it receives the buffer to mark
+ * dirty after a change.
+ */
+struct basefs_group_desc *basefs_get_group_desc(struct super_block *sb,
+						u32 group,
+						struct buffer_head **bhp)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct buffer_head *bh;
+
+	if (group >= sbi->groups_count) {
+		basefs_msg(sb, KERN_ERR, "group %u out of range (%u groups)",
+			   group, sbi->groups_count);
+		return NULL;
+	}
+	bh = sbi->gdt_bh[group / sbi->desc_per_block];
+	if (bhp)
+		*bhp = bh;
+	return (struct basefs_group_desc *)bh->b_data +
+	       group % sbi->desc_per_block;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Block allocator                                                             */
+
+/*
+ * Free space is tracked as extents in two B+ trees, both protected by
+ * alloc_lock:
+ *
+ *   free_by_start  start -> length, to find the neighbours of a freed
+ *                  range (coalescing) and the extent covering a goal
+ *   free_by_len    (length, start) -> start, for best fit: the first key
+ *                  >= (n, 0) is the smallest extent that holds n blocks,
+ *                  the lowest one among equals
+ *
+ * The block bitmaps stay the on-disk truth and every change is applied
+ * to both.  A group's bitmap and free count are protected by its own
+ * group_locks[] entry, so blocks already out of the trees are marked
+ * without alloc_lock.
+ *
+ * Mount does not read the bitmaps: free_blocks starts as the sum of the
+ * descriptor counts and a group enters the trees the first time the
+ * allocator looks at it (basefs_load_group()), while a background work
+ * loads the rest in disk order.  Blocks freed in a group that is not
+ * loaded yet only go to its bitmap, under alloc_lock so the load sees
+ * them exactly once.
+ */
+
+static int basefs_insert_free(struct basefs_sb_info *sbi, u64 start, u64 len)
+{
+	int ret;
+
+	ret = btree_insert(sbi->free_by_start, start, len);
+	if (ret)
+		return ret;
+	ret = btree_insert(sbi->free_by_len, BASEFS_LEN_KEY(len, start), start);
+	if (ret)
+		btree_delete(sbi->free_by_start, start);
+	return ret;
+}
+
+static void basefs_remove_free(struct basefs_sb_info *sbi, u64 start, u64 len)
+{
+	btree_delete(sbi->free_by_start, start);
+	btree_delete(sbi->free_by_len, BASEFS_LEN_KEY(len, start));
+}
+
+/*
+ * A tree insert can only fail for lack of memory.  The blocks are still
+ * free in the bitmap, so they come back at the next mount.
+ */
+static void basefs_add_free(struct super_block *sb, u64 start, u64 len)
+{
+	if (basefs_insert_free(BASEFS_SB(sb), start, len))
+		basefs_msg(sb, KERN_WARNING,
+			   "out of memory, %llu free blocks at %llu unusable until remount",
+			   len, start);
+}
+
+/*
+ * basefs_load_group - Add the free runs of one group's bitmap to the
+ * trees and mark the group loaded.  free_blocks already counts the
+ * group's descriptor count; it is corrected if the bitmap disagrees.  A
+ * group that cannot be read is still marked loaded, its free space
+ * unusable until remount, so the allocator does not retry it on every
+ * call.  Called with alloc_lock held.
+ */
+static void basefs_load_group(struct super_block *sb, u32 group)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_group_desc *gd;
+	struct buffer_head *gd_bh, *bh;
+	u64 first = basefs_group_first_block(sbi->first_group_block,
+					     sbi->blocks_per_group, group);
+	u32 len = basefs_group_nr_blocks(sbi->blocks_count,
+					 sbi->first_group_block,
+					 sbi->blocks_per_group, group);
+	unsigned long bit, end;
+	u32 gd_free;
+	s64 nr_free = 0;
+	int ret = 0;
+
+	gd = basefs_get_group_desc(sb, group, &gd_bh);
+	gd_free = le32_to_cpu(gd->free_blocks_count);
+	bh = sb_bread(sb, le64_to_cpu(gd->block_bitmap));
+	if (bh) {
+		bit = find_next_zero_bit_le(bh->b_data, len, 0);
+		while (bit < len) {
+			end = find_next_bit_le(bh->b_data, len, bit);
+			ret = basefs_insert_free(sbi, first + bit, end - bit);
+			if (ret)
+				break;
+			nr_free += end - bit;
+			bit = find_next_zero_bit_le(bh->b_data, len, end);
+		}
+		brelse(bh);
+	} else {
+		ret = -EIO;
+	}
+
+	set_bit(group, sbi->group_loaded);
+	sbi->groups_loaded++;
+	percpu_counter_add(&sbi->free_blocks, nr_free - (s64)gd_free);
+	if (ret) {
+		basefs_msg(sb, KERN_ERR,
+			   "cannot load free space of group %u (%d), %lld blocks unusable until remount",
+			   group, ret, (s64)gd_free - nr_free);
+		return;
+	}
+	if (nr_free != gd_free) {
+		basefs_msg(sb, KERN_WARNING,
+			   "group %u free block count %u, bitmap says %lld; using the bitmap",
+			   group, gd_free, nr_free);
+		gd->free_blocks_count = cpu_to_le32((u32)nr_free);
+		basefs_journal_dirty(sb, gd_bh, NULL);
+		basefs_mark_sb_dirty(sb);
+	}
+}
+
+/*
+ * basefs_load_next_group - Load the first group not loaded yet.  Returns
+ * false once every group is.  Called with alloc_lock held.
+ */
+static bool basefs_load_next_group(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	unsigned long group;
+
+	if (sbi->groups_loaded == sbi->groups_count)
+		return false;
+	group = find_first_zero_bit(sbi->group_loaded, sbi->groups_count);
+	if (group >= sbi->groups_count)
+		return false;
+	basefs_load_group(sb, (u32)group);
+	return true;
+}
+
+/*
+ * basefs_prefetch_groups - Work queued at mount that loads every group,
+ * reading the bitmaps of BASEFS_PREFETCH_BATCH groups ahead.  Each
+ * bitmap is read before alloc_lock is taken, so allocations only wait
+ * for the scan of a group, not for its I/O.
+ */
+static void basefs_prefetch_groups(struct work_struct *work)
+{
+	struct basefs_sb_info *sbi = container_of(work, struct basefs_sb_info,
+						  prefetch_work);
+	struct super_block *sb = sbi->sb;
+	struct basefs_group_desc *gd;
+	struct basefs_handle h;
+	struct buffer_head *bh;
+	u32 group, g;
+
+	for (group = 0; group < sbi->groups_count; group++) {
+		if (READ_ONCE(sbi->prefetch_stop))
+			return;
+		if (!(group % BASEFS_PREFETCH_BATCH)) {
+			for (g = group; g < sbi->groups_count &&
+			     g < group + BASEFS_PREFETCH_BATCH; g++) {
+				if (test_bit(g, sbi->group_loaded))
+					continue;
+				gd = basefs_get_group_desc(sb, g, NULL);
+				sb_breadahead(sb, le64_to_cpu(gd->block_bitmap));
+				sb_breadahead(sb, le64_to_cpu(gd->inode_bitmap));
+			}
+		}
+		if (test_bit(group, sbi->group_loaded))
+			continue;
+
+		gd = basefs_get_group_desc(sb, group, NULL);
+		bh = sb_bread(sb, le64_to_cpu(gd->block_bitmap));
+		basefs_journal_start(sb, &h);
+		mutex_lock(&sbi->alloc_lock);
+		if (!test_bit(group, sbi->group_loaded))
+			basefs_load_group(sb, group);
+		mutex_unlock(&sbi->alloc_lock);
+		basefs_journal_stop(sb, &h);
+		brelse(bh);
+		cond_resched();
+	}
+}
+
+/*
+ * basefs_mark_blocks - Set or clear 'count' bits for blocks starting at
+ * 'start' in their group's bitmap and fix the group's free count.  The
+ * range must lie in one group.
+ */
+static int basefs_mark_blocks(struct super_block *sb, u64 start, u32 count,
+			      bool used)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 group = basefs_group_of_block(sbi, start);
+	struct basefs_group_desc *gd;
+	struct buffer_head *gd_bh, *bh;
+	u32 bit, i, bad = 0;
+
+	gd = basefs_get_group_desc(sb, group, &gd_bh);
+	if (!gd)
+		return -EFSCORRUPTED;
+	bh = sb_bread(sb, le64_to_cpu(gd->block_bitmap));
+	if (!bh)
+		return -EIO;
+
+	bit = (u32)(start - basefs_group_first_block(sbi->first_group_block,
+						     sbi->blocks_per_group,
+						     group));
+	spin_lock(&sbi->group_locks[group]);
+	for (i = 0; i < count; i++) {
+		if (used)
+			bad += __test_and_set_bit_le(bit + i, bh->b_data);
+		else
+			bad += !__test_and_clear_bit_le(bit + i, bh->b_data);
+	}
+	le32_add_cpu(&gd->free_blocks_count, used ? -(s32)count : (s32)count);
+	spin_unlock(&sbi->group_locks[group]);
+	if (bad)
+		basefs_msg(sb, KERN_ERR,
+			   "block bitmap of group %u disagrees with free space: %u of %u blocks at %llu already %s",
+			   group, bad, count, start, used ? "used" : "free");
+	basefs_journal_dirty(sb, bh, NULL);
+	brelse(bh);
+	basefs_journal_dirty(sb, gd_bh, NULL);
+	basefs_mark_sb_dirty(sb);
+	return 0;
+}
+
+/*
+ * basefs_find_free - Pick up to 'want' blocks and take them out of the
+ * trees.  'goal' is where the caller would like the blocks (usually
+ * right after the previous extent of the file) and 'hint' how much
+ * contiguous space it expects to need eventually.  The search order is:
+ *
+ *   1. the free extent covering 'goal', so a file grows in place;
+ *   2. best fit: the smallest free extent of at least 'hint' blocks;
+ *   3. the largest free extent, which then holds fewer than asked.
+ *
+ * Best fit on the hint, not on 'want', is what keeps large files in few
+ * extents: a writer gets placed in a hole big enough to keep growing
+ * into, while small files fill the small holes.  The goal's group is
+ * loaded first and others only while no loaded extent is large enough.
+ * Called with alloc_lock held; the bitmap is not touched.
+ */
+static int basefs_find_free(struct super_block *sb, u64 goal, u32 hint,
+			    u32 want, u64 *start, u32 *count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u64 ext_start, ext_len, key, at;
+	u32 group, n;
+
+	hint = max(hint, want);
+	if (goal >= sbi->first_group_block && goal < sbi->blocks_count) {
+		group = basefs_group_of_block(sbi, goal);
+		if (!test_bit(group, sbi->group_loaded))
+			basefs_load_group(sb, group);
+	}
+
+	if (goal && btree_lookup_le(sbi->free_by_start, goal, &ext_start,
+				    &ext_len) &&
+	    goal < ext_start + ext_len) {
+		at = goal;
+		n = (u32)min_t(u64, want, ext_start + ext_len - goal);
+		goto found;
+	}
+
+	/* Best fit among the loaded groups, loading more until one fits. */
+	while (!btree_lookup_ge(sbi->free_by_len, BASEFS_LEN_KEY(hint, 0),
+				&key, &ext_start)) {
+		if (!basefs_load_next_group(sb)) {
+			if (!btree_lookup_le(sbi->free_by_len, U64_MAX, &key,
+					     &ext_start))
+				return -ENOSPC;
+			break;
+		}
+	}
+	ext_len = key >> BASEFS_START_BITS;
+	at = ext_start;
+	n = (u32)min_t(u64, want, ext_len);
+
+found:
+	basefs_remove_free(sbi, ext_start, ext_len);
+	if (at > ext_start)
+		basefs_add_free(sb, ext_start, at - ext_start);
+	if (at + n < ext_start + ext_len)
+		basefs_add_free(sb, at + n, ext_start + ext_len - at - n);
+	percpu_counter_sub(&sbi->free_blocks, n);
+
+	*start = at;
+	*count = n;
+	return 0;
+}
+
+/*
+ * basefs_put_free - Give [start, start + count) back to the trees,
+ * merged with free neighbours so the trees always hold maximal extents.
+ * Called with alloc_lock held.
+ */
+static void basefs_put_free(struct super_block *sb, u64 start, u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u64 prev_start, prev_len, next_len;
+	u64 new_start = start, new_len = count;
+
+	if (btree_lookup_le(sbi->free_by_start, start, &prev_start, &prev_len) &&
+	    prev_start + prev_len == start) {
+		basefs_remove_free(sbi, prev_start, prev_len);
+		new_start = prev_start;
+		new_len += prev_len;
+	}
+	if (btree_search(sbi->free_by_start, start + count, &next_len)) {
+		basefs_remove_free(sbi, start + count, next_len);
+		new_len += next_len;
+	}
+	basefs_add_free(sb, new_start, new_len);
+	percpu_counter_add(&sbi->free_blocks, count);
+}
+
+/* True if [start, start + count) is data space inside one group. */
+static bool basefs_valid_range(struct super_block *sb, u64 start, u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u64 group_start;
+	u32 group;
+
+	if (!count || start < sbi->first_group_block)
+		return false;
+	group = basefs_group_of_block(sbi, start);
+	group_start = basefs_group_first_block(sbi->first_group_block,
+					       sbi->blocks_per_group, group);
+	return group < sbi->groups_count &&
+	       start >= group_start + basefs_group_overhead(sbi->itable_blocks) &&
+	       start + count <= group_start + sbi->blocks_per_group &&
+	       start + count <= sbi->blocks_count;
+}
+
+/*
+ * basefs_new_blocks - Allocate up to *count contiguous blocks, placed as
+ * described at basefs_find_free().  Only *count blocks are taken; the
+ * rest of the chosen extent stays free.
+ *
+ * On success *start is the first block and *count the number allocated
+ * (at least one).  Returns 0, -ENOSPC or -EIO.
+ */
+int basefs_new_blocks(struct super_block *sb, u64 goal, u32 hint,
+		      u32 *count, u64 *start)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	int ret;
+
+	if (!*count)
+		return -EINVAL;
+
+	mutex_lock(&sbi->alloc_lock);
+	ret = basefs_find_free(sb, goal, hint, *count, start, count);
+	mutex_unlock(&sbi->alloc_lock);
+	if (ret)
+		return ret;
+
+	ret = basefs_mark_blocks(sb, *start, *count, true);
+	if (ret) {
+		mutex_lock(&sbi->alloc_lock);
+		basefs_put_free(sb, *start, *count);
+		mutex_unlock(&sbi->alloc_lock);
+	}
+	return ret;
+}
+
+/*
+ * Reservations.
+ *
+ * A file being written keeps a window of blocks ahead of its last extent
+ * (see basefs_map_blocks()) so that other writers cannot take the space
+ * it is about to grow into.  Reserved blocks are out of the trees but
+ * still free in the bitmaps: nothing reaches the disk until a block is
+ * claimed, and a crash leaves no trace of the window.
+ *
+ * Small windows are cut from a per-CPU pool, a chunk of pool_chunk
+ * blocks taken from the trees in one go, so writers on different CPUs
+ * do not meet on alloc_lock more than once per chunk.  A file that
+ * keeps writing from the same CPU gets consecutive windows of the same
+ * chunk, which then join into one extent, and files written from
+ * different CPUs grow in different chunks.  Windows of a stream
+ * (BASEFS_STREAM_WINDOW and up) are already a chunk of their own: unless
+ * they continue the CPU's chunk they come straight from the trees at the
+ * file's goal, which keeps a large file in one extent while the space
+ * behind it is free.  Claiming blocks only takes the group's lock.
+ */
+
+static int basefs_reserve_blocks(struct super_block *sb, u64 goal, u32 hint,
+				 u32 *count, u64 *start)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	int ret;
+
+	mutex_lock(&sbi->alloc_lock);
+	ret = basefs_find_free(sb, goal, hint, *count, start, count);
+	mutex_unlock(&sbi->alloc_lock);
+	if (!ret)
+		percpu_counter_add(&sbi->reserved_blocks, *count);
+	return ret;
+}
+
+static void basefs_unreserve_blocks(struct super_block *sb, u64 start,
+				    u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	if (!basefs_valid_range(sb, start, count)) {
+		basefs_msg(sb, KERN_ERR, "unreserving invalid blocks %llu+%u",
+			   start, count);
+		return;
+	}
+
+	mutex_lock(&sbi->alloc_lock);
+	basefs_put_free(sb, start, count);
+	mutex_unlock(&sbi->alloc_lock);
+	percpu_counter_sub(&sbi->reserved_blocks, count);
+}
+
+/*
+ * basefs_drain_pools - Give every CPU's chunk back to the trees, when
+ * they ran dry or at unmount.  Returns whether anything came back.
+ */
+static bool basefs_drain_pools(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_pool *pool;
+	bool drained = false;
+	u64 start;
+	u32 len;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(sbi->pools, cpu);
+		spin_lock(&pool->lock);
+		start = pool->start;
+		len = pool->len;
+		pool->len = 0;
+		spin_unlock(&pool->lock);
+		if (len) {
+			basefs_unreserve_blocks(sb, start, len);
+			drained = true;
+		}
+	}
+	return drained;
+}
+
+/* Can 'pool' serve a window of 'want' blocks for 'goal'?  Under its lock. */
+static bool basefs_pool_fits(struct basefs_sb_info *sbi,
+			     struct basefs_pool *pool, u64 goal, u32 want)
+{
+	if (!pool->len)
+		return false;
+	if (pool->start == goal)
+		return true;
+	if (want >= BASEFS_STREAM_WINDOW || pool->len < want)
+		return false;
+	return !sbi->orlov || basefs_group_of_block(sbi, pool->start) ==
+			      basefs_group_of_block(sbi, goal);
+}
+
+/*
+ * basefs_reserve_window - Reserve up to *count blocks for a file whose
+ * next block would ideally be 'goal'.  Served from this CPU's chunk if
+ * the chunk continues right at the goal, or for a small window if it
+ * holds all of it.  Otherwise a small window replaces the chunk by a new
+ * one and a stream window is taken on its own, both asked for at the
+ * goal so the file can keep growing in place.  With the orlov mount
+ * option a small window is only cut from a chunk in the goal's group, so
+ * files land near their directory rather than wherever this CPU's chunk
+ * happens to be.
+ */
+int basefs_reserve_window(struct super_block *sb, u64 goal, u32 *count,
+			  u64 *start)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_pool *pool = raw_cpu_ptr(sbi->pools);
+	u32 want = *count, n;
+	u64 chunk, old_start;
+	u32 old_len;
+	int ret;
+
+	if (!want)
+		return -EINVAL;
+
+	spin_lock(&pool->lock);
+	if (basefs_pool_fits(sbi, pool, goal, want)) {
+		n = min(want, pool->len);
+		*start = pool->start;
+		*count = n;
+		pool->start += n;
+		pool->len -= n;
+		spin_unlock(&pool->lock);
+		return 0;
+	}
+	spin_unlock(&pool->lock);
+
+	n = want < BASEFS_STREAM_WINDOW ? max(want, sbi->pool_chunk) : want;
+	ret = basefs_reserve_blocks(sb, goal, n, &n, &chunk);
+	if (ret == -ENOSPC && basefs_drain_pools(sb)) {
+		n = want;
+		ret = basefs_reserve_blocks(sb, goal, n, &n, &chunk);
+	}
+	if (ret)
+		return ret;
+
+	*start = chunk;
+	*count = min(want, n);
+	if (n == *count)
+		return 0;
+
+	/* Keep the rest for the next windows cut on this CPU. */
+	spin_lock(&pool->lock);
+	old_start = pool->start;
+	old_len = pool->len;
+	pool->start = chunk + *count;
+	pool->len = n - *count;
+	spin_unlock(&pool->lock);
+	if (old_len)
+		basefs_unreserve_blocks(sb, old_start, old_len);
+	return 0;
+}
+
+/*
+ * basefs_release_window - Give back the unused part of a window.  If it
+ * ends where this CPU's chunk starts (or the chunk is empty) it goes
+ * back into the chunk, so the next small file is packed right behind
+ * this one; otherwise it returns to the trees.
+ */
+void basefs_release_window(struct super_block *sb, u64 start, u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_pool *pool = raw_cpu_ptr(sbi->pools);
+
+	if (!count)
+		return;
+
+	spin_lock(&pool->lock);
+	if (!pool->len || pool->start == start + count) {
+		if (!pool->len)
+			pool->start = start + count;
+		pool->start -= count;
+		pool->len += count;
+		spin_unlock(&pool->lock);
+		return;
+	}
+	spin_unlock(&pool->lock);
+	basefs_unreserve_blocks(sb, start, count);
+}
+
+/* basefs_claim_blocks - Turn reserved blocks into allocated ones. */
+int basefs_claim_blocks(struct super_block *sb, u64 start, u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	int ret;
+
+	ret = basefs_mark_blocks(sb, start, count, true);
+	if (!ret)
+		percpu_counter_sub(&sbi->reserved_blocks, count);
+	return ret;
+}
+
+/*
+ * Delayed allocation (file.c) promises blocks to dirty buffers before
+ * choosing them.  The promise is only a count, checked against what is
+ * free or reserved, so write() fails with ENOSPC rather than writeback.
+ *
+ * The counters are per-CPU and their approximate values are off by up
+ * to the batch size per CPU, so the check only sums them exactly when
+ * the file system is within BASEFS_FREE_WATERMARK of full.
+ */
+#define BASEFS_FREE_WATERMARK   (4 * percpu_counter_batch * nr_cpu_ids)
+
+static s64 basefs_avail_blocks(struct basefs_sb_info *sbi, bool exact)
+{
+	if (exact)
+		return percpu_counter_sum_positive(&sbi->free_blocks) +
+		       percpu_counter_sum_positive(&sbi->reserved_blocks) -
+		       percpu_counter_sum(&sbi->delalloc_blocks);
+	return percpu_counter_read_positive(&sbi->free_blocks) +
+	       percpu_counter_read_positive(&sbi->reserved_blocks) -
+	       percpu_counter_read(&sbi->delalloc_blocks);
+}
+
+int basefs_reserve_delalloc(struct super_block *sb, u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	if (basefs_avail_blocks(sbi, false) < count + BASEFS_FREE_WATERMARK &&
+	    basefs_avail_blocks(sbi, true) < count)
+		return -ENOSPC;
+	percpu_counter_add(&sbi->delalloc_blocks, count);
+	return 0;
+}
+
+void basefs_release_delalloc(struct super_block *sb, u32 count)
+{
+	percpu_counter_sub(&BASEFS_SB(sb)->delalloc_blocks, count);
+}
+
+/* basefs_free_blocks - Return 'count' allocated blocks starting at 'start'. */
+void basefs_free_blocks(struct super_block *sb, u64 start, u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	if (!count)
+		return;
+	if (!basefs_valid_range(sb, start, count)) {
+		basefs_msg(sb, KERN_ERR, "freeing invalid blocks %llu+%u",
+			   start, count);
+		return;
+	}
+
+	/* A group not loaded yet picks the blocks up from its bitmap. */
+	mutex_lock(&sbi->alloc_lock);
+	if (!test_bit(basefs_group_of_block(sbi, start), sbi->group_loaded)) {
+		if (!basefs_mark_blocks(sb, start, count, false))
+			percpu_counter_add(&sbi->free_blocks, count);
+		else
+			basefs_msg(sb, KERN_ERR, "cannot read bitmap, %u blocks at %llu leaked",
+				   count, start);
+		mutex_unlock(&sbi->alloc_lock);
+		return;
+	}
+	mutex_unlock(&sbi->alloc_lock);
+
+	if (basefs_mark_blocks(sb, start, count, false)) {
+		basefs_msg(sb, KERN_ERR, "cannot read bitmap, %u blocks at %llu leaked",
+			   count, start);
+		return;
+	}
+	mutex_lock(&sbi->alloc_lock);
+	basefs_put_free(sb, start, count);
+	mutex_unlock(&sbi->alloc_lock);
+}
+
+/*
+ * basefs_free_meta_blocks - Free blocks that held metadata (directory
+ * blocks).  With a journal, copies of them may still be in the log, and
+ * replaying one over a block that holds file data by then would corrupt
+ * the file.  The blocks are revoked and cleared in the bitmap in the
+ * running transaction, but only go back to the trees once that
+ * transaction is checkpointed (basefs_reuse_blocks()).  Their group is
+ * loaded first, so that no load puts them in the trees early.
+ *
+ * Without a journal they are freed at once, but their buffers may still
+ * be dirty in the block device cache: they are forgotten first, or
+ * writeback could put the old metadata over file data written there.
+ */
+void basefs_free_meta_blocks(struct super_block *sb, u64 start, u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 group;
+
+	if (!sbi->journal) {
+		if (count && basefs_valid_range(sb, start, count))
+			clean_bdev_aliases(sb->s_bdev, start, count);
+		basefs_free_blocks(sb, start, count);
+		return;
+	}
+	if (!count)
+		return;
+	if (!basefs_valid_range(sb, start, count)) {
+		basefs_msg(sb, KERN_ERR, "freeing invalid blocks %llu+%u",
+			   start, count);
+		return;
+	}
+
+	group = basefs_group_of_block(sbi, start);
+	mutex_lock(&sbi->alloc_lock);
+	if (!test_bit(group, sbi->group_loaded))
+		basefs_load_group(sb, group);
+	mutex_unlock(&sbi->alloc_lock);
+
+	if (basefs_mark_blocks(sb, start, count, false)) {
+		basefs_msg(sb, KERN_ERR, "cannot read bitmap, %u blocks at %llu leaked",
+			   count, start);
+		return;
+	}
+	basefs_journal_revoke(sb, start, count);
+}
+
+/* basefs_reuse_blocks - The journal is done with freed metadata blocks. */
+void basefs_reuse_blocks(struct super_block *sb, u64 start, u32 count)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	mutex_lock(&sbi->alloc_lock);
+	basefs_put_free(sb, start, count);
+	mutex_unlock(&sbi->alloc_lock);
+}
+
+static void basefs_destroy_allocator(struct basefs_sb_info *sbi)
+{
+	btree_destroy(sbi->free_by_start);
+	btree_destroy(sbi->free_by_len);
+	sbi->free_by_start = NULL;
+	sbi->free_by_len = NULL;
+	free_percpu(sbi->pools);
+	sbi->pools = NULL;
+	kvfree(sbi->group_locks);
+	sbi->group_locks = NULL;
+	kvfree(sbi->group_loaded);
+	sbi->group_loaded = NULL;
+	percpu_counter_destroy(&sbi->free_blocks);
+	percpu_counter_destroy(&sbi->reserved_blocks);
+	percpu_counter_destroy(&sbi->delalloc_blocks);
+	percpu_counter_destroy(&sbi->free_inodes);
+}
+
+/*
+ * basefs_init_allocator - Set up empty free-extent trees and take the
+ * free block and inode totals from the group descriptors.  The bitmaps
+ * are loaded later, see basefs_load_group().
+ */
+static int basefs_init_allocator(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_group_desc *gd;
+	u64 free_blocks = 0, free_inodes = 0;
+	u32 group;
+	int cpu, ret;
+
+	for (group = 0; group < sbi->groups_count; group++) {
+		gd = basefs_get_group_desc(sb, group, NULL);
+		free_blocks += le32_to_cpu(gd->free_blocks_count);
+		free_inodes += le32_to_cpu(gd->free_inodes_count);
+	}
+	ret = percpu_counter_init(&sbi->free_blocks, free_blocks, GFP_KERNEL);
+	if (!ret)
+		ret = percpu_counter_init(&sbi->reserved_blocks, 0, GFP_KERNEL);
+	if (!ret)
+		ret = percpu_counter_init(&sbi->delalloc_blocks, 0, GFP_KERNEL);
+	if (!ret)
+		ret = percpu_counter_init(&sbi->free_inodes, free_inodes,
+					  GFP_KERNEL);
+	if (ret) {
+		basefs_destroy_allocator(sbi);
+		return ret;
+	}
+	/* An immutable image never allocates: the counts are for statfs. */
+	if (sbi->immutable)
+		return 0;
+
+	sbi->free_by_start = btree_init();
+	sbi->free_by_len = btree_init();
+	sbi->pools = alloc_percpu(struct basefs_pool);
+	sbi->group_locks = kvcalloc(sbi->groups_count,
+				    sizeof(*sbi->group_locks), GFP_KERNEL);
+	sbi->group_loaded = kvcalloc(BITS_TO_LONGS(sbi->groups_count),
+				     sizeof(unsigned long), GFP_KERNEL);
+	if (!sbi->free_by_start || !sbi->free_by_len || !sbi->pools ||
+	    !sbi->group_locks || !sbi->group_loaded) {
+		basefs_destroy_allocator(sbi);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(sbi->pools, cpu)->lock);
+	for (group = 0; group < sbi->groups_count; group++)
+		spin_lock_init(&sbi->group_locks[group]);
+
+	/* Chunks never hold more than 1/16 of the file system between them. */
+	sbi->pool_chunk = (u32)clamp_t(u64,
+			div_u64(sbi->blocks_count, 16 * num_possible_cpus()),
+			BASEFS_MIN_PREALLOC, BASEFS_POOL_CHUNK);
+
+	sbi->groups_loaded = 0;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Superblock operations                                                       */
+
+static struct kmem_cache *basefs_inode_cachep;
+
+/* Slab constructor: runs once per object, not on every allocation. */
+static void basefs_inode_init_once(void *obj)
+{
+	struct basefs_inode_info *bi = obj;
+
+	mutex_init(&bi->i_map_lock);
+	init_rwsem(&bi->i_xattr_sem);
+	inode_init_once(&bi->vfs_inode);
+}
+
+/*
+ * Inline symlink targets are read straight out of i_data by readlink,
+ * so that is the one part of the object copied to user space.
+ */
+int basefs_init_inodecache(void)
+{
+	basefs_inode_cachep = kmem_cache_create_usercopy("basefs_inode_cache",
+				sizeof(struct basefs_inode_info), 0,
+				SLAB_HWCACHE_ALIGN | SLAB_RECLAIM_ACCOUNT |
+				SLAB_ACCOUNT,
+				offsetof(struct basefs_inode_info, i_data),
+				sizeof_field(struct basefs_inode_info, i_data),
+				basefs_inode_init_once);
+	return basefs_inode_cachep ? 0 : -ENOMEM;
+}
+
+void basefs_destroy_inodecache(void)
+{
+	/* Inodes are freed after an RCU grace period; wait for them. */
+	rcu_barrier();
+	kmem_cache_destroy(basefs_inode_cachep);
+}
+
+static struct inode *basefs_alloc_inode(struct super_block *sb)
+{
+	struct basefs_inode_info *bi;
+
+	bi = alloc_inode_sb(sb, basefs_inode_cachep, GFP_KERNEL);
+	if (!bi)
+		return NULL;
+	/* Left as the last user freed it; iget and new_inode fill i_data. */
+	bi->i_flags = 0;
+	bi->i_nr_extents = 0;
+	bi->i_prealloc_len = 0;
+	bi->i_prealloc_start = 0;
+	bi->i_block_group = 0;
+	bi->i_sync_tid = 0;
+	bi->i_dir_index = NULL;
+	bi->i_dir_bloom = NULL;
+	bi->i_dir_hint = 0;
+	bi->i_xattr_block = 0;
+	return &bi->vfs_inode;
+}
+
+/* Called by the VFS after an RCU grace period. */
+static void basefs_free_inode(struct inode *inode)
+{
+	kmem_cache_free(basefs_inode_cachep, BASEFS_I(inode));
+}
+
+/*
+ * basefs_save_sb - Copy the in-memory totals into the superblock buffer
+ * and log it.
+ */
+int basefs_save_sb(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_super_block *raw = sbi->raw_sb;
+	struct basefs_handle h;
+	u64 free_blocks, free_inodes;
+
+	basefs_journal_start(sb, &h);
+	clear_bit(BASEFS_SB_DIRTY, &sbi->sb_state);
+	/* Reserved blocks are still free on disk. */
+	free_blocks = percpu_counter_sum_positive(&sbi->free_blocks) +
+		      percpu_counter_sum_positive(&sbi->reserved_blocks);
+	free_inodes = percpu_counter_sum_positive(&sbi->free_inodes);
+	lock_buffer(sbi->sbh);
+	raw->free_blocks_count = cpu_to_le64(free_blocks);
+	raw->free_inodes_count = cpu_to_le64(free_inodes);
+	raw->wtime = cpu_to_le64(ktime_get_real_seconds());
+	if (le32_to_cpu(raw->feature_ro_compat) & BASEFS_FEATURE_RO_COMPAT_SB_CSUM)
+		raw->checksum = cpu_to_le32(basefs_super_csum(raw));
+	unlock_buffer(sbi->sbh);
+	basefs_journal_dirty(sb, sbi->sbh, NULL);
+	return basefs_journal_stop(sb, &h);
+}
+
+static void basefs_set_feature(struct super_block *sb, __le32 *features,
+			       u32 feature)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_super_block *raw = sbi->raw_sb;
+
+	if (le32_to_cpu(READ_ONCE(*features)) & feature)
+		return;
+	lock_buffer(sbi->sbh);
+	*features |= cpu_to_le32(feature);
+	if (le32_to_cpu(raw->feature_ro_compat) & BASEFS_FEATURE_RO_COMPAT_SB_CSUM)
+		raw->checksum = cpu_to_le32(basefs_super_csum(raw));
+	unlock_buffer(sbi->sbh);
+	basefs_journal_dirty(sb, sbi->sbh, NULL);
+}
+
+/*
+ * basefs_set_incompat - The image starts using 'feature' in the running
+ * transaction: record it so that code that does not know it refuses the
+ * image from then on.  Called inside a handle.
+ */
+void basefs_set_incompat(struct super_block *sb, u32 feature)
+{
+	basefs_set_feature(sb, &BASEFS_SB(sb)->raw_sb->feature_incompat,
+			   feature);
+}
+
+/* The same for a feature that code which does not know it may ignore. */
+void basefs_set_compat(struct super_block *sb, u32 feature)
+{
+	basefs_set_feature(sb, &BASEFS_SB(sb)->raw_sb->feature_compat,
+			   feature);
+}
+
+/*
+ * basefs_clear_ro_compat - The image no longer uses 'feature', so code
+ * that does not know it may write to it again.  Called inside a handle.
+ */
+void basefs_clear_ro_compat(struct super_block *sb, u32 feature)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_super_block *raw = sbi->raw_sb;
+
+	if (!(le32_to_cpu(READ_ONCE(raw->feature_ro_compat)) & feature))
+		return;
+	lock_buffer(sbi->sbh);
+	raw->feature_ro_compat &= ~cpu_to_le32(feature);
+	if (le32_to_cpu(raw->feature_ro_compat) & BASEFS_FEATURE_RO_COMPAT_SB_CSUM)
+		raw->checksum = cpu_to_le32(basefs_super_csum(raw));
+	unlock_buffer(sbi->sbh);
+	basefs_journal_dirty(sb, sbi->sbh, NULL);
+}
+
+/*
+ * The free counts change with every allocation, so they are not copied
+ * to the superblock each time.  The first change after a save arms
+ * sb_work, which saves them all BASEFS_SB_WRITEBACK_SECS later; sync
+ * and unmount save them at once.  The buffer itself is written by the
+ * journal, or without one by the block device's writeback like the
+ * bitmaps.
+ */
+void basefs_mark_sb_dirty(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	if (test_bit(BASEFS_SB_DIRTY, &sbi->sb_state) ||
+	    test_and_set_bit(BASEFS_SB_DIRTY, &sbi->sb_state))
+		return;
+	queue_delayed_work(system_long_wq, &sbi->sb_work,
+			   BASEFS_SB_WRITEBACK_SECS * HZ);
+}
+
+static void basefs_sb_writeback(struct work_struct *work)
+{
+	struct basefs_sb_info *sbi = container_of(to_delayed_work(work),
+						  struct basefs_sb_info,
+						  sb_work);
+
+	basefs_save_sb(sbi->sb);
+}
+
+static int basefs_sync_fs(struct super_block *sb, int wait)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	basefs_save_sb(sb);
+	if (sbi->journal)
+		return wait ? basefs_journal_commit(sb) : 0;
+	if (wait)
+		sync_dirty_buffer(sbi->sbh);
+	return 0;
+}
+
+/* Stop the background works that write, at unmount or remount read-only. */
+static void basefs_stop_works(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	WRITE_ONCE(sbi->prefetch_stop, true);
+	cancel_work_sync(&sbi->prefetch_work);
+	basefs_itable_stop(sb);
+	cancel_delayed_work_sync(&sbi->sb_work);
+}
+
+/*
+ * Save the superblock for the last time before the mount stops writing.
+ * With a journal, emptying it writes it home.
+ */
+static void basefs_write_super_final(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 i;
+
+	basefs_save_sb(sb);
+	if (!sbi->journal) {
+		for (i = 0; i < sbi->gdt_blocks; i++)
+			sync_dirty_buffer(sbi->gdt_bh[i]);
+		sync_dirty_buffer(sbi->sbh);
+	}
+}
+
+static void basefs_put_super(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 i;
+
+	proc_remove(sbi->proc);
+	basefs_stop_works(sb);
+
+	if (!sb_rdonly(sb)) {
+		/* Every file is gone, only the per-CPU chunks hold blocks. */
+		basefs_drain_pools(sb);
+		basefs_write_super_final(sb);
+	}
+	/* Blocks freed in the last transactions return to the trees here. */
+	basefs_journal_destroy(sb);
+
+	free_percpu(sbi->dir_stats);
+	basefs_xattr_destroy(sb);
+	basefs_destroy_allocator(sbi);
+	for (i = 0; i < sbi->gdt_blocks; i++)
+		brelse(sbi->gdt_bh[i]);
+	kfree(sbi->gdt_bh);
+	brelse(sbi->sbh);
+	sb->s_fs_info = NULL;
+	kfree(sbi);
+}
+
+static int basefs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+	/*
+	 * Reserved blocks are not in use and come back when needed; delayed
+	 * blocks are as good as allocated.
+	 */
+	s64 nr_free = basefs_avail_blocks(sbi, true);
+
+	if (nr_free < 0)
+		nr_free = 0;
+
+	buf->f_type = BASEFS_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sbi->blocks_count;
+	buf->f_bfree = nr_free;
+	buf->f_bavail = nr_free;
+	buf->f_files = sbi->inodes_count;
+	buf->f_ffree = percpu_counter_sum_positive(&sbi->free_inodes);
+	buf->f_namelen = BASEFS_NAME_LEN;
+	buf->f_fsid = u64_to_fsid(id);
+	return 0;
+}
+
+static int basefs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(root->d_sb);
+
+	if (sbi->commit_interval != BASEFS_COMMIT_INTERVAL_SECS * HZ)
+		seq_printf(seq, ",commit=%lu", sbi->commit_interval / HZ);
+	if (sbi->max_batch_us != BASEFS_MAX_BATCH_USECS)
+		seq_printf(seq, ",max_batch_time=%u", sbi->max_batch_us);
+	if (sbi->immutable)
+		seq_puts(seq, ",immutable");
+	if (sbi->orlov)
+		seq_puts(seq, ",orlov");
+	if (sbi->itable_rate != BASEFS_ITABLE_RATE)
+		seq_printf(seq, ",init_itable=%u", sbi->itable_rate);
+	return 0;
+}
+
+enum { Opt_commit, Opt_max_batch_time, Opt_immutable, Opt_orlov,
+       Opt_init_itable, Opt_err };
+
+static const match_table_t basefs_tokens = {
+	{ Opt_commit,         "commit=%u" },
+	{ Opt_max_batch_time, "max_batch_time=%u" },
+	{ Opt_immutable,      "immutable" },
+	{ Opt_orlov,          "orlov" },
+	{ Opt_init_itable,    "init_itable=%u" },
+	{ Opt_err,            NULL },
+};
+
+struct basefs_mount_opts {
+	unsigned long commit_interval;
+	u32 max_batch_us;
+	u32 itable_rate;
+	bool immutable;
+	bool orlov;
+};
+
+/*
+ * basefs_parse_options - Mount options, parsed into 'opts', which holds
+ * the defaults at mount and the current values at remount:
+ *   commit=secs          seconds between journal commits (0: default)
+ *   max_batch_time=usecs longest a sync request waits for others to
+ *                        join its commit (0: never waits)
+ *   immutable            the image is a dataset nobody writes while it
+ *                        is mounted, see basefs_fill_super()
+ *   orlov                spread top-level directories over the groups
+ *                        and keep each one's files together, see
+ *                        basefs_new_inode()
+ *   init_itable=MB/s     rate of the background zeroing of inode tables
+ *                        makefs left unwritten (0: only as inodes are
+ *                        allocated), see itable.c
+ */
+static int basefs_parse_options(struct super_block *sb, char *options,
+				struct basefs_mount_opts *opts)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int n;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, basefs_tokens, args)) {
+		case Opt_commit:
+			if (match_int(&args[0], &n) || n < 0 || n > INT_MAX / HZ)
+				goto bad;
+			opts->commit_interval =
+				(n ? n : BASEFS_COMMIT_INTERVAL_SECS) * HZ;
+			break;
+		case Opt_max_batch_time:
+			if (match_int(&args[0], &n) || n < 0)
+				goto bad;
+			opts->max_batch_us = n;
+			break;
+		case Opt_immutable:
+			opts->immutable = true;
+			break;
+		case Opt_orlov:
+			opts->orlov = true;
+			break;
+		case Opt_init_itable:
+			if (match_int(&args[0], &n) || n < 0)
+				goto bad;
+			opts->itable_rate = n;
+			break;
+		default:
+			goto bad;
+		}
+	}
+	return 0;
+
+bad:
+	basefs_msg(sb, KERN_ERR, "bad mount option \"%s\"", p);
+	return -EINVAL;
+}
+
+/*
+ * Remount takes the same options.  commit=, max_batch_time= and
+ * init_itable= change; immutable and orlov must stay as they were
+ * mounted, and options not given keep their current values.
+ *
+ * An immutable mount has no write path to bring up.  Otherwise a remount
+ * read-only stops the background works and leaves the journal empty and
+ * INCOMPAT_RECOVER clear, as an unmount would; a remount read-write
+ * undoes that, as a read-write mount would.
+ */
+static int basefs_remount(struct super_block *sb, int *flags, char *data)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 ro_compat = le32_to_cpu(sbi->raw_sb->feature_ro_compat);
+	struct basefs_mount_opts opts = {
+		.commit_interval = sbi->commit_interval,
+		.max_batch_us    = sbi->max_batch_us,
+		.itable_rate     = sbi->itable_rate,
+		.immutable       = sbi->immutable,
+		.orlov           = sbi->orlov,
+	};
+	int ret;
+
+	ret = basefs_parse_options(sb, data, &opts);
+	if (ret)
+		return ret;
+	if (opts.immutable != sbi->immutable || opts.orlov != sbi->orlov) {
+		basefs_msg(sb, KERN_ERR, "immutable and orlov cannot be changed on remount");
+		return -EINVAL;
+	}
+	if (sbi->immutable && !(*flags & SB_RDONLY)) {
+		basefs_msg(sb, KERN_ERR, "immutable mounts cannot be remounted read-write");
+		return -EROFS;
+	}
+	sync_filesystem(sb);
+
+	sbi->commit_interval = opts.commit_interval;
+	sbi->max_batch_us = opts.max_batch_us;
+	basefs_journal_set_options(sb);
+	if (opts.itable_rate != sbi->itable_rate) {
+		basefs_itable_stop(sb);
+		sbi->itable_rate = opts.itable_rate;
+		if (!sb_rdonly(sb) && !(*flags & SB_RDONLY))
+			basefs_itable_start(sb);
+	}
+	if (!(*flags & SB_RDONLY) == !sb_rdonly(sb))
+		return 0;
+
+	if (*flags & SB_RDONLY) {
+		basefs_stop_works(sb);
+		basefs_write_super_final(sb);
+		ret = basefs_journal_remount(sb, true);
+		if (ret)
+			goto restart;
+		return 0;
+	}
+
+	if (ro_compat & ~BASEFS_FEATURE_RO_COMPAT_SUPP) {
+		basefs_msg(sb, KERN_ERR, "unsupported ro_compat features 0x%x, cannot remount read-write",
+			   ro_compat & ~BASEFS_FEATURE_RO_COMPAT_SUPP);
+		return -EROFS;
+	}
+	ret = basefs_journal_remount(sb, false);
+	if (ret)
+		return ret;
+restart:
+	WRITE_ONCE(sbi->prefetch_stop, false);
+	queue_work(system_unbound_wq, &sbi->prefetch_work);
+	basefs_itable_start(sb);
+	return ret;
+}
+
+const struct super_operations basefs_super_ops = {
+	.alloc_inode  = basefs_alloc_inode,
+	.free_inode   = basefs_free_inode,
+	.dirty_inode  = basefs_dirty_inode,
+	.write_inode  = basefs_write_inode,
+	.evict_inode  = basefs_evict_inode,
+	.put_super    = basefs_put_super,
+	.sync_fs      = basefs_sync_fs,
+	.statfs       = basefs_statfs,
+	.remount_fs   = basefs_remount,
+	.show_options = basefs_show_options,
+};
+
+/* ------------------------------------------------------------------------- */
+/* Mount                                                                       */
+
+/*
+ * basefs_check_geometry - Reject superblocks whose layout the rest of the
+ * code would trust blindly.
+ */
+static int basefs_check_geometry(struct super_block *sb,
+				 struct basefs_sb_info *sbi)
+{
+	u64 gdt_bytes = (u64)sbi->gdt_blocks * sbi->block_size;
+
+	if (!sbi->groups_count || !sbi->inodes_per_group ||
+	    sbi->inode_size < BASEFS_MIN_INODE_SIZE ||
+	    sbi->inode_size > sbi->block_size ||
+	    (sbi->inode_size & (sbi->inode_size - 1)) ||
+	    sbi->blocks_per_group > sbi->block_size * 8 ||
+	    sbi->inodes_per_group > sbi->block_size * 8 ||
+	    sbi->blocks_per_group >= (1U << BASEFS_LEN_BITS) ||
+	    sbi->blocks_count >= (1ULL << BASEFS_START_BITS) ||
+	    gdt_bytes < (u64)sbi->groups_count * sizeof(struct basefs_group_desc) ||
+	    sbi->first_group_block + (u64)(sbi->groups_count - 1) *
+	    sbi->blocks_per_group + basefs_group_overhead(sbi->itable_blocks) >=
+	    sbi->blocks_count) {
+		basefs_msg(sb, KERN_ERR, "inconsistent superblock geometry");
+		return -EINVAL;
+	}
+	/* Every inode must be in its table, and every table in its group. */
+	if ((u64)sbi->itable_blocks * sbi->block_size <
+	    (u64)sbi->inodes_per_group * sbi->inode_size ||
+	    (u64)BASEFS_GROUP_META_BLOCKS + sbi->itable_blocks >=
+	    sbi->blocks_per_group) {
+		basefs_msg(sb, KERN_ERR, "inode tables of %u blocks do not fit %u inodes in groups of %u blocks",
+			   sbi->itable_blocks, sbi->inodes_per_group,
+			   sbi->blocks_per_group);
+		return -EFSCORRUPTED;
+	}
+	if (sb_bdev_nr_blocks(sb) < sbi->blocks_count) {
+		basefs_msg(sb, KERN_ERR, "device is smaller than the file system (%llu < %llu blocks)",
+			   (u64)sb_bdev_nr_blocks(sb), sbi->blocks_count);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * basefs_read_super_block - Read block 0 at the right block size and
+ * check the magic number, version, checksum and incompat features.
+ */
+static int basefs_read_super_block(struct super_block *sb, int silent)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_super_block *raw;
+	struct buffer_head *bh;
+	u32 block_size;
+
+	if (!sb_set_blocksize(sb, BASEFS_MIN_BLOCK_SIZE)) {
+		if (!silent)
+			basefs_msg(sb, KERN_ERR, "device block size is above %u",
+				   BASEFS_MIN_BLOCK_SIZE);
+		return -EINVAL;
+	}
+
+	bh = sb_bread(sb, 0);
+	if (!bh)
+		return -EIO;
+	raw = (struct basefs_super_block *)bh->b_data;
+	if (le32_to_cpu(raw->magic) != BASEFS_MAGIC) {
+		if (!silent)
+			basefs_msg(sb, KERN_ERR, "bad magic number 0x%08x",
+				   le32_to_cpu(raw->magic));
+		goto fail;
+	}
+	if (le32_to_cpu(raw->version) != BASEFS_FORMAT_VERSION) {
+		basefs_msg(sb, KERN_ERR, "unsupported format version %u",
+			   le32_to_cpu(raw->version));
+		goto fail;
+	}
+
+	block_size = le32_to_cpu(raw->block_size);
+	if (block_size < BASEFS_MIN_BLOCK_SIZE ||
+	    block_size > BASEFS_MAX_BLOCK_SIZE ||
+	    (block_size & (block_size - 1))) {
+		basefs_msg(sb, KERN_ERR, "invalid block size %u", block_size);
+		goto fail;
+	}
+	if (block_size != sb->s_blocksize) {
+		brelse(bh);
+		if (!sb_set_blocksize(sb, block_size)) {
+			basefs_msg(sb, KERN_ERR, "block size %u is not supported here",
+				   block_size);
+			return -EINVAL;
+		}
+		bh = sb_bread(sb, 0);
+		if (!bh)
+			return -EIO;
+		raw = (struct basefs_super_block *)bh->b_data;
+	}
+
+	if ((le32_to_cpu(raw->feature_ro_compat) &
+	     BASEFS_FEATURE_RO_COMPAT_SB_CSUM) &&
+	    le32_to_cpu(raw->checksum) != basefs_super_csum(raw)) {
+		basefs_msg(sb, KERN_ERR, "superblock checksum mismatch (0x%08x, computed 0x%08x)",
+			   le32_to_cpu(raw->checksum), basefs_super_csum(raw));
+		goto fail;
+	}
+	if (le32_to_cpu(raw->feature_incompat) & ~BASEFS_FEATURE_INCOMPAT_SUPP) {
+		basefs_msg(sb, KERN_ERR, "unsupported incompat features 0x%x",
+			   le32_to_cpu(raw->feature_incompat) &
+			   ~BASEFS_FEATURE_INCOMPAT_SUPP);
+		goto fail;
+	}
+
+	sbi->sbh = bh;
+	sbi->raw_sb = raw;
+	sbi->block_size = block_size;
+	return 0;
+
+fail:
+	brelse(bh);
+	return -EINVAL;
+}
+
+static int basefs_read_gdt(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u64 start = le64_to_cpu(sbi->raw_sb->gdt_start);
+	u32 i;
+
+	sbi->gdt_bh = kcalloc(sbi->gdt_blocks, sizeof(*sbi->gdt_bh), GFP_KERNEL);
+	if (!sbi->gdt_bh)
+		return -ENOMEM;
+	for (i = 0; i < sbi->gdt_blocks; i++) {
+		sbi->gdt_bh[i] = sb_bread(sb, start + i);
+		if (!sbi->gdt_bh[i]) {
+			basefs_msg(sb, KERN_ERR, "cannot read group descriptor block %u",
+				   i);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * basefs_fill_super - Called by mount_bdev() to set up the in-memory
+ * superblock: read and check the on-disk one, replay the journal, load
+ * the descriptor table and get the root inode.  Nothing else is read:
+ * bitmaps are loaded on first use and by the prefetch work started
+ * here, inode table blocks when their inodes are looked up.
+ *
+ * An immutable mount is read-only and never writes to the device, not
+ * even the journal or the superblock, so many of them (on many hosts)
+ * can share one image.  The journal is not loaded, the allocator gets
+ * no free-space trees, atime is never updated and block mapping takes
+ * no locks, since nothing can change an extent map.
+ */
+int basefs_fill_super(struct super_block *sb, void *data, int silent)
+{
+	struct basefs_sb_info *sbi;
+	struct basefs_super_block *raw;
+	struct basefs_mount_opts opts = {
+		.commit_interval = BASEFS_COMMIT_INTERVAL_SECS * HZ,
+		.max_batch_us    = BASEFS_MAX_BATCH_USECS,
+		.itable_rate     = BASEFS_ITABLE_RATE,
+	};
+	struct inode *root;
+	unsigned long root_ino;
+	u32 i;
+	int ret;
+
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi)
+		return -ENOMEM;
+	sb->s_fs_info = sbi;
+	sbi->sb = sb;
+	mutex_init(&sbi->alloc_lock);
+	mutex_init(&sbi->ialloc_lock);
+	INIT_WORK(&sbi->prefetch_work, basefs_prefetch_groups);
+	INIT_DELAYED_WORK(&sbi->sb_work, basefs_sb_writeback);
+	INIT_DELAYED_WORK(&sbi->itable_work, basefs_itable_work);
+
+	ret = basefs_parse_options(sb, data, &opts);
+	if (ret)
+		goto failed;
+	sbi->commit_interval = opts.commit_interval;
+	sbi->max_batch_us = opts.max_batch_us;
+	sbi->itable_rate = opts.itable_rate;
+	sbi->immutable = opts.immutable;
+	sbi->orlov = opts.orlov;
+	if (sbi->immutable)
+		sb->s_flags |= SB_RDONLY | SB_NOATIME | SB_NODIRATIME;
+	ret = basefs_read_super_block(sb, silent);
+	if (ret)
+		goto failed;
+	ret = basefs_journal_load(sb);
+	if (ret)
+		goto failed;
+	raw = sbi->raw_sb;
+
+	sbi->groups_count      = le32_to_cpu(raw->groups_count);
+	sbi->blocks_per_group  = le32_to_cpu(raw->blocks_per_group);
+	sbi->inodes_per_group  = le32_to_cpu(raw->inodes_per_group);
+	sbi->inode_size        = le32_to_cpu(raw->inode_size);
+	sbi->itable_blocks     = le32_to_cpu(raw->itable_blocks);
+	sbi->blocks_count      = le64_to_cpu(raw->blocks_count);
+	sbi->inodes_count      = le64_to_cpu(raw->inodes_count);
+	sbi->first_group_block = le64_to_cpu(raw->first_group_block);
+	sbi->gdt_blocks        = le32_to_cpu(raw->gdt_blocks);
+	sbi->desc_per_block    = sbi->block_size /
+				 sizeof(struct basefs_group_desc);
+	ret = basefs_check_geometry(sb, sbi);
+	if (ret)
+		goto failed;
+
+	/* Old code may read images with unknown ro_compat features. */
+	if ((le32_to_cpu(raw->feature_ro_compat) &
+	     ~BASEFS_FEATURE_RO_COMPAT_SUPP) && !sb_rdonly(sb)) {
+		basefs_msg(sb, KERN_ERR, "unsupported ro_compat features 0x%x, mount read-only",
+			   le32_to_cpu(raw->feature_ro_compat) &
+			   ~BASEFS_FEATURE_RO_COMPAT_SUPP);
+		ret = -EROFS;
+		goto failed;
+	}
+
+	ret = basefs_read_gdt(sb);
+	if (ret)
+		goto failed;
+
+	sb->s_magic = BASEFS_MAGIC;
+	sb->s_op = &basefs_super_ops;
+	sb->s_xattr = basefs_xattr_handlers;
+	sb->s_maxbytes = BASEFS_MAX_FILESIZE;
+	sb->s_max_links = BASEFS_LINK_MAX;
+	sb->s_time_gran = NSEC_PER_SEC;   /* timestamps are whole seconds */
+	sb->s_time_min = 0;
+	sb->s_time_max = S64_MAX;
+	memcpy(&sb->s_uuid, raw->uuid, sizeof(raw->uuid));
+
+	ret = basefs_init_allocator(sb);
+	if (ret)
+		goto failed;
+	ret = basefs_xattr_init(sb);
+	if (ret)
+		goto failed_alloc;
+	sbi->dir_stats = alloc_percpu(struct basefs_dir_stats);
+	if (!sbi->dir_stats) {
+		ret = -ENOMEM;
+		goto failed_alloc;
+	}
+
+	root_ino = le32_to_cpu(raw->root_ino);
+	if (!root_ino)
+		root_ino = BASEFS_ROOT_INO;
+	root = basefs_iget(sb, root_ino);
+	if (IS_ERR(root)) {
+		ret = PTR_ERR(root);
+		goto failed_alloc;
+	}
+	if (!S_ISDIR(root->i_mode)) {
+		iput(root);
+		basefs_msg(sb, KERN_ERR, "root inode %lu is not a directory",
+			   root_ino);
+		ret = -EINVAL;
+		goto failed_alloc;
+	}
+	sb->s_root = d_make_root(root);
+	if (!sb->s_root) {
+		ret = -ENOMEM;
+		goto failed_alloc;
+	}
+
+	/* Writes may need any group; load them before they are asked for. */
+	if (!sb_rdonly(sb)) {
+		queue_work(system_unbound_wq, &sbi->prefetch_work);
+		basefs_itable_start(sb);
+	}
+
+	if (basefs_proc_root) {
+		sbi->proc = proc_mkdir(sb->s_id, basefs_proc_root);
+		if (sbi->proc) {
+			proc_create_single_data("journal", 0444, sbi->proc,
+						basefs_journal_stats_show, sb);
+			proc_create_single_data("dir", 0444, sbi->proc,
+						basefs_dir_stats_show, sb);
+		}
+	}
+	return 0;
+
+failed_alloc:
+	free_percpu(sbi->dir_stats);
+	basefs_xattr_destroy(sb);
+	basefs_destroy_allocator(sbi);
+failed:
+	basefs_journal_destroy(sb);
+	if (sbi->gdt_bh) {
+		for (i = 0; i < sbi->gdt_blocks; i++)
+			brelse(sbi->gdt_bh[i]);
+		kfree(sbi->gdt_bh);
+	}
+	brelse(sbi->sbh);
+	sb->s_fs_info = NULL;
+	kfree(sbi);
+	return ret;
+}
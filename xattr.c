@@ -0,0 +1,753 @@
+#include <linux/xattr.h>
+#include "basefs.h"
+
+/*
+ * Extended attributes.
+ *
+ * Datasets tag their samples with labels, split names and hashes; as
+ * xattrs these cost no extra file.  An inode's attributes are kept in up
+ * to two areas of sorted entries (see basefs_disk.h): the tail of its
+ * on-disk inode, read along with the inode and free of any extra I/O,
+ * and an xattr block for what does not fit there.  Inline data of more
+ * than BASEFS_INODE_DATA_SIZE bytes takes the tail, and while the tail
+ * holds attributes inline data only has i_data (basefs_inline_max()), so
+ * a new file, which starts out inline and empty, can still have them
+ * there.  A set tries the tail first and falls back to the block.
+ *
+ * Samples of one split often carry the very same attributes, so xattr
+ * blocks are shared: a block with the same entries and a reference to
+ * spare is found through an in-memory index from the hash of its entries
+ * to its block number (a B+ tree, btree.c, under xattr_lock, keyed by
+ * hash and the low bits of the block number), and a change to a shared
+ * block writes a new one instead.  Only blocks written, or that lost a
+ * reference, since mount are indexed.
+ *
+ * i_xattr_sem orders readers against writers of an inode's attributes;
+ * the VFS holds i_rwsem around every set, as around writes, so inline
+ * data cannot grow into the tail meanwhile.  A set runs in one handle,
+ * taken before i_xattr_sem: the tail, the blocks and the inode change
+ * in one transaction.  xattr_lock is taken inside i_xattr_sem and the
+ * buffer locks inside xattr_lock.
+ */
+
+static inline u32 basefs_xattr_ibody_size(struct super_block *sb)
+{
+	return BASEFS_SB(sb)->inode_size - sizeof(struct basefs_inode);
+}
+
+static inline void *basefs_xattr_ibody(struct basefs_inode *raw)
+{
+	return raw + 1;
+}
+
+static inline u32 basefs_xattr_block_size(struct super_block *sb)
+{
+	return sb->s_blocksize - sizeof(struct basefs_xattr_header);
+}
+
+static inline void *basefs_xattr_entries(struct buffer_head *bh)
+{
+	return bh->b_data + sizeof(struct basefs_xattr_header);
+}
+
+static inline struct basefs_xattr_entry *basefs_xattr_at(void *area, u32 off)
+{
+	return area + off;
+}
+
+static inline u32 basefs_xattr_len(const struct basefs_xattr_entry *e)
+{
+	return BASEFS_XATTR_ENTRY_LEN(e->name_len, le32_to_cpu(e->value_len));
+}
+
+/* The sort order of entries: index, then name length, then name. */
+static int basefs_xattr_cmp(const struct basefs_xattr_entry *e, int index,
+			    const char *name, size_t len)
+{
+	if (e->name_index != index)
+		return e->name_index - index;
+	if (e->name_len != len)
+		return e->name_len - (int)len;
+	return memcmp(e->name, name, len);
+}
+
+/* Entry (index, name) in the 'used' bytes of 'area', or NULL. */
+static struct basefs_xattr_entry *basefs_xattr_find(void *area, u32 used,
+						    int index, const char *name,
+						    size_t len)
+{
+	struct basefs_xattr_entry *e;
+	u32 off;
+
+	for (off = 0; off < used; off += basefs_xattr_len(e)) {
+		e = basefs_xattr_at(area, off);
+		if (!basefs_xattr_cmp(e, index, name, len))
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * basefs_xattr_edit - Remove entry (index, name) from the 'used' bytes of
+ * an area of 'cap' bytes, and if 'value' is not NULL insert it anew with
+ * that value in its sorted place.  Returns the bytes in use after, or
+ * -ENOSPC if the new entry does not fit (the area is then left without
+ * the entry).
+ */
+static int basefs_xattr_edit(void *area, u32 cap, u32 used, int index,
+			     const char *name, size_t len, const void *value,
+			     size_t size)
+{
+	struct basefs_xattr_entry *e = NULL;
+	u32 off, elen;
+	u64 need;
+	int cmp = 1;
+
+	for (off = 0; off < used; off += basefs_xattr_len(e)) {
+		e = basefs_xattr_at(area, off);
+		cmp = basefs_xattr_cmp(e, index, name, len);
+		if (cmp >= 0)
+			break;
+	}
+	if (off < used && !cmp) {
+		elen = basefs_xattr_len(e);
+		memmove(area + off, area + off + elen, used - off - elen);
+		used -= elen;
+		memset(area + used, 0, elen);
+	}
+	if (!value)
+		return used;
+
+	need = BASEFS_XATTR_ENTRY_LEN(len, size);
+	if (need > cap - used)
+		return -ENOSPC;
+	memmove(area + off + need, area + off, used - off);
+	e = basefs_xattr_at(area, off);
+	memset(e, 0, need);
+	e->name_len = len;
+	e->name_index = index;
+	e->value_len = cpu_to_le32(size);
+	memcpy(e->name, name, len);
+	memcpy(e->name + len, value, size);
+	return used + need;
+}
+
+/* Copy the value of entry 'e' to 'buffer', or only size it if NULL. */
+static int basefs_xattr_value(const struct basefs_xattr_entry *e,
+			      void *buffer, size_t size)
+{
+	u32 len = le32_to_cpu(e->value_len);
+
+	if (buffer) {
+		if (len > size)
+			return -ERANGE;
+		memcpy(buffer, e->name + e->name_len, len);
+	}
+	return len;
+}
+
+/*
+ * The tail of 'inode' as an area: its on-disk inode (*bhp to brelse())
+ * and the bytes in use, or 0 with *bhp NULL if it holds no attributes.
+ */
+static int basefs_xattr_read_ibody(struct inode *inode,
+				   struct buffer_head **bhp, void **area)
+{
+	struct super_block *sb = inode->i_sb;
+	struct basefs_inode *raw;
+	long used;
+
+	*bhp = NULL;
+	if (!(READ_ONCE(BASEFS_I(inode)->i_flags) & BASEFS_INODE_INLINE_XATTR))
+		return 0;
+	raw = basefs_get_raw_inode(sb, inode->i_ino, bhp);
+	if (IS_ERR(raw)) {
+		*bhp = NULL;
+		return PTR_ERR(raw);
+	}
+	*area = basefs_xattr_ibody(raw);
+	used = basefs_xattr_area_used(*area, basefs_xattr_ibody_size(sb));
+	if (used < 0) {
+		basefs_msg(sb, KERN_ERR, "inode %lu has corrupt inline xattrs",
+			   inode->i_ino);
+		brelse(*bhp);
+		*bhp = NULL;
+		return -EFSCORRUPTED;
+	}
+	return used;
+}
+
+/* Read and check xattr block 'blk'; returns the bytes of entries in use. */
+static int basefs_xattr_read_block(struct super_block *sb, u64 blk,
+				   struct buffer_head **bhp)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	struct basefs_xattr_header *hdr;
+	struct buffer_head *bh;
+	long used;
+
+	*bhp = NULL;
+	if (blk < sbi->first_group_block || blk >= sbi->blocks_count) {
+		basefs_msg(sb, KERN_ERR, "xattr block %llu out of range", blk);
+		return -EFSCORRUPTED;
+	}
+	bh = sb_bread(sb, blk);
+	if (!bh)
+		return -EIO;
+	hdr = (struct basefs_xattr_header *)bh->b_data;
+	used = basefs_xattr_area_used(basefs_xattr_entries(bh),
+				      basefs_xattr_block_size(sb));
+	if (le32_to_cpu(hdr->magic) != BASEFS_XATTR_MAGIC ||
+	    !le32_to_cpu(hdr->refcount) || used < 0) {
+		basefs_msg(sb, KERN_ERR, "xattr block %llu is corrupt", blk);
+		brelse(bh);
+		return -EFSCORRUPTED;
+	}
+	*bhp = bh;
+	return used;
+}
+
+/*
+ * basefs_xattr_get - Copy the value of attribute 'name' in namespace
+ * 'index' (BASEFS_XATTR_INDEX_*) of 'inode' to 'buffer'.  Returns its
+ * length, -ENODATA if there is no such attribute or -ERANGE if 'size' is
+ * too small.  With a NULL buffer it only returns the length.
+ */
+int basefs_xattr_get(struct inode *inode, int index, const char *name,
+		     void *buffer, size_t size)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_xattr_entry *e = NULL;
+	size_t len = strlen(name);
+	struct buffer_head *bh;
+	void *area;
+	int used, ret;
+
+	if (len > 255)
+		return -ERANGE;
+
+	down_read(&bi->i_xattr_sem);
+	used = basefs_xattr_read_ibody(inode, &bh, &area);
+	if (used > 0)
+		e = basefs_xattr_find(area, used, index, name, len);
+	if (!e && used >= 0 && bi->i_xattr_block) {
+		brelse(bh);
+		used = basefs_xattr_read_block(inode->i_sb, bi->i_xattr_block,
+					       &bh);
+		if (used > 0)
+			e = basefs_xattr_find(basefs_xattr_entries(bh), used,
+					      index, name, len);
+	}
+	if (used < 0)
+		ret = used;
+	else
+		ret = e ? basefs_xattr_value(e, buffer, size) : -ENODATA;
+	brelse(bh);
+	up_read(&bi->i_xattr_sem);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Shared xattr blocks                                                         */
+
+static inline u64 basefs_xattr_key(u32 hash, u64 blk)
+{
+	return ((u64)hash << 32) | (u32)blk;
+}
+
+int basefs_xattr_init(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	mutex_init(&sbi->xattr_lock);
+	sbi->xattr_index = btree_init();
+	return sbi->xattr_index ? 0 : -ENOMEM;
+}
+
+void basefs_xattr_destroy(struct super_block *sb)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+
+	btree_destroy(sbi->xattr_index);
+	sbi->xattr_index = NULL;
+}
+
+/*
+ * Index block 'blk' holding entries with 'hash'.  An index that cannot
+ * take it only loses a chance to share.  Called with xattr_lock held.
+ */
+static void basefs_xattr_index_add(struct basefs_sb_info *sbi, u32 hash,
+				   u64 blk)
+{
+	btree_insert(sbi->xattr_index, basefs_xattr_key(hash, blk), blk);
+}
+
+static void basefs_xattr_index_del(struct basefs_sb_info *sbi, u32 hash,
+				   u64 blk)
+{
+	u64 value;
+
+	if (btree_search(sbi->xattr_index, basefs_xattr_key(hash, blk), &value) &&
+	    value == blk)
+		btree_delete(sbi->xattr_index, basefs_xattr_key(hash, blk));
+}
+
+/*
+ * An indexed block holding exactly the 'used' bytes of entries at
+ * 'area', with a reference to spare: take one and return its number, or
+ * 0 if there is none.  If that block is 'own', the block the inode
+ * already holds a reference to, it is returned without taking another.
+ * Called with xattr_lock held.
+ */
+static u64 basefs_xattr_share(struct super_block *sb, const void *area,
+			      u32 used, u32 hash, u64 own)
+{
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u32 cap = basefs_xattr_block_size(sb);
+	struct basefs_xattr_header *hdr;
+	struct buffer_head *bh;
+	u64 key = basefs_xattr_key(hash, 0), found, blk;
+	const u8 *entries;
+	bool same;
+
+	while (btree_lookup_ge(sbi->xattr_index, key, &found, &blk) &&
+	       found >> 32 == hash) {
+		key = found + 1;
+		if (basefs_xattr_read_block(sb, blk, &bh) != used)
+			goto next;
+		hdr = (struct basefs_xattr_header *)bh->b_data;
+		entries = basefs_xattr_entries(bh);
+		lock_buffer(bh);
+		same = (blk == own ||
+			le32_to_cpu(hdr->refcount) < BASEFS_XATTR_REFCOUNT_MAX) &&
+		       le32_to_cpu(hdr->hash) == hash &&
+		       !memcmp(entries, area, used) &&
+		       (used == cap || !entries[used]);
+		if (same && blk != own)
+			le32_add_cpu(&hdr->refcount, 1);
+		unlock_buffer(bh);
+		if (same) {
+			if (blk != own)
+				basefs_journal_dirty(sb, bh, NULL);
+			brelse(bh);
+			return blk;
+		}
+next:
+		brelse(bh);
+	}
+	return 0;
+}
+
+/*
+ * Drop a reference to xattr block 'blk', freeing it with the last one.
+ * A freed block keeps a refcount of 0, so no stale copy of it is ever
+ * shared.  Called with xattr_lock held.
+ */
+static void basefs_xattr_put_block(struct inode *inode, u64 blk)
+{
+	struct super_block *sb = inode->i_sb;
+	struct basefs_xattr_header *hdr;
+	struct buffer_head *bh;
+	bool last;
+	u32 hash;
+
+	if (basefs_xattr_read_block(sb, blk, &bh) < 0) {
+		basefs_msg(sb, KERN_ERR, "inode %lu: xattr block %llu leaked",
+			   inode->i_ino, blk);
+		return;
+	}
+	hdr = (struct basefs_xattr_header *)bh->b_data;
+	lock_buffer(bh);
+	hash = le32_to_cpu(hdr->hash);
+	last = le32_to_cpu(hdr->refcount) == 1;
+	le32_add_cpu(&hdr->refcount, -1);
+	unlock_buffer(bh);
+	basefs_journal_dirty(sb, bh, NULL);
+	brelse(bh);
+	if (last) {
+		basefs_xattr_index_del(BASEFS_SB(sb), hash, blk);
+		basefs_free_meta_blocks(sb, blk, 1);
+	} else {
+		basefs_xattr_index_add(BASEFS_SB(sb), hash, blk);
+	}
+}
+
+/* Write a fresh block or rewrite one only 'inode' uses. */
+static void basefs_xattr_fill_block(struct super_block *sb,
+				    struct buffer_head *bh, const void *area,
+				    u32 used, u32 hash, bool fresh)
+{
+	struct basefs_xattr_header *hdr;
+
+	lock_buffer(bh);
+	hdr = (struct basefs_xattr_header *)bh->b_data;
+	if (fresh) {
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->magic = cpu_to_le32(BASEFS_XATTR_MAGIC);
+		hdr->refcount = cpu_to_le32(1);
+	}
+	hdr->hash = cpu_to_le32(hash);
+	memcpy(basefs_xattr_entries(bh), area, used);
+	memset(basefs_xattr_entries(bh) + used, 0,
+	       basefs_xattr_block_size(sb) - used);
+	if (fresh)
+		set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	basefs_journal_dirty(sb, bh, NULL);
+}
+
+/*
+ * basefs_xattr_set_block - Make the xattr block of 'inode' hold the
+ * 'used' bytes of entries at 'area', none if 0: share a block that has
+ * them, rewrite the inode's own block if nobody else uses it, or write a
+ * new one.  Called inside a handle with i_xattr_sem held.
+ */
+static int basefs_xattr_set_block(struct inode *inode, const void *area,
+				  u32 used)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct basefs_sb_info *sbi = BASEFS_SB(sb);
+	u64 old = bi->i_xattr_block, blk = 0, goal;
+	struct basefs_xattr_header *hdr;
+	struct buffer_head *bh = NULL;
+	u32 hash = 0, count = 1;
+	int ret = 0;
+
+	mutex_lock(&sbi->xattr_lock);
+	if (!used)
+		goto done;
+
+	hash = basefs_crc32c(~0U, area, used);
+	blk = basefs_xattr_share(sb, area, used, hash, old);
+	if (blk)
+		goto done;
+
+	if (old && basefs_xattr_read_block(sb, old, &bh) >= 0) {
+		hdr = (struct basefs_xattr_header *)bh->b_data;
+		if (le32_to_cpu(hdr->refcount) == 1) {
+			basefs_xattr_index_del(sbi, le32_to_cpu(hdr->hash), old);
+			basefs_xattr_fill_block(sb, bh, area, used, hash, false);
+			basefs_xattr_index_add(sbi, hash, old);
+			brelse(bh);
+			blk = old;
+			goto done;
+		}
+		brelse(bh);
+	}
+
+	goal = basefs_group_first_block(sbi->first_group_block,
+					sbi->blocks_per_group,
+					bi->i_block_group) +
+	       basefs_group_overhead(sbi->itable_blocks);
+	ret = basefs_new_blocks(sb, goal, 1, &count, &blk);
+	if (ret)
+		goto out;
+	bh = sb_getblk(sb, blk);
+	if (!bh) {
+		basefs_free_blocks(sb, blk, 1);
+		ret = -ENOMEM;
+		goto out;
+	}
+	basefs_xattr_fill_block(sb, bh, area, used, hash, true);
+	brelse(bh);
+	basefs_xattr_index_add(sbi, hash, blk);
+
+done:
+	if (old && old != blk)
+		basefs_xattr_put_block(inode, old);
+	mutex_lock(&bi->i_map_lock);
+	bi->i_xattr_block = blk;
+	mutex_unlock(&bi->i_map_lock);
+out:
+	mutex_unlock(&sbi->xattr_lock);
+	return ret;
+}
+
+/*
+ * Write the 'used' bytes of entries at 'area' to the tail of 'inode'.
+ * Called inside a handle with i_xattr_sem held.
+ */
+static int basefs_xattr_set_ibody(struct inode *inode, const void *area,
+				  u32 used)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct basefs_inode *raw;
+	struct buffer_head *bh;
+
+	raw = basefs_get_raw_inode(sb, inode->i_ino, &bh);
+	if (IS_ERR(raw))
+		return PTR_ERR(raw);
+	lock_buffer(bh);
+	memcpy(basefs_xattr_ibody(raw), area, basefs_xattr_ibody_size(sb));
+	mutex_lock(&bi->i_map_lock);
+	if (used)
+		bi->i_flags |= BASEFS_INODE_INLINE_XATTR;
+	else
+		bi->i_flags &= ~BASEFS_INODE_INLINE_XATTR;
+	mutex_unlock(&bi->i_map_lock);
+	unlock_buffer(bh);
+	basefs_journal_dirty(sb, bh, inode);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * basefs_xattr_set - Set attribute 'name' in namespace 'index' of 'inode'
+ * to 'value', or remove it if 'value' is NULL.  XATTR_CREATE and
+ * XATTR_REPLACE in 'flags' as for setxattr(2).
+ */
+static int basefs_xattr_set(struct inode *inode, int index, const char *name,
+			    const void *value, size_t size, int flags)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	u32 icap = basefs_xattr_ibody_size(sb), bcap = basefs_xattr_block_size(sb);
+	bool in_ibody = false, in_block = false;
+	size_t len = strlen(name);
+	int iused = 0, bused = 0, ret, err;
+	void *ibuf = NULL, *bbuf = NULL, *area;
+	struct basefs_handle h;
+	struct buffer_head *bh;
+
+	if (len > 255)
+		return -ERANGE;
+	if (!value)
+		size = 0;
+	if (BASEFS_XATTR_ENTRY_LEN(len, size) > max(icap, bcap))
+		return -ENOSPC;
+
+	ibuf = kzalloc(icap, GFP_KERNEL);
+	bbuf = kvzalloc(bcap, GFP_KERNEL);
+	if ((icap && !ibuf) || !bbuf) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	basefs_journal_start(sb, &h);
+	down_write(&bi->i_xattr_sem);
+	if (basefs_has_inline_data(inode) &&
+	    i_size_read(inode) > BASEFS_INODE_DATA_SIZE)
+		icap = 0;
+
+	ret = basefs_xattr_read_ibody(inode, &bh, &area);
+	if (ret > 0) {
+		iused = ret;
+		memcpy(ibuf, area, iused);
+		in_ibody = basefs_xattr_find(ibuf, iused, index, name, len);
+	}
+	brelse(bh);
+	if (ret >= 0 && bi->i_xattr_block) {
+		ret = basefs_xattr_read_block(sb, bi->i_xattr_block, &bh);
+		if (ret >= 0) {
+			bused = ret;
+			memcpy(bbuf, basefs_xattr_entries(bh), bused);
+			in_block = basefs_xattr_find(bbuf, bused, index, name,
+						     len);
+			brelse(bh);
+		}
+	}
+	if (ret < 0)
+		goto out;
+
+	ret = 0;
+	if ((flags & XATTR_CREATE) && (in_ibody || in_block))
+		ret = -EEXIST;
+	else if (((flags & XATTR_REPLACE) || !value) && !in_ibody && !in_block)
+		ret = -ENODATA;
+	if (ret)
+		goto out;
+
+	/* Take the old value out, then put the new one where it fits. */
+	if (in_ibody)
+		iused = basefs_xattr_edit(ibuf, icap, iused, index, name, len,
+					  NULL, 0);
+	if (in_block)
+		bused = basefs_xattr_edit(bbuf, bcap, bused, index, name, len,
+					  NULL, 0);
+	if (value) {
+		err = basefs_xattr_edit(ibuf, icap, iused, index, name, len,
+					value, size);
+		if (err >= 0) {
+			iused = err;
+			in_ibody = true;
+		} else {
+			err = basefs_xattr_edit(bbuf, bcap, bused, index, name,
+						len, value, size);
+			if (err < 0) {
+				ret = err;
+				goto out;
+			}
+			bused = err;
+			in_block = true;
+		}
+	}
+
+	if (in_block) {
+		ret = basefs_xattr_set_block(inode, bbuf, bused);
+		if (ret)
+			goto out;
+	}
+	if (in_ibody) {
+		ret = basefs_xattr_set_ibody(inode, ibuf, iused);
+		if (ret)
+			goto out;
+	}
+	basefs_set_compat(sb, BASEFS_FEATURE_COMPAT_XATTR);
+	inode_set_ctime_current(inode);
+	mark_inode_dirty(inode);
+out:
+	up_write(&bi->i_xattr_sem);
+	err = basefs_journal_stop(sb, &h);
+	if (!ret)
+		ret = err;
+out_free:
+	kfree(ibuf);
+	kvfree(bbuf);
+	return ret;
+}
+
+/*
+ * basefs_xattr_delete_inode - Drop the xattr block reference of an inode
+ * being deleted.  Its tail goes with the inode.  Called inside a handle.
+ */
+void basefs_xattr_delete_inode(struct inode *inode)
+{
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct basefs_sb_info *sbi = BASEFS_SB(inode->i_sb);
+
+	if (!bi->i_xattr_block)
+		return;
+	mutex_lock(&sbi->xattr_lock);
+	basefs_xattr_put_block(inode, bi->i_xattr_block);
+	mutex_unlock(&sbi->xattr_lock);
+	bi->i_xattr_block = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* VFS glue                                                                    */
+
+static int basefs_xattr_handler_get(const struct xattr_handler *handler,
+				    struct dentry *unused, struct inode *inode,
+				    const char *name, void *buffer, size_t size)
+{
+	return basefs_xattr_get(inode, handler->flags, name, buffer, size);
+}
+
+static int basefs_xattr_handler_set(const struct xattr_handler *handler,
+				    struct mnt_idmap *idmap,
+				    struct dentry *unused, struct inode *inode,
+				    const char *name, const void *value,
+				    size_t size, int flags)
+{
+	return basefs_xattr_set(inode, handler->flags, name, value, size,
+				flags);
+}
+
+static bool basefs_xattr_trusted_list(struct dentry *dentry)
+{
+	return capable(CAP_SYS_ADMIN);
+}
+
+static const struct xattr_handler basefs_xattr_user_handler = {
+	.prefix = XATTR_USER_PREFIX,
+	.flags  = BASEFS_XATTR_INDEX_USER,
+	.get    = basefs_xattr_handler_get,
+	.set    = basefs_xattr_handler_set,
+};
+
+static const struct xattr_handler basefs_xattr_trusted_handler = {
+	.prefix = XATTR_TRUSTED_PREFIX,
+	.flags  = BASEFS_XATTR_INDEX_TRUSTED,
+	.list   = basefs_xattr_trusted_list,
+	.get    = basefs_xattr_handler_get,
+	.set    = basefs_xattr_handler_set,
+};
+
+static const struct xattr_handler basefs_xattr_security_handler = {
+	.prefix = XATTR_SECURITY_PREFIX,
+	.flags  = BASEFS_XATTR_INDEX_SECURITY,
+	.get    = basefs_xattr_handler_get,
+	.set    = basefs_xattr_handler_set,
+};
+
+const struct xattr_handler *basefs_xattr_handlers[] = {
+	&basefs_xattr_user_handler,
+	&basefs_xattr_trusted_handler,
+	&basefs_xattr_security_handler,
+	NULL,
+};
+
+static const struct xattr_handler *basefs_xattr_handler(int index)
+{
+	switch (index) {
+	case BASEFS_XATTR_INDEX_USER:
+		return &basefs_xattr_user_handler;
+	case BASEFS_XATTR_INDEX_TRUSTED:
+		return &basefs_xattr_trusted_handler;
+	case BASEFS_XATTR_INDEX_SECURITY:
+		return &basefs_xattr_security_handler;
+	}
+	return NULL;
+}
+
+/* Append the names in an area to the list; returns its new length. */
+static ssize_t basefs_xattr_list_area(struct dentry *dentry, void *area,
+				      u32 used, char *buffer, size_t size,
+				      ssize_t total)
+{
+	const struct xattr_handler *handler;
+	struct basefs_xattr_entry *e;
+	const char *prefix;
+	size_t plen, len;
+	u32 off;
+
+	for (off = 0; off < used; off += basefs_xattr_len(e)) {
+		e = basefs_xattr_at(area, off);
+		handler = basefs_xattr_handler(e->name_index);
+		if (!handler || (handler->list && !handler->list(dentry)))
+			continue;
+		prefix = xattr_prefix(handler);
+		plen = strlen(prefix);
+		len = plen + e->name_len + 1;
+		if (buffer) {
+			if (total + len > size)
+				return -ERANGE;
+			memcpy(buffer + total, prefix, plen);
+			memcpy(buffer + total + plen, e->name, e->name_len);
+			buffer[total + len - 1] = '\0';
+		}
+		total += len;
+	}
+	return total;
+}
+
+ssize_t basefs_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+	struct inode *inode = d_inode(dentry);
+	struct basefs_inode_info *bi = BASEFS_I(inode);
+	struct buffer_head *bh;
+	ssize_t total = 0;
+	void *area;
+	int used;
+
+	down_read(&bi->i_xattr_sem);
+	used = basefs_xattr_read_ibody(inode, &bh, &area);
+	if (used > 0)
+		total = basefs_xattr_list_area(dentry, area, used, buffer, size,
+					       total);
+	brelse(bh);
+	if (used >= 0 && total >= 0 && bi->i_xattr_block) {
+		used = basefs_xattr_read_block(inode->i_sb, bi->i_xattr_block,
+					       &bh);
+		if (used > 0)
+			total = basefs_xattr_list_area(dentry,
+						       basefs_xattr_entries(bh),
+						       used, buffer, size,
+						       total);
+		brelse(bh);
+	}
+	up_read(&bi->i_xattr_sem);
+	return used < 0 ? used : total;
+}